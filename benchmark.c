@@ -0,0 +1,804 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Headless benchmark of the renderer, frames are rendered as fast as they can into a sink
+// instead of a terminal
+// - Generated frame sets (static, gradient, noise, pan, cuts) at a few sizes and folders of
+// real frames are rendered in every mode, each case in a process of its own
+// - Prints frames/sec, ns/cell, bytes/frame and peak RSS of every case as JSON
+// - Player cases run the scene cuts through the loop of the player twice: frames that hash
+// the same as the one before are skipped, the second loop comes from the frame cache and
+// frames are paced to a frame rate (sleeping is not timed)
+// - Two more cases time trace points (TRACE_BEGIN and TRACE_END) with the trace off and on,
+// the cost of a pair is their ns/cell
+// - Output of every case is hashed, compared with a baseline the hashes have to be the same
+// (golden output) and the frames/sec must not drop more than the tolerance
+// - Golden file only has the hashes, trace cases have no output and are only compared by -c
+// - ./benchmark [-n frames] [-r WIDTHxHEIGHT]... [-d folder]... [-m mode]... [-e encoder]
+// [-k null|memory] [-o results.json] [-c baseline.json] [-g golden.json] [-t percent]
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image/stb_image.h"
+
+#include "charset.h"
+#include "duckvideo.h"
+#include "frame_cache.h"
+#include "frame_hash.h"
+#include "source.h"
+#include "trace.h"
+
+// Struct that represents what a case measured
+// - Name is the frames ("noise 320x180" or "folder path"), mode and encoder the config
+// - Cells is per frame, it is output pixels for sixel
+typedef struct bench_result {
+    char name[256];
+    int mode;
+    int encoder;
+    int frames;
+    double fps;
+    double ns_per_cell;
+    double bytes_per_frame;
+    long peak_rss_kb;
+    uint64_t hash;
+} bench_result;
+
+// Struct that represents a result file that is compared against
+typedef struct bench_baseline {
+    bench_result *results;
+    int count;
+} bench_baseline;
+
+// Struct that keeps the state of a source of generated frames
+// - Next is the frame it gives next, frame i + frames is frame i again
+typedef struct generated_state {
+    int pattern;
+    int frames;
+    int next;
+    unsigned char *rgb;
+    unsigned char *luma;
+} generated_state;
+
+static void run_case(const char *name, int pattern, const char *folder, int width, int height, int mode, int encoder, int frames, int sink,
+                     bench_result *result);
+static void run_in_child(const char *name, int pattern, const char *folder, int width, int height, int mode, int encoder, int frames,
+                         int sink, bench_result *result);
+static void run_player_case(const char *name, int width, int height, int mode, int encoder, int frames, int sink, bench_result *result);
+static void run_trace_case(const char *name, int enabled, bench_result *result);
+static void open_generated_source(frame_source *source, int pattern, int width, int height, int channels, int frames, int loops);
+static const unsigned char *next_generated_frame(frame_source *);
+static int seek_generated_source(frame_source *, int);
+static void close_generated_source(frame_source *);
+static void generate_frame(int pattern, unsigned char *rgb, int width, int height, int index);
+static void draw_scene(int scene, unsigned char *rgb, int width, int height, int shift_x, int shift_y);
+static void to_luma(const unsigned char *rgb, unsigned char *luma, int pixels);
+static void write_result(FILE *, const bench_result *, int last);
+static void read_baseline(const char *path, bench_baseline *baseline);
+static const bench_result *find_result(const bench_baseline *, const bench_result *);
+static int compare_results(const bench_result *results, int count, const bench_baseline *baseline, int check_speed, double tolerance);
+static double get_wall_seconds(void);
+static void wait_until(double seconds);
+static uint32_t get_noise(uint32_t);
+
+#define PATTERN_STATIC 0
+#define PATTERN_GRADIENT 1
+#define PATTERN_NOISE 2
+#define PATTERN_PAN 3
+#define PATTERN_CUTS 4
+#define PATTERN_COUNT 5
+#define PATTERN_FOLDER -1
+#define PATTERN_TRACE_OFF -2
+#define PATTERN_TRACE_ON -3
+#define PATTERN_PLAYER -4
+#define SINK_NULL 0
+#define SINK_MEMORY 1
+#define DEFAULT_FRAMES 60
+#define DEFAULT_TOLERANCE 10
+#define MAX_SIZES 8
+#define MAX_FOLDERS 8
+#define MAX_MODES 8
+// Cuts go to another scene this often
+#define CUT_FRAMES 15
+// Player cases play their frames this many times at this frame rate, the cache keeps all of them
+#define PLAYER_LOOPS 2
+#define PLAYER_FRAMERATE 500
+#define PLAYER_CACHE_BYTES (256 << 20)
+// Trace cases time this many batches of begin and end pairs, a batch fits in the ring of a
+// thread and the flusher empties it between batches, so no event is lost
+#define TRACE_BATCHES 64
+#define TRACE_BATCH_PAIRS 4096
+#define TRACE_FLUSH_WAIT_MS 30
+
+static const char *pattern_names[PATTERN_COUNT] = {"static", "gradient", "noise", "pan", "cuts"};
+
+int main(int argc, char *argv[]) {
+    int frames = DEFAULT_FRAMES, encoder = DV_ENCODER_DELTA, sink = SINK_NULL;
+    int sizes[MAX_SIZES][2], size_count = 0;
+    int modes[MAX_MODES], mode_count = 0;
+    const char *folders[MAX_FOLDERS];
+    int folder_count = 0;
+    const char *output_path = NULL, *baseline_path = NULL;
+    int check_speed = 0;
+    double tolerance = DEFAULT_TOLERANCE;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:r:d:m:e:k:o:c:g:t:h")) != -1) {
+        switch (option) {
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 'r':
+            if (size_count == MAX_SIZES || sscanf(optarg, "%dx%d", &sizes[size_count][0], &sizes[size_count][1]) != 2 ||
+                sizes[size_count][0] < 1 || sizes[size_count][1] < 1) {
+                fprintf(stderr, "Size has to be WIDTHxHEIGHT (at most %d of them) in main()\n", MAX_SIZES);
+                return 1;
+            }
+            size_count++;
+            break;
+        case 'd':
+            if (folder_count == MAX_FOLDERS) {
+                fprintf(stderr, "At most %d folders in main()\n", MAX_FOLDERS);
+                return 1;
+            }
+            folders[folder_count++] = optarg;
+            break;
+        case 'm':
+            if (mode_count == MAX_MODES) {
+                fprintf(stderr, "At most %d modes in main()\n", MAX_MODES);
+                return 1;
+            }
+            modes[mode_count++] = (optarg[0] == '-' && optarg[1] != '\0') ? atoi(optarg) : optarg[0];
+            break;
+        case 'e':
+            encoder = atoi(optarg);
+            break;
+        case 'k':
+            sink = strcmp(optarg, "memory") == 0 ? SINK_MEMORY : SINK_NULL;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'c':
+        case 'g':
+            baseline_path = optarg;
+            check_speed = option == 'c';
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n frames] [-r WIDTHxHEIGHT]... [-d folder]... [-m mode]... [-e encoder] [-k null|memory] [-o results.json] "
+                    "[-c baseline.json] [-g golden.json] [-t percent]\n"
+                    "  -n  frames of every case (default %d)\n"
+                    "  -r  size of the generated frames (default 160x90, 320x180 and 640x360)\n"
+                    "  -d  folder of real frames to render too\n"
+                    "  -m  mode to render in (default -1, -2, -3 and -4)\n"
+                    "  -e  encoder (default 2)\n"
+                    "  -k  sink of the output, null only counts the bytes, memory copies them (default null)\n"
+                    "  -o  save the results to a file instead of printing them\n"
+                    "  -c  fail if the output is not the same as in the baseline, a case got slower than the tolerance or is\n"
+                    "      not in the baseline\n"
+                    "  -g  fail if the output is not the same as in the baseline or a case is not in it (speed is not checked)\n"
+                    "  -t  tolerance of -c in percent of frames/sec (default %d)\n"
+                    "Player cases play the scene cuts twice through the player loop (repeats, frame cache, pacing)\n"
+                    "Trace points are timed with the trace off and on too, their ns/cell is per begin and end pair\n",
+                    argv[0], DEFAULT_FRAMES, DEFAULT_TOLERANCE);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    if (frames < 1 || encoder < 0 || encoder >= DV_ENCODER_COUNT) {
+        fprintf(stderr, "Frames has to be at least 1 and the encoder 0-%d in main()\n", DV_ENCODER_COUNT - 1);
+        return 1;
+    }
+    if (size_count == 0) {
+        int defaults[3][2] = {{160, 90}, {320, 180}, {640, 360}};
+        memcpy(sizes, defaults, sizeof(defaults));
+        size_count = 3;
+    }
+    if (mode_count == 0) {
+        int defaults[4] = {DV_MODE_GRAYSCALE, DV_MODE_COLORED, DV_MODE_DOUBLE_PIXEL, DV_MODE_SIXEL};
+        memcpy(modes, defaults, sizeof(defaults));
+        mode_count = 4;
+    }
+
+    int case_count = (size_count * (PATTERN_COUNT + 1) + folder_count) * mode_count + 2;
+    bench_result *results = (bench_result *)calloc(case_count, sizeof(bench_result));
+    if (!results) {
+        fprintf(stderr, "Memory allocation failed in main()\n");
+        return 1;
+    }
+    int count = 0;
+    for (int m = 0; m < mode_count; m++) {
+        for (int s = 0; s < size_count; s++) {
+            for (int p = 0; p < PATTERN_COUNT; p++) {
+                char name[256];
+                snprintf(name, sizeof(name), "%s %dx%d", pattern_names[p], sizes[s][0], sizes[s][1]);
+                run_in_child(name, p, NULL, sizes[s][0], sizes[s][1], modes[m], encoder, frames, sink, &results[count++]);
+            }
+            char name[256];
+            snprintf(name, sizeof(name), "player cuts %dx%d", sizes[s][0], sizes[s][1]);
+            run_in_child(name, PATTERN_PLAYER, NULL, sizes[s][0], sizes[s][1], modes[m], encoder, frames, sink, &results[count++]);
+        }
+        for (int f = 0; f < folder_count; f++) {
+            char name[256];
+            snprintf(name, sizeof(name), "folder %s", folders[f]);
+            run_in_child(name, PATTERN_FOLDER, folders[f], 0, 0, modes[m], encoder, frames, sink, &results[count++]);
+        }
+    }
+    run_in_child("trace off", PATTERN_TRACE_OFF, NULL, 0, 0, 0, 0, 0, sink, &results[count++]);
+    run_in_child("trace on", PATTERN_TRACE_ON, NULL, 0, 0, 0, 0, 0, sink, &results[count++]);
+
+    FILE *output = output_path ? fopen(output_path, "w") : stdout;
+    if (!output) {
+        fprintf(stderr, "Could not open %s for writing in main()\n", output_path);
+        return 1;
+    }
+    fprintf(output, "{\"cases\": [\n");
+    for (int i = 0; i < count; i++)
+        write_result(output, &results[i], i == count - 1);
+    fprintf(output, "]}\n");
+    if (output_path)
+        fclose(output);
+
+    int failed = 0;
+    if (baseline_path) {
+        bench_baseline baseline;
+        read_baseline(baseline_path, &baseline);
+        failed = compare_results(results, count, &baseline, check_speed, tolerance / 100);
+        free(baseline.results);
+    }
+    free(results);
+    return failed ? 1 : 0;
+}
+
+// Runs a case in a child process so its peak RSS is its own
+// - Child sends the result through a pipe, the parent adds the peak RSS from wait4()
+static void run_in_child(const char *name, int pattern, const char *folder, int width, int height, int mode, int encoder, int frames,
+                         int sink, bench_result *result) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        fprintf(stderr, "Could not create a pipe in run_in_child()\n");
+        exit(1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t child = fork();
+    if (child < 0) {
+        fprintf(stderr, "Could not fork in run_in_child()\n");
+        exit(1);
+    }
+    if (child == 0) {
+        close(pipe_fds[0]);
+        bench_result measured;
+        run_case(name, pattern, folder, width, height, mode, encoder, frames, sink, &measured);
+        ssize_t written = write(pipe_fds[1], &measured, sizeof(measured));
+        _exit(written == sizeof(measured) ? 0 : 1);
+    }
+
+    close(pipe_fds[1]);
+    ssize_t size = read(pipe_fds[0], result, sizeof(*result));
+    close(pipe_fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || size != sizeof(*result)) {
+        fprintf(stderr, "Case %s in mode %d failed in run_in_child()\n", name, mode);
+        exit(1);
+    }
+    result->peak_rss_kb = usage.ru_maxrss;
+    fprintf(stderr, "%-24s mode %3d: %9.1f FPS %8.2f ns/cell %10.0f bytes/frame %7ld KB\n", result->name, result->mode, result->fps,
+            result->ns_per_cell, result->bytes_per_frame, result->peak_rss_kb);
+}
+
+// Renders the frames of a case, only rendering and the sink are timed
+// - Generated frames are made before each frame is rendered, folder frames are decoded
+// - Every frame of the output is chained into the hash
+static void run_case(const char *name, int pattern, const char *folder, int width, int height, int mode, int encoder, int frames, int sink,
+                     bench_result *result) {
+    if (pattern == PATTERN_TRACE_OFF || pattern == PATTERN_TRACE_ON) {
+        run_trace_case(name, pattern == PATTERN_TRACE_ON, result);
+        return;
+    }
+    if (pattern == PATTERN_PLAYER) {
+        run_player_case(name, width, height, mode, encoder, frames, sink, result);
+        return;
+    }
+    int channels = mode == DV_MODE_GRAYSCALE ? 1 : 3;
+    frame_folder frame_folder;
+    frame_source source;
+    if (folder) {
+        open_frame_folder(&frame_folder, folder, 0);
+        open_folder_source(&source, &frame_folder, channels, 0, 0, 0, 1);
+        width = source.width;
+        height = source.height;
+        if (source.frame_count < frames)
+            frames = source.frame_count;
+    }
+
+    dv_character set[ASCII_CHARACTER_COUNT] = {0};
+    get_character_set(set);
+    // (mode, encoder, resize filter, source width, source height, output width, output height, sixel threads, sixel palette reuse,
+    // hysteresis luma, hysteresis color, hysteresis refresh, static frames, motion savings)
+    dv_config config = {mode, encoder, DV_FILTER_BOX, width, height, 0, 0, sysconf(_SC_NPROCESSORS_ONLN), 0, 0, 0, 0, 0, 0};
+    size_t scratch_size = dv_scratch_size(&config);
+    void *scratch = malloc(scratch_size);
+    dv_context *context = (dv_context *)malloc(sizeof(dv_context));
+    unsigned char *rgb = (unsigned char *)malloc((size_t)width * height * 3);
+    unsigned char *luma = (unsigned char *)malloc((size_t)width * height);
+    if (!scratch || !context || !rgb || !luma) {
+        fprintf(stderr, "Memory allocation failed in run_case()\n");
+        exit(1);
+    }
+    int error = dv_context_init(context, &config, set, ASCII_CHARACTER_COUNT, scratch, scratch_size);
+    if (error) {
+        fprintf(stderr, "Could not create the renderer in run_case(): %s\n", dv_error_string(error));
+        exit(1);
+    }
+    size_t capacity = dv_output_capacity(context);
+    char *buffer = (char *)malloc(capacity);
+    char *terminal = sink == SINK_MEMORY ? (char *)malloc(capacity) : NULL;
+    if (!buffer || (sink == SINK_MEMORY && !terminal)) {
+        fprintf(stderr, "Memory allocation failed in run_case()\n");
+        exit(1);
+    }
+
+    double seconds = 0;
+    long long bytes = 0;
+    uint64_t hash = 0;
+    for (int i = 0; i < frames; i++) {
+        const unsigned char *frame;
+        int stride;
+        if (folder) {
+            frame = source.next_frame(&source);
+            stride = source.stride;
+            if (!frame) {
+                fprintf(stderr, "Frame %d of %s is missing in run_case()\n", i, folder);
+                exit(1);
+            }
+        } else {
+            generate_frame(pattern, rgb, width, height, i);
+            if (channels == 1)
+                to_luma(rgb, luma, width * height);
+            frame = channels == 1 ? luma : rgb;
+            stride = width * channels;
+        }
+
+        double start = get_wall_seconds();
+        int size;
+        if (channels == 1)
+            size = dv_render_luma(context, frame, width, height, stride, buffer, capacity);
+        else
+            size = dv_render_rgb(context, frame, width, height, stride, buffer, capacity);
+        if (size > 0 && terminal)
+            memcpy(terminal, buffer, size);
+        seconds += get_wall_seconds() - start;
+        if (size < 0) {
+            fprintf(stderr, "Could not render frame %d in run_case(): %s\n", i, dv_error_string(size));
+            exit(1);
+        }
+        bytes += size;
+        hash = hash_bytes(buffer, size, hash);
+    }
+
+    // Output is the size of the frames, sixel has no cells so it is timed per pixel
+    const dv_cell_frame *cells = dv_current_cells(context);
+    double cell_count = cells ? (double)cells->width * cells->height : (double)width * height;
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->mode = mode;
+    result->encoder = encoder;
+    result->frames = frames;
+    result->fps = seconds > 0 ? frames / seconds : 0;
+    result->ns_per_cell = seconds * 1e9 / frames / cell_count;
+    result->bytes_per_frame = (double)bytes / frames;
+    result->hash = hash;
+
+    if (folder) {
+        source.close(&source);
+        close_frame_folder(&frame_folder);
+    }
+    free(terminal);
+    free(buffer);
+    free(luma);
+    free(rgb);
+    free(context);
+    free(scratch);
+}
+
+// Plays the scene cuts the way play_source() in main.c does, without a terminal
+// - Frames that hash the same as the one before are not rendered or written again
+// - Rendered frames go into a frame cache, the loops after the first one are found there
+// and the source seeks back to where it has to decode again
+// - Every frame is paced to PLAYER_FRAMERATE, everything but the sleep is timed (decoding
+// the generated frames too), frames are the frames of every loop
+static void run_player_case(const char *name, int width, int height, int mode, int encoder, int frames, int sink, bench_result *result) {
+    int channels = mode == DV_MODE_GRAYSCALE ? 1 : 3;
+    frame_source source;
+    open_generated_source(&source, PATTERN_CUTS, width, height, channels, frames, PLAYER_LOOPS);
+
+    dv_character set[ASCII_CHARACTER_COUNT] = {0};
+    get_character_set(set);
+    // (mode, encoder, resize filter, source width, source height, output width, output height, sixel threads, sixel palette reuse,
+    // hysteresis luma, hysteresis color, hysteresis refresh, static frames, motion savings)
+    dv_config config = {mode, encoder, DV_FILTER_BOX, width, height, 0, 0, sysconf(_SC_NPROCESSORS_ONLN), 0, 0, 0, 0, 0, 0};
+    size_t scratch_size = dv_scratch_size(&config);
+    void *scratch = malloc(scratch_size);
+    dv_context *context = (dv_context *)malloc(sizeof(dv_context));
+    if (!scratch || !context) {
+        fprintf(stderr, "Memory allocation failed in run_player_case()\n");
+        exit(1);
+    }
+    int error = dv_context_init(context, &config, set, ASCII_CHARACTER_COUNT, scratch, scratch_size);
+    if (error) {
+        fprintf(stderr, "Could not create the renderer in run_player_case(): %s\n", dv_error_string(error));
+        exit(1);
+    }
+    size_t capacity = dv_output_capacity(context);
+    char *buffer = (char *)malloc(capacity);
+    char *terminal = sink == SINK_MEMORY ? (char *)malloc(capacity) : NULL;
+    if (!buffer || (sink == SINK_MEMORY && !terminal)) {
+        fprintf(stderr, "Memory allocation failed in run_player_case()\n");
+        exit(1);
+    }
+    frame_cache cache;
+    frame_cache_init(&cache, PLAYER_CACHE_BYTES);
+
+    // Same bookkeeping as play_source(), see the comments there
+    uint64_t previous_hash = 0;
+    int has_previous = 0, shown = -1, synced = 1, behind = 0;
+    cache_key key = {0, -1, mode, encoder, config.output_width, config.output_height};
+    double seconds = 0, playback_start = get_wall_seconds();
+    long long bytes = 0;
+    uint64_t hash = 0;
+    for (int i = 0; i < source.frame_count; i++) {
+        double start = get_wall_seconds();
+        key.index = i % source.period;
+        key.previous = shown;
+        const cached_frame *cached = frame_cache_find(&cache, &key);
+        const char *output = buffer;
+        int size = 0;
+        if (cached) {
+            behind = 1;
+            if (!has_previous || cached->hash != previous_hash) {
+                output = cached->data;
+                size = cached->size;
+                previous_hash = cached->hash;
+                has_previous = 1;
+                synced = 0;
+            }
+        } else {
+            if (behind && source.seek(&source, i) != 0) {
+                fprintf(stderr, "Could not seek to frame %d in run_player_case()\n", i);
+                exit(1);
+            }
+            behind = 0;
+            const unsigned char *frame = source.next_frame(&source);
+            uint64_t frame_hash = hash_frame(frame, (size_t)width * channels, height, source.stride);
+            if (!has_previous || frame_hash != previous_hash) {
+                if (!synced)
+                    dv_context_reset(context);
+                if (channels == 1)
+                    size = dv_render_luma(context, frame, width, height, source.stride, buffer, capacity);
+                else
+                    size = dv_render_rgb(context, frame, width, height, source.stride, buffer, capacity);
+                if (size < 0) {
+                    fprintf(stderr, "Could not render frame %d in run_player_case(): %s\n", i, dv_error_string(size));
+                    exit(1);
+                }
+                key.previous = synced ? shown : -1;
+                frame_cache_insert(&cache, &key, buffer, size, frame_hash, 0);
+                previous_hash = frame_hash;
+                has_previous = 1;
+                synced = 1;
+            }
+        }
+        shown = key.index;
+        if (size > 0 && terminal)
+            memcpy(terminal, output, size);
+        bytes += size;
+        hash = hash_bytes(output, size, hash);
+        seconds += get_wall_seconds() - start;
+        wait_until(playback_start + (i + 1.0) / PLAYER_FRAMERATE);
+    }
+
+    const dv_cell_frame *cells = dv_current_cells(context);
+    double cell_count = cells ? (double)cells->width * cells->height : (double)width * height;
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->mode = mode;
+    result->encoder = encoder;
+    result->frames = source.frame_count;
+    result->fps = seconds > 0 ? source.frame_count / seconds : 0;
+    result->ns_per_cell = seconds * 1e9 / source.frame_count / cell_count;
+    result->bytes_per_frame = (double)bytes / source.frame_count;
+    result->hash = hash;
+
+    frame_cache_close(&cache);
+    source.close(&source);
+    free(terminal);
+    free(buffer);
+    free(context);
+    free(scratch);
+}
+
+// Times trace point pairs, with the trace on the events are written to /dev/null
+// - Frames are the pairs, fps is pairs per second and ns/cell the ns of a pair
+static void run_trace_case(const char *name, int enabled, bench_result *result) {
+    if (enabled)
+        trace_open("/dev/null");
+    struct timespec wait = {0, TRACE_FLUSH_WAIT_MS * 1000000L};
+    double seconds = 0;
+    for (int batch = 0; batch < TRACE_BATCHES; batch++) {
+        double start = get_wall_seconds();
+        for (int i = 0; i < TRACE_BATCH_PAIRS; i++) {
+            TRACE_BEGIN("benchmark");
+            TRACE_END("benchmark");
+        }
+        seconds += get_wall_seconds() - start;
+        if (enabled)
+            nanosleep(&wait, NULL);
+    }
+    if (enabled)
+        trace_close();
+
+    int pairs = TRACE_BATCHES * TRACE_BATCH_PAIRS;
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->frames = pairs;
+    result->fps = seconds > 0 ? pairs / seconds : 0;
+    result->ns_per_cell = seconds * 1e9 / pairs;
+}
+
+// Makes a source out of a generated set that plays frames frames loops times and can seek
+static void open_generated_source(frame_source *source, int pattern, int width, int height, int channels, int frames, int loops) {
+    generated_state *state = (generated_state *)calloc(1, sizeof(generated_state));
+    if (!state || !(state->rgb = (unsigned char *)malloc((size_t)width * height * 3)) ||
+        !(state->luma = (unsigned char *)malloc((size_t)width * height))) {
+        fprintf(stderr, "Memory allocation failed in open_generated_source()\n");
+        exit(1);
+    }
+    state->pattern = pattern;
+    state->frames = frames;
+
+    source->width = width;
+    source->height = height;
+    source->channels = channels;
+    source->stride = width * channels;
+    source->framerate = PLAYER_FRAMERATE;
+    source->frame_count = frames * loops;
+    source->period = frames;
+    source->delay = 0;
+    source->state = state;
+    source->next_frame = next_generated_frame;
+    source->seek = seek_generated_source;
+    source->next_rows = NULL;
+    source->close = close_generated_source;
+}
+
+static const unsigned char *next_generated_frame(frame_source *source) {
+    generated_state *state = (generated_state *)source->state;
+    if (state->next >= source->frame_count)
+        return NULL;
+    generate_frame(state->pattern, state->rgb, source->width, source->height, state->next++ % state->frames);
+    if (source->channels == 3)
+        return state->rgb;
+    to_luma(state->rgb, state->luma, source->width * source->height);
+    return state->luma;
+}
+
+static int seek_generated_source(frame_source *source, int frame) {
+    generated_state *state = (generated_state *)source->state;
+    if (frame < 0 || frame >= source->frame_count)
+        return -1;
+    state->next = frame;
+    return 0;
+}
+
+static void close_generated_source(frame_source *source) {
+    generated_state *state = (generated_state *)source->state;
+    free(state->rgb);
+    free(state->luma);
+    free(state);
+}
+
+// Fills frame index of a generated set
+// - Static never changes, gradient moves its colors, noise is new every frame, pan moves a
+// scene 2 pixels right and 1 down every frame and cuts jump to another scene now and then
+static void generate_frame(int pattern, unsigned char *rgb, int width, int height, int index) {
+    if (pattern == PATTERN_STATIC) {
+        draw_scene(0, rgb, width, height, 0, 0);
+    } else if (pattern == PATTERN_GRADIENT) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                unsigned char *pixel = &rgb[((size_t)y * width + x) * 3];
+                pixel[0] = (x * 255 / width + index * 4) & 255;
+                pixel[1] = y * 255 / height;
+                pixel[2] = (x + y + index * 2) & 255;
+            }
+        }
+    } else if (pattern == PATTERN_NOISE) {
+        uint32_t state = get_noise(index + 1);
+        for (size_t i = 0; i < (size_t)width * height * 3; i++) {
+            state = get_noise(state);
+            rgb[i] = state >> 24;
+        }
+    } else if (pattern == PATTERN_PAN) {
+        draw_scene(1, rgb, width, height, index * 2, index);
+    } else {
+        draw_scene(index / CUT_FRAMES % 3, rgb, width, height, 0, 0);
+    }
+}
+
+// Draws one of three scenes, shifted by the given pixels
+// - 0 is soft rings, 1 is a checkerboard with fine texture (lots of detail to move), 2 is
+// flat color blocks
+static void draw_scene(int scene, unsigned char *rgb, int width, int height, int shift_x, int shift_y) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int sx = x - shift_x, sy = y - shift_y;
+            unsigned char *pixel = &rgb[((size_t)y * width + x) * 3];
+            if (scene == 0) {
+                int dx = x - width / 2, dy = y - height / 2;
+                int ring = (dx * dx + dy * dy) / 64;
+                pixel[0] = ring * 7 & 255;
+                pixel[1] = 128 + (ring & 63);
+                pixel[2] = 255 - (ring * 3 & 255);
+            } else if (scene == 1) {
+                int checker = ((sx >> 4) + (sy >> 4)) & 1;
+                pixel[0] = checker ? 220 : 30 + (sx * sy & 31);
+                pixel[1] = checker ? 200 - (sx & 15) * 4 : 60;
+                pixel[2] = (sy * 3 + sx) & 255;
+            } else {
+                int block = (x * 4 / width) + (y * 3 / height) * 4;
+                pixel[0] = block * 40 & 255;
+                pixel[1] = 255 - block * 20;
+                pixel[2] = block * 90 & 255;
+            }
+        }
+    }
+}
+
+static void to_luma(const unsigned char *rgb, unsigned char *luma, int pixels) {
+    for (int i = 0; i < pixels; i++)
+        luma[i] = (rgb[i * 3] * 77 + rgb[i * 3 + 1] * 150 + rgb[i * 3 + 2] * 29) >> 8;
+}
+
+// Writes a case as a line of JSON, the baseline reader reads these lines back
+static void write_result(FILE *file, const bench_result *result, int last) {
+    fprintf(file,
+            "{\"case\": \"%s\", \"mode\": %d, \"encoder\": %d, \"frames\": %d, \"fps\": %.2f, \"ns_per_cell\": %.3f, \"bytes_per_frame\": %.1f, "
+            "\"peak_rss_kb\": %ld, \"hash\": \"%016llx\"}%s\n",
+            result->name, result->mode, result->encoder, result->frames, result->fps, result->ns_per_cell, result->bytes_per_frame,
+            result->peak_rss_kb, (unsigned long long)result->hash, last ? "" : ",");
+}
+
+// Reads a result file written by this program, one case per line
+static void read_baseline(const char *path, bench_baseline *baseline) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open %s in read_baseline()\n", path);
+        exit(1);
+    }
+    baseline->results = NULL;
+    baseline->count = 0;
+    int capacity = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        char *name = strstr(line, "\"case\": \"");
+        if (!name)
+            continue;
+        if (baseline->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            bench_result *grown = (bench_result *)realloc(baseline->results, capacity * sizeof(bench_result));
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed in read_baseline()\n");
+                exit(1);
+            }
+            baseline->results = grown;
+        }
+        bench_result *result = &baseline->results[baseline->count];
+        memset(result, 0, sizeof(*result));
+        unsigned long long hash = 0;
+        name += strlen("\"case\": \"");
+        char *end = strchr(name, '"');
+        if (!end || sscanf(end, "\", \"mode\": %d, \"encoder\": %d, \"frames\": %d", &result->mode, &result->encoder, &result->frames) != 3) {
+            fprintf(stderr, "Broken line in %s in read_baseline(): %s", path, line);
+            exit(1);
+        }
+        char *fps_text = strstr(line, "\"fps\": ");
+        if (fps_text)
+            sscanf(fps_text, "\"fps\": %lf", &result->fps);
+        char *hash_text = strstr(line, "\"hash\": \"");
+        if (!hash_text || sscanf(hash_text, "\"hash\": \"%llx\"", &hash) != 1) {
+            fprintf(stderr, "Line without a hash in %s in read_baseline(): %s", path, line);
+            exit(1);
+        }
+        snprintf(result->name, sizeof(result->name), "%.*s", (int)(end - name), name);
+        result->hash = hash;
+        baseline->count++;
+    }
+    fclose(file);
+}
+
+static const bench_result *find_result(const bench_baseline *baseline, const bench_result *result) {
+    for (int i = 0; i < baseline->count; i++) {
+        const bench_result *other = &baseline->results[i];
+        if (strcmp(other->name, result->name) == 0 && other->mode == result->mode && other->encoder == result->encoder &&
+            other->frames == result->frames)
+            return other;
+    }
+    return NULL;
+}
+
+// Prints every case whose output changed, that got slower or that is not in the baseline,
+// returns 1 if there was one
+// - A case that is not in the baseline fails too, a check that compared nothing is no check
+static int compare_results(const bench_result *results, int count, const bench_baseline *baseline, int check_speed, double tolerance) {
+    int changed = 0, slower = 0, missing = 0, skipped = 0;
+    for (int i = 0; i < count; i++) {
+        const bench_result *result = &results[i];
+        // Trace cases only have a speed, there is no output to compare
+        if (!check_speed && result->hash == 0) {
+            skipped++;
+            continue;
+        }
+        const bench_result *expected = find_result(baseline, result);
+        if (!expected) {
+            fprintf(stderr, "MISSING %s in mode %d (encoder %d, %d frames) is not in the baseline\n", result->name, result->mode,
+                    result->encoder, result->frames);
+            missing++;
+            continue;
+        }
+        if (result->hash != expected->hash) {
+            fprintf(stderr, "CHANGED %s in mode %d: output hash %016llx, baseline %016llx\n", result->name, result->mode,
+                    (unsigned long long)result->hash, (unsigned long long)expected->hash);
+            changed++;
+        }
+        // Lines without a speed (the golden file) have fps 0 and are never slower
+        if (check_speed && result->fps < expected->fps * (1 - tolerance)) {
+            fprintf(stderr, "SLOWER %s in mode %d: %.1f FPS, baseline %.1f FPS (%.1f%%)\n", result->name, result->mode, result->fps,
+                    expected->fps, 100 * (result->fps - expected->fps) / expected->fps);
+            slower++;
+        }
+    }
+    fprintf(stderr, "Compared %d of %d cases with the baseline: %d changed output", count - missing - skipped, count, changed);
+    if (check_speed)
+        fprintf(stderr, ", %d slower than %.0f%% under it", slower, tolerance * 100);
+    fprintf(stderr, ", %d missing\n", missing);
+    return changed > 0 || slower > 0 || missing > 0;
+}
+
+static double get_wall_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Sleeps until the wall clock (get_wall_seconds()) reaches seconds, returns right away if it is late
+static void wait_until(double seconds) {
+    struct timespec until = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+        ;
+}
+
+// Xorshift, the noise is the same on every run so its output hash is too
+static uint32_t get_noise(uint32_t state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
@@ -1,3 +1,6 @@
 #!/bin/bash
-gcc -fsanitize=address -g -o output main.c -I/usr/include/freetype2 -lfreetype -lm
-
+gcc -fsanitize=address -g -c -o duckvideo.o duckvideo.c
+ar rcs libduckvideo.a duckvideo.o
+gcc -fsanitize=address -g -o output main.c prefetch.c source_folder.c source_stream.c source_shm.c source_pack.c source_preload.c source_avi.c source_gif.c frame_cache.c frame_hash.c charset.c frame_log.c trace.c perf_counters.c governor.c cpu_budget.c jpeg.c qoi.c -I/usr/include/freetype2 -L. -lduckvideo -lfreetype -lm -lpthread
+gcc -fsanitize=address -g -o ring_producer ring_producer.c
+gcc -O2 -o benchmark benchmark.c duckvideo.c charset.c frame_cache.c frame_hash.c source_folder.c prefetch.c jpeg.c qoi.c trace.c -I/usr/include/freetype2 -lfreetype -lm -lpthread
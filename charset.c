@@ -0,0 +1,103 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Glyphs of the font through FreeType and the brightness of every character
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freetype2/ft2build.h>
+#include FT_FREETYPE_H
+
+#include "charset.h"
+
+// Gets you a set of Character - Value pairs that
+// represents the brightness value for each ASCII character
+// - Sorting and scaling up to 255 is done by dv_context_init()
+int get_character_set(dv_character set[]) {
+    int width, height;
+    for (int i = ASCII_STARTING_POINT; i < ASCII_ENDING_POINT + 1; i++) {
+        unsigned char *bitmap = get_character_bitmap(i, DEFAULT_FONT_PATH, &width, &height);
+        int size = width * height;
+        double avg = get_average_brightness(bitmap, size);
+        avg = avg * size / (DEFAULT_CHARACTER_HEIGHT * DEFAULT_CHARACTER_WIDTH);
+        set[i - 32].character = i;
+        set[i - 32].value = avg;
+        free(bitmap);
+    }
+
+    return 0;
+}
+
+// Returns the character glyph bitmap based on a font
+unsigned char *get_character_bitmap(char character, const char *font_path, int *width_out, int *height_out) {
+    FT_Library library;
+    FT_Face face;
+
+    if (FT_Init_FreeType(&library)) {
+        fprintf(stderr, "Could not initialize FreeType library in get_character_bitmap()\n");
+        FT_Done_Face(face);
+        FT_Done_FreeType(library);
+        exit(1);
+    }
+
+    if (FT_New_Face(library, font_path, 0, &face)) {
+        fprintf(stderr, "Could not load font in get_character_bitmap()\n");
+        FT_Done_Face(face);
+        FT_Done_FreeType(library);
+        exit(1);
+    }
+
+    FT_Set_Pixel_Sizes(face, 0, 22);
+
+    if (FT_Load_Char(face, character, FT_LOAD_RENDER)) {
+        fprintf(stderr, "Could not load character in get_character_bitmap()\n");
+        FT_Done_Face(face);
+        FT_Done_FreeType(library);
+        exit(1);
+    }
+
+    FT_Bitmap bitmap = face->glyph->bitmap;
+
+    int width = bitmap.width;
+    int height = bitmap.rows;
+    int pitch = bitmap.pitch;
+
+    unsigned char *buffer = malloc(width * height);
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation failed in get_character_bitmap()\n");
+        FT_Done_Face(face);
+        FT_Done_FreeType(library);
+        exit(1);
+    }
+
+    for (int y = 0; y < height; y++) {
+        memcpy(buffer + y * width, bitmap.buffer + y * pitch, width);
+    }
+
+    if (width_out)
+        *width_out = width;
+    if (height_out)
+        *height_out = height;
+
+    FT_Done_Face(face);
+    FT_Done_FreeType(library);
+
+    return buffer;
+}
+
+// Returns the average value of each pixel in a characters glyph
+double get_average_brightness(unsigned char *bitmap, int size) {
+    double total = 0;
+    for (int i = 0; i < size; i++)
+        total += bitmap[i];
+    if (size == 0)
+        return 0;
+    else
+        return (total / size);
+}
@@ -0,0 +1,27 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Character set of the renderer, the brightness of every printable ASCII character in the font
+// - Shared by the player and the benchmark so both draw with the same characters
+
+#ifndef CHARSET_H
+#define CHARSET_H
+
+#include "duckvideo.h"
+
+#define DEFAULT_FONT_PATH "assets/fonts/UbuntuMono.ttf"
+#define ASCII_STARTING_POINT 32
+#define ASCII_ENDING_POINT 126
+#define ASCII_CHARACTER_COUNT 95
+#define DEFAULT_CHARACTER_HEIGHT 22
+#define DEFAULT_CHARACTER_WIDTH 10
+
+unsigned char *get_character_bitmap(char, const char *, int *, int *);
+double get_average_brightness(unsigned char *, int);
+int get_character_set(dv_character[]);
+
+#endif
@@ -0,0 +1,223 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Once a second controller over the quality knobs of playback
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu_budget.h"
+
+static void turn_down(cpu_budget *, const cpu_stages *);
+static void turn_up(cpu_budget *);
+static void add_rendered_stages(const cpu_budget *, cpu_stages *);
+static double get_clock_seconds(clockid_t);
+
+#define CPU_KNOB_FILTER 0
+#define CPU_KNOB_SIZE 1
+#define CPU_KNOB_FRAMES 2
+// Drawn frames go down to one of this many
+#define CPU_BUDGET_MAX_DIVISOR 4
+// A knob is turned back up if the usage it is expected to bring stays under this share of the budget
+#define CPU_BUDGET_ROOM 0.9
+
+void cpu_budget_init(cpu_budget *budget, double target, dv_context *contexts[2][2], const char *log_path) {
+    memset(budget, 0, sizeof(*budget));
+    budget->target = target;
+    for (int half = 0; half < 2; half++) {
+        for (int box = 0; box < 2; box++)
+            budget->contexts[half][box] = contexts[half][box];
+    }
+    budget->divisor = 1;
+    budget->start_wall = budget->window_wall = get_clock_seconds(CLOCK_MONOTONIC);
+    budget->start_cpu = budget->window_cpu = get_clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    if (log_path) {
+        budget->log = fopen(log_path, "w");
+        if (!budget->log) {
+            fprintf(stderr, "Could not open %s for writing in cpu_budget_init()\n", log_path);
+            exit(1);
+        }
+        fprintf(budget->log, "second,usage,level,decode_ms,resize_ms,convert_ms,encode_ms,write_ms\n");
+    }
+}
+
+dv_context *cpu_budget_plan(cpu_budget *budget, int index, int *cleared) {
+    *cleared = 0;
+    if (index % budget->divisor != 0) {
+        budget->skipped++;
+        return NULL;
+    }
+    dv_context *context = budget->contexts[budget->half][budget->box];
+    if (budget->half != budget->applied_half || budget->box != budget->applied_box) {
+        dv_context_reset(context);
+        *cleared = budget->half != budget->applied_half;
+        budget->applied_half = budget->half;
+        budget->applied_box = budget->box;
+    }
+    return context;
+}
+
+void cpu_budget_account(cpu_budget *budget, double decode_seconds, double write_seconds) {
+    budget->frames++;
+    budget->window.decode += decode_seconds;
+    budget->window.write += write_seconds;
+    double wall = get_clock_seconds(CLOCK_MONOTONIC);
+    if (wall - budget->window_wall < 1)
+        return;
+
+    double cpu = get_clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    budget->usage = (cpu - budget->window_cpu) / (wall - budget->window_wall);
+    budget->level_seconds[budget->step_count] += wall - budget->window_wall;
+    // Renderer stages are totals, the window gets what they grew by since the last one
+    cpu_stages window = budget->window;
+    add_rendered_stages(budget, &window);
+    window.resize -= budget->stages.resize;
+    window.convert -= budget->stages.convert;
+    window.encode -= budget->stages.encode;
+    budget->stages.decode += window.decode;
+    budget->stages.resize += window.resize;
+    budget->stages.convert += window.convert;
+    budget->stages.encode += window.encode;
+    budget->stages.write += window.write;
+    if (budget->log) {
+        fprintf(budget->log, "%.0f,%.4f,%d,%.2f,%.2f,%.2f,%.2f,%.2f\n", wall - budget->start_wall, budget->usage, budget->step_count,
+                window.decode * 1000, window.resize * 1000, window.convert * 1000, window.encode * 1000, window.write * 1000);
+    }
+
+    // Second after a change has a frame drawn from scratch in it, it only measures the change
+    if (budget->settling) {
+        if (budget->step_count > 0 && budget->steps[budget->step_count - 1].after == 0)
+            budget->steps[budget->step_count - 1].after = budget->usage;
+        budget->settling = 0;
+    } else if (budget->usage > budget->target) {
+        turn_down(budget, &window);
+    } else if (budget->step_count > 0) {
+        const cpu_step *last = &budget->steps[budget->step_count - 1];
+        double expected = last->after > 0 ? budget->usage * last->before / last->after : budget->usage * 2;
+        if (expected < budget->target * CPU_BUDGET_ROOM)
+            turn_up(budget);
+    }
+    memset(&budget->window, 0, sizeof(budget->window));
+    budget->window_wall = wall;
+    budget->window_cpu = cpu;
+}
+
+const char *cpu_budget_describe(const cpu_budget *budget, char *buffer, size_t size) {
+    int used = snprintf(buffer, size, "%d", budget->step_count);
+    const char *separator = " (";
+    if (budget->box) {
+        used += snprintf(buffer + used, size - used, "%sbox filter", separator);
+        separator = ", ";
+    }
+    if (budget->half) {
+        used += snprintf(buffer + used, size - used, "%shalf size", separator);
+        separator = ", ";
+    }
+    if (budget->divisor > 1)
+        used += snprintf(buffer + used, size - used, "%s1/%d frames", separator, budget->divisor);
+    if (budget->step_count > 0)
+        snprintf(buffer + used, size - used, ")");
+    return buffer;
+}
+
+void cpu_budget_report(const cpu_budget *budget, FILE *file) {
+    double wall = get_clock_seconds(CLOCK_MONOTONIC) - budget->start_wall;
+    if (budget->frames == 0 || wall <= 0)
+        return;
+    double cpu = get_clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - budget->start_cpu;
+    fprintf(file, "CPU budget: used %.1f%% of a core on average (budget %.1f%%), %ld changes, skipped %ld of %ld frames\n", 100 * cpu / wall,
+            100 * budget->target, budget->changes, budget->skipped, budget->frames);
+    cpu_stages stages = budget->stages;
+    fprintf(file, "CPU stages: decode %.3f s, resize %.3f s, convert %.3f s, encode %.3f s, write %.3f s\n", stages.decode, stages.resize,
+            stages.convert, stages.encode, stages.write);
+    double measured = 0;
+    for (int i = 0; i <= CPU_BUDGET_MAX_STEPS; i++)
+        measured += budget->level_seconds[i];
+    if (measured <= 0)
+        return;
+    fprintf(file, "CPU levels:");
+    for (int i = 0, first = 1; i <= CPU_BUDGET_MAX_STEPS; i++) {
+        if (budget->level_seconds[i] == 0)
+            continue;
+        fprintf(file, "%s %d %.1f%%", first ? "" : ",", i, 100 * budget->level_seconds[i] / measured);
+        first = 0;
+    }
+    fprintf(file, "\n");
+}
+
+void cpu_budget_close(cpu_budget *budget) {
+    if (budget->log)
+        fclose(budget->log);
+}
+
+// Turns down the knob of the stage that took the most CPU time in the window
+// - Filter only makes resize cheaper, the size makes convert and encode cheaper and
+// frames are the only knob that saves decoding and writing
+static void turn_down(cpu_budget *budget, const cpu_stages *window) {
+    if (budget->step_count == CPU_BUDGET_MAX_STEPS)
+        return;
+    int knob = -1;
+    double cost = -1;
+    if (!budget->box && budget->contexts[budget->half][1] && window->resize > cost) {
+        knob = CPU_KNOB_FILTER;
+        cost = window->resize;
+    }
+    if (!budget->half && budget->contexts[1][budget->box] && window->convert + window->encode > cost) {
+        knob = CPU_KNOB_SIZE;
+        cost = window->convert + window->encode;
+    }
+    if (budget->divisor < CPU_BUDGET_MAX_DIVISOR && window->decode + window->write > cost)
+        knob = CPU_KNOB_FRAMES;
+    if (knob == -1)
+        return;
+    if (knob == CPU_KNOB_FILTER)
+        budget->box = 1;
+    else if (knob == CPU_KNOB_SIZE)
+        budget->half = 1;
+    else
+        budget->divisor++;
+    cpu_step *step = &budget->steps[budget->step_count++];
+    step->knob = knob;
+    step->before = budget->usage;
+    step->after = 0;
+    budget->settling = 1;
+    budget->changes++;
+}
+
+// Turns the last knob that was turned down back up
+static void turn_up(cpu_budget *budget) {
+    const cpu_step *step = &budget->steps[--budget->step_count];
+    if (step->knob == CPU_KNOB_FILTER)
+        budget->box = 0;
+    else if (step->knob == CPU_KNOB_SIZE)
+        budget->half = 0;
+    else
+        budget->divisor--;
+    budget->settling = 1;
+    budget->changes++;
+}
+
+// Adds the stage totals of every context to stages
+static void add_rendered_stages(const cpu_budget *budget, cpu_stages *stages) {
+    for (int half = 0; half < 2; half++) {
+        for (int box = 0; box < 2; box++) {
+            if (!budget->contexts[half][box])
+                continue;
+            const dv_stage_stats *rendered = dv_get_stage_stats(budget->contexts[half][box]);
+            stages->resize += rendered->resize;
+            stages->convert += rendered->convert;
+            stages->encode += rendered->encode;
+        }
+    }
+}
+
+static double get_clock_seconds(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
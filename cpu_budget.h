@@ -0,0 +1,95 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// CPU budget that keeps playback under a share of one core
+// - CPU time of every stage is added up (decode, resize, convert, encode and write)
+// - Every second the share of a core the process used is measured, over the budget the knob
+// of the most expensive stage is turned down: box filter for resize, half the pixel grid
+// for convert and encode, fewer drawn frames for decode and write
+// - Knobs are turned back up one by one, last one first, once the budget has room for them
+
+#ifndef CPU_BUDGET_H
+#define CPU_BUDGET_H
+
+#include <stdio.h>
+
+#include "duckvideo.h"
+
+#define CPU_BUDGET_MAX_STEPS 8
+
+// Struct that adds up CPU seconds of every stage of playback
+typedef struct cpu_stages {
+    double decode;
+    double resize;
+    double convert;
+    double encode;
+    double write;
+} cpu_stages;
+
+// Struct that represents a knob that was turned down
+// - Before and after are the core shares of the seconds around the change (after is 0
+// until it was measured), they tell how much turning it back up will cost
+typedef struct cpu_step {
+    int knob;
+    double before;
+    double after;
+} cpu_step;
+
+// Struct that represents the state of the CPU budget
+// - Contexts are indexed by [half size][box filter], NULL if that one was not made
+// - Divisor draws one of that many frames
+// - Usage is the share of a core the last second used (0.15 is 15%)
+// - Log gets a line every second (NULL for no log)
+typedef struct cpu_budget {
+    double target;
+    dv_context *contexts[2][2];
+    int half;
+    int box;
+    int divisor;
+    int applied_half;
+    int applied_box;
+    cpu_step steps[CPU_BUDGET_MAX_STEPS];
+    int step_count;
+    cpu_stages stages;
+    cpu_stages window;
+    double window_wall;
+    double window_cpu;
+    double start_wall;
+    double start_cpu;
+    double usage;
+    int settling;
+    long frames;
+    long skipped;
+    long changes;
+    double level_seconds[CPU_BUDGET_MAX_STEPS + 1];
+    FILE *log;
+} cpu_budget;
+
+// Sets up a budget of a share of one core (0.15 is 15%) over the contexts
+// - Contexts[0][0] is the context of the player, the others are the same one with half the
+// output size and/or the box filter (NULL if the knob is not there)
+// - Log path is where the usage of every second is written as CSV (NULL for no log)
+void cpu_budget_init(cpu_budget *, double target, dv_context *contexts[2][2], const char *log_path);
+
+// Picks the context for frame index, or returns NULL if the frame is not drawn
+// - Cleared is set to 1 if the pixel grid changed size, the screen has to be cleared
+// - A context that takes over was reset, it draws from scratch
+dv_context *cpu_budget_plan(cpu_budget *, int index, int *cleared);
+
+// Counts the CPU seconds of a frame outside the renderer, call it for every frame
+// - Once a second the usage is measured and a knob may be turned
+void cpu_budget_account(cpu_budget *, double decode_seconds, double write_seconds);
+
+// Writes the quality level and the knobs that are turned down ("0" is full quality)
+const char *cpu_budget_describe(const cpu_budget *, char *buffer, size_t size);
+
+// Prints the average usage, the CPU time of every stage and the time at each level
+void cpu_budget_report(const cpu_budget *, FILE *);
+
+void cpu_budget_close(cpu_budget *);
+
+#endif
@@ -0,0 +1,1810 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// libduckvideo, see duckvideo.h
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "duckvideo.h"
+
+// Struct that holds the precomputed weights for resizing one plane
+// - Weights are 14 bit fixed point and every output pixel sums to 1 << 14
+// - Values are resized in linear light, rows is a ring with the horizontal pass
+// of the last vertical_taps input rows so the input can come a few rows at a time
+// - Input row and output row are the next rows to be read and written
+// - Output rows marked in skipped rows (can be NULL) are not written, input rows only
+// they use are not read
+// - Accumulator is the vertical pass of one output row, contributions are the weights
+// of one output pixel while they are built
+struct dv_resampler {
+    int input_width;
+    int input_height;
+    int output_width;
+    int output_height;
+    int channels;
+    int horizontal_taps;
+    int vertical_taps;
+    int *horizontal_first;
+    int *horizontal_weights;
+    int *vertical_first;
+    int *vertical_weights;
+    unsigned short *rows;
+    int *accumulator;
+    double *contributions;
+    int input_row;
+    int output_row;
+    const unsigned char *skipped_rows;
+    unsigned short to_linear[256];
+    unsigned char to_srgb[16384];
+};
+
+// Struct that remembers which colors the terminal is currently using
+// - Used by the encoders to skip escape codes that would change nothing
+typedef struct cell_pen {
+    unsigned char attributes;
+    unsigned char fg[3];
+    unsigned char bg[3];
+} cell_pen;
+
+// Struct that holds the work of a single sixel encoding thread
+// - Each thread encodes the bands [first_band, last_band) into its own buffer
+typedef struct sixel_job {
+    const unsigned char *indices;
+    unsigned char *masks;
+    int width;
+    int height;
+    int first_band;
+    int last_band;
+    char *buffer;
+    int size;
+} sixel_job;
+
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define ARENA_ALIGNMENT 64
+#define MAXIMUM_ENCODED_CELL_SIZE 64
+#define SIXEL_HEADER_SIZE 32
+#define SIXEL_COLOR_DEFINITION_SIZE 19
+#define ENCODE_ELIDE 1
+#define ENCODE_256 2
+#define ENCODE_REP 4
+#define ENCODE_DELTA 8
+#define ENCODE_PAN 16
+#define MOTION_MAX_COLUMNS 16
+#define MOTION_SAMPLES 8
+#define STATIC_SAMPLE_STRIDE 8
+#define STATIC_TILE_WIDTH 8
+
+static void *arena_alloc(dv_arena *, size_t);
+static int layout_context(dv_context *, dv_arena *);
+static void get_output_size(const dv_config *, int *, int *);
+static void get_cell_size(const dv_config *, int *, int *);
+static dv_resampler *create_resampler(dv_arena *, int, int, int, int, int, int);
+static void build_resampler_weights(int *, int *, double *, int, int, int, int);
+static void resample(dv_resampler *, const unsigned char *, int, unsigned char *);
+static void resample_rows(dv_resampler *, const unsigned char *, int, int, unsigned char *);
+static int get_last_input_row(const dv_resampler *, int);
+static int is_input_row_used(const dv_resampler *, int);
+static void carve_cell_frame(dv_cell_frame *, dv_arena *, int, int);
+static int render(dv_context *, const unsigned char *, int, int, int, int, char *, size_t);
+static int push_rows(dv_context *, const unsigned char *, int, int, int);
+static int draw(dv_context *, const unsigned char *, int, int, char *);
+static int encode_counting_motion(dv_context *, const dv_cell_frame *, const dv_cell_frame *, char *);
+static const unsigned char *hold_pixels(dv_context *, const unsigned char *, int, int);
+static void fill_cells(dv_context *, dv_cell_frame *, const unsigned char *, int, int, int);
+static void plan_static_rows(dv_context *);
+static void fill_changing_cells(dv_context *, dv_cell_frame *, const dv_cell_frame *, const unsigned char *, int, int);
+static void fill_cell_span(dv_context *, dv_cell_frame *, int, int, int, const unsigned char *, int, int, int);
+static int pixels_match_cell(const dv_context *, const dv_cell_frame *, int, const unsigned char *, int, int, int);
+static void reduce_colors(const dv_context *, dv_cell_frame *);
+static void fill_cells_grayscale(dv_cell_frame *, const unsigned char *, int, int, const char *);
+static void fill_cells_colored(dv_cell_frame *, const unsigned char *, int, int, const char *);
+static void fill_cells_single_character(dv_cell_frame *, const unsigned char *, int, int, char);
+static void fill_cells_double_pixel(dv_cell_frame *, const unsigned char *, int, int, int);
+static int encode_cells(const dv_cell_frame *, const dv_cell_frame *, char *, int, int, int *);
+static int encode_moved_cells(const dv_cell_frame *, const dv_cell_frame *, char *, int *, int *);
+static int find_vertical_shift(const dv_cell_frame *, const dv_cell_frame *);
+static int find_horizontal_shift(const dv_cell_frame *, int, const dv_cell_frame *, int);
+static int rows_equal(const dv_cell_frame *, int, const dv_cell_frame *, int);
+static int spans_equal(const dv_cell_frame *, size_t, const dv_cell_frame *, size_t, int);
+static int is_on_screen(const dv_cell_frame *, int, const dv_cell_frame *, int, int);
+static int write_cell_pen(char *, const dv_cell_frame *, int, cell_pen *, int);
+static int write_glyph(char *, unsigned int);
+static int write_number(char *, int);
+static int get_number_size(int);
+static int get_256_color_index(int, int, int);
+static int get_sixel_thread_count(const dv_config *, int);
+static int get_sixel_band_size(int);
+static int render_sixel(dv_context *, const unsigned char *, int, int, char *);
+static void quantize_to_sixel_palette(const unsigned char *, int, int, int, int, unsigned char *, unsigned char *);
+static void *encode_sixel_bands(void *);
+static int write_sixel_run(char *, char, int);
+static void sort_characters(dv_character *, int);
+static void scale_to_255(dv_character *, int);
+static int get_closest_character_index(unsigned char, dv_character *, int);
+static void calculate_lookup_table(dv_character *, int, char *);
+static double get_thread_seconds(void);
+static void mark_stage(const dv_context *, const char *, int);
+
+size_t dv_scratch_size(const dv_config *config) {
+    dv_context context;
+    dv_arena arena = {NULL, 0, 0};
+    context.config = *config;
+    layout_context(&context, &arena);
+    return arena.used + ARENA_ALIGNMENT;
+}
+
+int dv_context_init(dv_context *context, const dv_config *config, const dv_character *set, int set_size, void *scratch, size_t scratch_size) {
+    if (!context || !config || !set || set_size < 1 || set_size > DV_MAX_CHARACTERS || !scratch)
+        return DV_ERROR_ARGUMENT;
+    if (config->source_width < 1 || config->source_height < 1 || config->output_width < 0 || config->output_height < 0)
+        return DV_ERROR_ARGUMENT;
+    if (config->encoder < 0 || config->encoder >= DV_ENCODER_COUNT)
+        return DV_ERROR_ARGUMENT;
+    if (config->hysteresis_luma < 0 || config->hysteresis_color < 0 || config->hysteresis_refresh < 0 || config->hysteresis_refresh > 255)
+        return DV_ERROR_ARGUMENT;
+    if (config->static_frames < 0 || config->static_frames > 255)
+        return DV_ERROR_ARGUMENT;
+    if (config->mode != DV_MODE_GRAYSCALE && config->mode != DV_MODE_COLORED &&
+        config->mode != DV_MODE_DOUBLE_PIXEL && config->mode != DV_MODE_SIXEL &&
+        (config->mode <= 32 || config->mode >= 126))
+        return DV_ERROR_ARGUMENT;
+
+    memset(context, 0, sizeof(dv_context));
+    context->config = *config;
+    memcpy(context->set, set, set_size * sizeof(dv_character));
+    context->set_size = set_size;
+    sort_characters(context->set, set_size);
+    scale_to_255(context->set, set_size);
+    calculate_lookup_table(context->set, set_size, context->lookup_table);
+
+    dv_cell_encoder encoders[DV_ENCODER_COUNT] = {dv_encode_truecolor, dv_encode_256, dv_encode_delta, dv_encode_rep, dv_encode_scroll, dv_encode_delta_256};
+    context->encoder = encoders[config->encoder];
+    dv_set_color_bits(context, 8);
+
+    // Scratch is aligned so every plane starts on a cache line
+    size_t offset = (ARENA_ALIGNMENT - ((size_t)scratch % ARENA_ALIGNMENT)) % ARENA_ALIGNMENT;
+    if (scratch_size < offset)
+        return DV_ERROR_NO_SPACE;
+    context->arena.base = (unsigned char *)scratch + offset;
+    context->arena.capacity = scratch_size - offset;
+    context->arena.used = 0;
+    return layout_context(context, &context->arena);
+}
+
+void dv_context_reset(dv_context *context) {
+    context->has_previous = 0;
+    memset(context->sixel_defined, 0, DV_SIXEL_COLOR_COUNT);
+}
+
+void dv_set_encoder(dv_context *context, dv_cell_encoder encoder) {
+    context->encoder = encoder;
+}
+
+void dv_set_trace_hook(dv_context *context, dv_trace_hook hook) {
+    context->trace = hook;
+}
+
+int dv_set_color_bits(dv_context *context, int bits) {
+    if (bits < 1 || bits > 8)
+        return DV_ERROR_ARGUMENT;
+    // Kept bits are repeated into the dropped ones so black and white stay exact
+    int keep = (0xff << (8 - bits)) & 0xff;
+    for (int i = 0; i < 256; i++) {
+        int value = i & keep;
+        for (int shift = bits; shift < 8; shift += bits)
+            value |= (i & keep) >> shift;
+        context->color_levels[i] = value;
+    }
+    context->color_bits = bits;
+    return DV_OK;
+}
+
+size_t dv_output_capacity(const dv_context *context) {
+    int width, height;
+    get_output_size(&context->config, &width, &height);
+    if (context->config.mode == DV_MODE_SIXEL) {
+        return SIXEL_HEADER_SIZE + DV_SIXEL_COLOR_COUNT * SIXEL_COLOR_DEFINITION_SIZE +
+               (size_t)((height + 5) / 6) * get_sixel_band_size(width) + 2;
+    }
+    return dv_cell_capacity(&context->frames[0]);
+}
+
+int dv_render_rgb(dv_context *context, const unsigned char *rgb, int width, int height, int stride, char *output, size_t output_capacity) {
+    return render(context, rgb, 3, width, height, stride, output, output_capacity);
+}
+
+int dv_render_luma(dv_context *context, const unsigned char *luma, int width, int height, int stride, char *output, size_t output_capacity) {
+    return render(context, luma, 1, width, height, stride, output, output_capacity);
+}
+
+int dv_push_rgb_rows(dv_context *context, const unsigned char *rgb, int count, int stride) {
+    return push_rows(context, rgb, 3, count, stride);
+}
+
+int dv_push_luma_rows(dv_context *context, const unsigned char *luma, int count, int stride) {
+    return push_rows(context, luma, 1, count, stride);
+}
+
+int dv_render_pushed(dv_context *context, char *output, size_t output_capacity) {
+    if (!output || context->pushed_rows != context->config.source_height)
+        return DV_ERROR_ARGUMENT;
+    if (output_capacity < dv_output_capacity(context))
+        return DV_ERROR_NO_SPACE;
+    int pixels_width, pixels_height;
+    get_output_size(&context->config, &pixels_width, &pixels_height);
+    int channels = context->pushed_channels;
+    context->pushed_rows = 0;
+    return draw(context, channels == 3 ? context->pixels : context->luma, pixels_width * channels, channels, output);
+}
+
+const dv_cell_frame *dv_current_cells(const dv_context *context) {
+    if (context->config.mode == DV_MODE_SIXEL || !context->has_previous)
+        return NULL;
+    return &context->frames[context->current_frame];
+}
+
+const dv_hysteresis_stats *dv_get_hysteresis_stats(const dv_context *context) {
+    return &context->hysteresis;
+}
+
+const dv_motion_stats *dv_get_motion_stats(const dv_context *context) {
+    return &context->motion;
+}
+
+const dv_static_stats *dv_get_static_stats(const dv_context *context) {
+    return &context->statics;
+}
+
+const dv_stage_stats *dv_get_stage_stats(const dv_context *context) {
+    return &context->stages;
+}
+
+const char *dv_error_string(int error) {
+    switch (error) {
+    case DV_OK:
+        return "no error";
+    case DV_ERROR_ARGUMENT:
+        return "invalid argument";
+    case DV_ERROR_NO_SPACE:
+        return "buffer too small";
+    case DV_ERROR_THREAD:
+        return "could not create a thread";
+    default:
+        return "unknown error";
+    }
+}
+
+// Returns memory from the arena or NULL if it does not fit
+// - If the arena has no base it only counts the size and returns NULL
+static void *arena_alloc(dv_arena *arena, size_t size) {
+    size_t start = (arena->used + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (arena->base && start + size > arena->capacity)
+        return NULL;
+    arena->used = start + size;
+    if (!arena->base)
+        return NULL;
+    return arena->base + start;
+}
+
+// Carves every buffer of the context out of the arena
+// - Works in counting mode too, then nothing is written
+static int layout_context(dv_context *context, dv_arena *arena) {
+    const dv_config *config = &context->config;
+    int counting = arena->base == NULL;
+    int width, height, cell_width, cell_height;
+    get_output_size(config, &width, &height);
+    get_cell_size(config, &cell_width, &cell_height);
+
+    // Pixels are also needed without resizing, pushed rows are collected there
+    if (width != config->source_width || height != config->source_height) {
+        context->resampler = create_resampler(arena, config->source_width, config->source_height, width, height, 3, config->filter);
+        context->luma_resampler = create_resampler(arena, config->source_width, config->source_height, width, height, 1, config->filter);
+        if (!counting && (!context->resampler || !context->luma_resampler))
+            return DV_ERROR_NO_SPACE;
+    }
+    context->pixels = (unsigned char *)arena_alloc(arena, (size_t)width * height * 3);
+    context->luma = (unsigned char *)arena_alloc(arena, (size_t)width * height);
+    if (!counting && (!context->pixels || !context->luma))
+        return DV_ERROR_NO_SPACE;
+    if (config->hysteresis_luma > 0 && config->mode != DV_MODE_SIXEL) {
+        context->held_pixels = (unsigned char *)arena_alloc(arena, (size_t)width * height * 3);
+        context->held_ages = (unsigned char *)arena_alloc(arena, (size_t)width * height);
+        if (!counting && (!context->held_pixels || !context->held_ages))
+            return DV_ERROR_NO_SPACE;
+    }
+
+    if (config->mode == DV_MODE_SIXEL) {
+        int band_count = (height + 5) / 6;
+        int thread_count = get_sixel_thread_count(config, band_count);
+        int bands_per_thread = (band_count + thread_count - 1) / thread_count;
+        context->sixel_indices = (unsigned char *)arena_alloc(arena, (size_t)width * height);
+        if (!counting && !context->sixel_indices)
+            return DV_ERROR_NO_SPACE;
+        for (int t = 0; t < thread_count; t++) {
+            context->sixel_masks[t] = (unsigned char *)arena_alloc(arena, (size_t)DV_SIXEL_COLOR_COUNT * width);
+            if (t > 0)
+                context->sixel_buffers[t] = (char *)arena_alloc(arena, (size_t)bands_per_thread * get_sixel_band_size(width));
+            if (!counting && (!context->sixel_masks[t] || (t > 0 && !context->sixel_buffers[t])))
+                return DV_ERROR_NO_SPACE;
+        }
+        return DV_OK;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        carve_cell_frame(&context->frames[i], arena, cell_width, cell_height);
+        if (!counting && !context->frames[i].data)
+            return DV_ERROR_NO_SPACE;
+    }
+    if (config->encoder == DV_ENCODER_SCROLL && config->motion_savings) {
+        context->motion_buffer = (char *)arena_alloc(arena, dv_cell_capacity(&context->frames[0]));
+        if (!counting && !context->motion_buffer)
+            return DV_ERROR_NO_SPACE;
+    }
+    if (config->static_frames > 0) {
+        context->static_ages = (unsigned char *)arena_alloc(arena, (size_t)cell_width * cell_height);
+        context->static_mask = (unsigned char *)arena_alloc(arena, (size_t)cell_width * cell_height);
+        context->static_rows = (unsigned char *)arena_alloc(arena, height);
+        if (!counting && (!context->static_ages || !context->static_mask || !context->static_rows))
+            return DV_ERROR_NO_SPACE;
+        // Rows that are masked whole are not resized either
+        if (!counting) {
+            memset(context->static_rows, 0, height);
+            if (context->resampler) {
+                context->resampler->skipped_rows = context->static_rows;
+                context->luma_resampler->skipped_rows = context->static_rows;
+            }
+        }
+    }
+    return DV_OK;
+}
+
+// Size of the pixel grid that gets drawn
+static void get_output_size(const dv_config *config, int *width, int *height) {
+    *width = config->output_width ? config->output_width : config->source_width;
+    if (config->output_height)
+        *height = config->output_height;
+    else if (config->mode == DV_MODE_DOUBLE_PIXEL || config->mode == DV_MODE_SIXEL)
+        *height = config->source_height;
+    else
+        *height = config->source_height / 2;
+    if (*height < 1)
+        *height = 1;
+}
+
+// Size of the cell frame, mode -3 keeps two pixels in a cell
+static void get_cell_size(const dv_config *config, int *width, int *height) {
+    get_output_size(config, width, height);
+    if (config->mode == DV_MODE_DOUBLE_PIXEL)
+        *height /= 2;
+}
+
+// Creates a resampler for a plane with the given amount of channels
+// - Box filter averages the covered area, tent weights it by distance
+// - Upscaling always uses linear interpolation
+static dv_resampler *create_resampler(dv_arena *arena, int input_width, int input_height, int output_width, int output_height, int channels, int filter) {
+    double horizontal_scale = (double)input_width / output_width;
+    double vertical_scale = (double)input_height / output_height;
+    int horizontal_taps = (int)ceil(horizontal_scale < 1 ? 1 : horizontal_scale) * (filter == DV_FILTER_TENT ? 2 : 1) + 2;
+    int vertical_taps = (int)ceil(vertical_scale < 1 ? 1 : vertical_scale) * (filter == DV_FILTER_TENT ? 2 : 1) + 2;
+
+    dv_resampler *resampler = (dv_resampler *)arena_alloc(arena, sizeof(dv_resampler));
+    int *horizontal_first = (int *)arena_alloc(arena, output_width * sizeof(int));
+    int *horizontal_weights = (int *)arena_alloc(arena, (size_t)output_width * horizontal_taps * sizeof(int));
+    int *vertical_first = (int *)arena_alloc(arena, output_height * sizeof(int));
+    int *vertical_weights = (int *)arena_alloc(arena, (size_t)output_height * vertical_taps * sizeof(int));
+    unsigned short *rows = (unsigned short *)arena_alloc(arena, (size_t)vertical_taps * output_width * channels * sizeof(unsigned short));
+    int *accumulator = (int *)arena_alloc(arena, (size_t)output_width * channels * sizeof(int));
+    double *contributions = (double *)arena_alloc(arena, (horizontal_taps > vertical_taps ? horizontal_taps : vertical_taps) * sizeof(double));
+    if (!resampler || !horizontal_first || !horizontal_weights || !vertical_first || !vertical_weights || !rows || !accumulator ||
+        !contributions)
+        return NULL;
+
+    resampler->input_width = input_width;
+    resampler->input_height = input_height;
+    resampler->output_width = output_width;
+    resampler->output_height = output_height;
+    resampler->channels = channels;
+    resampler->horizontal_taps = horizontal_taps;
+    resampler->vertical_taps = vertical_taps;
+    resampler->horizontal_first = horizontal_first;
+    resampler->horizontal_weights = horizontal_weights;
+    resampler->vertical_first = vertical_first;
+    resampler->vertical_weights = vertical_weights;
+    resampler->rows = rows;
+    resampler->accumulator = accumulator;
+    resampler->contributions = contributions;
+    resampler->skipped_rows = NULL;
+    build_resampler_weights(horizontal_first, horizontal_weights, contributions, horizontal_taps, input_width, output_width, filter);
+    build_resampler_weights(vertical_first, vertical_weights, contributions, vertical_taps, input_height, output_height, filter);
+
+    for (int i = 0; i < 256; i++) {
+        double value = i / 255.0;
+        double linear = value <= 0.04045 ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+        resampler->to_linear[i] = (unsigned short)(linear * 65535.0 + 0.5);
+    }
+    for (int i = 0; i < 16384; i++) {
+        double linear = (i + 0.5) / 16384.0;
+        double value = linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+        resampler->to_srgb[i] = (unsigned char)(value * 255.0 + 0.5);
+    }
+    return resampler;
+}
+
+// Fills the first input index and the weights of every output pixel along one axis
+// - Contributions has room for taps values
+static void build_resampler_weights(int *first, int *weights, double *contributions, int taps, int input_size, int output_size, int filter) {
+    double scale = (double)input_size / output_size;
+    for (int o = 0; o < output_size; o++) {
+        int start;
+        double total = 0;
+        if (scale <= 1) {
+            double center = (o + 0.5) * scale - 0.5;
+            start = (int)floor(center);
+            for (int k = 0; k < taps; k++)
+                contributions[k] = fmax(0, 1 - fabs(start + k - center));
+        } else if (filter == DV_FILTER_TENT) {
+            double center = (o + 0.5) * scale;
+            start = (int)floor(center - scale);
+            for (int k = 0; k < taps; k++)
+                contributions[k] = fmax(0, 1 - fabs(start + k + 0.5 - center) / scale);
+        } else {
+            double left = o * scale;
+            double right = (o + 1) * scale;
+            start = (int)floor(left);
+            for (int k = 0; k < taps; k++)
+                contributions[k] = fmax(0, fmin(right, start + k + 1) - fmax(left, start + k));
+        }
+
+        // Edges are clamped by folding the weights that fall outside onto the border pixel
+        for (int k = 0; k < taps; k++) {
+            int index = start + k;
+            if (index < 0 && contributions[k] > 0) {
+                contributions[-start] += contributions[k];
+                contributions[k] = 0;
+            } else if (index >= input_size && contributions[k] > 0) {
+                contributions[input_size - 1 - start] += contributions[k];
+                contributions[k] = 0;
+            }
+        }
+        for (int k = 0; k < taps; k++)
+            total += contributions[k];
+
+        int sum = 0, largest = 0;
+        first[o] = start;
+        for (int k = 0; k < taps; k++) {
+            int weight = (int)(contributions[k] / total * WEIGHT_ONE + 0.5);
+            weights[o * taps + k] = weight;
+            sum += weight;
+            if (weight > weights[o * taps + largest])
+                largest = k;
+        }
+        weights[o * taps + largest] += WEIGHT_ONE - sum;
+    }
+}
+
+// Resizes a whole plane in linear light
+static void resample(dv_resampler *resampler, const unsigned char *input, int stride, unsigned char *output) {
+    resampler->input_row = 0;
+    resampler->output_row = 0;
+    resample_rows(resampler, input, resampler->input_height, stride, output);
+}
+
+// Resizes the next count input rows, horizontal pass first
+// - Every output row is written as soon as its last input row arrived
+// - Taps that fall outside of the input always have a weight of 0
+static void resample_rows(dv_resampler *resampler, const unsigned char *input, int count, int stride, unsigned char *output) {
+    int channels = resampler->channels;
+    int output_width = resampler->output_width;
+    int row_size = output_width * channels;
+    int horizontal_taps = resampler->horizontal_taps;
+    int vertical_taps = resampler->vertical_taps;
+    int *accumulator = resampler->accumulator;
+
+    for (int r = 0; r < count; r++) {
+        const unsigned char *line = input + (size_t)r * stride;
+        int y = resampler->input_row++;
+        unsigned short *row = &resampler->rows[(size_t)(y % vertical_taps) * row_size];
+        if (resampler->skipped_rows && !is_input_row_used(resampler, y)) {
+            // Nothing reads the slot of this row before it is written again
+        } else if (resampler->input_width == output_width) {
+            for (int i = 0; i < row_size; i++)
+                row[i] = resampler->to_linear[line[i]];
+        } else {
+            for (int x = 0; x < output_width; x++) {
+                int first = resampler->horizontal_first[x];
+                const int *weights = &resampler->horizontal_weights[x * horizontal_taps];
+                for (int c = 0; c < channels; c++) {
+                    int total = 0;
+                    for (int k = 0; k < horizontal_taps; k++) {
+                        if (weights[k])
+                            total += weights[k] * resampler->to_linear[line[(first + k) * channels + c]];
+                    }
+                    row[x * channels + c] = (total + WEIGHT_ONE / 2) >> WEIGHT_BITS;
+                }
+            }
+        }
+
+        // Windows only move down so the rows an output row needs are still in the ring
+        while (resampler->output_row < resampler->output_height && get_last_input_row(resampler, resampler->output_row) <= y) {
+            int o = resampler->output_row++;
+            if (resampler->skipped_rows && resampler->skipped_rows[o])
+                continue;
+            int first = resampler->vertical_first[o];
+            const int *weights = &resampler->vertical_weights[o * vertical_taps];
+            memset(accumulator, 0, row_size * sizeof(int));
+            for (int k = 0; k < vertical_taps; k++) {
+                int weight = weights[k];
+                if (!weight)
+                    continue;
+                const unsigned short *ring_row = &resampler->rows[(size_t)((first + k) % vertical_taps) * row_size];
+                for (int i = 0; i < row_size; i++)
+                    accumulator[i] += weight * ring_row[i];
+            }
+            unsigned char *out = &output[(size_t)o * row_size];
+            for (int i = 0; i < row_size; i++)
+                out[i] = resampler->to_srgb[((accumulator[i] + WEIGHT_ONE / 2) >> WEIGHT_BITS) >> 2];
+        }
+    }
+}
+
+// Returns the last input row that has a weight in an output row
+static int get_last_input_row(const dv_resampler *resampler, int output_row) {
+    const int *weights = &resampler->vertical_weights[output_row * resampler->vertical_taps];
+    int last = resampler->vertical_taps - 1;
+    while (last > 0 && !weights[last])
+        last--;
+    return resampler->vertical_first[output_row] + last;
+}
+
+// Returns 1 if an output row that is not skipped has a weight in the input row
+// - Output rows before the next one to be written are done and do not count
+static int is_input_row_used(const dv_resampler *resampler, int input_row) {
+    for (int o = resampler->output_row; o < resampler->output_height && resampler->vertical_first[o] <= input_row; o++) {
+        if (!resampler->skipped_rows[o] && get_last_input_row(resampler, o) >= input_row)
+            return 1;
+    }
+    return 0;
+}
+
+// Carves a cell frame with all of its planes out of the arena
+static void carve_cell_frame(dv_cell_frame *frame, dv_arena *arena, int width, int height) {
+    size_t count = (size_t)width * height;
+    frame->width = width;
+    frame->height = height;
+    frame->size = count * (sizeof(unsigned int) + 7);
+    frame->unchanged = NULL;
+    frame->data = (unsigned char *)arena_alloc(arena, frame->size);
+    if (!frame->data)
+        return;
+    memset(frame->data, 0, frame->size);
+    frame->glyph = (unsigned int *)frame->data;
+    frame->fg_red = frame->data + count * sizeof(unsigned int);
+    frame->fg_green = frame->fg_red + count;
+    frame->fg_blue = frame->fg_green + count;
+    frame->bg_red = frame->fg_blue + count;
+    frame->bg_green = frame->bg_red + count;
+    frame->bg_blue = frame->bg_green + count;
+    frame->attributes = frame->bg_blue + count;
+}
+
+// Shared body of dv_render_rgb and dv_render_luma
+static int render(dv_context *context, const unsigned char *input, int channels, int width, int height, int stride, char *output, size_t output_capacity) {
+    const dv_config *config = &context->config;
+    if (!input || !output || width != config->source_width || height != config->source_height)
+        return DV_ERROR_ARGUMENT;
+    if (output_capacity < dv_output_capacity(context))
+        return DV_ERROR_NO_SPACE;
+    if (stride == 0)
+        stride = width * channels;
+
+    if (context->static_mask)
+        plan_static_rows(context);
+    int pixels_width, pixels_height;
+    get_output_size(config, &pixels_width, &pixels_height);
+    const unsigned char *pixels = input;
+    int pixels_stride = stride;
+    if (pixels_width != width || pixels_height != height) {
+        mark_stage(context, "resize", 1);
+        double start = get_thread_seconds();
+        unsigned char *resized = channels == 3 ? context->pixels : context->luma;
+        resample(channels == 3 ? context->resampler : context->luma_resampler, input, stride, resized);
+        pixels = resized;
+        pixels_stride = pixels_width * channels;
+        context->stages.resize += get_thread_seconds() - start;
+        mark_stage(context, "resize", 0);
+    }
+    return draw(context, pixels, pixels_stride, channels, output);
+}
+
+// Shared body of dv_push_rgb_rows and dv_push_luma_rows
+// - The first rows of a frame decide its channels
+// - Rows are resized right away, without resizing they are copied into the pixels
+static int push_rows(dv_context *context, const unsigned char *input, int channels, int count, int stride) {
+    const dv_config *config = &context->config;
+    if (!input || count < 1 || context->pushed_rows + count > config->source_height)
+        return DV_ERROR_ARGUMENT;
+    if (context->pushed_rows > 0 && channels != context->pushed_channels)
+        return DV_ERROR_ARGUMENT;
+    if (stride == 0)
+        stride = config->source_width * channels;
+
+    dv_resampler *resampler = channels == 3 ? context->resampler : context->luma_resampler;
+    unsigned char *pixels = channels == 3 ? context->pixels : context->luma;
+    if (context->pushed_rows == 0) {
+        context->pushed_channels = channels;
+        if (context->static_mask)
+            plan_static_rows(context);
+        if (resampler) {
+            resampler->input_row = 0;
+            resampler->output_row = 0;
+        }
+    }
+    mark_stage(context, "resize", 1);
+    double start = get_thread_seconds();
+    if (resampler) {
+        resample_rows(resampler, input, count, stride, pixels);
+    } else {
+        size_t row_size = (size_t)config->source_width * channels;
+        for (int r = 0; r < count; r++)
+            memcpy(pixels + (context->pushed_rows + r) * row_size, input + (size_t)r * stride, row_size);
+    }
+    context->stages.resize += get_thread_seconds() - start;
+    mark_stage(context, "resize", 0);
+    context->pushed_rows += count;
+    return DV_OK;
+}
+
+// Turns the output pixel grid into terminal output
+static int draw(dv_context *context, const unsigned char *pixels, int pixels_stride, int channels, char *output) {
+    const dv_config *config = &context->config;
+    mark_stage(context, "convert", 1);
+    double start = get_thread_seconds();
+    if (context->held_pixels) {
+        pixels = hold_pixels(context, pixels, pixels_stride, channels);
+        int width, height;
+        get_output_size(config, &width, &height);
+        pixels_stride = width * channels;
+    }
+    if (config->mode == DV_MODE_SIXEL) {
+        context->stages.convert += get_thread_seconds() - start;
+        mark_stage(context, "convert", 0);
+        return render_sixel(context, pixels, pixels_stride, channels, output);
+    }
+
+    int next = context->has_previous ? !context->current_frame : context->current_frame;
+    dv_cell_frame *frame = &context->frames[next];
+    const dv_cell_frame *previous = context->has_previous ? &context->frames[context->current_frame] : NULL;
+    if (context->static_mask && previous) {
+        fill_changing_cells(context, frame, previous, pixels, pixels_stride, channels);
+    } else {
+        int width, height;
+        get_output_size(config, &width, &height);
+        fill_cells(context, frame, pixels, pixels_stride, channels, height);
+        if (context->static_mask) {
+            memset(context->static_ages, 0, (size_t)frame->width * frame->height);
+            memset(context->static_mask, 0, (size_t)frame->width * frame->height);
+        }
+    }
+    double converted = get_thread_seconds();
+    context->stages.convert += converted - start;
+    mark_stage(context, "convert", 0);
+    mark_stage(context, "encode", 1);
+    int size;
+    if (context->encoder == dv_encode_scroll)
+        size = encode_counting_motion(context, frame, previous, output);
+    else
+        size = context->encoder(frame, previous, output);
+    context->stages.encode += get_thread_seconds() - converted;
+    mark_stage(context, "encode", 0);
+    context->current_frame = next;
+    context->has_previous = 1;
+    return size;
+}
+
+// Runs dv_encode_scroll and counts what it did
+// - With motion savings frames that were scrolled or panned are also encoded without
+// moving anything into the motion buffer to count the bytes that were saved
+static int encode_counting_motion(dv_context *context, const dv_cell_frame *frame, const dv_cell_frame *previous, char *output) {
+    dv_motion_stats *stats = &context->motion;
+    int rows, panned;
+    int size = encode_moved_cells(frame, previous, output, &rows, &panned);
+    stats->frames++;
+    if (rows == 0 && panned == 0)
+        return size;
+    stats->moved_frames++;
+    stats->scrolls += rows != 0;
+    stats->scrolled_rows += abs(rows);
+    stats->panned_rows += panned;
+    stats->bytes += size;
+    if (context->motion_buffer)
+        stats->plain_bytes += encode_cells(frame, previous, context->motion_buffer, ENCODE_ELIDE | ENCODE_DELTA, 0, NULL);
+    return size;
+}
+
+// Keeps the last drawn value of every output pixel that only changed a little
+// - Returns the held pixels (packed, same channels), they are what gets drawn
+// - Kept pixels age every frame and are updated once they reach the refresh
+// count, so small changes can not pile up into a visible difference
+// - First frame and frames with other channels than the last one are taken as they are
+static const unsigned char *hold_pixels(dv_context *context, const unsigned char *pixels, int stride, int channels) {
+    const dv_config *config = &context->config;
+    dv_hysteresis_stats *stats = &context->hysteresis;
+    int width, height;
+    get_output_size(config, &width, &height);
+    unsigned char *held = context->held_pixels;
+    size_t row_size = (size_t)width * channels;
+    stats->pixels += (long long)width * height;
+    stats->samples += (long long)width * height * channels;
+
+    if (context->held_channels != channels) {
+        for (int i = 0; i < height; i++)
+            memcpy(held + i * row_size, pixels + (size_t)i * stride, row_size);
+        memset(context->held_ages, 0, (size_t)width * height);
+        context->held_channels = channels;
+        return held;
+    }
+
+    int luma_step = config->hysteresis_luma;
+    int color_limit = config->hysteresis_color * config->hysteresis_color;
+    int refresh = config->hysteresis_refresh;
+    for (int i = 0; i < height; i++) {
+        const unsigned char *line = pixels + (size_t)i * stride;
+        unsigned char *held_line = held + i * row_size;
+        unsigned char *ages = context->held_ages + (size_t)i * width;
+        for (int j = 0; j < width; j++) {
+            const unsigned char *pixel = line + j * channels;
+            unsigned char *old = held_line + j * channels;
+            int keep, error;
+            if (channels == 1) {
+                int difference = pixel[0] - old[0];
+                if (difference == 0) {
+                    ages[j] = 0;
+                    continue;
+                }
+                keep = abs(difference) <= luma_step;
+                error = difference * difference;
+            } else {
+                int red = pixel[0] - old[0], green = pixel[1] - old[1], blue = pixel[2] - old[2];
+                if ((red | green | blue) == 0) {
+                    ages[j] = 0;
+                    continue;
+                }
+                int luma = (red * 19595 + green * 38470 + blue * 7471) / 65536;
+                error = red * red + green * green + blue * blue;
+                keep = abs(luma) <= luma_step && (color_limit == 0 || error <= color_limit);
+            }
+            if (keep && (refresh == 0 || ages[j] < refresh)) {
+                if (ages[j] < 255)
+                    ages[j]++;
+                stats->held++;
+                stats->squared_error += error;
+                continue;
+            }
+            if (keep)
+                stats->refreshed++;
+            memcpy(old, pixel, channels);
+            ages[j] = 0;
+        }
+    }
+    return held;
+}
+
+// Fills the cell frame from the output pixel grid for the mode of the context
+// - Pixels height is how many pixel rows are left from the first row of the frame
+static void fill_cells(dv_context *context, dv_cell_frame *frame, const unsigned char *pixels, int stride, int channels, int pixels_height) {
+    int mode = context->config.mode;
+    frame->unchanged = NULL;
+    if (mode == DV_MODE_GRAYSCALE) {
+        fill_cells_grayscale(frame, pixels, stride, channels, context->lookup_table);
+    } else if (mode == DV_MODE_COLORED) {
+        fill_cells_colored(frame, pixels, stride, channels, context->lookup_table);
+    } else if (mode == DV_MODE_DOUBLE_PIXEL) {
+        fill_cells_double_pixel(frame, pixels, stride, channels, pixels_height);
+    } else {
+        fill_cells_single_character(frame, pixels, stride, channels, mode);
+    }
+    if (context->color_bits < 8 && mode != DV_MODE_GRAYSCALE)
+        reduce_colors(context, frame);
+}
+
+// Maps every color of the frame through the color levels of the context
+// - Mode -2 picks its characters again from the reduced colors, so a cell only depends
+// on its reduced color (the static check relies on that)
+static void reduce_colors(const dv_context *context, dv_cell_frame *frame) {
+    size_t count = (size_t)frame->width * frame->height;
+    unsigned char *planes[] = {frame->fg_red, frame->fg_green, frame->fg_blue, frame->bg_red, frame->bg_green, frame->bg_blue};
+    for (int p = 0; p < 6; p++) {
+        for (size_t i = 0; i < count; i++)
+            planes[p][i] = context->color_levels[planes[p][i]];
+    }
+    if (context->config.mode != DV_MODE_COLORED)
+        return;
+    for (size_t i = 0; i < count; i++) {
+        int gray_value = (frame->fg_red[i] * 19595 + frame->fg_green[i] * 38470 + frame->fg_blue[i] * 7471) >> 16;
+        frame->glyph[i] = (unsigned char)context->lookup_table[gray_value];
+    }
+}
+
+// Decides which rows of the output grid are not resized or converted this frame
+// - A cell row that is masked whole is only resized and checked once every
+// STATIC_SAMPLE_STRIDE frames (rows take turns), other rows always are
+// - After a check woke up a row masked whole every row is checked, what changed in
+// one row (a new background in the letterbox) usually changed in the rows around it
+static void plan_static_rows(dv_context *context) {
+    int width, height;
+    get_output_size(&context->config, &width, &height);
+    int pixel_rows = context->config.mode == DV_MODE_DOUBLE_PIXEL ? 2 : 1;
+    const dv_cell_frame *frame = &context->frames[0];
+    int phase = (context->static_phase + 1) % STATIC_SAMPLE_STRIDE;
+    context->static_phase = phase;
+    memset(context->static_rows, 0, height);
+    if (!context->has_previous || context->static_woken) {
+        context->static_woken = 0;
+        return;
+    }
+    for (int i = 0; i < frame->height; i++) {
+        if ((phase + i) % STATIC_SAMPLE_STRIDE == 0 || memchr(&context->static_mask[i * frame->width], 0, frame->width))
+            continue;
+        memset(&context->static_rows[i * pixel_rows], 1, pixel_rows);
+    }
+}
+
+// Fills only the cells that are not masked as static
+// - Masked cells keep what the frame had two frames ago, that is the same as previous
+// because they were already masked (or just got masked) when previous was drawn
+// - Rows that plan_static_rows() skipped are left alone, a row that is masked whole
+// is checked against its pixels in full when it is its turn, in other rows one in
+// STATIC_SAMPLE_STRIDE masked cells is checked every frame (a different one each frame)
+// - If a checked cell changed the whole masked run around it is filled again
+// - Cells that stayed the same for static_frames frames in a row get masked
+static void fill_changing_cells(dv_context *context, dv_cell_frame *frame, const dv_cell_frame *previous, const unsigned char *pixels, int stride,
+                                int channels) {
+    dv_static_stats *stats = &context->statics;
+    int width = frame->width;
+    int limit = context->config.static_frames;
+    int pixel_rows = context->config.mode == DV_MODE_DOUBLE_PIXEL ? 2 : 1;
+    int pixels_width, pixels_height;
+    get_output_size(&context->config, &pixels_width, &pixels_height);
+    int phase = context->static_phase;
+
+    for (int i = 0; i < frame->height; i++) {
+        const unsigned char *line = pixels + (size_t)i * pixel_rows * stride;
+        int line_height = pixels_height - i * pixel_rows;
+        int start = i * width;
+        unsigned char *ages = &context->static_ages[start];
+        unsigned char *mask = &context->static_mask[start];
+        stats->cells += width;
+        if (context->static_rows[i * pixel_rows]) {
+            stats->skipped += width;
+            continue;
+        }
+
+        int whole = !memchr(mask, 0, width);
+        int step = whole ? 1 : STATIC_SAMPLE_STRIDE;
+        for (int j = whole ? 0 : (phase + i) % STATIC_SAMPLE_STRIDE; j < width; j += step) {
+            if (!mask[j])
+                continue;
+            stats->checked++;
+            if (pixels_match_cell(context, previous, start + j, line + (size_t)j * channels, stride, channels, line_height))
+                continue;
+            int first = j, last = j + 1;
+            while (first > 0 && mask[first - 1])
+                first--;
+            while (last < width && mask[last])
+                last++;
+            memset(&mask[first], 0, last - first);
+            memset(&ages[first], 0, last - first);
+            stats->woken += last - first - 1;
+            context->static_woken |= whole;
+        }
+
+        int j = 0;
+        while (j < width) {
+            int first = j;
+            if (mask[j]) {
+                while (j < width && mask[j])
+                    j++;
+                stats->skipped += j - first;
+                continue;
+            }
+            while (j < width && !mask[j])
+                j++;
+            fill_cell_span(context, frame, i, first, j, line, stride, channels, line_height);
+        }
+
+        // Tiles are compared with memcmp over the planes, a tile is always masked whole so
+        // its age is kept in its first cell (colors a mode does not use stay 0 in both frames)
+        for (j = 0; j < width; j += STATIC_TILE_WIDTH) {
+            int count = width - j < STATIC_TILE_WIDTH ? width - j : STATIC_TILE_WIDTH;
+            if (mask[j])
+                continue;
+            if (!spans_equal(frame, start + j, previous, start + j, count))
+                ages[j] = 0;
+            else if (++ages[j] >= limit)
+                memset(&mask[j], 1, count);
+        }
+    }
+    frame->unchanged = context->static_mask;
+}
+
+// Fills the columns [first, last) of a row of the frame through a view of that span
+// - Line is the first pixel row of the cell row, pixels height counts from there
+static void fill_cell_span(dv_context *context, dv_cell_frame *frame, int row, int first, int last, const unsigned char *line, int stride,
+                           int channels, int pixels_height) {
+    size_t start = (size_t)row * frame->width + first;
+    dv_cell_frame span = {.width = last - first, .height = 1};
+    span.glyph = frame->glyph + start;
+    span.fg_red = frame->fg_red + start;
+    span.fg_green = frame->fg_green + start;
+    span.fg_blue = frame->fg_blue + start;
+    span.bg_red = frame->bg_red + start;
+    span.bg_green = frame->bg_green + start;
+    span.bg_blue = frame->bg_blue + start;
+    span.attributes = frame->attributes + start;
+    fill_cells(context, &span, line + (size_t)first * channels, stride, channels, pixels_height);
+}
+
+// Returns 1 if the pixels of a cell would still give the cell in previous
+// - Pixel points at the upper pixel of the cell, lines left is how many pixel rows
+// are left from there (mode -3 draws a missing lower pixel black)
+static int pixels_match_cell(const dv_context *context, const dv_cell_frame *previous, int index, const unsigned char *pixel, int stride, int channels,
+                             int lines_left) {
+    int green = channels == 3;
+    int blue = (channels == 3) * 2;
+    const unsigned char *levels = context->color_levels;
+    if (context->config.mode == DV_MODE_GRAYSCALE) {
+        int gray_value = channels == 1 ? pixel[0] : (pixel[0] * 19595 + pixel[1] * 38470 + pixel[2] * 7471) >> 16;
+        return previous->glyph[index] == (unsigned char)context->lookup_table[gray_value];
+    }
+    if (previous->fg_red[index] != levels[pixel[0]] || previous->fg_green[index] != levels[pixel[green]] ||
+        previous->fg_blue[index] != levels[pixel[blue]])
+        return 0;
+    if (context->config.mode != DV_MODE_DOUBLE_PIXEL || lines_left < 2)
+        return 1;
+    const unsigned char *lower = pixel + stride;
+    return previous->bg_red[index] == levels[lower[0]] && previous->bg_green[index] == levels[lower[green]] &&
+           previous->bg_blue[index] == levels[lower[blue]];
+}
+
+// Fills the frame with characters picked by brightness, no colors (mode -1)
+// - Brightness uses 16 bit fixed point weights (0.299, 0.587, 0.114) so the loops vectorize
+static void fill_cells_grayscale(dv_cell_frame *frame, const unsigned char *pixels, int stride, int channels, const char *lookup_table) {
+    int width = frame->width;
+    for (int i = 0; i < frame->height; i++) {
+        const unsigned char *line = pixels + (size_t)i * stride;
+        unsigned int *glyph = &frame->glyph[i * width];
+        if (channels == 1) {
+            for (int j = 0; j < width; j++)
+                glyph[j] = (unsigned char)lookup_table[line[j]];
+        } else {
+            for (int j = 0; j < width; j++) {
+                int gray_value = (line[j * 3] * 19595 + line[j * 3 + 1] * 38470 + line[j * 3 + 2] * 7471) >> 16;
+                glyph[j] = (unsigned char)lookup_table[gray_value];
+            }
+        }
+    }
+    memset(frame->attributes, 0, (size_t)frame->width * frame->height);
+}
+
+// Fills the frame with colored characters picked by brightness (mode -2)
+static void fill_cells_colored(dv_cell_frame *frame, const unsigned char *pixels, int stride, int channels, const char *lookup_table) {
+    int width = frame->width;
+    for (int i = 0; i < frame->height; i++) {
+        const unsigned char *line = pixels + (size_t)i * stride;
+        int start = i * width;
+        if (channels == 1) {
+            for (int j = 0; j < width; j++) {
+                frame->fg_red[start + j] = line[j];
+                frame->fg_green[start + j] = line[j];
+                frame->fg_blue[start + j] = line[j];
+                frame->glyph[start + j] = (unsigned char)lookup_table[line[j]];
+            }
+            continue;
+        }
+        for (int j = 0; j < width; j++) {
+            frame->fg_red[start + j] = line[j * 3];
+            frame->fg_green[start + j] = line[j * 3 + 1];
+            frame->fg_blue[start + j] = line[j * 3 + 2];
+        }
+        for (int j = 0; j < width; j++) {
+            int gray_value = (frame->fg_red[start + j] * 19595 + frame->fg_green[start + j] * 38470 + frame->fg_blue[start + j] * 7471) >> 16;
+            frame->glyph[start + j] = (unsigned char)lookup_table[gray_value];
+        }
+    }
+    memset(frame->attributes, DV_CELL_FOREGROUND, (size_t)frame->width * frame->height);
+}
+
+// Fills the frame using the same character everywhere
+static void fill_cells_single_character(dv_cell_frame *frame, const unsigned char *pixels, int stride, int channels, char character) {
+    int width = frame->width;
+    for (int i = 0; i < frame->height; i++) {
+        const unsigned char *line = pixels + (size_t)i * stride;
+        int start = i * width;
+        for (int j = 0; j < width; j++) {
+            frame->fg_red[start + j] = line[j * channels];
+            frame->fg_green[start + j] = line[j * channels + (channels == 3)];
+            frame->fg_blue[start + j] = line[j * channels + (channels == 3) * 2];
+            frame->glyph[start + j] = (unsigned char)character;
+        }
+    }
+    memset(frame->attributes, DV_CELL_FOREGROUND, (size_t)frame->width * frame->height);
+}
+
+// Fills the frame with two pixels per cell (mode -3)
+// - Upper pixel is the text color, lower pixel is the background
+// - If the grid has an odd height the missing lower pixels are black
+static void fill_cells_double_pixel(dv_cell_frame *frame, const unsigned char *pixels, int stride, int channels, int pixels_height) {
+    int width = frame->width;
+    int green = channels == 3;
+    int blue = (channels == 3) * 2;
+    for (int i = 0; i < frame->height; i++) {
+        const unsigned char *upper = pixels + (size_t)i * 2 * stride;
+        const unsigned char *lower = pixels + (size_t)(i * 2 + 1) * stride;
+        int start = i * width;
+        for (int j = 0; j < width; j++) {
+            frame->fg_red[start + j] = upper[j * channels];
+            frame->fg_green[start + j] = upper[j * channels + green];
+            frame->fg_blue[start + j] = upper[j * channels + blue];
+            frame->glyph[start + j] = DV_UPPER_HALF_BLOCK;
+        }
+        if ((i * 2 + 1) < pixels_height) {
+            for (int j = 0; j < width; j++) {
+                frame->bg_red[start + j] = lower[j * channels];
+                frame->bg_green[start + j] = lower[j * channels + green];
+                frame->bg_blue[start + j] = lower[j * channels + blue];
+            }
+        } else {
+            memset(&frame->bg_red[start], 0, width);
+            memset(&frame->bg_green[start], 0, width);
+            memset(&frame->bg_blue[start], 0, width);
+        }
+    }
+    memset(frame->attributes, DV_CELL_FOREGROUND | DV_CELL_BACKGROUND, (size_t)frame->width * frame->height);
+}
+
+// Encodes with ENCODE_DELTA after scrolling the rows that moved up or down together
+// - Rows gets how far the screen was scrolled (0 if it was not), panned gets the rows
+// that were shifted sideways
+static int encode_moved_cells(const dv_cell_frame *frame, const dv_cell_frame *previous, char *buffer_out, int *rows, int *panned) {
+    *rows = 0;
+    if (!previous || previous->width != frame->width || previous->height != frame->height)
+        return encode_cells(frame, NULL, buffer_out, ENCODE_ELIDE | ENCODE_DELTA, 0, panned);
+
+    int size = 0;
+    *rows = find_vertical_shift(frame, previous);
+    if (*rows != 0) {
+        // Scroll region is the frame, resetting it moves the cursor back to the top left corner
+        memcpy(&buffer_out[size], "\033[1;", 4);
+        size += 4;
+        size += write_number(&buffer_out[size], frame->height);
+        memcpy(&buffer_out[size], "r\033[", 3);
+        size += 3;
+        size += write_number(&buffer_out[size], abs(*rows));
+        buffer_out[size++] = *rows > 0 ? 'S' : 'T';
+        memcpy(&buffer_out[size], "\033[r", 3);
+        size += 3;
+    }
+    return size + encode_cells(frame, previous, &buffer_out[size], ENCODE_ELIDE | ENCODE_DELTA | ENCODE_PAN, *rows, panned);
+}
+
+// Finds how many rows the picture moved up (negative for down)
+// - A shift is only used if it explains at least half of the rows and more rows
+// than staying still, otherwise 0 is returned
+static int find_vertical_shift(const dv_cell_frame *frame, const dv_cell_frame *previous) {
+    int height = frame->height;
+    int best_rows = 0, best_count = 0;
+    for (int i = 0; i < height; i++)
+        best_count += rows_equal(frame, i, previous, i);
+    int still_count = best_count;
+    for (int shift = 1; shift <= height / 2; shift++) {
+        for (int sign = 1; sign >= -1; sign -= 2) {
+            int rows = shift * sign, count = 0;
+            for (int i = 0; i < height; i++) {
+                int source_row = i + rows;
+                if (source_row >= 0 && source_row < height)
+                    count += rows_equal(frame, i, previous, source_row);
+            }
+            if (count > best_count) {
+                best_count = count;
+                best_rows = rows;
+            }
+        }
+    }
+    if (best_count * 2 < height || best_count <= still_count + 1)
+        return 0;
+    return best_rows;
+}
+
+// Finds how many cells a row moved left (negative for right) compared to a row of the screen
+// - A few cells are checked first so most shifts are ruled out cheaply
+// - A shift is only used if it explains at least 3/4 of the row and a quarter
+// of the row more than staying still, otherwise 0 is returned
+static int find_horizontal_shift(const dv_cell_frame *frame, int row, const dv_cell_frame *previous, int source_row) {
+    int width = frame->width;
+    if (source_row < 0 || source_row >= previous->height || width < MOTION_SAMPLES * 2)
+        return 0;
+    const int start = row * width, source_start = source_row * width;
+    int best_columns = 0, best_count = 0;
+    for (int j = 0; j < width; j++)
+        best_count += dv_cells_equal(frame, start + j, previous, source_start + j);
+    int still_count = best_count;
+    int max_shift = width / 4 < MOTION_MAX_COLUMNS ? width / 4 : MOTION_MAX_COLUMNS;
+    for (int shift = 1; shift <= max_shift; shift++) {
+        for (int sign = 1; sign >= -1; sign -= 2) {
+            int columns = shift * sign;
+            int first = columns < 0 ? -columns : 0;
+            int last = columns > 0 ? width - columns : width;
+            int sampled = 0;
+            for (int k = 0; k < MOTION_SAMPLES; k++) {
+                int j = first + (last - first - 1) * k / (MOTION_SAMPLES - 1);
+                sampled += dv_cells_equal(frame, start + j, previous, source_start + j + columns);
+            }
+            if (sampled < MOTION_SAMPLES * 3 / 4)
+                continue;
+            int count = 0;
+            for (int j = first; j < last; j++)
+                count += dv_cells_equal(frame, start + j, previous, source_start + j + columns);
+            if (count > best_count) {
+                best_count = count;
+                best_columns = columns;
+            }
+        }
+    }
+    if (best_count * 4 < width * 3 || best_count - still_count < width / 4)
+        return 0;
+    return best_columns;
+}
+
+// Returns 1 if the cell is already on the screen
+// - Row and column are the cell of previous that the screen shows there,
+// outside of previous the screen is blank
+static int is_on_screen(const dv_cell_frame *frame, int index, const dv_cell_frame *previous, int row, int column) {
+    if (row < 0 || row >= previous->height || column < 0 || column >= previous->width)
+        return frame->glyph[index] == ' ' && frame->attributes[index] == 0;
+    return dv_cells_equal(frame, index, previous, row * previous->width + column);
+}
+
+// Returns 1 if both frames have the same size and the same cells
+int dv_cell_frames_equal(const dv_cell_frame *a, const dv_cell_frame *b) {
+    if (a->width != b->width || a->height != b->height)
+        return 0;
+    return memcmp(a->data, b->data, a->size) == 0;
+}
+
+// Returns 1 if the row is the same in both frames
+// - Assumes both frames have the same size
+int dv_cell_rows_equal(const dv_cell_frame *a, const dv_cell_frame *b, int row) {
+    return rows_equal(a, row, b, row);
+}
+
+// Returns 1 if row a_row of a is the same as row b_row of b
+// - Assumes both frames have the same width
+static int rows_equal(const dv_cell_frame *a, int a_row, const dv_cell_frame *b, int b_row) {
+    return spans_equal(a, (size_t)a_row * a->width, b, (size_t)b_row * b->width, a->width);
+}
+
+// Returns 1 if count cells from a_start in a have the same planes as the ones from b_start in b
+static int spans_equal(const dv_cell_frame *a, size_t a_start, const dv_cell_frame *b, size_t b_start, int count) {
+    return memcmp(&a->glyph[a_start], &b->glyph[b_start], count * sizeof(unsigned int)) == 0 &&
+           memcmp(&a->fg_red[a_start], &b->fg_red[b_start], count) == 0 &&
+           memcmp(&a->fg_green[a_start], &b->fg_green[b_start], count) == 0 &&
+           memcmp(&a->fg_blue[a_start], &b->fg_blue[b_start], count) == 0 &&
+           memcmp(&a->bg_red[a_start], &b->bg_red[b_start], count) == 0 &&
+           memcmp(&a->bg_green[a_start], &b->bg_green[b_start], count) == 0 &&
+           memcmp(&a->bg_blue[a_start], &b->bg_blue[b_start], count) == 0 &&
+           memcmp(&a->attributes[a_start], &b->attributes[b_start], count) == 0;
+}
+
+// Returns 1 if the cell at index a_index in a looks the same as the cell at b_index in b
+// - Colors that are not used by the attributes are ignored
+int dv_cells_equal(const dv_cell_frame *a, int a_index, const dv_cell_frame *b, int b_index) {
+    int attributes = a->attributes[a_index];
+    if (a->glyph[a_index] != b->glyph[b_index] || attributes != b->attributes[b_index])
+        return 0;
+    if ((attributes & DV_CELL_FOREGROUND) &&
+        (a->fg_red[a_index] != b->fg_red[b_index] || a->fg_green[a_index] != b->fg_green[b_index] || a->fg_blue[a_index] != b->fg_blue[b_index]))
+        return 0;
+    if ((attributes & DV_CELL_BACKGROUND) &&
+        (a->bg_red[a_index] != b->bg_red[b_index] || a->bg_green[a_index] != b->bg_green[b_index] || a->bg_blue[a_index] != b->bg_blue[b_index]))
+        return 0;
+    return 1;
+}
+
+// Returns the buffer size that is always enough for any encoder
+size_t dv_cell_capacity(const dv_cell_frame *frame) {
+    return (size_t)frame->width * frame->height * MAXIMUM_ENCODED_CELL_SIZE + (size_t)frame->height * 16 + 32;
+}
+
+// Plain truecolor encoder, every cell sets its own colors and resets them
+int dv_encode_truecolor(const dv_cell_frame *frame, const dv_cell_frame *previous, char *buffer_out) {
+    (void)previous;
+    return encode_cells(frame, NULL, buffer_out, 0, 0, NULL);
+}
+
+// Encoder for terminals without truecolor, uses the xterm 256 color palette
+// - Colors only change when they need to
+int dv_encode_256(const dv_cell_frame *frame, const dv_cell_frame *previous, char *buffer_out) {
+    (void)previous;
+    return encode_cells(frame, NULL, buffer_out, ENCODE_ELIDE | ENCODE_256, 0, NULL);
+}
+
+// Only writes the cells that differ from the previous frame
+// - Falls back to a full frame if there is no previous frame with the same size
+int dv_encode_delta(const dv_cell_frame *frame, const dv_cell_frame *previous, char *buffer_out) {
+    return encode_cells(frame, previous, buffer_out, ENCODE_ELIDE | ENCODE_DELTA, 0, NULL);
+}
+
+// Delta encoder that first moves what is on the screen when the picture moved
+// - Rows that moved up or down together are scrolled with a scroll region (DECSTBM and
+// SU/SD), rows that moved sideways are shifted with DCH/ICH, then only the cells that
+// still differ are written
+// - Terminal has to be at least as tall as the frame
+int dv_encode_scroll(const dv_cell_frame *frame, const dv_cell_frame *previous, char *buffer_out) {
+    int rows, panned;
+    return encode_moved_cells(frame, previous, buffer_out, &rows, &panned);
+}
+
+// Delta encoder for terminals without truecolor
+int dv_encode_delta_256(const dv_cell_frame *frame, const dv_cell_frame *previous, char *buffer_out) {
+    return encode_cells(frame, previous, buffer_out, ENCODE_ELIDE | ENCODE_DELTA | ENCODE_256, 0, NULL);
+}
+
+// Full frame where colors only change when they need to
+// and repeated cells are sent as "CSI n b" (REP)
+int dv_encode_rep(const dv_cell_frame *frame, const dv_cell_frame *previous, char *buffer_out) {
+    (void)previous;
+    return encode_cells(frame, NULL, buffer_out, ENCODE_ELIDE | ENCODE_REP, 0, NULL);
+}
+
+// Shared encoder behind all the cell encoders
+// - ENCODE_ELIDE: Keeps the colors between cells and only sends changes
+// - ENCODE_256: Uses 256 color codes instead of truecolor
+// - ENCODE_REP: Sends runs of the same cell with REP
+// - ENCODE_DELTA: Skips cells that are the same in previous, moves the cursor instead
+// - ENCODE_PAN: Shifts rows that moved sideways with DCH/ICH first (needs ENCODE_DELTA)
+// - Rows is how far the screen was scrolled up before (down if negative), row i of the
+// screen then shows row i + rows of previous or blank cells
+// - Panned gets the amount of shifted rows (can be NULL)
+// - Frame is assumed to start at the top left corner of the terminal
+// - Cursor ends on the line under the frame
+static int encode_cells(const dv_cell_frame *frame, const dv_cell_frame *previous, char *buffer_out, int flags, int rows, int *panned) {
+    int width = frame->width;
+    int height = frame->height;
+    int size = 0;
+    cell_pen pen = {0};
+
+    if (previous && (previous->width != width || previous->height != height))
+        previous = NULL;
+    if (!(flags & ENCODE_DELTA))
+        previous = NULL;
+    if (panned)
+        *panned = 0;
+
+    // Cells known to be unchanged are only skipped where the screen did not move
+    const unsigned char *unchanged = previous ? frame->unchanged : NULL;
+    int cursor_row = 0, cursor_column = 0;
+    for (int i = 0; i < height; i++) {
+        int source_row = i + rows;
+        if (unchanged && rows == 0 && !memchr(&unchanged[i * width], 0, width))
+            continue;
+        if (previous && source_row >= 0 && source_row < height && rows_equal(frame, i, previous, source_row))
+            continue;
+
+        // Columns is how far the row moved left (right if negative), after ICH the last
+        // column is not known because the terminal may be exactly as wide as the frame
+        int columns = 0, unknown_column = -1;
+        if (previous && (flags & ENCODE_PAN))
+            columns = find_horizontal_shift(frame, i, previous, source_row);
+        if (columns != 0) {
+            if (pen.attributes) {
+                // Inserted and deleted cells take the current background
+                memcpy(&buffer_out[size], "\033[0m", 4);
+                size += 4;
+                pen.attributes = 0;
+            }
+            memcpy(&buffer_out[size], "\033[", 2);
+            size += 2;
+            size += write_number(&buffer_out[size], i + 1);
+            memcpy(&buffer_out[size], ";1H\033[", 5);
+            size += 5;
+            size += write_number(&buffer_out[size], abs(columns));
+            buffer_out[size++] = columns > 0 ? 'P' : '@';
+            cursor_row = i;
+            cursor_column = 0;
+            if (columns < 0) {
+                // Cells pushed past the frame are erased
+                memcpy(&buffer_out[size], "\033[", 2);
+                size += 2;
+                size += write_number(&buffer_out[size], width + 1);
+                memcpy(&buffer_out[size], "G\033[K", 4);
+                size += 4;
+                cursor_column = width;
+                unknown_column = width - 1;
+            }
+            if (panned)
+                (*panned)++;
+        }
+
+        int j = 0;
+        while (j < width) {
+            int index = i * width + j;
+            if (previous && j != unknown_column &&
+                ((unchanged && rows == 0 && columns == 0 && unchanged[index]) || is_on_screen(frame, index, previous, source_row, j + columns))) {
+                j++;
+                continue;
+            }
+            if (previous && (cursor_row != i || cursor_column != j)) {
+                memcpy(&buffer_out[size], "\033[", 2);
+                size += 2;
+                if (cursor_row == i && j > cursor_column) {
+                    size += write_number(&buffer_out[size], j - cursor_column);
+                    buffer_out[size++] = 'C';
+                } else {
+                    size += write_number(&buffer_out[size], i + 1);
+                    buffer_out[size++] = ';';
+                    size += write_number(&buffer_out[size], j + 1);
+                    buffer_out[size++] = 'H';
+                }
+            }
+
+            size += write_cell_pen(&buffer_out[size], frame, index, &pen, flags);
+            size += write_glyph(&buffer_out[size], frame->glyph[index]);
+            if (!(flags & ENCODE_ELIDE) && frame->attributes[index]) {
+                memcpy(&buffer_out[size], "\033[0m", 4);
+                size += 4;
+            }
+            j++;
+
+            if (flags & ENCODE_REP) {
+                int run = 0;
+                while (j + run < width && dv_cells_equal(frame, index, frame, index + run + 1))
+                    run++;
+                int glyph_size = frame->glyph[index] < 0x80 ? 1 : (frame->glyph[index] < 0x800 ? 2 : 3);
+                if (run * glyph_size > 3 + get_number_size(run)) {
+                    memcpy(&buffer_out[size], "\033[", 2);
+                    size += 2;
+                    size += write_number(&buffer_out[size], run);
+                    buffer_out[size++] = 'b';
+                } else {
+                    for (int k = 0; k < run; k++)
+                        size += write_glyph(&buffer_out[size], frame->glyph[index]);
+                }
+                j += run;
+            }
+            cursor_row = i;
+            cursor_column = j;
+        }
+        if (!previous) {
+            buffer_out[size++] = '\n';
+            cursor_row = i + 1;
+            cursor_column = 0;
+        }
+    }
+
+    if (pen.attributes) {
+        memcpy(&buffer_out[size], "\033[0m", 4);
+        size += 4;
+    }
+    if (previous) {
+        memcpy(&buffer_out[size], "\033[", 2);
+        size += 2;
+        size += write_number(&buffer_out[size], height + 1);
+        memcpy(&buffer_out[size], ";1H", 3);
+        size += 3;
+    }
+    return size;
+}
+
+// Writes the escape codes that set the colors of a cell
+// - Without ENCODE_ELIDE the pen is ignored and every color is written
+// - Returns the amount of bytes written
+static int write_cell_pen(char *buffer_out, const dv_cell_frame *frame, int index, cell_pen *pen, int flags) {
+    int attributes = frame->attributes[index];
+    unsigned char fg[3] = {frame->fg_red[index], frame->fg_green[index], frame->fg_blue[index]};
+    unsigned char bg[3] = {frame->bg_red[index], frame->bg_green[index], frame->bg_blue[index]};
+    int size = 0;
+
+    if (flags & ENCODE_ELIDE) {
+        if ((pen->attributes & ~attributes) != 0) {
+            memcpy(&buffer_out[size], "\033[0m", 4);
+            size += 4;
+            pen->attributes = 0;
+        }
+        int set_fg = (attributes & DV_CELL_FOREGROUND) && (!(pen->attributes & DV_CELL_FOREGROUND) || memcmp(pen->fg, fg, 3) != 0);
+        int set_bg = (attributes & DV_CELL_BACKGROUND) && (!(pen->attributes & DV_CELL_BACKGROUND) || memcmp(pen->bg, bg, 3) != 0);
+        if (flags & ENCODE_256) {
+            // Two colors can be the same palette entry even if the RGB values differ
+            if (set_fg && (pen->attributes & DV_CELL_FOREGROUND) &&
+                get_256_color_index(fg[0], fg[1], fg[2]) == get_256_color_index(pen->fg[0], pen->fg[1], pen->fg[2]))
+                set_fg = 0;
+            if (set_bg && (pen->attributes & DV_CELL_BACKGROUND) &&
+                get_256_color_index(bg[0], bg[1], bg[2]) == get_256_color_index(pen->bg[0], pen->bg[1], pen->bg[2]))
+                set_bg = 0;
+        }
+        if (!set_fg && !set_bg)
+            return size;
+
+        memcpy(&buffer_out[size], "\033[", 2);
+        size += 2;
+        if (set_fg) {
+            if (flags & ENCODE_256) {
+                memcpy(&buffer_out[size], "38;5;", 5);
+                size += 5;
+                size += write_number(&buffer_out[size], get_256_color_index(fg[0], fg[1], fg[2]));
+            } else {
+                memcpy(&buffer_out[size], "38;2;", 5);
+                size += 5;
+                size += write_number(&buffer_out[size], fg[0]);
+                buffer_out[size++] = ';';
+                size += write_number(&buffer_out[size], fg[1]);
+                buffer_out[size++] = ';';
+                size += write_number(&buffer_out[size], fg[2]);
+            }
+            memcpy(pen->fg, fg, 3);
+            if (set_bg)
+                buffer_out[size++] = ';';
+        }
+        if (set_bg) {
+            if (flags & ENCODE_256) {
+                memcpy(&buffer_out[size], "48;5;", 5);
+                size += 5;
+                size += write_number(&buffer_out[size], get_256_color_index(bg[0], bg[1], bg[2]));
+            } else {
+                memcpy(&buffer_out[size], "48;2;", 5);
+                size += 5;
+                size += write_number(&buffer_out[size], bg[0]);
+                buffer_out[size++] = ';';
+                size += write_number(&buffer_out[size], bg[1]);
+                buffer_out[size++] = ';';
+                size += write_number(&buffer_out[size], bg[2]);
+            }
+            memcpy(pen->bg, bg, 3);
+        }
+        buffer_out[size++] = 'm';
+        pen->attributes = attributes;
+        return size;
+    }
+
+    if (attributes & DV_CELL_FOREGROUND) {
+        memcpy(&buffer_out[size], "\033[38;2;", 7);
+        size += 7;
+        size += write_number(&buffer_out[size], fg[0]);
+        buffer_out[size++] = ';';
+        size += write_number(&buffer_out[size], fg[1]);
+        buffer_out[size++] = ';';
+        size += write_number(&buffer_out[size], fg[2]);
+        buffer_out[size++] = 'm';
+    }
+    if (attributes & DV_CELL_BACKGROUND) {
+        memcpy(&buffer_out[size], "\033[48;2;", 7);
+        size += 7;
+        size += write_number(&buffer_out[size], bg[0]);
+        buffer_out[size++] = ';';
+        size += write_number(&buffer_out[size], bg[1]);
+        buffer_out[size++] = ';';
+        size += write_number(&buffer_out[size], bg[2]);
+        buffer_out[size++] = 'm';
+    }
+    return size;
+}
+
+// Writes a unicode codepoint as UTF-8
+// - Returns the amount of bytes written
+static int write_glyph(char *buffer_out, unsigned int glyph) {
+    if (glyph < 0x80) {
+        buffer_out[0] = glyph;
+        return 1;
+    }
+    if (glyph < 0x800) {
+        buffer_out[0] = 0xC0 | (glyph >> 6);
+        buffer_out[1] = 0x80 | (glyph & 0x3F);
+        return 2;
+    }
+    buffer_out[0] = 0xE0 | (glyph >> 12);
+    buffer_out[1] = 0x80 | ((glyph >> 6) & 0x3F);
+    buffer_out[2] = 0x80 | (glyph & 0x3F);
+    return 3;
+}
+
+// Writes a non negative number in decimal without sprintf
+// - Returns the amount of bytes written
+static int write_number(char *buffer_out, int number) {
+    char digits[12];
+    int count = 0;
+    do {
+        digits[count++] = '0' + number % 10;
+        number /= 10;
+    } while (number);
+    for (int i = 0; i < count; i++)
+        buffer_out[i] = digits[count - 1 - i];
+    return count;
+}
+
+// Returns the amount of digits of a non negative number
+static int get_number_size(int number) {
+    int size = 1;
+    while (number >= 10) {
+        number /= 10;
+        size++;
+    }
+    return size;
+}
+
+// Returns the closest color in the xterm 256 color palette
+// - Picks between the 6x6x6 cube (16-231) and the gray ramp (232-255)
+static int get_256_color_index(int red, int green, int blue) {
+    static const int levels[6] = {0, 95, 135, 175, 215, 255};
+    int cube[3], channels[3] = {red, green, blue};
+    int cube_distance = 0;
+    for (int c = 0; c < 3; c++) {
+        int level = channels[c] < 48 ? 0 : (channels[c] < 115 ? 1 : (channels[c] - 35) / 40);
+        cube[c] = level;
+        cube_distance += (channels[c] - levels[level]) * (channels[c] - levels[level]);
+    }
+
+    int average = (red + green + blue) / 3;
+    int gray = average > 238 ? 23 : (average < 8 ? 0 : (average - 3) / 10);
+    int gray_value = 8 + gray * 10;
+    int gray_distance = (red - gray_value) * (red - gray_value) + (green - gray_value) * (green - gray_value) + (blue - gray_value) * (blue - gray_value);
+
+    if (gray_distance < cube_distance)
+        return 232 + gray;
+    return 16 + cube[0] * 36 + cube[1] * 6 + cube[2];
+}
+
+// Amount of threads used for sixel, never more than the amount of bands
+static int get_sixel_thread_count(const dv_config *config, int band_count) {
+    int thread_count = config->threads;
+    if (thread_count > DV_SIXEL_MAX_THREADS)
+        thread_count = DV_SIXEL_MAX_THREADS;
+    if (thread_count > band_count)
+        thread_count = band_count;
+    if (thread_count < 1)
+        thread_count = 1;
+    return thread_count;
+}
+
+// A band can at most use every color once, each color row is "#ddd" + width + "$"
+static int get_sixel_band_size(int width) {
+    int colors_per_band = (width * 6 < DV_SIXEL_COLOR_COUNT) ? width * 6 : DV_SIXEL_COLOR_COUNT;
+    return colors_per_band * (width + 5) + 1;
+}
+
+// Encodes the output pixel grid as sixel graphics
+// - Every pixel is mapped to the fixed 6x7x6 color cube
+// - Bands of 6 rows are encoded in parallel and joined in order
+// - First thread writes straight into the output, the rest into the arena
+static int render_sixel(dv_context *context, const unsigned char *pixels, int stride, int channels, char *output) {
+    int width, height;
+    get_output_size(&context->config, &width, &height);
+    unsigned char used[DV_SIXEL_COLOR_COUNT] = {0};
+    mark_stage(context, "convert", 1);
+    double start = get_thread_seconds();
+    quantize_to_sixel_palette(pixels, stride, channels, width, height, context->sixel_indices, used);
+    double quantized = get_thread_seconds();
+    context->stages.convert += quantized - start;
+    mark_stage(context, "convert", 0);
+    mark_stage(context, "encode", 1);
+
+    int size = 0;
+    memcpy(output, "\033P0;1;0q\"1;1;", 13);
+    size += 13;
+    size += write_number(&output[size], width);
+    output[size++] = ';';
+    size += write_number(&output[size], height);
+    for (int c = 0; c < DV_SIXEL_COLOR_COUNT; c++) {
+        if (!used[c] || (context->config.sixel_palette_reuse && context->sixel_defined[c]))
+            continue;
+        size += sprintf(&output[size], "#%d;2;%d;%d;%d", c, (c / 42) * 100 / 5, ((c / 6) % 7) * 100 / 6, (c % 6) * 100 / 5);
+        context->sixel_defined[c] = 1;
+    }
+
+    int band_count = (height + 5) / 6;
+    int thread_count = get_sixel_thread_count(&context->config, band_count);
+    sixel_job jobs[DV_SIXEL_MAX_THREADS];
+    pthread_t threads[DV_SIXEL_MAX_THREADS];
+    int started = 1;
+    for (int t = 0; t < thread_count; t++) {
+        jobs[t].indices = context->sixel_indices;
+        jobs[t].masks = context->sixel_masks[t];
+        jobs[t].width = width;
+        jobs[t].height = height;
+        jobs[t].first_band = band_count * t / thread_count;
+        jobs[t].last_band = band_count * (t + 1) / thread_count;
+        jobs[t].buffer = t == 0 ? &output[size] : context->sixel_buffers[t];
+        if (t > 0) {
+            if (pthread_create(&threads[t], NULL, encode_sixel_bands, &jobs[t]))
+                break;
+            started++;
+        }
+    }
+    encode_sixel_bands(&jobs[0]);
+    for (int t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+    if (started != thread_count)
+        return DV_ERROR_THREAD;
+
+    size += jobs[0].size;
+    for (int t = 1; t < thread_count; t++) {
+        memcpy(&output[size], jobs[t].buffer, jobs[t].size);
+        size += jobs[t].size;
+    }
+    output[size++] = '\033';
+    output[size++] = '\\';
+    context->stages.encode += get_thread_seconds() - quantized;
+    mark_stage(context, "encode", 0);
+    return size;
+}
+
+// Maps pixels to the 6x7x6 color cube (6 red, 7 green, 6 blue levels)
+// - Register = red_level * 42 + green_level * 6 + blue_level
+// - Uses per channel lookup tables so a pixel costs 3 loads and 2 adds
+// - Marks every register that is used
+static void quantize_to_sixel_palette(const unsigned char *pixels, int stride, int channels, int width, int height, unsigned char *indices, unsigned char *used) {
+    unsigned char red_lookup[256], green_lookup[256], blue_lookup[256];
+    for (int i = 0; i < 256; i++) {
+        red_lookup[i] = ((i * 5 + 127) / 255) * 42;
+        green_lookup[i] = ((i * 6 + 127) / 255) * 6;
+        blue_lookup[i] = (i * 5 + 127) / 255;
+    }
+    int green = channels == 3;
+    int blue = (channels == 3) * 2;
+    for (int y = 0; y < height; y++) {
+        const unsigned char *line = pixels + (size_t)y * stride;
+        unsigned char *row = &indices[y * width];
+        for (int x = 0; x < width; x++)
+            row[x] = red_lookup[line[x * channels]] + green_lookup[line[x * channels + green]] + blue_lookup[line[x * channels + blue]];
+        for (int x = 0; x < width; x++)
+            used[row[x]] = 1;
+    }
+}
+
+// Encodes a range of 6 pixel tall bands into sixel data
+// - Every color in a band gets its own row of sixels followed by "$"
+// - Columns on the right with no pixels in that color are not written
+// - Runs longer than 3 characters are compressed as "!n<sixel>"
+// - Thread entry point, takes a sixel_job
+static void *encode_sixel_bands(void *argument) {
+    sixel_job *job = (sixel_job *)argument;
+    int width = job->width;
+    unsigned char *masks = job->masks;
+    job->size = 0;
+
+    for (int band = job->first_band; band < job->last_band; band++) {
+        unsigned char present[DV_SIXEL_COLOR_COUNT] = {0};
+        unsigned char order[DV_SIXEL_COLOR_COUNT];
+        int first[DV_SIXEL_COLOR_COUNT], last[DV_SIXEL_COLOR_COUNT];
+        int color_count = 0;
+
+        for (int row = 0; row < 6 && band * 6 + row < job->height; row++) {
+            const unsigned char *line = &job->indices[(band * 6 + row) * width];
+            for (int x = 0; x < width; x++) {
+                int c = line[x];
+                if (!present[c]) {
+                    present[c] = 1;
+                    order[color_count++] = c;
+                    memset(&masks[c * width], 0, width);
+                    first[c] = x;
+                    last[c] = x;
+                }
+                masks[c * width + x] |= 1 << row;
+                if (x < first[c])
+                    first[c] = x;
+                if (x > last[c])
+                    last[c] = x;
+            }
+        }
+
+        for (int k = 0; k < color_count; k++) {
+            int c = order[k];
+            unsigned char *mask = &masks[c * width];
+            job->buffer[job->size++] = '#';
+            job->size += write_number(&job->buffer[job->size], c);
+            if (first[c] > 0)
+                job->size += write_sixel_run(&job->buffer[job->size], '?', first[c]);
+            int x = first[c];
+            while (x <= last[c]) {
+                int run = 1;
+                while (x + run <= last[c] && mask[x + run] == mask[x])
+                    run++;
+                job->size += write_sixel_run(&job->buffer[job->size], 63 + mask[x], run);
+                x += run;
+            }
+            job->buffer[job->size++] = (k == color_count - 1) ? '-' : '$';
+        }
+    }
+    return NULL;
+}
+
+// Writes a run of the same sixel character to the buffer
+// - Returns the amount of bytes written
+static int write_sixel_run(char *buffer_out, char sixel, int run) {
+    if (run > 3) {
+        buffer_out[0] = '!';
+        int size = 1 + write_number(&buffer_out[1], run);
+        buffer_out[size] = sixel;
+        return size + 1;
+    }
+    for (int i = 0; i < run; i++)
+        buffer_out[i] = sixel;
+    return run;
+}
+
+// Sorts the character set based on
+// their brigtness levels using Bubble Sort
+static void sort_characters(dv_character *set, int size) {
+    int changes_made = 1;
+    while (changes_made) {
+        changes_made = 0;
+        for (int i = 0; i < size - 1; i++) {
+            if ((set + i)->value > (set + i + 1)->value) {
+                dv_character swap = set[i];
+                set[i] = set[i + 1];
+                set[i + 1] = swap;
+                changes_made++;
+            }
+        }
+    }
+}
+
+// - The original ASCII list usually has numbers between 0-150
+// - Each pixel can have a value between 0-255
+// - To make matching easier this function scales all the values
+// - At the end the maximum value is 255
+static void scale_to_255(dv_character *set, int size) {
+    if (set[size - 1].value <= 0)
+        return;
+    double multiplier = 255.0 / set[size - 1].value;
+    for (int i = 0; i < size; i++) {
+        set[i].value *= multiplier;
+    }
+}
+
+// Takes a brightness value and matches it with
+// the closest character in the ASCII set using Linear Search
+static int get_closest_character_index(unsigned char value, dv_character *set, int set_size) {
+    int closest_index = set_size - 1;
+    double latest_difference = 255.0 - value;
+
+    for (int i = set_size - 2; i >= 0; i--) {
+        double temp_difference = abs((int)(set[i].value - value));
+        if (temp_difference > latest_difference)
+            break;
+        else {
+            closest_index = i;
+            latest_difference = temp_difference;
+        }
+    }
+
+    return closest_index;
+}
+
+// Assigns a character to each possible color value
+// - Example: If the brightness value is 139 then the assigned character is lookup_table[139]
+static void calculate_lookup_table(dv_character *set, int set_size, char *lookup_table) {
+    for (int i = 0; i < 256; i++)
+        lookup_table[i] = set[get_closest_character_index(i, set, set_size)].character;
+}
+
+// Returns the CPU time the calling thread used so far
+static double get_thread_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Tells the trace hook that a stage begins (begin 1) or ends (begin 0), nothing if there is none
+static void mark_stage(const dv_context *context, const char *name, int begin) {
+    if (context->trace)
+        context->trace(name, begin);
+}
@@ -0,0 +1,295 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// libduckvideo
+// Turns RGB or luma frames that are already in memory into terminal output
+// - No globals, everything lives in a dv_context
+// - No allocations, the caller gives the scratch memory and the output buffer
+// - No exits, every function returns DV_OK or one of the DV_ERROR codes
+// - Not thread safe per context, separate contexts can be used from separate threads
+
+#ifndef DUCKVIDEO_H
+#define DUCKVIDEO_H
+
+#include <stddef.h>
+
+// Modes, same numbers as print_image
+// - Any printable ASCII character (33-125) -> Colored Single Character
+#define DV_MODE_GRAYSCALE -1
+#define DV_MODE_COLORED -2
+#define DV_MODE_DOUBLE_PIXEL -3
+#define DV_MODE_SIXEL -4
+
+// Encoders that turn a cell frame into escape codes (not used for sixel)
+#define DV_ENCODER_TRUECOLOR 0
+#define DV_ENCODER_256 1
+#define DV_ENCODER_DELTA 2
+#define DV_ENCODER_REP 3
+#define DV_ENCODER_SCROLL 4
+#define DV_ENCODER_DELTA_256 5
+#define DV_ENCODER_COUNT 6
+
+// Filters for resampling the source to the output grid
+#define DV_FILTER_BOX 0
+#define DV_FILTER_TENT 1
+
+#define DV_OK 0
+#define DV_ERROR_ARGUMENT -1
+#define DV_ERROR_NO_SPACE -2
+#define DV_ERROR_THREAD -3
+
+#define DV_MAX_CHARACTERS 256
+#define DV_SIXEL_COLOR_COUNT 252
+#define DV_SIXEL_MAX_THREADS 8
+#define DV_UPPER_HALF_BLOCK 0x2580
+#define DV_CELL_FOREGROUND 1
+#define DV_CELL_BACKGROUND 2
+
+// Struct that represents a character and it's brightness value
+typedef struct dv_character {
+    char character;
+    double value;
+} dv_character;
+
+// Struct-of-arrays frame of terminal cells
+// - Every plane has width * height entries in row order
+// - All planes live in one block so two frames of the same size can be
+// compared with a single memcmp over data
+// - Glyph is a unicode codepoint, attributes tell which colors are in use
+// - Unchanged is NULL or has a byte per cell, cells where it is not 0 are known to be
+// the same as in the frame drawn before, encoders do not have to compare them
+typedef struct dv_cell_frame {
+    int width;
+    int height;
+    size_t size;
+    unsigned char *data;
+    unsigned int *glyph;
+    unsigned char *fg_red;
+    unsigned char *fg_green;
+    unsigned char *fg_blue;
+    unsigned char *bg_red;
+    unsigned char *bg_green;
+    unsigned char *bg_blue;
+    unsigned char *attributes;
+    const unsigned char *unchanged;
+} dv_cell_frame;
+
+// Every encoder takes the new frame, the frame on the screen (can be NULL)
+// and a buffer with at least dv_cell_capacity() bytes
+// - Returns the amount of bytes written
+typedef int (*dv_cell_encoder)(const dv_cell_frame *, const dv_cell_frame *, char *);
+
+// Called on the rendering thread when a stage begins (begin 1) and ends (begin 0)
+// - Name is "resize", "convert" or "encode", the same stages as dv_stage_stats
+typedef void (*dv_trace_hook)(const char *name, int begin);
+
+// Settings of a context, they can not change after dv_context_init()
+// - Source is the size of the frames given to dv_render_rgb/dv_render_luma
+// - Output is the pixel grid that gets drawn, 0 picks the old defaults:
+// Width x Height/2 for -1, -2 and characters (cells are twice as tall as wide)
+// Width x Height for -3 (two pixels per cell) and -4
+// - Threads is only used by sixel, 0 or 1 encodes on the calling thread
+// - Hysteresis luma is the biggest brightness change of an output pixel that is not
+// drawn (0 turns hysteresis off), hysteresis color is the biggest RGB distance that
+// is not drawn (0 only checks brightness) and a pixel is drawn again after at most
+// hysteresis refresh frames (0 never forces it, at most 255), not used for sixel
+// because sixel frames are always drawn whole
+// - Static frames is how many frames in a row a cell has to stay the same before it is
+// masked, masked cells are not converted or compared until a sampled check sees them
+// change (0 turns masking off, at most 255), not used for sixel
+// - Motion savings 1 also encodes every frame the scroll encoder moved as plain delta to
+// count the bytes it saved (plain bytes of dv_motion_stats), it doubles the encode time
+// of those frames so it is off (0) unless the numbers are wanted
+typedef struct dv_config {
+    int mode;
+    int encoder;
+    int filter;
+    int source_width;
+    int source_height;
+    int output_width;
+    int output_height;
+    int threads;
+    int sixel_palette_reuse;
+    int hysteresis_luma;
+    int hysteresis_color;
+    int hysteresis_refresh;
+    int static_frames;
+    int motion_savings;
+} dv_config;
+
+// Struct that counts what hysteresis did since the context was made
+// - Pixels is every output pixel of every frame, held is the pixels that changed
+// but kept their old value and refreshed is the ones that were forced to update
+// - Squared error is summed over every channel of every pixel (samples of them)
+typedef struct dv_hysteresis_stats {
+    long long pixels;
+    long long held;
+    long long refreshed;
+    long long samples;
+    double squared_error;
+} dv_hysteresis_stats;
+
+// Struct that counts what static masking did since the context was made
+// - Cells is every cell of every frame, skipped is the ones that were not converted
+// - Checked is the masked cells that were converted by the sampled check and woken is
+// the masked cells that were converted again because a check in their run saw a change
+typedef struct dv_static_stats {
+    long long cells;
+    long long skipped;
+    long long checked;
+    long long woken;
+} dv_static_stats;
+
+// Struct that counts what the scroll encoder did since the context was made
+// - Moved frames were scrolled, panned or both, scrolls is the ones that were scrolled
+// - Bytes is the output of the moved frames, plain bytes is what plain delta
+// output of the same frames would have been (only with motion savings, 0 otherwise)
+typedef struct dv_motion_stats {
+    long long frames;
+    long long moved_frames;
+    long long scrolls;
+    long long scrolled_rows;
+    long long panned_rows;
+    long long bytes;
+    long long plain_bytes;
+} dv_motion_stats;
+
+// Struct that adds up the CPU time (seconds) the calling thread spent in each stage
+// - Resize is resampling to the output grid (pushed rows too), convert is hysteresis,
+// turning pixels into cells and the sixel palette, encode is writing the output
+// - Sixel worker threads are not counted, only the thread that renders
+typedef struct dv_stage_stats {
+    double resize;
+    double convert;
+    double encode;
+} dv_stage_stats;
+
+// Bump allocator over the scratch memory of a context
+// - If base is NULL it only counts how much memory would be needed
+typedef struct dv_arena {
+    unsigned char *base;
+    size_t capacity;
+    size_t used;
+} dv_arena;
+
+typedef struct dv_resampler dv_resampler;
+
+// Everything the renderer needs between frames
+// - Fields are read only for the caller, use the functions below
+typedef struct dv_context {
+    dv_config config;
+    dv_character set[DV_MAX_CHARACTERS];
+    int set_size;
+    char lookup_table[256];
+    dv_arena arena;
+    dv_resampler *resampler;
+    dv_resampler *luma_resampler;
+    unsigned char *pixels;
+    unsigned char *luma;
+    int pushed_rows;
+    int pushed_channels;
+    dv_cell_frame frames[2];
+    int current_frame;
+    int has_previous;
+    dv_cell_encoder encoder;
+    unsigned char *sixel_indices;
+    unsigned char *sixel_masks[DV_SIXEL_MAX_THREADS];
+    char *sixel_buffers[DV_SIXEL_MAX_THREADS];
+    unsigned char sixel_defined[DV_SIXEL_COLOR_COUNT];
+    unsigned char *held_pixels;
+    unsigned char *held_ages;
+    int held_channels;
+    dv_hysteresis_stats hysteresis;
+    char *motion_buffer;
+    dv_motion_stats motion;
+    unsigned char *static_ages;
+    unsigned char *static_mask;
+    unsigned char *static_rows;
+    int static_phase;
+    int static_woken;
+    dv_static_stats statics;
+    int color_bits;
+    unsigned char color_levels[256];
+    dv_stage_stats stages;
+    dv_trace_hook trace;
+} dv_context;
+
+// Returns the amount of scratch memory dv_context_init() needs for the config
+size_t dv_scratch_size(const dv_config *config);
+
+// Sets up a context inside the given scratch memory
+// - Set is copied, it does not have to be sorted or scaled
+// - Scratch has to stay alive until the context is not used anymore
+int dv_context_init(dv_context *context, const dv_config *config, const dv_character *set, int set_size, void *scratch, size_t scratch_size);
+
+// Forgets the frame on the screen (use after the terminal was cleared)
+void dv_context_reset(dv_context *context);
+
+// Replaces the encoder of the context (not used for sixel)
+void dv_set_encoder(dv_context *context, dv_cell_encoder encoder);
+
+// Sets the hook that is told about every stage of rendering (NULL for none, the default)
+void dv_set_trace_hook(dv_context *context, dv_trace_hook hook);
+
+// Keeps only the top bits of every color channel from the next frame on (1-8, 8 is the default)
+// - Fewer colors make longer runs of the same color, so fewer color codes are written
+// - Not used for sixel, it has its own palette
+int dv_set_color_bits(dv_context *context, int bits);
+
+// Returns the output buffer size that is always enough for a single frame
+size_t dv_output_capacity(const dv_context *context);
+
+// Renders a frame into the output buffer
+// - RGB has 3 bytes per pixel, luma has 1, stride is in bytes (0 means packed)
+// - Width and height have to match the source size of the config
+// - Output capacity has to be at least dv_output_capacity()
+// - Returns the amount of bytes written or one of the DV_ERROR codes
+int dv_render_rgb(dv_context *context, const unsigned char *rgb, int width, int height, int stride, char *output, size_t output_capacity);
+int dv_render_luma(dv_context *context, const unsigned char *luma, int width, int height, int stride, char *output, size_t output_capacity);
+
+// Renders a frame that is given a few rows at a time, top to bottom
+// - Push the rows (count rows, stride is in bytes, 0 means packed) until all
+// source rows are in, then dv_render_pushed() draws them like dv_render_rgb()
+// - Rows are resized as they come in, only a few of them are kept
+// - All rows of a frame have to have the same channels
+int dv_push_rgb_rows(dv_context *context, const unsigned char *rgb, int count, int stride);
+int dv_push_luma_rows(dv_context *context, const unsigned char *luma, int count, int stride);
+int dv_render_pushed(dv_context *context, char *output, size_t output_capacity);
+
+// Returns the cell frame of the last rendered frame (NULL for sixel or before the first frame)
+const dv_cell_frame *dv_current_cells(const dv_context *context);
+
+// Returns what hysteresis held back so far (all zero if it is off)
+const dv_hysteresis_stats *dv_get_hysteresis_stats(const dv_context *context);
+
+// Returns what the scroll encoder did so far (all zero for other encoders)
+const dv_motion_stats *dv_get_motion_stats(const dv_context *context);
+
+// Returns what static masking skipped so far (all zero if it is off)
+const dv_static_stats *dv_get_static_stats(const dv_context *context);
+
+// Returns the CPU time spent in each stage so far
+const dv_stage_stats *dv_get_stage_stats(const dv_context *context);
+
+// Encoders for dv_set_encoder()
+int dv_encode_truecolor(const dv_cell_frame *, const dv_cell_frame *, char *);
+int dv_encode_256(const dv_cell_frame *, const dv_cell_frame *, char *);
+int dv_encode_delta(const dv_cell_frame *, const dv_cell_frame *, char *);
+int dv_encode_rep(const dv_cell_frame *, const dv_cell_frame *, char *);
+int dv_encode_scroll(const dv_cell_frame *, const dv_cell_frame *, char *);
+int dv_encode_delta_256(const dv_cell_frame *, const dv_cell_frame *, char *);
+
+// Cell frame helpers
+size_t dv_cell_capacity(const dv_cell_frame *frame);
+int dv_cell_frames_equal(const dv_cell_frame *, const dv_cell_frame *);
+int dv_cell_rows_equal(const dv_cell_frame *, const dv_cell_frame *, int);
+int dv_cells_equal(const dv_cell_frame *, int, const dv_cell_frame *, int);
+
+// Returns a short description of a DV_ERROR code
+const char *dv_error_string(int error);
+
+#endif
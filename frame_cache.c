@@ -0,0 +1,168 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Hash table of rendered frames with a least recently used list through it
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_cache.h"
+#include "frame_hash.h"
+
+static uint64_t hash_key(const cache_key *);
+static cached_frame *find_entry(const frame_cache *, const cache_key *, uint64_t);
+static void unlink_entry(frame_cache *, cached_frame *);
+static void link_newest(frame_cache *, cached_frame *);
+static void remove_oldest(frame_cache *);
+static void grow_buckets(frame_cache *);
+
+#define CACHE_FIRST_BUCKETS 256
+
+void frame_cache_init(frame_cache *cache, size_t budget) {
+    memset(cache, 0, sizeof(frame_cache));
+    cache->budget = budget;
+    cache->bucket_count = CACHE_FIRST_BUCKETS;
+    cache->buckets = (cached_frame **)calloc(cache->bucket_count, sizeof(cached_frame *));
+    if (!cache->buckets) {
+        fprintf(stderr, "Memory allocation failed in frame_cache_init()\n");
+        exit(1);
+    }
+}
+
+const cached_frame *frame_cache_find(frame_cache *cache, const cache_key *key) {
+    cached_frame *entry = find_entry(cache, key, hash_key(key));
+    if (!entry && key->previous != -1) {
+        cache_key scratch = *key;
+        scratch.previous = -1;
+        entry = find_entry(cache, &scratch, hash_key(&scratch));
+    }
+    if (!entry) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    unlink_entry(cache, entry);
+    link_newest(cache, entry);
+    return entry;
+}
+
+void frame_cache_insert(frame_cache *cache, const cache_key *key, const char *data, int size, uint64_t hash, int delay) {
+    size_t bytes = sizeof(cached_frame) + size;
+    if (bytes > cache->budget)
+        return;
+    uint64_t key_hash = hash_key(key);
+    if (find_entry(cache, key, key_hash))
+        return;
+    while (cache->used + bytes > cache->budget)
+        remove_oldest(cache);
+
+    cached_frame *entry = (cached_frame *)malloc(bytes);
+    if (!entry) {
+        fprintf(stderr, "Memory allocation failed in frame_cache_insert()\n");
+        exit(1);
+    }
+    entry->key = *key;
+    entry->key_hash = key_hash;
+    entry->hash = hash;
+    entry->delay = delay;
+    // Output is kept right after the entry
+    entry->data = (char *)(entry + 1);
+    entry->size = size;
+    memcpy(entry->data, data, size);
+
+    if ((size_t)cache->count >= cache->bucket_count)
+        grow_buckets(cache);
+    cached_frame **bucket = &cache->buckets[key_hash & (cache->bucket_count - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    link_newest(cache, entry);
+    cache->count++;
+    cache->used += bytes;
+}
+
+void frame_cache_report(const frame_cache *cache, FILE *file) {
+    long lookups = cache->hits + cache->misses;
+    if (lookups == 0)
+        return;
+    fprintf(file, "Frame cache: %ld hits, %ld misses (%.1f%% hit rate), %d frames in %.1f MB of %.1f MB\n", cache->hits,
+            cache->misses, 100.0 * cache->hits / lookups, cache->count, cache->used / 1e6, cache->budget / 1e6);
+}
+
+void frame_cache_close(frame_cache *cache) {
+    while (cache->oldest)
+        remove_oldest(cache);
+    free(cache->buckets);
+}
+
+// Keys are hashed as a whole, cache_key has no padding
+static uint64_t hash_key(const cache_key *key) {
+    return hash_bytes(key, sizeof(cache_key), 0);
+}
+
+static cached_frame *find_entry(const frame_cache *cache, const cache_key *key, uint64_t key_hash) {
+    for (cached_frame *entry = cache->buckets[key_hash & (cache->bucket_count - 1)]; entry; entry = entry->next) {
+        if (entry->key_hash == key_hash && memcmp(&entry->key, key, sizeof(cache_key)) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static void unlink_entry(frame_cache *cache, cached_frame *entry) {
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+static void link_newest(frame_cache *cache, cached_frame *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest)
+        cache->newest->newer = entry;
+    else
+        cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static void remove_oldest(frame_cache *cache) {
+    cached_frame *entry = cache->oldest;
+    unlink_entry(cache, entry);
+    cached_frame **link = &cache->buckets[entry->key_hash & (cache->bucket_count - 1)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    cache->count--;
+    cache->used -= sizeof(cached_frame) + entry->size;
+    free(entry);
+}
+
+// Doubles the buckets and moves every entry into its new bucket
+static void grow_buckets(frame_cache *cache) {
+    size_t count = cache->bucket_count * 2;
+    cached_frame **buckets = (cached_frame **)calloc(count, sizeof(cached_frame *));
+    if (!buckets) {
+        fprintf(stderr, "Memory allocation failed in grow_buckets()\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < cache->bucket_count; i++) {
+        cached_frame *entry = cache->buckets[i];
+        while (entry) {
+            cached_frame *next = entry->next;
+            size_t bucket = entry->key_hash & (count - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = count;
+}
@@ -0,0 +1,80 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Cache of rendered frames (the escape codes that are written to the terminal)
+// - Least recently used frames are dropped once the byte budget is used up
+// - Looping and going back to a frame then only costs a write
+
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Struct that says what a rendered frame looks like on the screen
+// - Previous is the frame that was on the screen when it was rendered, the
+// output only draws what changed since then (-1 means it was drawn from scratch)
+// - Mode, encoder and size are the ones of the context that rendered it
+typedef struct cache_key {
+    int index;
+    int previous;
+    int mode;
+    int encoder;
+    int width;
+    int height;
+} cache_key;
+
+// Struct that represents a rendered frame in the cache
+// - Hash is the hash of the source frame, delay is its delay in ms
+// - Newer and older link the entries from the most to the least recently used one
+// - Next links the entries of a bucket
+typedef struct cached_frame {
+    cache_key key;
+    uint64_t key_hash;
+    uint64_t hash;
+    int delay;
+    char *data;
+    int size;
+    struct cached_frame *newer;
+    struct cached_frame *older;
+    struct cached_frame *next;
+} cached_frame;
+
+// Struct that keeps every cached frame
+// - Buckets are a power of two and grow with the entry count
+// - Used is the bytes of every entry (output and the entry itself)
+typedef struct frame_cache {
+    size_t budget;
+    size_t used;
+    cached_frame **buckets;
+    size_t bucket_count;
+    int count;
+    cached_frame *newest;
+    cached_frame *oldest;
+    long hits;
+    long misses;
+} frame_cache;
+
+// Sets up an empty cache that keeps at most budget bytes
+void frame_cache_init(frame_cache *, size_t budget);
+
+// Looks for the frame drawn over key's previous frame, or drawn from scratch
+// - Returns NULL if neither is there, a found frame becomes the most recently used
+// - Frame stays valid until the next frame_cache_insert()
+const cached_frame *frame_cache_find(frame_cache *, const cache_key *);
+
+// Copies a rendered frame into the cache, older frames are dropped to make room
+// - Frames bigger than the whole budget are not kept
+void frame_cache_insert(frame_cache *, const cache_key *, const char *data, int size, uint64_t hash, int delay);
+
+// Prints the hit rate and how much memory the cache holds
+void frame_cache_report(const frame_cache *, FILE *);
+
+void frame_cache_close(frame_cache *);
+
+#endif
@@ -0,0 +1,106 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// XXH64 as described in the xxHash spec
+// - Four independent lanes take 32 bytes at a time, the compiler keeps them in
+// registers and the multiplications overlap
+
+#include <string.h>
+
+#include "frame_hash.h"
+
+static uint64_t read_u64(const unsigned char *);
+static uint32_t read_u32(const unsigned char *);
+static uint64_t rotate_left(uint64_t, int);
+static uint64_t hash_round(uint64_t, uint64_t);
+static uint64_t merge_round(uint64_t, uint64_t);
+
+#define PRIME_1 0x9E3779B185EBCA87ULL
+#define PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME_3 0x165667B19E3779F9ULL
+#define PRIME_4 0x85EBCA77C2B2AE63ULL
+#define PRIME_5 0x27D4EB2F165667C5ULL
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+    const unsigned char *position = (const unsigned char *)data;
+    const unsigned char *end = position + size;
+    uint64_t hash;
+
+    if (size >= 32) {
+        uint64_t lanes[4] = {seed + PRIME_1 + PRIME_2, seed + PRIME_2, seed, seed - PRIME_1};
+        const unsigned char *last = end - 32;
+        do {
+            for (int i = 0; i < 4; i++)
+                lanes[i] = hash_round(lanes[i], read_u64(position + i * 8));
+            position += 32;
+        } while (position <= last);
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        for (int i = 0; i < 4; i++)
+            hash = merge_round(hash, lanes[i]);
+    } else {
+        hash = seed + PRIME_5;
+    }
+    hash += size;
+
+    for (; position + 8 <= end; position += 8) {
+        hash ^= hash_round(0, read_u64(position));
+        hash = rotate_left(hash, 27) * PRIME_1 + PRIME_4;
+    }
+    if (position + 4 <= end) {
+        hash ^= read_u32(position) * PRIME_1;
+        hash = rotate_left(hash, 23) * PRIME_2 + PRIME_3;
+        position += 4;
+    }
+    for (; position < end; position++) {
+        hash ^= *position * PRIME_5;
+        hash = rotate_left(hash, 11) * PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t hash_frame(const unsigned char *frame, size_t row_size, int height, size_t stride) {
+    if (stride == row_size)
+        return hash_bytes(frame, row_size * height, 0);
+    uint64_t hash = 0;
+    for (int y = 0; y < height; y++)
+        hash = hash_bytes(frame + y * stride, row_size, hash);
+    return hash;
+}
+
+// Unaligned little endian reads, memcpy becomes a single load
+static uint64_t read_u64(const unsigned char *position) {
+    uint64_t value;
+    memcpy(&value, position, 8);
+    return value;
+}
+
+static uint32_t read_u32(const unsigned char *position) {
+    uint32_t value;
+    memcpy(&value, position, 4);
+    return value;
+}
+
+static uint64_t rotate_left(uint64_t value, int amount) {
+    return (value << amount) | (value >> (64 - amount));
+}
+
+static uint64_t hash_round(uint64_t lane, uint64_t input) {
+    lane += input * PRIME_2;
+    lane = rotate_left(lane, 31);
+    return lane * PRIME_1;
+}
+
+static uint64_t merge_round(uint64_t hash, uint64_t lane) {
+    hash ^= hash_round(0, lane);
+    return hash * PRIME_1 + PRIME_4;
+}
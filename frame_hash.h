@@ -0,0 +1,24 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Fast 64 bit hashes of frames and files (XXH64)
+// - Used to notice repeated frames, equal hashes are taken as equal frames
+
+#ifndef FRAME_HASH_H
+#define FRAME_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hashes the bytes with XXH64, the seed lets hashes be chained
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed);
+
+// Hashes the first row size bytes of every row
+// - Bytes between the rows (stride - row size) are left out
+uint64_t hash_frame(const unsigned char *frame, size_t row_size, int height, size_t stride);
+
+#endif
@@ -0,0 +1,152 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Single producer ring of frame records that a thread formats into the CSV file
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_log.h"
+#include "trace.h"
+
+static void *write_records(void *);
+static void write_record(FILE *, const frame_record *);
+static void add_sample(frame_log *, int, double);
+static double get_percentile(const frame_log *, int, int);
+
+// Writer looks at the ring this often when it is empty
+#define FRAME_LOG_POLL_MS 10
+// Lower edge of the first bucket and how much wider every bucket is than the one before
+#define FRAME_LOG_BUCKET_MIN_MS 0.001
+#define FRAME_LOG_BUCKET_GROWTH 1.02
+
+static const char *stage_names[FRAME_LOG_STAGES] = {"Decode", "Resize", "Convert", "Encode", "Write", "Frame"};
+static const char *status_names[FRAME_STATUS_COUNT] = {"drawn", "repeated", "cached", "skipped", "dropped"};
+
+void frame_log_open(frame_log *log, const char *path) {
+    memset(log, 0, sizeof(*log));
+    log->file = fopen(path, "w");
+    if (!log->file) {
+        fprintf(stderr, "Could not open %s for writing in frame_log_open()\n", path);
+        exit(1);
+    }
+    fprintf(log->file, "frame,ms,decode_ms,resize_ms,convert_ms,encode_ms,write_ms,total_ms,bytes,status,late_ms\n");
+    if (pthread_create(&log->writer, NULL, write_records, log)) {
+        fprintf(stderr, "Could not start the writer thread in frame_log_open()\n");
+        exit(1);
+    }
+}
+
+void frame_log_add(frame_log *log, const frame_record *record) {
+    log->frames++;
+    log->statuses[record->status]++;
+    log->bytes += record->bytes;
+    for (int i = 0; i < FRAME_LOG_STAGES; i++) {
+        if (record->stages[i] >= 0)
+            add_sample(log, i, record->stages[i]);
+    }
+
+    unsigned head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+    if (head - tail == FRAME_LOG_RING_SIZE) {
+        log->lost++;
+        return;
+    }
+    log->ring[head % FRAME_LOG_RING_SIZE] = *record;
+    atomic_store_explicit(&log->head, head + 1, memory_order_release);
+    TRACE_COUNTER("frame log queue", head + 1 - tail);
+}
+
+void frame_log_report(const frame_log *log, double seconds, FILE *file) {
+    if (log->frames == 0)
+        return;
+    long shown = log->statuses[FRAME_DRAWN] + log->statuses[FRAME_REPEATED] + log->statuses[FRAME_CACHED];
+    fprintf(file, "Played %ld frames in %.2f s: %.2f FPS effective, %.2f MB written", log->frames, seconds, seconds > 0 ? shown / seconds : 0,
+            log->bytes / 1e6);
+    for (int i = 1; i < FRAME_STATUS_COUNT; i++) {
+        if (log->statuses[i] > 0)
+            fprintf(file, ", %ld %s", log->statuses[i], status_names[i]);
+    }
+    fprintf(file, "\n");
+    for (int i = 0; i < FRAME_LOG_STAGES; i++) {
+        if (log->sample_counts[i] == 0)
+            continue;
+        fprintf(file, "%s: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", stage_names[i], get_percentile(log, i, 50),
+                get_percentile(log, i, 90), get_percentile(log, i, 99), log->max_ms[i]);
+    }
+    if (log->lost > 0)
+        fprintf(file, "Frame log lost %ld records, the writer could not keep up\n", log->lost);
+}
+
+void frame_log_close(frame_log *log) {
+    atomic_store_explicit(&log->stop, 1, memory_order_release);
+    pthread_join(log->writer, NULL);
+    fclose(log->file);
+}
+
+// Writer thread, formats the records until it is stopped and the ring is empty
+static void *write_records(void *argument) {
+    frame_log *log = (frame_log *)argument;
+    struct timespec poll = {0, FRAME_LOG_POLL_MS * 1000000L};
+    for (;;) {
+        int stop = atomic_load_explicit(&log->stop, memory_order_acquire);
+        unsigned head = atomic_load_explicit(&log->head, memory_order_acquire);
+        unsigned tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+        if (head == tail) {
+            if (stop)
+                break;
+            fflush(log->file);
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        for (; tail != head; tail++) {
+            write_record(log->file, &log->ring[tail % FRAME_LOG_RING_SIZE]);
+            atomic_store_explicit(&log->tail, tail + 1, memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+// Stages that did not run are left empty
+static void write_record(FILE *file, const frame_record *record) {
+    fprintf(file, "%d,%lf", record->frame, record->frame_ms);
+    for (int i = 0; i < FRAME_LOG_STAGES; i++) {
+        if (record->stages[i] >= 0)
+            fprintf(file, ",%.3f", record->stages[i]);
+        else
+            fprintf(file, ",");
+    }
+    fprintf(file, ",%d,%s,%.3f\n", record->bytes, status_names[record->status], record->late_ms);
+}
+
+static void add_sample(frame_log *log, int stage, double ms) {
+    int bucket = 0;
+    if (ms > FRAME_LOG_BUCKET_MIN_MS)
+        bucket = (int)(log2(ms / FRAME_LOG_BUCKET_MIN_MS) / log2(FRAME_LOG_BUCKET_GROWTH)) + 1;
+    if (bucket >= FRAME_LOG_BUCKETS)
+        bucket = FRAME_LOG_BUCKETS - 1;
+    log->histograms[stage][bucket]++;
+    log->sample_counts[stage]++;
+    if (ms > log->max_ms[stage])
+        log->max_ms[stage] = ms;
+}
+
+// Returns the upper edge of the bucket the percentile falls in (never more than the max),
+// it is at most 2% more than the exact value
+static double get_percentile(const frame_log *log, int stage, int percent) {
+    long rank = (log->sample_counts[stage] - 1) * percent / 100, seen = 0;
+    for (int bucket = 0; bucket < FRAME_LOG_BUCKETS; bucket++) {
+        seen += log->histograms[stage][bucket];
+        if (seen > rank) {
+            double edge = FRAME_LOG_BUCKET_MIN_MS * pow(FRAME_LOG_BUCKET_GROWTH, bucket);
+            return edge < log->max_ms[stage] ? edge : log->max_ms[stage];
+        }
+    }
+    return log->max_ms[stage];
+}
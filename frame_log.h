@@ -0,0 +1,88 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Per frame timing log (frametime.csv) and the percentile report printed at the end
+// - Records go through a ring to a writer thread, adding one never waits on the file,
+// if the ring is full the record is lost from the file (it is still in the report)
+
+#ifndef FRAME_LOG_H
+#define FRAME_LOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define FRAME_LOG_RING_SIZE 1024
+#define FRAME_LOG_STAGES 6
+// Buckets of the stage histograms, each one is 2% wider than the one before starting from
+// 1 us, so 1024 of them go past 10 minutes
+#define FRAME_LOG_BUCKETS 1024
+
+// Stages of a frame record
+#define FRAME_STAGE_DECODE 0
+#define FRAME_STAGE_RESIZE 1
+#define FRAME_STAGE_CONVERT 2
+#define FRAME_STAGE_ENCODE 3
+#define FRAME_STAGE_WRITE 4
+#define FRAME_STAGE_TOTAL 5
+
+// What happened to a frame
+#define FRAME_DRAWN 0
+#define FRAME_REPEATED 1
+#define FRAME_CACHED 2
+#define FRAME_SKIPPED 3
+#define FRAME_DROPPED 4
+#define FRAME_STATUS_COUNT 5
+
+// Struct that represents the timing of one frame
+// - Stages are decode, resize, convert, encode, write and the whole frame in ms, a stage
+// that did not run for the frame is -1 (resize, convert and encode are CPU time of the renderer,
+// decode and write are wall time so waits on the disk or other threads show up)
+// - Frame ms is how long the frame took with the sleep, like the old frametime.csv
+// - Late ms is when the frame was on the screen minus when it should have been
+typedef struct frame_record {
+    int frame;
+    int status;
+    double stages[FRAME_LOG_STAGES];
+    double frame_ms;
+    double late_ms;
+    int bytes;
+} frame_record;
+
+// Struct that represents the log
+// - Head is only moved by the player, tail only by the writer thread
+// - Histograms count the ms of every stage that ran for the report, their size does not
+// grow with the frames so endless loops do not use more memory
+typedef struct frame_log {
+    FILE *file;
+    frame_record ring[FRAME_LOG_RING_SIZE];
+    _Atomic unsigned head;
+    _Atomic unsigned tail;
+    _Atomic int stop;
+    pthread_t writer;
+    long histograms[FRAME_LOG_STAGES][FRAME_LOG_BUCKETS];
+    long sample_counts[FRAME_LOG_STAGES];
+    double max_ms[FRAME_LOG_STAGES];
+    long frames;
+    long statuses[FRAME_STATUS_COUNT];
+    long long bytes;
+    long lost;
+} frame_log;
+
+// Opens the CSV file and starts the writer thread, exits if it can not
+void frame_log_open(frame_log *, const char *path);
+
+// Adds the record of a frame, never waits for the writer
+void frame_log_add(frame_log *, const frame_record *);
+
+// Prints p50/p90/p99/max of every stage, the effective frame rate over seconds and the bytes written
+void frame_log_report(const frame_log *, double seconds, FILE *);
+
+// Writes what is left in the ring, stops the writer thread and closes the file
+void frame_log_close(frame_log *);
+
+#endif
@@ -0,0 +1,234 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Token bucket over the written bytes with a ladder of cheaper ways to draw a frame
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "governor.h"
+
+static void add_level(governor *, int color_bits, int colors_256, int half);
+static void set_level(governor *, int level);
+static void apply_level(governor *, int *cleared);
+static void measure_drain(governor *, int bytes, double write_seconds, double frame_ms);
+static const char *describe_level(const governor_level *, char *buffer, size_t size);
+
+#define GOVERNOR_DRAW 0
+#define GOVERNOR_SKIP 1
+#define GOVERNOR_SAME 2
+// Credit is kept between these many frames of budget (below the first one frames are skipped)
+#define GOVERNOR_SKIP_FRAMES 2
+#define GOVERNOR_BURST_FRAMES 8
+// A cheaper level is taken after this many frames, a better one only after more and with
+// this much credit saved, so the level does not flip every frame
+#define GOVERNOR_DOWN_DWELL 4
+#define GOVERNOR_UP_DWELL 30
+#define GOVERNOR_UP_CREDIT 4
+// Better level is taken if its frames are expected to use at most this share of the budget,
+// a level that was not seen yet is guessed to cost this much more than the current one
+#define GOVERNOR_UP_MARGIN 0.9
+#define GOVERNOR_UNSEEN_COST 1.5
+// While the credit is full, what the better levels cost is forgotten by this much every frame
+#define GOVERNOR_FORGET 0.98
+// Weight of a new frame in the average bytes of a level
+#define GOVERNOR_AVERAGE_WEIGHT 0.125
+// In auto mode a write that took this long blocked and measures the drain speed, the budget
+// is a bit under it, after a second of frames without a blocked write the budget grows a bit
+#define GOVERNOR_BLOCKED_SECONDS 0.002
+#define GOVERNOR_DRAIN_SHARE 0.9
+#define GOVERNOR_PROBE 1.1
+
+void governor_init(governor *governor, double budget, dv_context *full, dv_context *half, int encoder, const char *log_path) {
+    memset(governor, 0, sizeof(*governor));
+    governor->budget = budget;
+    governor->automatic = budget <= 0;
+    governor->full = full;
+    governor->half = half;
+    governor->encoder = full->encoder;
+    governor->encoder_256 = encoder == DV_ENCODER_TRUECOLOR || encoder == DV_ENCODER_256 ? dv_encode_256 : dv_encode_delta_256;
+    governor->applied = -1;
+    governor->action = GOVERNOR_SAME;
+
+    // Sixel has its own palette and B&W has no colors, those only have the half size level
+    // - Fewer bits only help encoders that skip repeated colors, 256 colors are close to 3 bits already
+    int mode = full->config.mode;
+    int colored = mode != DV_MODE_GRAYSCALE && mode != DV_MODE_SIXEL;
+    int colors_256 = encoder == DV_ENCODER_256 || encoder == DV_ENCODER_DELTA_256;
+    add_level(governor, 8, 0, 0);
+    if (colored && !colors_256) {
+        if (encoder != DV_ENCODER_TRUECOLOR) {
+            add_level(governor, 5, 0, 0);
+            add_level(governor, 4, 0, 0);
+            add_level(governor, 3, 0, 0);
+        }
+        add_level(governor, 8, 1, 0);
+    }
+    if (half) {
+        governor_level last = governor->levels[governor->level_count - 1];
+        add_level(governor, last.color_bits, last.colors_256, 1);
+    }
+
+    if (log_path) {
+        governor->log = fopen(log_path, "w");
+        if (!governor->log) {
+            fprintf(stderr, "Could not open %s for writing in governor_init()\n", log_path);
+            exit(1);
+        }
+        fprintf(governor->log, "frame,level,action,bytes,budget,credit\n");
+    }
+}
+
+dv_context *governor_plan(governor *governor, int can_skip, int *cleared) {
+    *cleared = 0;
+    governor->since_change++;
+    double allowance = governor->allowance;
+    if (governor->budget > 0 && allowance > 0) {
+        double current = governor->level_bytes[governor->level];
+        if (governor->level + 1 < governor->level_count && governor->credit < 0 && current > allowance &&
+            governor->since_change >= GOVERNOR_DOWN_DWELL) {
+            set_level(governor, governor->level + 1);
+            // Until it is seen the cheaper level is expected to cost as much, so it keeps going down
+            if (governor->level_bytes[governor->level] == 0)
+                governor->level_bytes[governor->level] = current;
+        } else if (governor->level > 0 && governor->credit > GOVERNOR_UP_CREDIT * allowance && governor->since_change >= GOVERNOR_UP_DWELL) {
+            double better = governor->level_bytes[governor->level - 1];
+            if (better == 0)
+                better = current * GOVERNOR_UNSEEN_COST;
+            if (better < allowance * GOVERNOR_UP_MARGIN)
+                set_level(governor, governor->level - 1);
+        }
+        // Level still changes while frames are skipped, the next drawn frame uses it
+        if (can_skip && governor->credit < -GOVERNOR_SKIP_FRAMES * allowance) {
+            governor->action = GOVERNOR_SKIP;
+            return NULL;
+        }
+    }
+    apply_level(governor, cleared);
+    governor->action = GOVERNOR_DRAW;
+    return governor->levels[governor->level].half ? governor->half : governor->full;
+}
+
+void governor_account(governor *governor, int bytes, double write_seconds, double frame_ms) {
+    if (governor->automatic)
+        measure_drain(governor, bytes, write_seconds, frame_ms);
+    governor->allowance = governor->budget * frame_ms / 1000;
+    governor->credit += governor->allowance - bytes;
+    if (governor->credit > GOVERNOR_BURST_FRAMES * governor->allowance) {
+        governor->credit = GOVERNOR_BURST_FRAMES * governor->allowance;
+        // Budget is not used up, guesses about better levels from busier scenes fade out
+        for (int i = 0; i < governor->level; i++)
+            governor->level_bytes[i] *= GOVERNOR_FORGET;
+    }
+    if (governor->action == GOVERNOR_DRAW) {
+        double *average = &governor->level_bytes[governor->level];
+        *average = *average == 0 ? bytes : *average + (bytes - *average) * GOVERNOR_AVERAGE_WEIGHT;
+        governor->level_frames[governor->level]++;
+    } else if (governor->action == GOVERNOR_SKIP) {
+        governor->skipped++;
+    }
+    governor->bytes += bytes;
+    governor->ms += frame_ms;
+    if (governor->log) {
+        const char *actions[] = {"draw", "skip", "same"};
+        fprintf(governor->log, "%ld,%d,%s,%d,%.0f,%.0f\n", governor->frame, governor->level, actions[governor->action], bytes,
+                governor->budget, governor->credit);
+    }
+    governor->action = GOVERNOR_SAME;
+    governor->frame++;
+}
+
+void governor_report(const governor *governor, FILE *file) {
+    if (governor->frame == 0 || governor->ms <= 0)
+        return;
+    fprintf(file, "Governor wrote %.1f KB/s", governor->bytes / governor->ms);
+    if (governor->budget > 0)
+        fprintf(file, " of a %.1f KB/s %sbudget", governor->budget / 1000, governor->automatic ? "measured " : "");
+    else
+        fprintf(file, " (writes never blocked, no budget was needed)");
+    fprintf(file, ", %ld level changes, skipped %ld of %ld frames\n", governor->changes, governor->skipped, governor->frame);
+    long drawn = 0;
+    for (int i = 0; i < governor->level_count; i++)
+        drawn += governor->level_frames[i];
+    if (drawn == 0)
+        return;
+    fprintf(file, "Governor levels:");
+    for (int i = 0; i < governor->level_count; i++) {
+        char name[32];
+        fprintf(file, "%s %s %.1f%%", i ? "," : "", describe_level(&governor->levels[i], name, sizeof(name)),
+                100.0 * governor->level_frames[i] / drawn);
+    }
+    fprintf(file, "\n");
+}
+
+void governor_close(governor *governor) {
+    if (governor->log)
+        fclose(governor->log);
+}
+
+static void add_level(governor *governor, int color_bits, int colors_256, int half) {
+    governor_level *level = &governor->levels[governor->level_count++];
+    level->color_bits = color_bits;
+    level->colors_256 = colors_256;
+    level->half = half;
+}
+
+static void set_level(governor *governor, int level) {
+    governor->level = level;
+    governor->since_change = 0;
+    governor->changes++;
+}
+
+// Sets the colors and the encoder of the level on its context
+// - Context that takes over from the other size draws from scratch
+static void apply_level(governor *governor, int *cleared) {
+    if (governor->applied == governor->level)
+        return;
+    const governor_level *level = &governor->levels[governor->level];
+    dv_context *context = level->half ? governor->half : governor->full;
+    dv_set_color_bits(context, level->color_bits);
+    dv_set_encoder(context, level->colors_256 ? governor->encoder_256 : governor->encoder);
+    if (governor->applied >= 0 && governor->levels[governor->applied].half != level->half) {
+        dv_context_reset(context);
+        *cleared = 1;
+    }
+    governor->applied = governor->level;
+}
+
+// Measures how fast the output drains from the writes that blocked
+// - A write that did not block only measures a copy, so then the budget grows a bit
+// until writes block again
+// - Bytes written before the first measure do not count against the budget
+static void measure_drain(governor *governor, int bytes, double write_seconds, double frame_ms) {
+    if (write_seconds >= GOVERNOR_BLOCKED_SECONDS) {
+        double drain = GOVERNOR_DRAIN_SHARE * bytes / write_seconds;
+        if (governor->budget == 0) {
+            governor->budget = drain;
+            governor->credit = bytes;
+        } else {
+            governor->budget += (drain - governor->budget) * GOVERNOR_AVERAGE_WEIGHT;
+        }
+        governor->unblocked_ms = 0;
+    } else if (governor->budget > 0) {
+        governor->unblocked_ms += frame_ms;
+        if (governor->unblocked_ms >= 1000) {
+            governor->budget *= GOVERNOR_PROBE;
+            governor->unblocked_ms = 0;
+        }
+    }
+}
+
+static const char *describe_level(const governor_level *level, char *buffer, size_t size) {
+    const char *grid = level->half ? "half size " : "";
+    if (level->colors_256)
+        snprintf(buffer, size, "%s256 colors", grid);
+    else if (level->color_bits < 8)
+        snprintf(buffer, size, "%s%d bit colors", grid, level->color_bits);
+    else
+        snprintf(buffer, size, "%s", level->half ? "half size" : "full size");
+    return buffer;
+}
@@ -0,0 +1,85 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Output bandwidth governor that keeps the written bytes under a budget
+// - Every frame it picks a level: fewer color bits, 256 colors, half the pixel grid
+// and lastly skipped frames, from what the frames of each level really took
+// - Budget is given in bytes per second or measured from how fast writes drain
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stdio.h>
+
+#include "duckvideo.h"
+
+#define GOVERNOR_MAX_LEVELS 6
+
+// Struct that says how a level draws the frames
+// - Half is 1 if the frames are drawn on the half size context
+typedef struct governor_level {
+    int color_bits;
+    int colors_256;
+    int half;
+} governor_level;
+
+// Struct that represents the state of the governor
+// - Budget is in bytes per second, 0 means no limit (auto mode before a write blocked)
+// - Credit is the bytes the budget allowed but were not written yet, it goes
+// below 0 when frames took more than their share
+// - Level bytes is the average bytes of a drawn frame at each level (0 if not seen yet)
+// - Unblocked ms is how long frames were written without blocking in auto mode
+// - Log gets one line for every frame (NULL for no log)
+typedef struct governor {
+    double budget;
+    int automatic;
+    double credit;
+    governor_level levels[GOVERNOR_MAX_LEVELS];
+    double level_bytes[GOVERNOR_MAX_LEVELS];
+    long level_frames[GOVERNOR_MAX_LEVELS];
+    int level_count;
+    int level;
+    int applied;
+    int since_change;
+    int action;
+    double allowance;
+    dv_context *full;
+    dv_context *half;
+    dv_cell_encoder encoder;
+    dv_cell_encoder encoder_256;
+    double unblocked_ms;
+    long frame;
+    long skipped;
+    long changes;
+    long long bytes;
+    double ms;
+    FILE *log;
+} governor;
+
+// Sets up a governor for a budget in bytes per second (0 measures it from the writes)
+// - Full is the context of the player, half is the same one with half the output size (NULL for none)
+// - Encoder is the configured encoder number, the 256 color level uses the matching 256 color one
+// - Log path is where every decision is written as CSV (NULL for no log)
+void governor_init(governor *, double budget, dv_context *full, dv_context *half, int encoder, const char *log_path);
+
+// Picks the level of the next frame and sets the context up for it
+// - Returns the context to render with, or NULL if the frame has to be skipped
+// (only if can skip is 1)
+// - Cleared is set to 1 if the pixel grid changed size, the screen has to be cleared
+// and the returned context was reset
+dv_context *governor_plan(governor *, int can_skip, int *cleared);
+
+// Counts what a frame wrote, call it for every frame (skipped and repeated ones too)
+// - Write seconds is how long the write took, frame ms is how long the frame is shown
+void governor_account(governor *, int bytes, double write_seconds, double frame_ms);
+
+// Prints the achieved bandwidth and how often each level was used
+void governor_report(const governor *, FILE *);
+
+void governor_close(governor *);
+
+#endif
@@ -0,0 +1,259 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Reduced-size JPEG decoding, see jpeg.h
+// - stb_image is compiled a second time in here with static functions so its
+// decoder internals can be used without touching the vendored header
+// - The IDCT kernel of the decoder is swapped for one that only makes the top
+// left NxN pixels of every 8x8 block from the lowest NxN coefficients
+// - Upsampling and color conversion are then done on the small image only
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_JPEG
+#define STBI_NO_STDIO
+#include "stb_image/stb_image.h"
+
+#include "jpeg.h"
+
+static void build_idct_tables(void);
+static inline void idct_scaled(stbi_uc *, int, const short *, int);
+static void idct_half(stbi_uc *, int, short[64]);
+static void idct_quarter(stbi_uc *, int, short[64]);
+static void idct_eighth(stbi_uc *, int, short[64]);
+static stbi_uc clamp_sample(int);
+static const stbi_uc *get_scaled_line(const stbi__jpeg *, int, int, int, int);
+static int get_scaled_column(int, int, int);
+
+#define JPEG_MAX_DENOMINATOR 8
+#define JPEG_IDCT_BITS 12
+
+// idct_tables[n][x][u] is the weight of coefficient u for output x of an n point IDCT
+// - Same normalization as the 8 point IDCT so every output is the average of 8/n pixels
+// - Weights are fixed point with JPEG_IDCT_BITS fraction bits
+static int idct_tables[JPEG_MAX_DENOMINATOR + 1][JPEG_MAX_DENOMINATOR][JPEG_MAX_DENOMINATOR];
+static pthread_once_t idct_tables_once = PTHREAD_ONCE_INIT;
+
+int jpeg_pick_scale(int width, int height, int min_width, int min_height) {
+    if (min_width <= 0 || min_height <= 0)
+        return 1;
+    int denominator = 1;
+    while (denominator < JPEG_MAX_DENOMINATOR) {
+        int next_width, next_height;
+        jpeg_scaled_size(width, height, denominator * 2, &next_width, &next_height);
+        if (next_width < min_width || next_height < min_height)
+            break;
+        denominator *= 2;
+    }
+    return denominator;
+}
+
+void jpeg_scaled_size(int width, int height, int denominator, int *scaled_width, int *scaled_height) {
+    *scaled_width = (width + denominator - 1) / denominator;
+    *scaled_height = (height + denominator - 1) / denominator;
+}
+
+unsigned char *jpeg_load_scaled(const unsigned char *data, int length, int denominator, int channels, int *width, int *height) {
+    if (denominator == 1) {
+        int file_channels;
+        return stbi_load_from_memory(data, length, width, height, &file_channels, channels);
+    }
+    if (denominator != 2 && denominator != 4 && denominator != 8)
+        return NULL;
+    pthread_once(&idct_tables_once, build_idct_tables);
+
+    stbi__context context;
+    stbi__jpeg *jpeg = (stbi__jpeg *)calloc(1, sizeof(stbi__jpeg));
+    if (!jpeg)
+        return NULL;
+    stbi__start_mem(&context, data, length);
+    jpeg->s = &context;
+    stbi__setup_jpeg(jpeg);
+    jpeg->idct_block_kernel = denominator == 2 ? idct_half : denominator == 4 ? idct_quarter : idct_eighth;
+    context.img_n = 0;
+    if (!stbi__decode_jpeg_image(jpeg) || (context.img_n != 1 && context.img_n != 3)) {
+        stbi__cleanup_jpeg(jpeg);
+        free(jpeg);
+        return NULL;
+    }
+
+    int n = JPEG_MAX_DENOMINATOR / denominator;
+    int output_width, output_height;
+    jpeg_scaled_size(context.img_x, context.img_y, denominator, &output_width, &output_height);
+    int component_count = context.img_n == 3 && channels == 3 ? 3 : 1;
+    int is_rgb = context.img_n == 3 && (jpeg->rgb == 3 || (jpeg->app14_color_transform == 0 && !jpeg->jfif));
+    if (context.img_n == 3 && channels == 1 && is_rgb)
+        component_count = 3;
+
+    unsigned char *output = (unsigned char *)malloc((size_t)output_width * output_height * channels);
+    unsigned char *rows = (unsigned char *)malloc((size_t)output_width * 7);
+    int *columns = (int *)malloc((size_t)output_width * 2 * component_count * sizeof(int));
+    if (!output || !rows || !columns) {
+        free(output);
+        free(rows);
+        free(columns);
+        stbi__cleanup_jpeg(jpeg);
+        free(jpeg);
+        return NULL;
+    }
+
+    // Subsampled components are upsampled with the same 3/4 1/4 triangle filter as stb_image
+    // - Other factors (4:1:1) take the nearest sample
+    // - Columns has the near and the far sample of every output column inside a scaled line
+    for (int k = 0; k < component_count; k++) {
+        int horizontal = jpeg->img_h_max / jpeg->img_comp[k].h;
+        int component_width = (jpeg->img_comp[k].x + denominator - 1) / denominator;
+        int *near_columns = columns + k * 2 * output_width, *far_columns = near_columns + output_width;
+        for (int x = 0; x < output_width; x++) {
+            int near_x = x / horizontal, far_x = near_x;
+            if (horizontal == 2)
+                far_x = x & 1 ? near_x + 1 : near_x - 1;
+            near_columns[x] = get_scaled_column(near_x, n, component_width);
+            far_columns[x] = get_scaled_column(far_x, n, component_width);
+        }
+    }
+    for (int y = 0; y < output_height; y++) {
+        for (int k = 0; k < component_count; k++) {
+            int near_weight_x = jpeg->img_h_max / jpeg->img_comp[k].h == 2 ? 3 : 4;
+            int vertical = jpeg->img_v_max / jpeg->img_comp[k].v;
+            int component_height = (jpeg->img_comp[k].y + denominator - 1) / denominator;
+            int near_y = y / vertical, far_y = near_y, near_weight_y = 4;
+            if (vertical == 2) {
+                far_y = y & 1 ? near_y + 1 : near_y - 1;
+                near_weight_y = 3;
+            }
+            const stbi_uc *near_line = get_scaled_line(jpeg, k, n, near_y, component_height);
+            const stbi_uc *far_line = get_scaled_line(jpeg, k, n, far_y, component_height);
+            const int *near_columns = columns + k * 2 * output_width, *far_columns = near_columns + output_width;
+            unsigned char *row = rows + k * output_width;
+            if (near_weight_x == 4 && near_weight_y == 4) {
+                for (int x = 0; x < output_width; x++)
+                    row[x] = near_line[near_columns[x]];
+                continue;
+            }
+            for (int x = 0; x < output_width; x++) {
+                int near = near_line[near_columns[x]] * near_weight_x + near_line[far_columns[x]] * (4 - near_weight_x);
+                int far = far_line[near_columns[x]] * near_weight_x + far_line[far_columns[x]] * (4 - near_weight_x);
+                row[x] = (near * near_weight_y + far * (4 - near_weight_y) + 8) >> 4;
+            }
+        }
+
+        unsigned char *out = output + (size_t)y * output_width * channels;
+        if (component_count == 1 && channels == 3) {
+            // Gray file into RGB, every pixel is the gray value 3 times
+            for (int x = 0; x < output_width; x++)
+                out[x * 3] = out[x * 3 + 1] = out[x * 3 + 2] = rows[x];
+        } else if (component_count == 1) {
+            memcpy(out, rows, output_width);
+        } else if (is_rgb && channels == 3) {
+            for (int x = 0; x < output_width; x++) {
+                out[x * 3] = rows[x];
+                out[x * 3 + 1] = rows[output_width + x];
+                out[x * 3 + 2] = rows[output_width * 2 + x];
+            }
+        } else if (is_rgb) {
+            for (int x = 0; x < output_width; x++)
+                out[x] = stbi__compute_y(rows[x], rows[output_width + x], rows[output_width * 2 + x]);
+        } else {
+            // The converter always writes 4 bytes per pixel
+            unsigned char *rgba = rows + output_width * 3;
+            stbi__YCbCr_to_RGB_row(rgba, rows, rows + output_width, rows + output_width * 2, output_width, 4);
+            for (int x = 0; x < output_width; x++)
+                memcpy(out + x * 3, rgba + x * 4, 3);
+        }
+    }
+
+    free(rows);
+    free(columns);
+    stbi__cleanup_jpeg(jpeg);
+    free(jpeg);
+    *width = output_width;
+    *height = output_height;
+    return output;
+}
+
+// Returns row y of a component after the scaled IDCT (clamped to the component)
+// - Every 8x8 block only has its top left n x n pixels filled
+static const stbi_uc *get_scaled_line(const stbi__jpeg *jpeg, int component, int n, int y, int height) {
+    if (y < 0)
+        y = 0;
+    if (y >= height)
+        y = height - 1;
+    return jpeg->img_comp[component].data + (size_t)jpeg->img_comp[component].w2 * ((y / n) * 8 + y % n);
+}
+
+// Returns where column x of a component is inside a scaled line (clamped to the component)
+static int get_scaled_column(int x, int n, int width) {
+    if (x < 0)
+        x = 0;
+    if (x >= width)
+        x = width - 1;
+    return (x / n) * 8 + x % n;
+}
+
+static void build_idct_tables(void) {
+    for (int n = 1; n <= JPEG_MAX_DENOMINATOR; n *= 2) {
+        for (int x = 0; x < n; x++) {
+            for (int u = 0; u < n; u++) {
+                double scale = u == 0 ? M_SQRT1_2 : 1.0;
+                idct_tables[n][x][u] = (int)lrint(scale * cos((2 * x + 1) * u * M_PI / (2 * n)) / 2 * (1 << JPEG_IDCT_BITS));
+            }
+        }
+    }
+}
+
+// Writes the NxN pixels of a block from the lowest NxN dequantized coefficients
+// - N is a constant in every caller so the loops are unrolled
+static inline void idct_scaled(stbi_uc *out, int out_stride, const short *data, int n) {
+    long long rows[JPEG_MAX_DENOMINATOR][JPEG_MAX_DENOMINATOR];
+    int (*table)[JPEG_MAX_DENOMINATOR] = idct_tables[n];
+    for (int v = 0; v < n; v++) {
+        for (int x = 0; x < n; x++) {
+            long long sum = 0;
+            for (int u = 0; u < n; u++)
+                sum += table[x][u] * data[v * 8 + u];
+            rows[v][x] = sum;
+        }
+    }
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            long long sum = 1LL << (2 * JPEG_IDCT_BITS - 1);
+            for (int v = 0; v < n; v++)
+                sum += table[y][v] * rows[v][x];
+            out[y * out_stride + x] = clamp_sample((int)(sum >> (2 * JPEG_IDCT_BITS)));
+        }
+    }
+}
+
+static void idct_half(stbi_uc *out, int out_stride, short data[64]) {
+    idct_scaled(out, out_stride, data, 4);
+}
+
+static void idct_quarter(stbi_uc *out, int out_stride, short data[64]) {
+    idct_scaled(out, out_stride, data, 2);
+}
+
+// DC only, the block is a single pixel
+static void idct_eighth(stbi_uc *out, int out_stride, short data[64]) {
+    (void)out_stride;
+    out[0] = clamp_sample((data[0] + 4) >> 3);
+}
+
+// Moves a sample back from around 0 to 0-255
+static stbi_uc clamp_sample(int value) {
+    int sample = value + 128;
+    if (sample < 0)
+        return 0;
+    if (sample > 255)
+        return 255;
+    return sample;
+}
@@ -0,0 +1,27 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Reduced-size JPEG decoding
+// - 1/2, 1/4 and 1/8 sizes come straight out of the inverse DCT (1/8 only needs DC)
+// - Entropy decoding is done by a private copy of stb_image's JPEG decoder
+
+#ifndef JPEG_H
+#define JPEG_H
+
+// Returns the largest denominator (1, 2, 4 or 8) that keeps the image at least min size
+// - Min width or height 0 means there is no target and gives 1
+int jpeg_pick_scale(int width, int height, int min_width, int min_height);
+
+// Returns the size of an image decoded with the denominator
+void jpeg_scaled_size(int width, int height, int denominator, int *scaled_width, int *scaled_height);
+
+// Decodes a JPEG at 1/denominator size
+// - Channels is 3 for RGB or 1 for luma
+// - Returns NULL if the data can not be decoded, free the result with free()
+unsigned char *jpeg_load_scaled(const unsigned char *data, int length, int denominator, int channels, int *width, int *height);
+
+#endif
@@ -5,269 +5,500 @@
 //
 // by ducktumn
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-#include <freetype2/ft2build.h>
-#include FT_FREETYPE_H
-
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image/stb_image_write.h"
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include "stb_image/stb_image_resize2.h"
-
-// Struct that represents a character and it's brightness value
-typedef struct character {
-    char character;
-    double value;
-} character;
-
-// Struct that represents a folder full of frames from a video
-// - All the frames are assumed to be the same dimension
-// - Height is the original frame height in the folder without any modifications
-typedef struct frame_folder {
-    char *folder_name_and_prefix;
-    int min_size_without_number;
-    char *extension;
-    int min_index_size;
-    int start;
-    int end;
-    int width;
-    int height;
-    int original_framerate;
-} frame_folder;
+
+#include "charset.h"
+#include "cpu_budget.h"
+#include "duckvideo.h"
+#include "frame_cache.h"
+#include "frame_hash.h"
+#include "frame_log.h"
+#include "governor.h"
+#include "perf_counters.h"
+#include "qoi.h"
+#include "source.h"
+#include "trace.h"
 
 // Functions used in this program
 
 int save_as_grayscale(const char *);
-unsigned char *get_character_bitmap(char, const char *, int *, int *);
-double get_average_brightness(unsigned char *, int);
-void sort_characters(character *, int);
-void scale_to_255(character *, int);
-unsigned char *get_image_as_grayscale(const char *, int *, int *, int);
-unsigned char *get_image_as_colored(const char *, int *, int *, int);
-char *turn_to_ascii(unsigned char *, character *, int, int, int);
-char *get_colored_character(char, int, int, int);
-int get_size(int);
-int get_closest_character_index(unsigned char, character *, int);
-int get_character_set(character[]);
-int print_image(char[], int, char *);
-char *get_colored_double_pixel(int, int, int, int, int, int);
-void get_colored_double_pixel_optimized(int, int, int, int, int, int, char *, char *, int *);
-void get_colored_character_optimized(char, int, int, int, char *, char *, int *);
-void play_folder(frame_folder, char *, int *, int, int);
-void calculate_lookup_table(character[], char *);
+int print_image(dv_context *, const char *, char *, size_t);
+void play_source(frame_source *, dv_context *, int *, int, int, int, frame_cache *, dv_context *, governor *, cpu_budget *);
+int render_next_rows(frame_source *, dv_context *, char *, size_t, int *, double *, double *);
+int skip_next_rows(frame_source *);
+void convert_folder_to_qoi(const frame_folder *, const char *);
+void open_file_source(frame_source *, const char *, int, int, int, int);
+void read_file_magic(const char *, char[4]);
+dv_context *create_context(dv_config *, dv_character[], void **);
+void print_usage(const char *);
 void print_timeline(int, int, int, int, char *);
+void print_hysteresis_report(const dv_hysteresis_stats *, long long, long long);
+void print_motion_report(const dv_motion_stats *);
+void print_static_report(const dv_static_stats *, double, double);
+void print_cpu_hud(const cpu_budget *);
+void set_render_stages(double *, const dv_stage_stats *, const dv_stage_stats *);
+void mark_stage(const char *, int);
+void print_perf_report(const dv_context *, const frame_source *);
+double get_cpu_seconds(void);
+double get_wall_seconds(void);
 
 // Default values for the current state of the program
 
-#define DEFAULT_FONT_PATH "assets/fonts/UbuntuMono.ttf"
-#define ASCII_STARTING_POINT 32
-#define ASCII_ENDING_POINT 126
-#define ASCII_CHARACTER_COUNT 95
-#define DEFAULT_CHARACTER_HEIGHT 22
-#define DEFAULT_CHARACTER_WIDTH 10
+#define DEFAULT_FOLDER_PATH "example_folder"
 #define FIRST_LINE_CODE "\033[H"
 #define CLEAR_CODE "\033[2J"
+#define SAVE_CURSOR_CODE "\0337"
+#define RESTORE_CURSOR_CODE "\0338"
 #define RED "\033[31m"
 #define RESET "\033[0m"
 #define GREEN "\033[32m"
 #define FULL_CLEAR "\033[2J\033[H"
-#define MAXIMUM_COLORED_CHARACTER_SIZE 25
-#define MAXIMUM_DOUBLE_PIXEL_SIZE 46
+#define SIXEL_PALETTE_REUSE 0
+#define PRELOAD_MAX_SOURCES 8
+#define HYSTERESIS_REFRESH 30
 
 // The font Ubunto Mono and the size 10x22 is default for now
+// - Without -i the example folder is played, -d plays another folder of frames
+// - With -i the frames are streamed from a file, a FIFO or stdin ("-")
+// - With -P the folder is packed into a single file
+// - With -f a frame pack, a Motion-JPEG AVI file or a GIF is played
+// - With -l a GIF or a preloaded video plays that many times (0 is forever)
+// - With -j playback starts from that frame (counting from 0)
+// - With -Q the folder is converted to QOI frames in another folder
+// - With -R frames are read from a shared memory ring (see ring_producer.c)
+// - With -b frames of streams and packs are read and resized a band of rows at a
+// time, memory then does not grow with the source resolution
+// - With -o the frames are drawn on a WIDTHxHEIGHT pixel grid, JPEG frames
+// are then decoded at the smallest 1/2, 1/4 or 1/8 size that still covers it
+// - With -k the files of that many next folder frames are read ahead through
+// io_uring (-K uses threads instead), read speed and latency are printed at the end
+// - With -M files and folders are decoded into memory in the background on every
+// core and kept compressed up to that many megabytes, frames after that are streamed
+// (GIFs are already decoded whole, they get one worker), with -k or -K every worker
+// reads ahead with a prefetcher of its own
+// - With -C up to that many megabytes of rendered frames are kept, loops and going
+// back to a frame then skip decoding and rendering (hits and misses are printed at the end)
+// - With -H luma[:color[:frames]] output pixels keep their last drawn value while they
+// change less than that, with -c the bytes it saved are measured and printed too
+// - With -S cells that stayed the same for that many frames are not converted or compared
+// until a sampled check sees them change, with -c the render CPU time it saved is printed too
+// - With -B the written bytes are kept under that many KB/s ("auto" measures how fast the terminal
+// takes them) by dropping color bits, using 256 colors, halving the pixel grid and skipping frames,
+// with -c every decision is saved to governor.csv
+// - With -F tent the pixel grid is resized with a tent filter (smoother, slower) instead of a box
+// - With -U playback stays under that percent of one core by turning down the knob of the
+// stage that costs the most (box filter, half the pixel grid, fewer drawn frames), the usage
+// and the level are shown next to the FPS and with -c saved to cpu.csv every second
+// - With -T decoding, the renderer stages, writes, sleeps and the queues of the reader
+// threads are traced into a Chrome trace JSON file that opens in Perfetto
+// - With -E hardware counters are read around decoding and the renderer stages on every
+// thread, IPC and misses per pixel or cell are printed at the end (if the kernel has them)
 int main(int argc, char *argv[]) {
     // Initial Setup
-    character ordered_set[ASCII_CHARACTER_COUNT] = {0};
-    get_character_set(ordered_set);
-    char lookup_table[256] = {0};
-    calculate_lookup_table(ordered_set, lookup_table);
-
-    // (path to the images without the number, size of the path string for any frame images excluding the numbers at the end, extension, minimum number length at the end, first frame, last frame, width, height, native fps)
-    frame_folder folder = {"example_folder/frame", 24, ".png", 3, 1, 6572, 288, 216, 30};
-    
-    play_folder(folder, lookup_table, NULL, -1, 0);
-    return 0;
-}
-
-// Assigns a character to each possible color value
-// - Example: If the brightness value is 139 then the assigned character is lookup_table[139]
-// - Assumes lookup_table has 256 spaces
-void calculate_lookup_table(character set[], char *lookup_table) {
-    for (int i = 0; i < 256; i++)
-        lookup_table[i] = set[get_closest_character_index(i, set, ASCII_CHARACTER_COUNT)].character;
-}
-
-// Prints the image in the original dimensions
-// - Color = -1 -> B&W
-// - Color = -2 -> Colored ASCII
-// - Color = -3 -> No Streching, Pixel by Pixel Display (Not ASCII)
-// - Color = Any Printable Character -> Colored Single Character
-int print_image(char lookup_table[], int color, char *path) {
-    int width, height;
-    char new_line = '\n';
-    if (color == -2) {
-        unsigned char *colored_image = get_image_as_colored(path, &height, &width, 1);
-
-        char *frame_buffer = (char *)malloc(height * (width + 1) * MAXIMUM_COLORED_CHARACTER_SIZE);
-        char *shared_buffer = (char *)malloc(MAXIMUM_COLORED_CHARACTER_SIZE);
-        if (!frame_buffer || !shared_buffer) {
-            fprintf(stderr, "Memory allocation failed in print_image()\n");
-            exit(1);
-        }
-        int size_of_buffer = 0;
-        for (int i = 0; i < height; i++) {
-            for (int j = 0; j < width; j++) {
-                int pixel_index = i * width * 3 + j * 3;
-                int red = colored_image[pixel_index];
-                int green = colored_image[pixel_index + 1];
-                int blue = colored_image[pixel_index + 2];
-
-                int gray_value = (red * 0.299) + (green * 0.587) + (blue * 0.114);
-                get_colored_character_optimized(lookup_table[gray_value],
-                                                red,
-                                                green,
-                                                blue,
-                                                shared_buffer,
-                                                &frame_buffer[size_of_buffer],
-                                                &size_of_buffer);
+    dv_character set[ASCII_CHARACTER_COUNT] = {0};
+    get_character_set(set);
+
+    // (mode, encoder, resize filter, source width, source height, output width, output height, sixel threads, sixel palette reuse,
+    // hysteresis luma, hysteresis color, hysteresis refresh, static frames, motion savings)
+    dv_config config = {-1, DV_ENCODER_TRUECOLOR, DV_FILTER_BOX, 0, 0, 0, 0, sysconf(_SC_NPROCESSORS_ONLN), SIXEL_PALETTE_REUSE, 0, 0, HYSTERESIS_REFRESH, 0, 0};
+    int framerate = 0, csv = 0, bands = 0;
+    char *stream_path = NULL, *ring_name = NULL, *pack_path = NULL, *pack_output = NULL, *qoi_output = NULL, *trace_path = NULL;
+    char *folder_path = DEFAULT_FOLDER_PATH;
+    int raw_width = 0, raw_height = 0, raw_channels = 3;
+    int start_frame = 0, loops = 1;
+    int read_ahead = 0, use_uring = 1;
+    size_t preload_budget = 0, cache_budget = 0;
+    int use_governor = 0, use_perf = 0;
+    double governor_budget = 0, cpu_target = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "m:e:r:ci:R:s:p:f:d:P:Q:j:l:o:k:K:M:C:H:S:B:F:U:T:Ebh")) != -1) {
+        switch (option) {
+        case 'm':
+            config.mode = (optarg[0] == '-' && optarg[1] != '\0') ? atoi(optarg) : optarg[0];
+            break;
+        case 'e':
+            config.encoder = atoi(optarg);
+            break;
+        case 'r':
+            framerate = atoi(optarg);
+            break;
+        case 'c':
+            csv = 1;
+            break;
+        case 'i':
+            stream_path = optarg;
+            break;
+        case 'R':
+            ring_name = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &raw_width, &raw_height) != 2 || raw_width < 1 || raw_height < 1) {
+                print_usage(argv[0]);
+                exit(1);
             }
-            frame_buffer[size_of_buffer] = '\n';
-            size_of_buffer++;
-        }
-        write(1, frame_buffer, size_of_buffer);
-
-        free(shared_buffer);
-        free(frame_buffer);
-        free(colored_image);
-    } else if (color == -1) {
-        unsigned char *gray_image = get_image_as_grayscale(path, &height, &width, 1);
-        char *image_buffer = (char *)malloc((width + 1) * height);
-        if (!image_buffer) {
-            fprintf(stderr, "Memory allocation failed in print_image()\n");
-            exit(1);
-        }
-        for (int i = 0; i < height; i++) {
-            for (int j = 0; j < width; j++) {
-                image_buffer[(i * (width + 1) + j)] = lookup_table[gray_image[i * width * 3 + j * 3]];
+            break;
+        case 'p':
+            if (strcmp(optarg, "rgb24") == 0)
+                raw_channels = 3;
+            else if (strcmp(optarg, "gray") == 0)
+                raw_channels = 1;
+            else {
+                print_usage(argv[0]);
+                exit(1);
             }
-            image_buffer[(i + 1) * (width + 1) - 1] = '\n';
-        }
-        write(1, image_buffer, (width + 1) * height);
-        free(gray_image);
-        free(image_buffer);
-    } else if (color == -3) {
-        unsigned char *colored_image = get_image_as_colored(path, &height, &width, 0);
-        char *shared_buffer = (char *)malloc(MAXIMUM_DOUBLE_PIXEL_SIZE);
-        char *frame_buffer = (char *)malloc((height / 2) * (width + 1) * MAXIMUM_DOUBLE_PIXEL_SIZE);
-        if (!frame_buffer || !shared_buffer) {
-            fprintf(stderr, "Memory allocation failed in print_image()\n");
-            exit(1);
-        }
-        int size_of_buffer = 0;
-        for (int i = 0; i < height / 2; i++) {
-            int upper_index = i * 6 * width;
-            int lower_index = (i * 2 + 1) * width * 3;
-            for (int j = 0; j < width; j++) {
-                if (lower_index >= ((height - 1) * width * 3)) {
-                    get_colored_double_pixel_optimized(colored_image[upper_index + j * 3],
-                                                       colored_image[upper_index + j * 3 + 1],
-                                                       colored_image[upper_index + j * 3 + 2],
-                                                       0,
-                                                       0,
-                                                       0,
-                                                       shared_buffer,
-                                                       &frame_buffer[size_of_buffer],
-                                                       &size_of_buffer);
-
-                }
-
-                else {
-                    get_colored_double_pixel_optimized(colored_image[upper_index + j * 3],
-                                                       colored_image[upper_index + j * 3 + 1],
-                                                       colored_image[upper_index + j * 3 + 2],
-                                                       colored_image[lower_index + j * 3],
-                                                       colored_image[lower_index + j * 3 + 1],
-                                                       colored_image[lower_index + j * 3 + 2],
-                                                       shared_buffer,
-                                                       &frame_buffer[size_of_buffer],
-                                                       &size_of_buffer);
+            break;
+        case 'f':
+            pack_path = optarg;
+            break;
+        case 'd':
+            folder_path = optarg;
+            break;
+        case 'P':
+            pack_output = optarg;
+            break;
+        case 'Q':
+            qoi_output = optarg;
+            break;
+        case 'j':
+            start_frame = atoi(optarg);
+            break;
+        case 'l':
+            loops = atoi(optarg);
+            break;
+        case 'o':
+            if (sscanf(optarg, "%dx%d", &config.output_width, &config.output_height) != 2 || config.output_width < 1 || config.output_height < 1) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'b':
+            bands = 1;
+            break;
+        case 'k':
+        case 'K':
+            read_ahead = atoi(optarg);
+            use_uring = option == 'k';
+            break;
+        case 'M':
+            if (atoi(optarg) < 1) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            preload_budget = (size_t)atoi(optarg) << 20;
+            break;
+        case 'C':
+            if (atoi(optarg) < 1) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            cache_budget = (size_t)atoi(optarg) << 20;
+            break;
+        case 'H':
+            // Without a color distance hue changes of the same brightness would be held too
+            config.hysteresis_color = -1;
+            if (sscanf(optarg, "%d:%d:%d", &config.hysteresis_luma, &config.hysteresis_color, &config.hysteresis_refresh) < 1 ||
+                config.hysteresis_luma < 1 || config.hysteresis_color < -1 || config.hysteresis_refresh < 0 || config.hysteresis_refresh > 255) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            if (config.hysteresis_color == -1)
+                config.hysteresis_color = config.hysteresis_luma * 2;
+            break;
+        case 'S':
+            config.static_frames = atoi(optarg);
+            if (config.static_frames < 1 || config.static_frames > 255) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'B':
+            use_governor = 1;
+            if (strcmp(optarg, "auto") != 0) {
+                governor_budget = atof(optarg) * 1000;
+                if (governor_budget <= 0) {
+                    print_usage(argv[0]);
+                    exit(1);
                 }
             }
-            frame_buffer[size_of_buffer] = '\n';
-            size_of_buffer++;
+            break;
+        case 'F':
+            if (strcmp(optarg, "box") == 0)
+                config.filter = DV_FILTER_BOX;
+            else if (strcmp(optarg, "tent") == 0)
+                config.filter = DV_FILTER_TENT;
+            else {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'U':
+            cpu_target = atof(optarg) / 100;
+            if (cpu_target <= 0 || cpu_target > 1) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'E':
+            use_perf = 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(option == 'h' ? 0 : 1);
         }
+    }
 
-        write(1, frame_buffer, size_of_buffer);
-        free(frame_buffer);
-        free(shared_buffer);
-        free(colored_image);
+    // Both switch between contexts of their own
+    if (use_governor && cpu_target > 0) {
+        print_usage(argv[0]);
+        exit(1);
+    }
 
-    } else {
-        if ((color >= ASCII_ENDING_POINT) || (color <= ASCII_STARTING_POINT)) {
-            fprintf(stderr, "ASCII out of bound in print_image()\n");
-            exit(1);
+    frame_folder folder;
+    int use_folder = !stream_path && !ring_name && !pack_path;
+    if (use_folder || pack_output || qoi_output)
+        open_frame_folder(&folder, folder_path, framerate);
+    if (pack_output || qoi_output) {
+        if (pack_output)
+            write_frame_pack(&folder, pack_output);
+        else
+            convert_folder_to_qoi(&folder, qoi_output);
+        close_frame_folder(&folder);
+        return 0;
+    }
+    // Trace is opened before the sources start their threads
+    if (trace_path) {
+        trace_open(trace_path);
+        TRACE_THREAD("player");
+    }
+    // Without hardware counters playback goes on, only the reason is printed
+    if (use_perf)
+        use_perf = perf_counters_open();
+
+    void *scratch;
+    dv_context *context;
+    frame_source source;
+    int channels = config.mode == DV_MODE_GRAYSCALE ? 1 : 3;
+    if (stream_path)
+        open_stream_source(&source, stream_path, config.mode == DV_MODE_GRAYSCALE, raw_width, raw_height, raw_channels, framerate);
+    else if (ring_name)
+        open_shm_source(&source, ring_name);
+    else if (preload_budget) {
+        // Every worker decodes with its own copy of the source, the preload source loops them itself
+        frame_source sources[PRELOAD_MAX_SOURCES];
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        int source_count = cores < 1 ? 1 : cores > PRELOAD_MAX_SOURCES ? PRELOAD_MAX_SOURCES : cores;
+        // A GIF is decoded whole when it is opened, more copies would only decode it again
+        char magic[4];
+        if (pack_path) {
+            read_file_magic(pack_path, magic);
+            if (memcmp(magic, "GIF8", 4) == 0)
+                source_count = 1;
         }
-
-        unsigned char *colored_image = get_image_as_colored(path, &height, &width, 1);
-        char *shared_buffer = (char *)malloc(MAXIMUM_COLORED_CHARACTER_SIZE);
-        char *frame_buffer = (char *)malloc(height * (width + 1) * MAXIMUM_COLORED_CHARACTER_SIZE);
-        if (!frame_buffer || !shared_buffer) {
-            fprintf(stderr, "Memory allocation failed in print_image()\n");
-            exit(1);
+        for (int i = 0; i < source_count; i++) {
+            if (pack_path)
+                open_file_source(&sources[i], pack_path, channels, 1, config.output_width, config.output_height);
+            else
+                open_folder_source(&sources[i], &folder, channels, config.output_width, config.output_height, read_ahead, use_uring);
         }
-        int size_of_buffer = 0;
-        for (int i = 0; i < height; i++) {
-            for (int j = 0; j < width; j++) {
-                int pixel_index = i * width * 3 + j * 3;
-                get_colored_character_optimized(color,
-                                                colored_image[pixel_index],
-                                                colored_image[pixel_index + 1],
-                                                colored_image[pixel_index + 2],
-                                                shared_buffer,
-                                                &frame_buffer[size_of_buffer],
-                                                &size_of_buffer);
+        open_preload_source(&source, sources, source_count, preload_budget, loops);
+    } else if (pack_path)
+        open_file_source(&source, pack_path, channels, loops, config.output_width, config.output_height);
+    else
+        open_folder_source(&source, &folder, channels, config.output_width, config.output_height, read_ahead, use_uring);
+    if (start_frame && (!source.seek || source.seek(&source, start_frame) != 0)) {
+        fprintf(stderr, "Could not start from frame %d in main()\n", start_frame);
+        exit(1);
+    }
+    config.source_width = source.width;
+    config.source_height = source.height;
+    // With -c the scroll encoder also counts what plain delta output would have been
+    config.motion_savings = csv;
+    context = create_context(&config, set, &scratch);
+    // Palette reuse, hysteresis, masking and the budgets make a frame depend on every frame before it, those are not cached
+    frame_cache cache;
+    int use_cache = cache_budget && !(config.mode == DV_MODE_SIXEL && config.sixel_palette_reuse) && !config.hysteresis_luma &&
+                    !config.static_frames && !use_governor && cpu_target == 0;
+    if (use_cache)
+        frame_cache_init(&cache, cache_budget);
+    else if (cache_budget) {
+        const char *reason = config.hysteresis_luma ? "-H" : config.static_frames ? "-S" : use_governor ? "-B" : cpu_target ? "-U" : "sixel palette reuse";
+        fprintf(stderr, "-C is turned off, with %s a frame depends on the frames before it\n", reason);
+    }
+    // With -c the frames are also rendered without hysteresis and masking to measure what they saved
+    void *unfiltered_scratch = NULL;
+    dv_context *unfiltered = NULL;
+    if (csv && (config.hysteresis_luma || config.static_frames)) {
+        dv_config unfiltered_config = config;
+        unfiltered_config.hysteresis_luma = 0;
+        unfiltered_config.static_frames = 0;
+        unfiltered = create_context(&unfiltered_config, set, &unfiltered_scratch);
+    }
+    // Governor and CPU budget also draw on a pixel grid of half the size, the CPU budget
+    // also with the box filter if the tent filter is used ([half size][box filter])
+    governor governor;
+    cpu_budget budget;
+    dv_context *contexts[2][2] = {{context, NULL}, {NULL, NULL}};
+    void *scratches[2][2] = {{NULL, NULL}, {NULL, NULL}};
+    if (use_governor || cpu_target > 0) {
+        for (int half = 0; half < 2; half++) {
+            for (int box = 0; box < 2; box++) {
+                if ((!half && !box) || (box && (use_governor || config.filter == DV_FILTER_BOX)))
+                    continue;
+                dv_config other_config = config;
+                if (half) {
+                    other_config.output_width = ((config.output_width ? config.output_width : source.width) + 1) / 2;
+                    other_config.output_height = ((config.output_height ? config.output_height : source.height) + 1) / 2;
+                }
+                if (box)
+                    other_config.filter = DV_FILTER_BOX;
+                contexts[half][box] = create_context(&other_config, set, &scratches[half][box]);
             }
-            frame_buffer[size_of_buffer] = '\n';
-            size_of_buffer++;
         }
-
-        write(1, frame_buffer, size_of_buffer);
-        free(shared_buffer);
-        free(frame_buffer);
-        free(colored_image);
+    }
+    if (use_governor)
+        governor_init(&governor, governor_budget, context, contexts[1][0], config.encoder, csv ? "governor.csv" : NULL);
+    if (cpu_target > 0)
+        cpu_budget_init(&budget, cpu_target, contexts, csv ? "cpu.csv" : NULL);
+    play_source(&source, context, framerate ? &framerate : NULL, csv, bands, start_frame, use_cache ? &cache : NULL, unfiltered,
+                use_governor ? &governor : NULL, cpu_target > 0 ? &budget : NULL);
+    if (use_cache) {
+        frame_cache_report(&cache, stderr);
+        frame_cache_close(&cache);
+    }
+    if (use_governor) {
+        governor_report(&governor, stderr);
+        governor_close(&governor);
+    }
+    if (cpu_target > 0) {
+        cpu_budget_report(&budget, stderr);
+        cpu_budget_close(&budget);
+    }
+    source.close(&source);
+    if (use_folder)
+        close_frame_folder(&folder);
+    if (trace_path) {
+        trace_close();
+        trace_report(stderr);
+    }
+    if (use_perf) {
+        perf_counters_close();
+        print_perf_report(context, &source);
     }
 
-    fflush(stdout);
+    free(context);
+    free(scratch);
+    free(unfiltered);
+    free(unfiltered_scratch);
+    for (int i = 1; i < 4; i++) {
+        free(contexts[i / 2][i % 2]);
+        free(scratches[i / 2][i % 2]);
+    }
     return 0;
 }
 
-// Gets you a set of Character - Value pairs that
-// represents the brightness value for each ASCII character
-// and also scaled up to 255
-int get_character_set(character set[]) {
-    int width, height;
-    for (int i = ASCII_STARTING_POINT; i < ASCII_ENDING_POINT + 1; i++) {
-        unsigned char *bitmap = get_character_bitmap(i, DEFAULT_FONT_PATH, &width, &height);
-        int size = width * height;
-        double avg = get_average_brightness(bitmap, size);
-        avg = avg * size / (DEFAULT_CHARACTER_HEIGHT * DEFAULT_CHARACTER_WIDTH);
-        set[i - 32].character = i;
-        set[i - 32].value = avg;
-        free(bitmap);
+// Creates a renderer for the config, exits if the config is not valid
+// - Scratch memory is returned through scratch_out and has to be freed with the context
+dv_context *create_context(dv_config *config, dv_character set[], void **scratch_out) {
+    size_t scratch_size = dv_scratch_size(config);
+    void *scratch = malloc(scratch_size);
+    dv_context *context = (dv_context *)malloc(sizeof(dv_context));
+    if (!scratch || !context) {
+        fprintf(stderr, "Memory allocation failed in create_context()\n");
+        exit(1);
+    }
+    int error = dv_context_init(context, config, set, ASCII_CHARACTER_COUNT, scratch, scratch_size);
+    if (error) {
+        fprintf(stderr, "Could not create the renderer in create_context(): %s\n", dv_error_string(error));
+        exit(1);
     }
+    if (TRACE_ENABLED || PERF_ENABLED)
+        dv_set_trace_hook(context, mark_stage);
+    *scratch_out = scratch;
+    return context;
+}
 
-    sort_characters(set, ASCII_CHARACTER_COUNT);
-    scale_to_255(set, ASCII_CHARACTER_COUNT);
+void print_usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-m mode] [-e encoder] [-r fps] [-c] [-i input [-s WIDTHxHEIGHT] [-p rgb24|gray]] [-R ring] [-f file] [-d folder] [-j frame] [-l loops] [-o WIDTHxHEIGHT] [-b] [-k depth] [-M megabytes] [-C megabytes] [-H luma[:color[:frames]]] [-S frames] [-B KB/s|auto] [-F box|tent] [-U percent] [-T trace.json] [-E] [-P pack] [-Q folder]\n"
+            "  -m  -1 B&W, -2 colored ASCII, -3 pixels, -4 sixel or a single character\n"
+            "  -e  0 truecolor, 1 256 colors, 2 delta, 3 REP, 4 delta that scrolls and pans the screen, 5 delta with 256 colors\n"
+            "  -r  framerate, default is the one of the video\n"
+            "  -c  save frametime.csv with the stages of every frame, print percentiles at the end\n"
+            "  -i  YUV4MPEG2 stream, \"-\" for stdin (ffmpeg -i video.mp4 -f yuv4mpegpipe -)\n"
+            "  -s  size of a headerless raw stream instead of YUV4MPEG2\n"
+            "  -p  pixel format of the raw stream\n"
+            "  -R  play from a shared memory frame ring (./ring_producer /duckring 288x216)\n"
+            "  -f  play a frame pack, a Motion-JPEG AVI file or a GIF\n"
+            "  -d  folder of numbered frames to play, pack or convert (default " DEFAULT_FOLDER_PATH ")\n"
+            "  -j  start from this frame (not for streams)\n"
+            "  -l  how many times a GIF or a preloaded video plays, 0 is forever (default 1)\n"
+            "  -o  size of the drawn pixel grid, JPEG frames are decoded at a smaller size if they can be\n"
+            "  -b  read streams and packs a few rows at a time (for very big frames)\n"
+            "  -k  read the files of this many next folder frames ahead with io_uring (-K with threads)\n"
+            "  -M  decode the file or the folder into at most this many megabytes of memory first, loops stay smooth\n"
+            "      (one worker per core, GIFs one; with -k/-K every worker reads ahead on its own)\n"
+            "  -C  keep this many megabytes of rendered frames, repeated loops only write them\n"
+            "  -H  do not draw pixels that changed less than this brightness (and RGB distance), redraw after frames (default 30)\n"
+            "  -S  stop converting cells that stayed the same for this many frames until they change (1-255)\n"
+            "  -B  keep the output under this many KB/s, \"auto\" measures how fast the terminal takes it\n"
+            "  -F  filter that resizes to the pixel grid (default box)\n"
+            "  -U  keep playback under this percent of one core\n"
+            "  -T  save what every thread does as Chrome trace JSON (open it in Perfetto)\n"
+            "  -E  count cycles, instructions, cache and branch misses of every stage with perf_event_open\n"
+            "  -P  pack the folder into a single file and exit\n"
+            "  -Q  convert the folder to QOI frames in another folder and exit\n",
+            name);
+}
 
-    return 0;
+// Prints the image using the mode of the context
+// - Frame buffer should have at least dv_output_capacity() bytes
+// - Returns the amount of bytes written
+int print_image(dv_context *context, const char *path, char *frame_buffer, size_t frame_buffer_size) {
+    int width, height, channels;
+    int wanted_channels = (context->config.mode == DV_MODE_GRAYSCALE) ? 1 : 3;
+    TRACE_BEGIN("stbi_load");
+    unsigned char *img = stbi_load(path, &width, &height, &channels, wanted_channels);
+    TRACE_END("stbi_load");
+    if (!img) {
+        fprintf(stderr, "Could not load %s in print_image()\n", path);
+        exit(1);
+    }
+
+    int size_of_buffer;
+    if (wanted_channels == 1)
+        size_of_buffer = dv_render_luma(context, img, width, height, 0, frame_buffer, frame_buffer_size);
+    else
+        size_of_buffer = dv_render_rgb(context, img, width, height, 0, frame_buffer, frame_buffer_size);
+    if (size_of_buffer < 0) {
+        fprintf(stderr, "Could not render %s in print_image(): %s\n", path, dv_error_string(size_of_buffer));
+        exit(1);
+    }
+
+    TRACE_BEGIN("write");
+    write(1, frame_buffer, size_of_buffer);
+    TRACE_END("write");
+    stbi_image_free(img);
+    return size_of_buffer;
 }
 
 // Saves the grayscale version of the image as a .png file
@@ -305,385 +536,119 @@ int save_as_grayscale(const char *path_to_file) {
     return 0;
 }
 
-// Returns the image bitmap as grayscale
-// - You can resize to half the length if you want
-// - Returns a bitmap in RGB format
-unsigned char *get_image_as_grayscale(const char *path_to_file, int *height, int *width, int shortened) {
-    int channels;
-    unsigned char *img = stbi_load(path_to_file, width, height, &channels, 3);
-    if (!img) {
-        fprintf(stderr, "Memory allocation failed in get_image_as_grayscale()\n");
-        exit(1);
-    }
-    int size = *height * *width * 3;
-    for (int i = 0; i < *width * *height; i++) {
-        unsigned char red = img[i * 3];
-        unsigned char green = img[i * 3 + 1];
-        unsigned char blue = img[i * 3 + 2];
-
-        unsigned char gray = (0.299 * red) + (0.587 * green) + (0.114 * blue);
-
-        img[i * 3] = gray;
-        img[i * 3 + 1] = gray;
-        img[i * 3 + 2] = gray;
-    }
-    if (shortened) {
-        unsigned char *resized_img = (unsigned char *)malloc(*width * (*height / 2) * 3);
-        if (!resized_img) {
-            fprintf(stderr, "Memory allocation failed in get_image_as_grayscale()\n");
-            exit(1);
-        }
-        stbir_resize_uint8_srgb(
-            img, *width, *height, 0,
-            resized_img, *width, *height / 2, 0,
-            STBIR_RGB);
-
-        *height /= 2;
-        stbi_image_free(img);
-        return resized_img;
-    }
-
-    unsigned char *copy = (unsigned char *)malloc(size);
-    if (!copy) {
-        fprintf(stderr, "Memory allocation failed in get_image_as_grayscale()\n");
-        exit(1);
-    }
-    memcpy(copy, img, size);
-    stbi_image_free(img);
-    return copy;
+// Opens a frame pack, a Motion-JPEG AVI file or a GIF, the first bytes tell which one
+// - Loops is only used for GIFs, min size only for AVI files
+void open_file_source(frame_source *source, const char *path, int channels, int loops, int min_width, int min_height) {
+    char magic[4];
+    read_file_magic(path, magic);
+    if (memcmp(magic, "RIFF", 4) == 0)
+        open_avi_source(source, path, channels, min_width, min_height);
+    else if (memcmp(magic, "GIF8", 4) == 0)
+        open_gif_source(source, path, channels, loops);
+    else
+        open_pack_source(source, path, channels);
 }
 
-// Returns the image bitmap
-// - You can resize to half the length if you want
-// - Returns a bitmap in RGB format
-unsigned char *get_image_as_colored(const char *path_to_file, int *height, int *width, int shortened) {
-    int channels;
-    unsigned char *img = stbi_load(path_to_file, width, height, &channels, 3);
-    if (!img) {
-        fprintf(stderr, "Memory allocation failed in get_image_as_colored()\n");
+// Reads the first 4 bytes of a file, the rest is 0 if it is shorter
+void read_file_magic(const char *path, char magic[4]) {
+    memset(magic, 0, 4);
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s in read_file_magic()\n", path);
         exit(1);
     }
-    int size = *height * *width * 3;
-
-    if (shortened) {
-        unsigned char *resized_img = (unsigned char *)malloc(*width * (*height / 2) * 3);
-        if (!resized_img) {
-            fprintf(stderr, "Memory allocation failed in get_image_as_colored()\n");
-            exit(1);
-        }
-
-        stbir_resize_uint8_srgb(
-            img, *width, *height, 0,
-            resized_img, *width, *height / 2, 0,
-            STBIR_RGB);
-
-        stbi_image_free(img);
-
-        *height /= 2;
-        return resized_img;
-    }
-
-    unsigned char *copy = (unsigned char *)malloc(size);
-    if (!copy) {
-        fprintf(stderr, "Memory allocation failed in get_image_as_colored()\n");
-        exit(1);
-    }
-    memcpy(copy, img, size);
-    stbi_image_free(img);
-    return copy;
+    fread(magic, 1, 4, file);
+    fclose(file);
 }
 
-// Returns the character glyph bitmap based on a font
-unsigned char *get_character_bitmap(char character, const char *font_path, int *width_out, int *height_out) {
-    FT_Library library;
-    FT_Face face;
-
-    if (FT_Init_FreeType(&library)) {
-        fprintf(stderr, "Could not initialize FreeType library in get_character_bitmap()\n");
-        FT_Done_Face(face);
-        FT_Done_FreeType(library);
+// Saves every frame of the folder into another folder as a QOI image
+// - Names stay the same apart from the extension, so the order does not change
+void convert_folder_to_qoi(const frame_folder *folder, const char *output_folder) {
+    if (mkdir(output_folder, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create the folder %s in convert_folder_to_qoi()\n", output_folder);
         exit(1);
     }
-
-    if (FT_New_Face(library, font_path, 0, &face)) {
-        fprintf(stderr, "Could not load font in get_character_bitmap()\n");
-        FT_Done_Face(face);
-        FT_Done_FreeType(library);
+    int directory = open(output_folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    unsigned char *encoded = (unsigned char *)malloc(qoi_max_size(folder->width, folder->height));
+    unsigned char *file = NULL;
+    size_t file_capacity = 0;
+    char name[NAME_MAX + 1];
+    if (directory < 0 || !encoded) {
+        fprintf(stderr, "Could not open the folder %s in convert_folder_to_qoi()\n", output_folder);
         exit(1);
     }
 
-    FT_Set_Pixel_Sizes(face, 0, 22);
-
-    if (FT_Load_Char(face, character, FT_LOAD_RENDER)) {
-        fprintf(stderr, "Could not load character in get_character_bitmap()\n");
-        FT_Done_Face(face);
-        FT_Done_FreeType(library);
-        exit(1);
-    }
-
-    FT_Bitmap bitmap = face->glyph->bitmap;
-
-    int width = bitmap.width;
-    int height = bitmap.rows;
-    int pitch = bitmap.pitch;
-
-    unsigned char *buffer = malloc(width * height);
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed in get_character_bitmap()\n");
-        FT_Done_Face(face);
-        FT_Done_FreeType(library);
-        exit(1);
-    }
-
-    for (int y = 0; y < height; y++) {
-        memcpy(buffer + y * width, bitmap.buffer + y * pitch, width);
-    }
-
-    if (width_out)
-        *width_out = width;
-    if (height_out)
-        *height_out = height;
-
-    FT_Done_Face(face);
-    FT_Done_FreeType(library);
-
-    return buffer;
-}
-
-// Returns the average value of each pixel in a characters glyph
-double get_average_brightness(unsigned char *bitmap, int size) {
-    double total = 0;
-    for (int i = 0; i < size; i++)
-        total += bitmap[i];
-    if (size == 0)
-        return 0;
-    else
-        return (total / size);
-}
-
-// Sorts the character set based on
-// their brigtness levels using Bubble Sort
-void sort_characters(character *set, int size) {
-    int changes_made = 1;
-    while (changes_made) {
-        changes_made = 0;
-        for (int i = 0; i < size - 1; i++) {
-            if ((set + i)->value > (set + i + 1)->value) {
-                char swap_c = (set + i)->character;
-                double swap_d = (set + i)->value;
-                (set + i)->character = (set + i + 1)->character;
-                (set + i)->value = (set + i + 1)->value;
-                (set + i + 1)->value = swap_d;
-                (set + i + 1)->character = swap_c;
-                changes_made++;
-            }
-        }
-    }
-}
-
-// - The original ASCII list usually has numbers between 0-150
-// - Each pixel can have a value between 0-255
-// - To make matching easier this function scales all the values
-// - At the end the maximum value is 255
-void scale_to_255(character *set, int size) {
-    double multiplier = 255.0 / set[size - 1].value;
-    for (int i = 0; i < size; i++) {
-        set[i].value *= multiplier;
-    }
-}
-
-// Turns all the values in the bitmap into ASCII art string
-// - Assumes the image is grayscale/single channel (Red=Green=Blue)
-char *turn_to_ascii(unsigned char *gray_img, character *set, int set_size, int width, int height) {
-    char *return_ascii = (char *)malloc(width * height);
-    if (!return_ascii) {
-        fprintf(stderr, "Memory allocation failed in turn_to_ascii()\n");
-        exit(1);
-    }
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            unsigned char pixel_value = gray_img[i * width * 3 + j * 3];
-            return_ascii[i * width + j] = set[get_closest_character_index(pixel_value, set, set_size)].character;
+    for (int i = 0; i < folder->count; i++) {
+        int width, height, channels;
+        size_t length = read_folder_frame(folder, i, &file, &file_capacity);
+        unsigned char *image = stbi_load_from_memory(file, length, &width, &height, &channels, 3);
+        if (!image) {
+            fprintf(stderr, "Could not load %s in convert_folder_to_qoi()\n", get_folder_frame_name(folder, i));
+            exit(1);
         }
-    }
-    return return_ascii;
-}
-
-// Takes a brightness value and matches it with
-// the closest character in the ASCII set using Linear Search
-int get_closest_character_index(unsigned char value, character *set, int set_size) {
-    int closest_index = set_size - 1;
-    double latest_difference = 255.0 - value;
-
-    for (int i = set_size - 2; i >= 0; i--) {
-        double temp_difference = abs(set[i].value - value);
-        if (temp_difference > latest_difference)
-            break;
-        else {
-            closest_index = i;
-            latest_difference = temp_difference;
+        size_t size = qoi_encode(image, width, height, encoded);
+        stbi_image_free(image);
+
+        const char *original = get_folder_frame_name(folder, i);
+        size_t base_length = strlen(original) - strlen(folder->extension);
+        memcpy(name, original, base_length);
+        strcpy(name + base_length, ".qoi");
+        int fd = openat(directory, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        FILE *output = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (!output || fwrite(encoded, 1, size, output) != size || fclose(output) != 0) {
+            fprintf(stderr, "Could not write %s in convert_folder_to_qoi()\n", name);
+            exit(1);
         }
     }
-
-    return closest_index;
-}
-
-// Turns a single character into a collection of escape codes that
-// will print the character in that color if terminal supports it
-char *get_colored_character(char character, int red, int green, int blue) {
-    int total_size = 13 + get_size(red) + get_size(green) + get_size(blue) + 3;
-    char *string = (char *)malloc(total_size);
-    if (!string) {
-        fprintf(stderr, "Memory allocation failed in get_colored_character()\n");
-        exit(1);
-    }
-
-    // Start the ANSI escape sequence
-    string[0] = '\033';
-    string[1] = '[';
-    string[2] = '3';
-    string[3] = '8';
-    string[4] = ';';
-    string[5] = '2';
-    string[6] = ';';
-
-    int current_index = 7;
-
-    // Turn RGB values to string and append it
-    current_index += sprintf(&string[current_index], "%d;", red);
-    current_index += sprintf(&string[current_index], "%d;", green);
-    current_index += sprintf(&string[current_index], "%d", blue);
-
-    // End the color sequence
-    string[current_index] = 'm';
-    current_index++;
-
-    // Append the character to the string
-    string[current_index] = character;
-    current_index++;
-
-    // Add the reset escape sequence
-    string[current_index] = '\033';
-    string[current_index + 1] = '[';
-    string[current_index + 2] = '0';
-    string[current_index + 3] = 'm';
-    string[current_index + 4] = '\0';
-
-    return string;
+    close(directory);
+    free(encoded);
+    free(file);
 }
 
-// Writes the related string to the buffer starting from that location
-// - Increases the total string size accordingly
-// - Assumes enough space is present
-// - For the safest way of using it allocate 25*"Amount of Calls" bytes of memory
-void get_colored_character_optimized(char character, int red, int green, int blue, char *temp_buffer, char *buffer_out, int *string_size) {
-    sprintf(temp_buffer, "\033[38;2;%d;%d;%dm%c\033[0m", red, green, blue, character);
-    int size = strlen(temp_buffer);
-    memcpy(buffer_out, temp_buffer, size);
-    *string_size += size;
-}
-
-// Instead of using an ASCII character this function uses
-// an upper half square character from UTF-8.
-// - Background is the lower pixel
-// - Text color is the upper pixel
-// - Returns two pixels in one character
-char *get_colored_double_pixel(int red_u, int green_u, int blue_u, int red_l, int green_l, int blue_l) {
-    int total_size = get_size(red_u) + get_size(green_u) + get_size(blue_u) +
-                     get_size(red_l) + get_size(green_l) + get_size(blue_l) + 28;
-    char *string = (char *)malloc(total_size);
-    if (!string) {
-        fprintf(stderr, "Memory allocation failed in get_colored_double_pixel()\n");
-        exit(1);
-    }
-
-    int current_index = 0;
-
-    // Foreground color
-    current_index += sprintf(&string[current_index], "\033[38;2;%d;%d;%dm", red_u, green_u, blue_u);
-
-    // Background color
-    current_index += sprintf(&string[current_index], "\033[48;2;%d;%d;%dm", red_l, green_l, blue_l);
-
-    // Upper half block character
-    current_index += sprintf(&string[current_index], "\xE2\x96\x80");
-
-    // Reset formatting
-    current_index += sprintf(&string[current_index], "\033[0m");
-
-    string[current_index] = '\0';
-
-    return string;
-}
-
-// Writes the related string to the buffer starting from that location
-// - Increases the total string size accordingly
-// - Assumes enough space is present
-// - For the safest way of using it allocate 46*"Amount of Calls" bytes of memory
-void get_colored_double_pixel_optimized(int red_u, int green_u, int blue_u, int red_l, int green_l, int blue_l, char *temp_buffer, char *buffer_out, int *string_size) {
-    sprintf(temp_buffer, "\033[38;2;%d;%d;%dm\033[48;2;%d;%d;%dm\xE2\x96\x80\033[0m", red_u, green_u, blue_u, red_l, green_l, blue_l);
-    int size = strlen(temp_buffer);
-    memcpy(buffer_out, temp_buffer, size);
-    *string_size += size;
-}
-
-// Returns the size of a number excluding the leading zeros
-// - ex. 0012 -> 2, 0000 -> 1
-int get_size(int number) {
-    int size = 0;
-    while (number != 0) {
-        number /= 10;
-        size++;
-    }
-    if (size == 0) {
-        return 1;
-    }
-    return size;
-}
-
-// Tries to play a folder full of frames in a spesific framerate
-// - Mode parameter is the same as the print_image function
-// - Expects a frame_folder object that is initialized correctly
-// - Plays frames from folderx/frame000.png to folderx/frame1111.png 
-// - Saves a frametime.csv file for framatime analyzing if needed
-// - If framerate is NULL then the original framerate from the folder will be used
-// - Assumes:
-// All parameters are correct
-// Dimensions are consistent
-void play_folder(frame_folder folder, char lookup_table[], int *framerate_target, int mode, int csv) {
-    char *folder_name_and_prefix = folder.folder_name_and_prefix;
-    int min_size_without_number = folder.min_size_without_number;
-    char *extension = folder.extension;
-    int minimum_index_size = folder.min_index_size;
-    int start = folder.start;
-    int end = folder.end;
-    int width = folder.width;
-    int height = folder.height;
+// Plays every frame of a source in a spesific framerate
+// - Context decides the mode, the encoder and the output size
+// - Saves a frametime.csv file for framatime analyzing if needed, it has the time of every
+// stage, the bytes, what happened to the frame and how late it was shown, p50/p90/p99/max
+// of every stage are printed at the end
+// - If framerate is NULL then the framerate (or the frame delays) of the source will be used
+// - Timelines are only shown if the source knows its frame count
+// - If bands is 1 and the source can give rows, frames are rendered band by band
+// - Frames that hash the same as the one before are not rendered or written again,
+// how many were skipped is printed at the end
+// - First frame is the index of the frame the source gives first
+// - With a cache, rendered frames of sources that can seek are kept and a frame that
+// is found is written without reading it from the source (NULL for no cache)
+// - Unfiltered is a context without hysteresis and masking that renders every frame
+// again only to count the bytes and the render CPU time they saved (NULL to not count them)
+// - With a governor it picks the context of every rendered frame or skips it (NULL for no governor)
+// - With a CPU budget it picks the context of every frame or leaves it out, left out frames
+// of sources that can seek are not even decoded (NULL for no CPU budget)
+void play_source(frame_source *source, dv_context *context, int *framerate_target, int csv, int bands, int first_frame, frame_cache *cache,
+                 dv_context *unfiltered, governor *governor, cpu_budget *budget) {
+    int width = source->width;
 
     int framerate;
     if (framerate_target == NULL)
-        framerate = folder.original_framerate;
+        framerate = source->framerate;
     else
         framerate = *framerate_target;
     double target_ms = 1000 / framerate;
 
-    int max_size = min_size_without_number;
-    if (get_size(end) > minimum_index_size)
-        max_size += get_size(end);
-    else
-        max_size += minimum_index_size;
-
-    char *shared_path_buffer = (char *)malloc(max_size + 1);
-    if (!shared_path_buffer) {
-        fprintf(stderr, "Memory allocation failed in play_folder()\n");
+    size_t frame_buffer_size = dv_output_capacity(context);
+    char *frame_buffer = (char *)malloc(frame_buffer_size);
+    char *unfiltered_buffer = unfiltered ? (char *)malloc(frame_buffer_size) : NULL;
+    long long written_bytes = 0, unfiltered_bytes = 0;
+    double render_seconds = 0, unfiltered_seconds = 0;
+    if (!frame_buffer || (unfiltered && !unfiltered_buffer)) {
+        fprintf(stderr, "Memory allocation failed in play_source()\n");
         exit(1);
     }
 
-    int frame_total = end - start + 1;
+    int frame_total = source->frame_count;
     char *timeline = (char *)malloc(width + 1);
     char *supposed_timeline = (char *)malloc(width + 1);
     if (!timeline || !supposed_timeline) {
-        fprintf(stderr, "Memory allocation failed in play_folder()\n");
+        fprintf(stderr, "Memory allocation failed in play_source()\n");
         exit(1);
     }
     memset(timeline, '-', width);
@@ -693,69 +658,384 @@ void play_folder(frame_folder folder, char lookup_table[], int *framerate_target
     double total_ms = 0;
     int supposed_frame = 0;
 
-    FILE *file;
+    frame_log *log = NULL;
     if (csv) {
-        file = fopen("frametime.csv", "w");
-        if (!file) {
-            fprintf(stderr, "Could not open frametime.csv for writing in play_folder()\n");
+        log = (frame_log *)malloc(sizeof(frame_log));
+        if (!log) {
+            fprintf(stderr, "Memory allocation failed in play_source()\n");
             exit(1);
         }
-        fprintf(file, "frame,ms\n");
+        frame_log_open(log, "frametime.csv");
     }
     struct timespec start_t,
         end_t, sleep_time, remaining;
+    // Frame i should be on the screen at scheduled ms after the playback started
+    double playback_start = get_wall_seconds(), scheduled_ms = 0;
+
+    // Hash of the last drawn frame, a frame with the same hash is not drawn again
+    uint64_t previous_hash = 0;
+    int has_previous = 0, repeats = 0, frames = 0;
+    // Shown is the frame on the screen (-1 for none), synced is 0 once a cached frame was
+    // written because the context still diffs against the frame it rendered last
+    // Behind is 1 if cached frames were not read from the source, it has to seek then
+    cache_key key = {0, -1, context->config.mode, context->config.encoder, context->config.output_width, context->config.output_height};
+    int shown = -1, synced = 1, behind = 0;
 
     printf(FULL_CLEAR);
     fflush(stdout);
-    for (int i = start; i <= end; i++) {
-        printf(FIRST_LINE_CODE);
-        fflush(stdout);
+    dv_context_reset(context);
+    for (int i = 1;; i++) {
         clock_gettime(CLOCK_MONOTONIC, &start_t);
 
-        sprintf(shared_path_buffer, "%s%0*d%s", folder_name_and_prefix, minimum_index_size, i, extension);
-        print_image(lookup_table, mode, shared_path_buffer);
+        int index = first_frame + i - 1;
+        key.index = source->period > 0 ? index % source->period : index;
+        key.previous = shown;
+        const cached_frame *cached = NULL;
+        if (cache && !(bands && source->next_rows) && source->seek && (source->frame_count < 0 || index < source->frame_count))
+            cached = frame_cache_find(cache, &key);
+
+        int size_of_buffer = 0, cleared = 0;
+        double decode_seconds = 0, decode_wall_seconds = 0;
+        const char *output = frame_buffer;
+        dv_context *active = context;
+        // Stages that do not run stay at -1, the renderer stages are what its totals grew by
+        frame_record record = {i, FRAME_DRAWN, {-1, -1, -1, -1, -1, -1}, 0, 0, 0};
+        dv_stage_stats stages_before = *dv_get_stage_stats(context);
+        if (budget && !(active = cpu_budget_plan(budget, index, &cleared))) {
+            // Frame is left out, the screen keeps the last drawn one
+            record.status = FRAME_DROPPED;
+            if (source->seek && !(bands && source->next_rows) && (source->frame_count < 0 || index < source->frame_count))
+                behind = 1;
+            else if (bands && source->next_rows ? !skip_next_rows(source) : !source->next_frame(source))
+                break;
+            printf(RESTORE_CURSOR_CODE);
+        } else if (bands && source->next_rows) {
+            // Rows are pushed before the frame could be skipped, bands only change the level
+            if (governor)
+                active = governor_plan(governor, 0, &cleared);
+            if (cleared)
+                printf(FULL_CLEAR);
+            printf(FIRST_LINE_CODE);
+            fflush(stdout);
+            stages_before = *dv_get_stage_stats(active);
+            if (!render_next_rows(source, active, frame_buffer, frame_buffer_size, &size_of_buffer, &decode_seconds, &decode_wall_seconds))
+                break;
+            record.stages[FRAME_STAGE_DECODE] = decode_wall_seconds * 1000;
+            set_render_stages(record.stages, &stages_before, dv_get_stage_stats(active));
+            has_previous = 0;
+        } else if (cached) {
+            source->delay = cached->delay;
+            behind = 1;
+            record.status = FRAME_CACHED;
+            if (has_previous && cached->hash == previous_hash) {
+                printf(RESTORE_CURSOR_CODE);
+                record.status = FRAME_REPEATED;
+                repeats++;
+            } else {
+                printf(FIRST_LINE_CODE);
+                fflush(stdout);
+                output = cached->data;
+                size_of_buffer = cached->size;
+                previous_hash = cached->hash;
+                has_previous = 1;
+                synced = 0;
+            }
+            shown = key.index;
+        } else {
+            if (behind && source->seek(source, index) != 0)
+                break;
+            behind = 0;
+            // Wall time goes to the log so waits on the disk or a reader thread show up, the
+            // CPU budget only counts CPU time
+            double decode_start = get_cpu_seconds(), decode_wall_start = get_wall_seconds();
+            mark_stage("decode", 1);
+            const unsigned char *frame = source->next_frame(source);
+            mark_stage("decode", 0);
+            decode_seconds = get_cpu_seconds() - decode_start;
+            decode_wall_seconds = get_wall_seconds() - decode_wall_start;
+            if (!frame)
+                break;
+            record.stages[FRAME_STAGE_DECODE] = decode_wall_seconds * 1000;
+            uint64_t hash = hash_frame(frame, (size_t)source->width * source->channels, source->height, source->stride);
+            // Screen that was cleared for another pixel grid has to be drawn again
+            if (has_previous && hash == previous_hash && !cleared) {
+                // Screen already has this frame, the cursor goes back to where the frame ended
+                printf(RESTORE_CURSOR_CODE);
+                record.status = FRAME_REPEATED;
+                repeats++;
+            } else if (governor && !(active = governor_plan(governor, 1, &cleared))) {
+                // Skipped frame leaves the last drawn one on the screen
+                printf(RESTORE_CURSOR_CODE);
+                record.status = FRAME_SKIPPED;
+            } else {
+                if (cleared)
+                    printf(FULL_CLEAR);
+                printf(FIRST_LINE_CODE);
+                fflush(stdout);
+                // Context has to draw from scratch if the screen is not what it rendered last
+                if (!synced)
+                    dv_context_reset(active);
+                stages_before = *dv_get_stage_stats(active);
+                double render_start = get_cpu_seconds();
+                TRACE_BEGIN("render");
+                if (source->channels == 1)
+                    size_of_buffer = dv_render_luma(active, frame, source->width, source->height, source->stride, frame_buffer, frame_buffer_size);
+                else
+                    size_of_buffer = dv_render_rgb(active, frame, source->width, source->height, source->stride, frame_buffer, frame_buffer_size);
+                TRACE_END("render");
+                render_seconds += get_cpu_seconds() - render_start;
+                set_render_stages(record.stages, &stages_before, dv_get_stage_stats(active));
+                if (unfiltered) {
+                    int unfiltered_size;
+                    render_start = get_cpu_seconds();
+                    if (source->channels == 1)
+                        unfiltered_size = dv_render_luma(unfiltered, frame, source->width, source->height, source->stride, unfiltered_buffer, frame_buffer_size);
+                    else
+                        unfiltered_size = dv_render_rgb(unfiltered, frame, source->width, source->height, source->stride, unfiltered_buffer, frame_buffer_size);
+                    unfiltered_seconds += get_cpu_seconds() - render_start;
+                    if (unfiltered_size > 0)
+                        unfiltered_bytes += unfiltered_size;
+                }
+                if (cache && size_of_buffer >= 0) {
+                    key.previous = synced ? shown : -1;
+                    frame_cache_insert(cache, &key, frame_buffer, size_of_buffer, hash, source->delay);
+                }
+                previous_hash = hash;
+                has_previous = 1;
+                synced = 1;
+            }
+            shown = key.index;
+        }
+        frames++;
+        if (framerate_target == NULL)
+            target_ms = source->delay > 0 ? source->delay : 1000 / framerate;
+        if (size_of_buffer < 0) {
+            fprintf(stderr, "Could not render frame %d in play_source(): %s\n", i, dv_error_string(size_of_buffer));
+            exit(1);
+        }
+        double write_seconds = 0, write_cpu_seconds = 0;
+        if (size_of_buffer > 0) {
+            written_bytes += size_of_buffer;
+            double write_start = get_wall_seconds(), write_cpu_start = get_cpu_seconds();
+            TRACE_BEGIN("write");
+            write(1, output, size_of_buffer);
+            TRACE_END("write");
+            write_seconds = get_wall_seconds() - write_start;
+            write_cpu_seconds = get_cpu_seconds() - write_cpu_start;
+            record.stages[FRAME_STAGE_WRITE] = write_seconds * 1000;
+            printf(SAVE_CURSOR_CODE);
+        }
+        record.bytes = size_of_buffer;
+        record.late_ms = (get_wall_seconds() - playback_start) * 1000 - scheduled_ms;
+        TRACE_COUNTER("frame bytes", size_of_buffer);
+        TRACE_COUNTER("late ms", (long)record.late_ms);
+        scheduled_ms += target_ms;
+        if (governor)
+            governor_account(governor, size_of_buffer, write_seconds, target_ms);
+        if (budget)
+            cpu_budget_account(budget, decode_seconds, write_cpu_seconds);
 
         clock_gettime(CLOCK_MONOTONIC, &end_t);
         double elapsed_ms = (end_t.tv_sec - start_t.tv_sec) * 1000.0 +
                             (end_t.tv_nsec - start_t.tv_nsec) / 1000000.0;
+        record.stages[FRAME_STAGE_TOTAL] = elapsed_ms;
         double sleep_ms = target_ms - elapsed_ms;
         if (sleep_ms > 0) {
             sleep_time.tv_sec = (time_t)(sleep_ms / 1000);
             sleep_time.tv_nsec = (long)((sleep_ms - (sleep_time.tv_sec * 1000)) * 1000000L);
-            if (nanosleep(&sleep_time, &remaining) == -1) {
-                if (csv)
-                    fprintf(file, "%d,%lf\n", i, elapsed_ms);
+            TRACE_BEGIN("sleep");
+            int interrupted = nanosleep(&sleep_time, &remaining) == -1;
+            TRACE_END("sleep");
+            if (interrupted) {
+                record.frame_ms = elapsed_ms;
                 elapsed_ms += sleep_ms - (remaining.tv_sec * 1000.0) - (remaining.tv_nsec / 1000000.0);
                 total_ms += elapsed_ms;
             } else {
-                if (csv)
-                    fprintf(file, "%d,%lf\n", i, target_ms);
+                record.frame_ms = target_ms;
                 total_ms += target_ms;
             }
         } else {
-            if (csv)
-                fprintf(file, "%d,%lf\n", i, elapsed_ms);
+            record.frame_ms = elapsed_ms;
             total_ms += elapsed_ms;
         }
-        supposed_frame = fmin(total_ms / target_ms, frame_total);
-
-        if ((i - start + 1) == supposed_frame)
-            print_timeline(width, i - start + 1, frame_total, 0, timeline);
-        else
-            print_timeline(width, i - start + 1, frame_total, 1, timeline);
-        printf(" -> %.3lf FPS     \n", fmin((double)framerate, 1000 / elapsed_ms));
-        print_timeline(width, supposed_frame, frame_total, 0, supposed_timeline);
-        printf(" -> %.3lf FPS     ", (double)framerate);
+        if (log)
+            frame_log_add(log, &record);
+
+        if (frame_total > 0) {
+            supposed_frame = fmin(total_ms / target_ms, frame_total);
+            if (i == supposed_frame)
+                print_timeline(width, i, frame_total, 0, timeline);
+            else
+                print_timeline(width, i, frame_total, 1, timeline);
+            printf(" -> %.3lf FPS     ", fmin((double)framerate, 1000 / elapsed_ms));
+            print_cpu_hud(budget);
+            printf("\n");
+            print_timeline(width, supposed_frame, frame_total, 0, supposed_timeline);
+            printf(" -> %.3lf FPS     ", (double)framerate);
+        } else {
+            printf("Frame %d -> %.3lf FPS     ", i, fmin((double)framerate, 1000 / elapsed_ms));
+            print_cpu_hud(budget);
+        }
     }
     fflush(stdout);
     printf(FULL_CLEAR);
     fflush(stdout);
+    if (repeats > 0)
+        fprintf(stderr, "Skipped %d of %d frames (%.1f%%) that were the same as the one before\n", repeats, frames, 100.0 * repeats / frames);
+    print_hysteresis_report(dv_get_hysteresis_stats(context), unfiltered ? written_bytes : 0, unfiltered_bytes);
+    print_motion_report(dv_get_motion_stats(context));
+    print_static_report(dv_get_static_stats(context), render_seconds, unfiltered ? unfiltered_seconds : 0);
+    if (log) {
+        frame_log_report(log, get_wall_seconds() - playback_start, stderr);
+        frame_log_close(log);
+        free(log);
+    }
 
+    free(frame_buffer);
+    free(unfiltered_buffer);
     free(supposed_timeline);
     free(timeline);
-    free(shared_path_buffer);
-    if (csv)
-        fclose(file);
+}
+
+// Sets the resize, convert and encode stages of a frame record to what the renderer totals grew by (in ms)
+void set_render_stages(double *stages, const dv_stage_stats *before, const dv_stage_stats *after) {
+    stages[FRAME_STAGE_RESIZE] = (after->resize - before->resize) * 1000;
+    stages[FRAME_STAGE_CONVERT] = (after->convert - before->convert) * 1000;
+    stages[FRAME_STAGE_ENCODE] = (after->encode - before->encode) * 1000;
+}
+
+// Tells the trace and the hardware counters that a stage begins (begin 1) or ends (begin 0)
+// - Used as the trace hook of the renderer too
+void mark_stage(const char *name, int begin) {
+    if (TRACE_ENABLED)
+        trace_stage(name, begin);
+    if (PERF_ENABLED)
+        perf_stage(name, begin);
+}
+
+// Prints the hardware counters per source pixel and per cell of the drawn frames
+// - Sixel has no cells, its stages are per pixel of the drawn grid
+void print_perf_report(const dv_context *context, const frame_source *source) {
+    const dv_config *config = &context->config;
+    long long pixels = (long long)source->width * source->height;
+    const dv_cell_frame *cells = dv_current_cells(context);
+    if (cells) {
+        perf_counters_report(stderr, config->mode, pixels, (long long)cells->width * cells->height, "cell");
+    } else {
+        long long width = config->output_width ? config->output_width : source->width;
+        long long height = config->output_height ? config->output_height : source->height;
+        perf_counters_report(stderr, config->mode, pixels, width * height, "pixel");
+    }
+}
+
+// Prints how many pixel changes hysteresis held back and how far the drawn frames were off
+// - If unfiltered bytes is not 0 the bytes saved are printed too
+void print_hysteresis_report(const dv_hysteresis_stats *stats, long long written_bytes, long long unfiltered_bytes) {
+    if (stats->pixels == 0)
+        return;
+    double rms = stats->samples ? sqrt(stats->squared_error / stats->samples) : 0;
+    fprintf(stderr, "Hysteresis held %lld pixel changes (%.2f%% of all pixels), %lld refreshes, RMS error %.2f", stats->held,
+            100.0 * stats->held / stats->pixels, stats->refreshed, rms);
+    if (rms > 0)
+        fprintf(stderr, " (PSNR %.1f dB)", 20 * log10(255 / rms));
+    fprintf(stderr, "\n");
+    if (unfiltered_bytes > 0)
+        fprintf(stderr, "Hysteresis wrote %.2f MB instead of %.2f MB (%.1f%% saved)\n", written_bytes / 1e6, unfiltered_bytes / 1e6,
+                100.0 * (unfiltered_bytes - written_bytes) / unfiltered_bytes);
+}
+
+// Prints how often the scroll encoder moved the screen and what that saved
+void print_motion_report(const dv_motion_stats *stats) {
+    if (stats->frames == 0)
+        return;
+    fprintf(stderr, "Moved %lld of %lld frames: %lld scrolls (%lld rows), %lld rows panned\n", stats->moved_frames, stats->frames,
+            stats->scrolls, stats->scrolled_rows, stats->panned_rows);
+    if (stats->plain_bytes > 0)
+        fprintf(stderr, "Moved frames took %.2f MB instead of %.2f MB (%.1f%% saved)\n", stats->bytes / 1e6, stats->plain_bytes / 1e6,
+                100.0 * (stats->plain_bytes - stats->bytes) / stats->plain_bytes);
+}
+
+// Prints how many cells static masking did not convert and the render CPU time
+// - If unfiltered seconds is not 0 the time without masking is printed too
+void print_static_report(const dv_static_stats *stats, double render_seconds, double unfiltered_seconds) {
+    if (stats->cells == 0)
+        return;
+    fprintf(stderr, "Static masking skipped %.1f%% of cells (%lld checked, %lld woken up)\n", 100.0 * stats->skipped / stats->cells,
+            stats->checked, stats->woken);
+    if (unfiltered_seconds > 0)
+        fprintf(stderr, "Rendering took %.3f s of CPU with masking, %.3f s without (%.1f%% saved)\n", render_seconds, unfiltered_seconds,
+                100.0 * (unfiltered_seconds - render_seconds) / unfiltered_seconds);
+    else
+        fprintf(stderr, "Rendering took %.3f s of CPU\n", render_seconds);
+}
+
+// Prints the CPU usage and the quality level of a CPU budget next to the FPS (nothing if NULL)
+void print_cpu_hud(const cpu_budget *budget) {
+    if (!budget)
+        return;
+    char level[64];
+    printf("CPU %.1f%% level %-40s", 100 * budget->usage, cpu_budget_describe(budget, level, sizeof(level)));
+}
+
+// Returns the CPU time the calling thread used so far
+double get_cpu_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Returns the time of a clock that only goes forward
+double get_wall_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Pushes the next frame of the source into the context band by band and renders it
+// - Returns 0 at the end of the source, otherwise size gets the amount of bytes
+// written or one of the DV_ERROR codes
+// - Decode seconds gets the CPU time spent reading the rows, decode wall seconds the wall time
+int render_next_rows(frame_source *source, dv_context *context, char *output, size_t output_capacity, int *size, double *decode_seconds,
+                     double *decode_wall_seconds) {
+    int pushed = 0;
+    *decode_seconds = 0;
+    *decode_wall_seconds = 0;
+    while (pushed < source->height) {
+        int first, count;
+        double decode_start = get_cpu_seconds(), decode_wall_start = get_wall_seconds();
+        TRACE_BEGIN("decode");
+        const unsigned char *rows = source->next_rows(source, &first, &count);
+        TRACE_END("decode");
+        *decode_seconds += get_cpu_seconds() - decode_start;
+        *decode_wall_seconds += get_wall_seconds() - decode_wall_start;
+        if (!rows)
+            return 0;
+        int error;
+        if (source->channels == 1)
+            error = dv_push_luma_rows(context, rows, count, source->stride);
+        else
+            error = dv_push_rgb_rows(context, rows, count, source->stride);
+        if (error) {
+            *size = error;
+            return 1;
+        }
+        pushed += count;
+    }
+    *size = dv_render_pushed(context, output, output_capacity);
+    return 1;
+}
+
+// Reads the rows of the next frame of the source without drawing them
+// - Returns 0 at the end of the source
+int skip_next_rows(frame_source *source) {
+    int read = 0;
+    while (read < source->height) {
+        int first, count;
+        if (!source->next_rows(source, &first, &count))
+            return 0;
+        read += count;
+    }
+    return 1;
 }
 
 // Prints the timeline for visualization
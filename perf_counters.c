@@ -0,0 +1,242 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Counter groups of perf_event_open per thread and the totals of every stage
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf_counters.h"
+
+// Struct that keeps the counters of a thread
+// - Fds has -1 for events that could not be opened, the first one that opened leads the group
+// - Begins has the read of every stage at its begin (0 time enabled if it did not begin)
+typedef struct perf_thread {
+    int fds[PERF_EVENT_COUNT];
+    int leader;
+    uint64_t begins[PERF_STAGE_COUNT][PERF_EVENT_COUNT + 2];
+} perf_thread;
+
+// Struct that adds up a stage over every thread
+typedef struct perf_totals {
+    double counts[PERF_EVENT_COUNT];
+    long runs;
+} perf_totals;
+
+static perf_thread *get_thread(void);
+static int open_group(perf_thread *, int *error);
+static int read_group(const perf_thread *, uint64_t *values);
+static int find_stage(const char *);
+
+// Stages before this one are counted per source pixel
+#define PERF_FIRST_RENDER_STAGE 2
+
+static const char *stage_names[PERF_STAGE_COUNT] = {"decode", "preload", "resize", "convert", "encode"};
+static const char *event_names[PERF_EVENT_COUNT] = {"cycles", "instructions", "cache misses", "branch misses"};
+static const uint64_t event_configs[PERF_EVENT_COUNT] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+                                                         PERF_COUNT_HW_BRANCH_MISSES};
+
+// Struct that keeps every thread that has counters and the totals of the stages
+// - Threads are only added and totals only changed under the lock
+// - Available has 1 for every event the first group could open
+typedef struct perf_state {
+    perf_thread *threads[PERF_MAX_THREADS];
+    int thread_count;
+    int refused;
+    int available[PERF_EVENT_COUNT];
+    perf_totals totals[PERF_STAGE_COUNT];
+    pthread_mutex_t lock;
+} perf_state;
+
+_Atomic int perf_enabled = 0;
+static perf_state perf = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static _Thread_local perf_thread *thread_counters;
+static _Thread_local int thread_refused;
+
+int perf_counters_open(void) {
+    perf_thread *thread = (perf_thread *)calloc(1, sizeof(perf_thread));
+    if (!thread) {
+        fprintf(stderr, "Memory allocation failed in perf_counters_open()\n");
+        exit(1);
+    }
+    int error;
+    if (!open_group(thread, &error)) {
+        fprintf(stderr, "Hardware counters are not available (%s), nothing is counted\n", strerror(error));
+        free(thread);
+        return 0;
+    }
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        perf.available[i] = thread->fds[i] >= 0;
+        if (!perf.available[i])
+            fprintf(stderr, "Hardware counter of %s is not available, it is left out\n", event_names[i]);
+    }
+    perf.threads[perf.thread_count++] = thread;
+    thread_counters = thread;
+    atomic_store_explicit(&perf_enabled, 1, memory_order_relaxed);
+    return 1;
+}
+
+void perf_stage(const char *name, int begin) {
+    int stage = find_stage(name);
+    if (stage < 0)
+        return;
+    perf_thread *thread = get_thread();
+    if (!thread)
+        return;
+    uint64_t values[PERF_EVENT_COUNT + 2];
+    if (!read_group(thread, values))
+        return;
+    uint64_t *start = thread->begins[stage];
+    if (begin) {
+        memcpy(start, values, sizeof(values));
+        return;
+    }
+    // Stage that did not begin on this thread is not counted
+    if (start[0] == 0)
+        return;
+    uint64_t enabled = values[0] - start[0], running = values[1] - start[1];
+    start[0] = 0;
+    if (running == 0)
+        return;
+    double scale = (double)enabled / running;
+    pthread_mutex_lock(&perf.lock);
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+        perf.totals[stage].counts[i] += (values[i + 2] - start[i + 2]) * scale;
+    perf.totals[stage].runs++;
+    pthread_mutex_unlock(&perf.lock);
+}
+
+void perf_counters_close(void) {
+    atomic_store_explicit(&perf_enabled, 0, memory_order_relaxed);
+    for (int t = 0; t < perf.thread_count; t++) {
+        for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+            if (perf.threads[t]->fds[i] >= 0)
+                close(perf.threads[t]->fds[i]);
+        }
+        free(perf.threads[t]);
+    }
+    perf.thread_count = 0;
+    thread_counters = NULL;
+}
+
+void perf_counters_report(FILE *file, int mode, long long pixels, long long units, const char *unit) {
+    long frames = perf.totals[find_stage("encode")].runs;
+    long decoded = perf.totals[find_stage("decode")].runs + perf.totals[find_stage("preload")].runs;
+    if (decoded == 0 && frames == 0)
+        return;
+    if (mode < 0)
+        fprintf(file, "Hardware counters of mode %d:\n", mode);
+    else
+        fprintf(file, "Hardware counters of mode '%c':\n", mode);
+    for (int s = 0; s < PERF_STAGE_COUNT; s++) {
+        const perf_totals *stage = &perf.totals[s];
+        // Decoding runs once per frame it decodes, the renderer stages are counted per drawn
+        // frame because resizing runs once per band when frames come in bands
+        int per_pixel = s < PERF_FIRST_RENDER_STAGE;
+        double amount = per_pixel ? (double)stage->runs * pixels : (double)frames * units;
+        if (stage->runs == 0 || amount <= 0)
+            continue;
+        fprintf(file, "%s:", stage_names[s]);
+        const char *separator = " ";
+        if (perf.available[PERF_CYCLES] && perf.available[PERF_INSTRUCTIONS] && stage->counts[PERF_CYCLES] > 0) {
+            fprintf(file, " IPC %.2f", stage->counts[PERF_INSTRUCTIONS] / stage->counts[PERF_CYCLES]);
+            separator = ", ";
+        }
+        for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+            if (perf.available[i]) {
+                fprintf(file, "%s%.3f %s", separator, stage->counts[i] / amount, event_names[i]);
+                separator = ", ";
+            }
+        }
+        fprintf(file, " per %s (%ld runs)\n", per_pixel ? "pixel" : unit, stage->runs);
+    }
+    if (perf.refused > 0)
+        fprintf(file, "%d threads could not open counters, their stages are left out\n", perf.refused);
+}
+
+// Returns the counters of the calling thread, they are opened on the first stage
+// - Returns NULL if they could not be opened, the thread is then never counted
+static perf_thread *get_thread(void) {
+    if (thread_counters || thread_refused)
+        return thread_counters;
+    perf_thread *thread = (perf_thread *)calloc(1, sizeof(perf_thread));
+    int error;
+    pthread_mutex_lock(&perf.lock);
+    if (thread && perf.thread_count < PERF_MAX_THREADS && open_group(thread, &error)) {
+        perf.threads[perf.thread_count++] = thread;
+        thread_counters = thread;
+    } else {
+        free(thread);
+        thread_refused = 1;
+        perf.refused++;
+    }
+    pthread_mutex_unlock(&perf.lock);
+    return thread_counters;
+}
+
+// Opens the events of the calling thread as a group, only user space is counted
+// - Returns 0 and the errno of the first event if none of them opened
+static int open_group(perf_thread *thread, int *error) {
+    thread->leader = -1;
+    *error = 0;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        struct perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = event_configs[i];
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attributes.disabled = thread->leader < 0;
+        // Events that were left out of the first group are not tried again
+        if (PERF_ENABLED && !perf.available[i]) {
+            thread->fds[i] = -1;
+            continue;
+        }
+        thread->fds[i] = syscall(__NR_perf_event_open, &attributes, 0, -1, thread->leader < 0 ? -1 : thread->fds[thread->leader], 0);
+        if (thread->fds[i] < 0 && *error == 0)
+            *error = errno;
+        if (thread->fds[i] >= 0 && thread->leader < 0)
+            thread->leader = i;
+    }
+    if (thread->leader < 0)
+        return 0;
+    ioctl(thread->fds[thread->leader], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 1;
+}
+
+// Reads the group into values: time enabled, time running and every event (0 if it did not open)
+// - Returns 0 if the read failed
+static int read_group(const perf_thread *thread, uint64_t *values) {
+    uint64_t buffer[3 + PERF_EVENT_COUNT];
+    ssize_t size = read(thread->fds[thread->leader], buffer, sizeof(buffer));
+    if (size < (ssize_t)(3 * sizeof(uint64_t)))
+        return 0;
+    values[0] = buffer[1];
+    values[1] = buffer[2];
+    // Group gives the events in the order they were opened, the ones that did not open are missing
+    int next = 3;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+        values[i + 2] = thread->fds[i] >= 0 && next < 3 + (int)buffer[0] ? buffer[next++] : 0;
+    return 1;
+}
+
+static int find_stage(const char *name) {
+    for (int i = 0; i < PERF_STAGE_COUNT; i++) {
+        if (strcmp(name, stage_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
@@ -0,0 +1,64 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Hardware counters (cycles, instructions, cache misses, branch misses) around the stages
+// of playback, read with perf_event_open
+// - Every thread that runs a stage opens a counter group of its own the first time, the
+// counts of a stage are what the group read grew by between its begin and end
+// - Counts are scaled up if the kernel had to share the counters with others
+// - If the kernel or the container has no hardware counters nothing is counted, the
+// reason is printed once and playback goes on
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define PERF_EVENT_COUNT 4
+#define PERF_STAGE_COUNT 5
+#define PERF_MAX_THREADS 64
+
+// Events of a group
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_CACHE_MISSES 2
+#define PERF_BRANCH_MISSES 3
+
+// 1 while counters are open, checked by PERF_STAGE before anything else
+// - Threads read it while perf_counters_close() clears it, so it is atomic
+extern _Atomic int perf_enabled;
+
+// Opens the counters of the calling thread to see if there are any
+// - Returns 0 and prints why if there are no hardware counters, it does not exit
+// - Call it before the threads that are counted start
+int perf_counters_open(void);
+
+// Begins (begin 1) or ends (begin 0) a stage on the calling thread, fits dv_set_trace_hook()
+// - Stages are "decode", "preload" (decoding on the preload threads), "resize", "convert"
+// and "encode", other names are not counted
+// - A stage that begins again before it ended only counts from the last begin
+void perf_stage(const char *name, int begin);
+
+// Closes the counters of every thread, the threads have to be done
+void perf_counters_close(void);
+
+// Prints IPC and the events per unit of every stage that ran (after perf_counters_close())
+// - Decode and preload are per source pixel (pixels of a frame), the renderer stages are
+// per unit of a drawn frame (units, "cell" or "pixel"), a drawn frame is one that was encoded
+void perf_counters_report(FILE *, int mode, long long pixels, long long units, const char *unit);
+
+// Whether counters are open, for code that checks it itself
+#define PERF_ENABLED atomic_load_explicit(&perf_enabled, memory_order_relaxed)
+
+#define PERF_STAGE(name, begin)      \
+    do {                             \
+        if (PERF_ENABLED)            \
+            perf_stage(name, begin); \
+    } while (0)
+
+#endif
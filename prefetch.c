@@ -0,0 +1,566 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Read-ahead of whole files, see prefetch.h
+// - With io_uring every file is an open linked to a read, the open puts the file in the
+// registered file table at the index of its slot so the read can use it right away
+// - The file left in the table is closed by the kernel when the slot opens the next one
+// - A read that fills the buffer is finished with pread() into the overflow buffer
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+#include "trace.h"
+
+static int setup_uring(file_prefetcher *);
+static int probe_uring(int);
+static void map_uring(file_prefetcher *, const struct io_uring_params *);
+static void register_buffers(file_prefetcher *);
+static struct io_uring_sqe *get_sqe(prefetch_uring *);
+static void queue_file(file_prefetcher *, int);
+static void flush_uring(file_prefetcher *);
+static void *reap_files(void *);
+static void *read_files(void *);
+static int read_file_into(prefetch_slot *, size_t);
+static int read_overflow(prefetch_slot *, size_t);
+static void finish_slot(file_prefetcher *, prefetch_slot *, int);
+static prefetch_slot *find_slot(file_prefetcher *, int);
+static int count_in_flight(const file_prefetcher *);
+static int get_state(const prefetch_slot *);
+static void set_state(prefetch_slot *, int);
+static double get_ms_between(const struct timespec *, const struct timespec *);
+static double get_latency_percentile(const file_prefetcher *, int);
+
+#define SLOT_FREE 0
+#define SLOT_QUEUED 1
+#define SLOT_READING 2
+#define SLOT_DONE 3
+#define SLOT_FAILED 4
+#define SLOT_TAKEN 5
+
+#define USER_DATA_OPEN 1ULL
+#define USER_DATA_READ 2ULL
+#define USER_DATA_STOP 3ULL
+#define USER_DATA_SHIFT 32
+
+// Lower edge of the first latency bucket and how much wider every bucket is than the one before
+#define LATENCY_BUCKET_MIN_MS 0.001
+#define LATENCY_BUCKET_GROWTH 1.02
+
+void prefetch_init(file_prefetcher *prefetcher, int depth, size_t buffer_size, int use_uring) {
+    memset(prefetcher, 0, sizeof(file_prefetcher));
+    prefetcher->depth = depth;
+    prefetcher->buffer_size = buffer_size;
+    prefetcher->slots = (prefetch_slot *)calloc(depth, sizeof(prefetch_slot));
+    prefetcher->buffers = (unsigned char *)malloc((size_t)depth * buffer_size);
+    prefetcher->queue = (int *)malloc(depth * sizeof(int));
+    if (!prefetcher->slots || !prefetcher->buffers || !prefetcher->queue) {
+        fprintf(stderr, "Memory allocation failed in prefetch_init()\n");
+        exit(1);
+    }
+    for (int i = 0; i < depth; i++) {
+        prefetcher->slots[i].buffer = prefetcher->buffers + (size_t)i * buffer_size;
+        prefetcher->slots[i].fd = -1;
+    }
+    pthread_mutex_init(&prefetcher->lock, NULL);
+    pthread_cond_init(&prefetcher->changed, NULL);
+
+    prefetcher->use_uring = use_uring && setup_uring(prefetcher);
+    if (prefetcher->use_uring) {
+        if (pthread_create(&prefetcher->uring.reaper, NULL, reap_files, prefetcher)) {
+            fprintf(stderr, "Could not create a thread in prefetch_init()\n");
+            exit(1);
+        }
+        return;
+    }
+    prefetcher->thread_count = depth < PREFETCH_MAX_THREADS ? depth : PREFETCH_MAX_THREADS;
+    for (int i = 0; i < prefetcher->thread_count; i++) {
+        if (pthread_create(&prefetcher->threads[i], NULL, read_files, prefetcher)) {
+            fprintf(stderr, "Could not create a thread in prefetch_init()\n");
+            exit(1);
+        }
+    }
+}
+
+int prefetch_has_room(const file_prefetcher *prefetcher) {
+    for (int i = 0; i < prefetcher->depth; i++) {
+        if (get_state(&prefetcher->slots[i]) == SLOT_FREE)
+            return 1;
+    }
+    return 0;
+}
+
+void prefetch_submit(file_prefetcher *prefetcher, int id, int directory, const char *name) {
+    int index = 0;
+    while (index < prefetcher->depth && get_state(&prefetcher->slots[index]) != SLOT_FREE)
+        index++;
+    if (index == prefetcher->depth) {
+        fprintf(stderr, "Could not queue %s in prefetch_submit()\n", name);
+        exit(1);
+    }
+
+    prefetch_slot *slot = &prefetcher->slots[index];
+    slot->id = id;
+    slot->size = 0;
+    slot->directory = directory;
+    slot->name = name;
+    clock_gettime(CLOCK_MONOTONIC, &slot->submitted);
+    pthread_mutex_lock(&prefetcher->lock);
+    if (prefetcher->first_submit.tv_sec == 0 && prefetcher->first_submit.tv_nsec == 0)
+        prefetcher->first_submit = slot->submitted;
+    if (prefetcher->use_uring) {
+        set_state(slot, SLOT_READING);
+        queue_file(prefetcher, index);
+    } else {
+        set_state(slot, SLOT_QUEUED);
+        prefetcher->queue[(prefetcher->queue_start + prefetcher->queue_count++) % prefetcher->depth] = index;
+        pthread_cond_broadcast(&prefetcher->changed);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    TRACE_COUNTER("prefetch files in flight", count_in_flight(prefetcher));
+}
+
+const unsigned char *prefetch_take(file_prefetcher *prefetcher, int id, size_t *size) {
+    prefetch_slot *slot = find_slot(prefetcher, id);
+    if (!slot) {
+        fprintf(stderr, "File %d was never queued in prefetch_take()\n", id);
+        exit(1);
+    }
+    if (prefetcher->use_uring)
+        flush_uring(prefetcher);
+
+    pthread_mutex_lock(&prefetcher->lock);
+    if (get_state(slot) != SLOT_DONE && get_state(slot) != SLOT_FAILED) {
+        TRACE_BEGIN("wait for file");
+        while (get_state(slot) != SLOT_DONE && get_state(slot) != SLOT_FAILED)
+            pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+        TRACE_END("wait for file");
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+
+    // The reaper leaves files that filled their buffer for here, they count as read after that
+    if (prefetcher->use_uring && get_state(slot) == SLOT_DONE && slot->size == prefetcher->buffer_size) {
+        slot->fd = openat(slot->directory, slot->name, O_RDONLY | O_CLOEXEC);
+        int ok = slot->fd >= 0 && read_overflow(slot, prefetcher->buffer_size);
+        if (slot->fd >= 0)
+            close(slot->fd);
+        slot->fd = -1;
+        pthread_mutex_lock(&prefetcher->lock);
+        finish_slot(prefetcher, slot, ok);
+        pthread_mutex_unlock(&prefetcher->lock);
+    }
+
+    int failed = get_state(slot) == SLOT_FAILED;
+    set_state(slot, SLOT_TAKEN);
+    TRACE_COUNTER("prefetch files in flight", count_in_flight(prefetcher));
+    if (failed)
+        return NULL;
+    *size = slot->size;
+    return slot->size > prefetcher->buffer_size ? slot->overflow : slot->buffer;
+}
+
+void prefetch_release(file_prefetcher *prefetcher, int id) {
+    prefetch_slot *slot = find_slot(prefetcher, id);
+    if (slot && get_state(slot) == SLOT_TAKEN)
+        set_state(slot, SLOT_FREE);
+}
+
+void prefetch_drain(file_prefetcher *prefetcher) {
+    size_t size;
+    for (int i = 0; i < prefetcher->depth; i++) {
+        prefetch_slot *slot = &prefetcher->slots[i];
+        if (get_state(slot) != SLOT_FREE && get_state(slot) != SLOT_TAKEN)
+            prefetch_take(prefetcher, slot->id, &size);
+        set_state(slot, SLOT_FREE);
+    }
+}
+
+void prefetch_report(const file_prefetcher *prefetcher, FILE *file) {
+    if (prefetcher->latency_count == 0)
+        return;
+    double seconds = get_ms_between(&prefetcher->first_submit, &prefetcher->last_done) / 1000;
+    double megabytes = prefetcher->bytes / 1e6;
+    fprintf(file, "Read %ld files (%.1f MB) in %.2f s with %s: %.1f MB/s\n", prefetcher->latency_count, megabytes, seconds,
+            prefetcher->use_uring ? "io_uring" : "threads", seconds > 0 ? megabytes / seconds : 0);
+    fprintf(file, "Latency per file: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", get_latency_percentile(prefetcher, 50),
+            get_latency_percentile(prefetcher, 90), get_latency_percentile(prefetcher, 99), prefetcher->latency_max_ms);
+}
+
+void prefetch_close(file_prefetcher *prefetcher) {
+    prefetch_drain(prefetcher);
+    if (prefetcher->use_uring) {
+        prefetch_uring *uring = &prefetcher->uring;
+        struct io_uring_sqe *sqe = get_sqe(uring);
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = USER_DATA_STOP << USER_DATA_SHIFT;
+        flush_uring(prefetcher);
+        pthread_join(uring->reaper, NULL);
+        munmap(uring->sqes, uring->sqes_size);
+        if (uring->cq_ring != uring->sq_ring)
+            munmap(uring->cq_ring, uring->cq_ring_size);
+        munmap(uring->sq_ring, uring->sq_ring_size);
+        close(uring->fd);
+    } else {
+        pthread_mutex_lock(&prefetcher->lock);
+        prefetcher->stop = 1;
+        pthread_cond_broadcast(&prefetcher->changed);
+        pthread_mutex_unlock(&prefetcher->lock);
+        for (int i = 0; i < prefetcher->thread_count; i++)
+            pthread_join(prefetcher->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&prefetcher->lock);
+    pthread_cond_destroy(&prefetcher->changed);
+    for (int i = 0; i < prefetcher->depth; i++)
+        free(prefetcher->slots[i].overflow);
+    free(prefetcher->slots);
+    free(prefetcher->buffers);
+    free(prefetcher->queue);
+}
+
+// Creates an io_uring with a file table of one file per slot
+// - Returns 0 if io_uring can not be used (old kernel, seccomp, no direct opens)
+static int setup_uring(file_prefetcher *prefetcher) {
+    prefetch_uring *uring = &prefetcher->uring;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // An open and a read for every slot and the stop entry
+    uring->fd = syscall(__NR_io_uring_setup, prefetcher->depth * 2 + 1, &params);
+    if (uring->fd < 0)
+        return 0;
+
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = prefetcher->depth;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (!probe_uring(uring->fd) || syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) != 0) {
+        close(uring->fd);
+        return 0;
+    }
+    map_uring(prefetcher, &params);
+    register_buffers(prefetcher);
+    return 1;
+}
+
+// Returns 1 if the kernel has every operation that is used
+static int probe_uring(int fd) {
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, probe_size);
+    if (!probe)
+        return 0;
+    int usable = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 && probe->last_op >= IORING_OP_READ &&
+                 (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                 (probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return usable;
+}
+
+static void map_uring(file_prefetcher *prefetcher, const struct io_uring_params *params) {
+    prefetch_uring *uring = &prefetcher->uring;
+    uring->entries = params->sq_entries;
+    uring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    int single_map = params->features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map) {
+        if (uring->cq_ring_size > uring->sq_ring_size)
+            uring->sq_ring_size = uring->cq_ring_size;
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = uring->sq_ring;
+    if (uring->sq_ring != MAP_FAILED && !single_map)
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+    uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = (struct io_uring_sqe *)mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        fprintf(stderr, "Could not map the io_uring rings in map_uring()\n");
+        exit(1);
+    }
+
+    unsigned char *sq = (unsigned char *)uring->sq_ring;
+    unsigned char *cq = (unsigned char *)uring->cq_ring;
+    uring->sq_head = (unsigned *)(sq + params->sq_off.head);
+    uring->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+    uring->sq_mask = (unsigned *)(sq + params->sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(sq + params->sq_off.array);
+    uring->cq_head = (unsigned *)(cq + params->cq_off.head);
+    uring->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+    uring->cq_mask = (unsigned *)(cq + params->cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+}
+
+// Registers the buffer of every slot so reads skip mapping the pages each time
+// - Fails on a low memlock limit, reads then go to the same buffers unregistered
+static void register_buffers(file_prefetcher *prefetcher) {
+    struct iovec *buffers = (struct iovec *)malloc(prefetcher->depth * sizeof(struct iovec));
+    if (!buffers) {
+        fprintf(stderr, "Memory allocation failed in register_buffers()\n");
+        exit(1);
+    }
+    for (int i = 0; i < prefetcher->depth; i++) {
+        buffers[i].iov_base = prefetcher->slots[i].buffer;
+        buffers[i].iov_len = prefetcher->buffer_size;
+    }
+    prefetcher->uring.registered = syscall(__NR_io_uring_register, prefetcher->uring.fd, IORING_REGISTER_BUFFERS, buffers, prefetcher->depth) == 0;
+    free(buffers);
+}
+
+// Returns the next free submission entry, the ring has room for everything of every slot
+static struct io_uring_sqe *get_sqe(prefetch_uring *uring) {
+    unsigned tail = *uring->sq_tail + uring->queued;
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)uring->sq_head, memory_order_acquire);
+    if (tail - head >= uring->entries) {
+        fprintf(stderr, "io_uring submission queue is full in get_sqe()\n");
+        exit(1);
+    }
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    uring->sq_array[index] = index;
+    uring->queued++;
+    return sqe;
+}
+
+// Queues the open of a slot linked to the read of the whole buffer
+// - The read only runs if the open worked, otherwise it completes with -ECANCELED
+static void queue_file(file_prefetcher *prefetcher, int index) {
+    prefetch_uring *uring = &prefetcher->uring;
+    prefetch_slot *slot = &prefetcher->slots[index];
+    struct io_uring_sqe *open_sqe = get_sqe(uring);
+    open_sqe->opcode = IORING_OP_OPENAT;
+    open_sqe->flags = IOSQE_IO_LINK;
+    open_sqe->fd = slot->directory;
+    open_sqe->addr = (uint64_t)(uintptr_t)slot->name;
+    // Direct opens never make a descriptor, so they do not take O_CLOEXEC
+    open_sqe->open_flags = O_RDONLY;
+    open_sqe->file_index = index + 1;
+    open_sqe->user_data = USER_DATA_OPEN << USER_DATA_SHIFT | index;
+
+    struct io_uring_sqe *read_sqe = get_sqe(uring);
+    read_sqe->opcode = uring->registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    read_sqe->flags = IOSQE_FIXED_FILE;
+    read_sqe->fd = index;
+    read_sqe->addr = (uint64_t)(uintptr_t)slot->buffer;
+    read_sqe->len = prefetcher->buffer_size;
+    read_sqe->buf_index = index;
+    read_sqe->user_data = USER_DATA_READ << USER_DATA_SHIFT | index;
+}
+
+// Gives every queued entry to the kernel in one system call
+static void flush_uring(file_prefetcher *prefetcher) {
+    prefetch_uring *uring = &prefetcher->uring;
+    unsigned count = uring->queued;
+    if (count == 0)
+        return;
+    atomic_store_explicit((_Atomic unsigned *)uring->sq_tail, *uring->sq_tail + count, memory_order_release);
+    uring->queued = 0;
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, uring->fd, count, 0, 0, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) {
+        fprintf(stderr, "io_uring_enter failed in flush_uring()\n");
+        exit(1);
+    }
+}
+
+// io_uring reaper thread, waits for completions and marks the files as read
+// - A failed open is handled by the read that gets canceled after it
+static void *reap_files(void *argument) {
+    file_prefetcher *prefetcher = (file_prefetcher *)argument;
+    prefetch_uring *uring = &prefetcher->uring;
+    int stopped = 0;
+    TRACE_THREAD("prefetch reaper");
+    while (!stopped) {
+        int result = syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result < 0 && errno != EINTR) {
+            fprintf(stderr, "io_uring_enter failed in reap_files()\n");
+            exit(1);
+        }
+
+        pthread_mutex_lock(&prefetcher->lock);
+        unsigned head = *uring->cq_head;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *)uring->cq_tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+            uint64_t kind = cqe->user_data >> USER_DATA_SHIFT;
+            prefetch_slot *slot = &prefetcher->slots[cqe->user_data & 0xffffffffu];
+            if (kind == USER_DATA_STOP)
+                stopped = 1;
+            if (kind != USER_DATA_READ)
+                continue;
+            if (cqe->res >= 0)
+                slot->size = cqe->res;
+            if (cqe->res >= 0 && slot->size == prefetcher->buffer_size)
+                set_state(slot, SLOT_DONE);
+            else
+                finish_slot(prefetcher, slot, cqe->res >= 0);
+        }
+        atomic_store_explicit((_Atomic unsigned *)uring->cq_head, head, memory_order_release);
+        pthread_cond_broadcast(&prefetcher->changed);
+        pthread_mutex_unlock(&prefetcher->lock);
+    }
+    return NULL;
+}
+
+// Thread pool worker, reads the queued slots one by one
+static void *read_files(void *argument) {
+    file_prefetcher *prefetcher = (file_prefetcher *)argument;
+    TRACE_THREAD("prefetch");
+    pthread_mutex_lock(&prefetcher->lock);
+    while (1) {
+        while (prefetcher->queue_count == 0 && !prefetcher->stop)
+            pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+        if (prefetcher->stop)
+            break;
+        prefetch_slot *slot = &prefetcher->slots[prefetcher->queue[prefetcher->queue_start]];
+        prefetcher->queue_start = (prefetcher->queue_start + 1) % prefetcher->depth;
+        prefetcher->queue_count--;
+        set_state(slot, SLOT_READING);
+        pthread_mutex_unlock(&prefetcher->lock);
+
+        TRACE_BEGIN("read file");
+        int ok = read_file_into(slot, prefetcher->buffer_size);
+        TRACE_END("read file");
+
+        pthread_mutex_lock(&prefetcher->lock);
+        finish_slot(prefetcher, slot, ok);
+        pthread_cond_broadcast(&prefetcher->changed);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return NULL;
+}
+
+// Reads a whole file with blocking calls, returns 0 if it could not be read
+static int read_file_into(prefetch_slot *slot, size_t buffer_size) {
+    slot->fd = openat(slot->directory, slot->name, O_RDONLY | O_CLOEXEC);
+    if (slot->fd < 0)
+        return 0;
+    int ok = 1;
+    slot->size = 0;
+    while (slot->size < buffer_size) {
+        ssize_t result = read(slot->fd, slot->buffer + slot->size, buffer_size - slot->size);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            ok = 0;
+        if (result <= 0)
+            break;
+        slot->size += result;
+    }
+    ok = ok && read_overflow(slot, buffer_size);
+    close(slot->fd);
+    slot->fd = -1;
+    return ok;
+}
+
+// Finishes a file that filled its buffer, the whole file then ends up in overflow
+// - Returns 0 if the file could not be read
+static int read_overflow(prefetch_slot *slot, size_t buffer_size) {
+    struct stat info;
+    if (slot->size < buffer_size)
+        return 1;
+    if (fstat(slot->fd, &info) != 0)
+        return 0;
+    if ((size_t)info.st_size <= buffer_size)
+        return 1;
+    if ((size_t)info.st_size > slot->overflow_capacity) {
+        unsigned char *grown = (unsigned char *)realloc(slot->overflow, info.st_size);
+        if (!grown)
+            return 0;
+        slot->overflow = grown;
+        slot->overflow_capacity = info.st_size;
+    }
+    memcpy(slot->overflow, slot->buffer, buffer_size);
+    while (slot->size < (size_t)info.st_size) {
+        ssize_t result = pread(slot->fd, slot->overflow + slot->size, info.st_size - slot->size, slot->size);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return 0;
+        slot->size += result;
+    }
+    return 1;
+}
+
+// Marks a slot as read and counts it for the report, the lock has to be held
+static void finish_slot(file_prefetcher *prefetcher, prefetch_slot *slot, int ok) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    set_state(slot, ok ? SLOT_DONE : SLOT_FAILED);
+    if (!ok)
+        return;
+    slot->latency_ms = get_ms_between(&slot->submitted, &now);
+    prefetcher->last_done = now;
+    prefetcher->bytes += slot->size;
+    int bucket = 0;
+    if (slot->latency_ms > LATENCY_BUCKET_MIN_MS)
+        bucket = (int)(log2(slot->latency_ms / LATENCY_BUCKET_MIN_MS) / log2(LATENCY_BUCKET_GROWTH)) + 1;
+    if (bucket >= PREFETCH_LATENCY_BUCKETS)
+        bucket = PREFETCH_LATENCY_BUCKETS - 1;
+    prefetcher->latency_histogram[bucket]++;
+    prefetcher->latency_count++;
+    if (slot->latency_ms > prefetcher->latency_max_ms)
+        prefetcher->latency_max_ms = slot->latency_ms;
+}
+
+static prefetch_slot *find_slot(file_prefetcher *prefetcher, int id) {
+    for (int i = 0; i < prefetcher->depth; i++) {
+        if (get_state(&prefetcher->slots[i]) != SLOT_FREE && prefetcher->slots[i].id == id)
+            return &prefetcher->slots[i];
+    }
+    return NULL;
+}
+
+// Counts the files that were submitted and not taken yet, only for the trace
+static int count_in_flight(const file_prefetcher *prefetcher) {
+    int count = 0;
+    for (int i = 0; i < prefetcher->depth; i++) {
+        int state = get_state(&prefetcher->slots[i]);
+        count += state != SLOT_FREE && state != SLOT_TAKEN;
+    }
+    return count;
+}
+
+static double get_ms_between(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Slots are looked at without the lock (free slots, the trace counter), so their state
+// is stored with release and loaded with acquire
+static int get_state(const prefetch_slot *slot) {
+    return atomic_load_explicit(&slot->state, memory_order_acquire);
+}
+
+static void set_state(prefetch_slot *slot, int state) {
+    atomic_store_explicit(&slot->state, state, memory_order_release);
+}
+
+// Returns the upper edge of the bucket the percentile falls in (never more than the max),
+// it is at most 2% more than the exact value
+static double get_latency_percentile(const file_prefetcher *prefetcher, int percent) {
+    long rank = (prefetcher->latency_count - 1) * percent / 100, seen = 0;
+    for (int bucket = 0; bucket < PREFETCH_LATENCY_BUCKETS; bucket++) {
+        seen += prefetcher->latency_histogram[bucket];
+        if (seen > rank) {
+            double edge = LATENCY_BUCKET_MIN_MS * pow(LATENCY_BUCKET_GROWTH, bucket);
+            return edge < prefetcher->latency_max_ms ? edge : prefetcher->latency_max_ms;
+        }
+    }
+    return prefetcher->latency_max_ms;
+}
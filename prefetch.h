@@ -0,0 +1,128 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Read-ahead of whole files for sources that read one file per frame
+// - Opens and reads are batched through io_uring into registered buffers,
+// a small thread pool does the same work if io_uring is not there
+// - Files are identified by an id (the frame number) and taken in any order
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define PREFETCH_MAX_THREADS 4
+// Buckets of the latency histogram, each one is 2% wider than the one before starting from
+// 1 us, so 1024 of them go past 10 minutes
+#define PREFETCH_LATENCY_BUCKETS 1024
+
+// Struct that represents a file that is being read or was read
+// - Name is opened relative to the directory descriptor, it is not copied
+// - Files bigger than the buffer are finished into overflow
+typedef struct prefetch_slot {
+    int id;
+    _Atomic int state;
+    int fd;
+    int directory;
+    const char *name;
+    unsigned char *buffer;
+    size_t size;
+    unsigned char *overflow;
+    size_t overflow_capacity;
+    struct timespec submitted;
+    double latency_ms;
+} prefetch_slot;
+
+// Struct that keeps the rings of io_uring, set up with raw system calls
+// - The submission side is only used by the caller, the completion side only by the reaper thread
+// - Queued is how many entries were filled in but not given to the kernel yet
+typedef struct prefetch_uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned queued;
+    int registered;
+    pthread_t reaper;
+} prefetch_uring;
+
+// Struct that keeps every file in flight and the numbers for the report
+// - Depth is the amount of slots, every slot owns one buffer of buffer size bytes
+// - Queue has the slots the threads have not picked up yet (thread pool only)
+// - Lock protects the numbers and the changes of the slot states that wait for a read,
+// states are atomic so a free slot can be looked for without it, changed is signaled
+// when a file is read
+// - Latencies are counted in a histogram, its size does not grow with the files
+typedef struct file_prefetcher {
+    int depth;
+    size_t buffer_size;
+    prefetch_slot *slots;
+    unsigned char *buffers;
+    int use_uring;
+    prefetch_uring uring;
+    pthread_t threads[PREFETCH_MAX_THREADS];
+    int thread_count;
+    int *queue;
+    int queue_start;
+    int queue_count;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    long latency_histogram[PREFETCH_LATENCY_BUCKETS];
+    long latency_count;
+    double latency_max_ms;
+    uint64_t bytes;
+    struct timespec first_submit;
+    struct timespec last_done;
+} file_prefetcher;
+
+// Sets up depth slots with buffers of buffer size bytes
+// - With use_uring 1 io_uring is used when the kernel has it, otherwise threads
+void prefetch_init(file_prefetcher *, int depth, size_t buffer_size, int use_uring);
+
+// Returns 1 if there is a free slot for prefetch_submit()
+int prefetch_has_room(const file_prefetcher *);
+
+// Starts reading a file into a free slot, the name is opened relative to the directory
+// - Name has to stay valid until the file is taken
+// - With io_uring the reads are batched and given to the kernel by the next prefetch_take()
+void prefetch_submit(file_prefetcher *, int id, int directory, const char *name);
+
+// Waits for a submitted file and gives its contents
+// - Returns NULL if the file could not be read
+// - Contents stay valid until prefetch_release() is called with the id
+const unsigned char *prefetch_take(file_prefetcher *, int id, size_t *size);
+
+// Gives the slot of a taken file back
+void prefetch_release(file_prefetcher *, int id);
+
+// Waits for everything in flight and frees every slot (used for seeking)
+void prefetch_drain(file_prefetcher *);
+
+// Prints the read speed and the latency percentiles of the files that were read
+void prefetch_report(const file_prefetcher *, FILE *);
+
+void prefetch_close(file_prefetcher *);
+
+#endif
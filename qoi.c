@@ -0,0 +1,202 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// QOI ("Quite OK Image") encoder and decoder, see qoi.h
+// - Follows the specification at qoiformat.org
+
+#include <string.h>
+
+#include "qoi.h"
+
+#define QOI_MAGIC "qoif"
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK 0xc0
+#define QOI_MAX_RUN 62
+
+// Position of a color in the table of recently seen colors
+#define QOI_HASH(r, g, b, a) (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) & 63)
+
+static void write_u32_be(unsigned char *, unsigned int);
+static unsigned int read_u32_be(const unsigned char *);
+
+size_t qoi_max_size(int width, int height) {
+    return QOI_HEADER_SIZE + (size_t)width * height * 4 + QOI_PADDING_SIZE;
+}
+
+size_t qoi_encode(const unsigned char *rgb, int width, int height, unsigned char *output) {
+    unsigned char table[64][3] = {{0}};
+    unsigned char table_used[64] = {0};
+    unsigned char *position = output;
+
+    memcpy(position, QOI_MAGIC, 4);
+    write_u32_be(position + 4, width);
+    write_u32_be(position + 8, height);
+    position[12] = 3;
+    position[13] = 0;
+    position += QOI_HEADER_SIZE;
+
+    // Alpha never changes from 255 so it only matters for the hash
+    unsigned char previous[3] = {0, 0, 0};
+    int run = 0;
+    size_t pixel_count = (size_t)width * height;
+    for (size_t i = 0; i < pixel_count; i++) {
+        const unsigned char *pixel = rgb + i * 3;
+        if (pixel[0] == previous[0] && pixel[1] == previous[1] && pixel[2] == previous[2]) {
+            run++;
+            if (run == QOI_MAX_RUN || i == pixel_count - 1) {
+                *position++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *position++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        int hash = QOI_HASH(pixel[0], pixel[1], pixel[2], 255);
+        if (table_used[hash] && memcmp(table[hash], pixel, 3) == 0) {
+            *position++ = QOI_OP_INDEX | hash;
+        } else {
+            table_used[hash] = 1;
+            memcpy(table[hash], pixel, 3);
+            signed char dr = pixel[0] - previous[0];
+            signed char dg = pixel[1] - previous[1];
+            signed char db = pixel[2] - previous[2];
+            signed char dr_dg = dr - dg;
+            signed char db_dg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *position++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+            } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                *position++ = QOI_OP_LUMA | (dg + 32);
+                *position++ = (dr_dg + 8) << 4 | (db_dg + 8);
+            } else {
+                *position++ = QOI_OP_RGB;
+                *position++ = pixel[0];
+                *position++ = pixel[1];
+                *position++ = pixel[2];
+            }
+        }
+        memcpy(previous, pixel, 3);
+    }
+
+    memset(position, 0, QOI_PADDING_SIZE - 1);
+    position[QOI_PADDING_SIZE - 1] = 1;
+    position += QOI_PADDING_SIZE;
+    return position - output;
+}
+
+int qoi_read_header(const unsigned char *data, size_t size, int *width, int *height) {
+    if (size < QOI_HEADER_SIZE + QOI_PADDING_SIZE || memcmp(data, QOI_MAGIC, 4) != 0)
+        return 0;
+    unsigned int w = read_u32_be(data + 4);
+    unsigned int h = read_u32_be(data + 8);
+    if (w == 0 || h == 0 || w > 0x7fff || h > 0x7fff || (data[12] != 3 && data[12] != 4))
+        return 0;
+    *width = w;
+    *height = h;
+    return 1;
+}
+
+int qoi_decode(const unsigned char *data, size_t size, unsigned char *output, int channels) {
+    qoi_decoder decoder;
+    if (!qoi_decoder_start(&decoder, data, size))
+        return 0;
+    return qoi_decode_rows(&decoder, output, decoder.height, channels);
+}
+
+int qoi_decoder_start(qoi_decoder *decoder, const unsigned char *data, size_t size) {
+    if (!qoi_read_header(data, size, &decoder->width, &decoder->height))
+        return 0;
+    memset(decoder->table, 0, sizeof(decoder->table));
+    memset(decoder->pixel, 0, 3);
+    decoder->pixel[3] = 255;
+    decoder->position = data + QOI_HEADER_SIZE;
+    decoder->end = data + size - QOI_PADDING_SIZE;
+    decoder->run = 0;
+    decoder->row = 0;
+    return 1;
+}
+
+int qoi_decode_rows(qoi_decoder *decoder, unsigned char *output, int count, int channels) {
+    if (count < 0 || count > decoder->height - decoder->row)
+        return 0;
+
+    // Works on locals so the loop does not go through the decoder
+    unsigned char (*table)[4] = decoder->table;
+    unsigned char pixel[4];
+    memcpy(pixel, decoder->pixel, 4);
+    const unsigned char *position = decoder->position;
+    const unsigned char *end = decoder->end;
+    size_t pixel_count = (size_t)decoder->width * count;
+    int run = decoder->run;
+    for (size_t i = 0; i < pixel_count; i++) {
+        if (run > 0) {
+            run--;
+        } else {
+            if (position >= end)
+                return 0;
+            int op = *position++;
+            if (op == QOI_OP_RGB) {
+                if (end - position < 3)
+                    return 0;
+                memcpy(pixel, position, 3);
+                position += 3;
+            } else if (op == QOI_OP_RGBA) {
+                if (end - position < 4)
+                    return 0;
+                memcpy(pixel, position, 4);
+                position += 4;
+            } else if ((op & QOI_MASK) == QOI_OP_INDEX) {
+                memcpy(pixel, table[op], 4);
+            } else if ((op & QOI_MASK) == QOI_OP_DIFF) {
+                pixel[0] += ((op >> 4) & 3) - 2;
+                pixel[1] += ((op >> 2) & 3) - 2;
+                pixel[2] += (op & 3) - 2;
+            } else if ((op & QOI_MASK) == QOI_OP_LUMA) {
+                if (position >= end)
+                    return 0;
+                int second = *position++;
+                int dg = (op & 63) - 32;
+                pixel[0] += dg - 8 + ((second >> 4) & 15);
+                pixel[1] += dg;
+                pixel[2] += dg - 8 + (second & 15);
+            } else {
+                run = op & 63;
+            }
+            memcpy(table[QOI_HASH(pixel[0], pixel[1], pixel[2], pixel[3])], pixel, 4);
+        }
+
+        if (channels == 3) {
+            memcpy(output + i * 3, pixel, 3);
+        } else {
+            output[i] = (pixel[0] * 77 + pixel[1] * 150 + pixel[2] * 29) >> 8;
+        }
+    }
+
+    memcpy(decoder->pixel, pixel, 4);
+    decoder->position = position;
+    decoder->run = run;
+    decoder->row += count;
+    return 1;
+}
+
+static void write_u32_be(unsigned char *buffer, unsigned int value) {
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+static unsigned int read_u32_be(const unsigned char *buffer) {
+    return (unsigned int)buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+}
@@ -0,0 +1,56 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// QOI ("Quite OK Image") encoder and decoder
+// - Lossless like PNG but decoded in a single pass without inflate
+// - Only RGB images are written, RGBA files can still be read
+
+#ifndef QOI_H
+#define QOI_H
+
+#include <stddef.h>
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+
+// Struct that keeps the state of an image that is decoded a few rows at a time
+typedef struct qoi_decoder {
+    const unsigned char *position;
+    const unsigned char *end;
+    unsigned char table[64][4];
+    unsigned char pixel[4];
+    int run;
+    int width;
+    int height;
+    int row;
+} qoi_decoder;
+
+// Returns the worst case size of an encoded image
+size_t qoi_max_size(int width, int height);
+
+// Encodes packed RGB pixels into the buffer (at least qoi_max_size() bytes)
+// - Returns the amount of bytes written
+size_t qoi_encode(const unsigned char *rgb, int width, int height, unsigned char *output);
+
+// Reads the size of an encoded image
+// - Returns 0 if the data is not a QOI image, 1 otherwise
+int qoi_read_header(const unsigned char *data, size_t size, int *width, int *height);
+
+// Decodes an image into a buffer with width * height * channels bytes
+// - Channels is 3 for RGB or 1 for luma (same weights as stb_image)
+// - Returns 0 if the data is broken, 1 otherwise
+int qoi_decode(const unsigned char *data, size_t size, unsigned char *output, int channels);
+
+// Starts decoding an image row by row, data has to stay alive until the last row
+// - Returns 0 if the data is not a QOI image, 1 otherwise
+int qoi_decoder_start(qoi_decoder *decoder, const unsigned char *data, size_t size);
+
+// Decodes the next count rows into a buffer with count * width * channels bytes
+// - Returns 0 if the data is broken or there are not that many rows left, 1 otherwise
+int qoi_decode_rows(qoi_decoder *decoder, unsigned char *output, int count, int channels);
+
+#endif
@@ -0,0 +1,153 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Reference producer for the shared memory frame ring (see shm_ring.h)
+// - Writes a moving test pattern into the ring at a fixed framerate
+// - ./ring_producer name WIDTHxHEIGHT [fps] [slots] [frames]
+// - Frames 0 (default) runs until Ctrl+C, the ring is removed at the end
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+static void stop_producing(int);
+static shm_ring_header *create_ring(const char *, int, int, int, int, size_t *);
+static uint32_t claim_slot(shm_ring_header *, shm_ring_slot *, uint32_t);
+static void draw_pattern(unsigned char *, int, int, int, uint64_t);
+
+#define DEFAULT_FRAMERATE 30
+#define DEFAULT_SLOTS 4
+#define SLOT_ALIGNMENT 4096
+
+static volatile sig_atomic_t stopped = 0;
+
+int main(int argc, char *argv[]) {
+    int width, height;
+    if (argc < 3 || sscanf(argv[2], "%dx%d", &width, &height) != 2 || width < 1 || height < 1) {
+        fprintf(stderr, "Usage: %s name WIDTHxHEIGHT [fps] [slots] [frames]\n", argv[0]);
+        return 1;
+    }
+    int framerate = argc > 3 ? atoi(argv[3]) : DEFAULT_FRAMERATE;
+    int slot_count = argc > 4 ? atoi(argv[4]) : DEFAULT_SLOTS;
+    long frame_total = argc > 5 ? atol(argv[5]) : 0;
+    if (framerate < 1 || slot_count < SHM_RING_MIN_SLOTS || slot_count > SHM_RING_MAX_SLOTS) {
+        fprintf(stderr, "Framerate has to be at least 1 and slots %d-%d in main()\n", SHM_RING_MIN_SLOTS, SHM_RING_MAX_SLOTS);
+        return 1;
+    }
+
+    size_t map_size;
+    shm_ring_header *header = create_ring(argv[1], width, height, framerate, slot_count, &map_size);
+    shm_ring_slot *slots = (shm_ring_slot *)(header + 1);
+    unsigned char *data = (unsigned char *)header + header->data_offset;
+    signal(SIGINT, stop_producing);
+    signal(SIGTERM, stop_producing);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    uint32_t slot = 0;
+    for (uint64_t sequence = 1; !stopped && (frame_total == 0 || (long)sequence <= frame_total); sequence++) {
+        slot = claim_slot(header, slots, slot);
+        draw_pattern(data + slot * header->slot_size, width, height, header->stride, sequence);
+        atomic_store_explicit(&slots[slot].sequence, sequence, memory_order_release);
+        atomic_store_explicit(&header->latest, sequence << SHM_RING_SLOT_BITS | slot, memory_order_release);
+
+        next.tv_nsec += 1000000000L / framerate;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    atomic_store(&header->closed, 1);
+    munmap(header, map_size);
+    shm_unlink(argv[1]);
+    return 0;
+}
+
+static void stop_producing(int signal_number) {
+    (void)signal_number;
+    stopped = 1;
+}
+
+// Creates the shared memory and fills in the header, frames are rgb24
+// - Slots start on a page so every frame is aligned
+static shm_ring_header *create_ring(const char *name, int width, int height, int framerate, int slot_count, size_t *map_size) {
+    size_t stride = (size_t)width * 3;
+    size_t slot_size = (stride * height + SLOT_ALIGNMENT - 1) / SLOT_ALIGNMENT * SLOT_ALIGNMENT;
+    size_t data_offset = (sizeof(shm_ring_header) + slot_count * sizeof(shm_ring_slot) + SLOT_ALIGNMENT - 1) / SLOT_ALIGNMENT * SLOT_ALIGNMENT;
+    *map_size = data_offset + slot_count * slot_size;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, *map_size) != 0) {
+        fprintf(stderr, "Could not create the ring %s in create_ring()\n", name);
+        exit(1);
+    }
+    shm_ring_header *header = (shm_ring_header *)mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "Could not map the ring %s in create_ring()\n", name);
+        exit(1);
+    }
+
+    // Shared memory starts zeroed, so every slot is empty and nothing is latest
+    header->version = SHM_RING_VERSION;
+    header->width = width;
+    header->height = height;
+    header->channels = 3;
+    header->stride = stride;
+    header->framerate = framerate;
+    header->slot_count = slot_count;
+    header->producer_pid = getpid();
+    header->slot_size = slot_size;
+    header->data_offset = data_offset;
+    atomic_store(&header->reading, SHM_RING_NO_SLOT);
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, SHM_RING_MAGIC, 8);
+    return header;
+}
+
+// Picks the slot after the last one that the reader is not showing and that is not the latest
+// - Sequence 0 marks the slot before reading is checked again, a reader that claimed
+// it at the same time sees the 0 and tries again
+static uint32_t claim_slot(shm_ring_header *header, shm_ring_slot *slots, uint32_t last) {
+    uint32_t slot = last;
+    while (1) {
+        slot = (slot + 1) % header->slot_count;
+        uint64_t latest = atomic_load(&header->latest);
+        if (slot == atomic_load(&header->reading) || (latest && slot == (latest & ((1u << SHM_RING_SLOT_BITS) - 1))))
+            continue;
+        uint64_t old_sequence = atomic_load(&slots[slot].sequence);
+        atomic_store(&slots[slot].sequence, 0);
+        if (atomic_load(&header->reading) != slot)
+            return slot;
+        atomic_store(&slots[slot].sequence, old_sequence);
+    }
+}
+
+// Diagonal color bands that move every frame and a white bar that shows the frame number
+static void draw_pattern(unsigned char *frame, int width, int height, int stride, uint64_t sequence) {
+    for (int y = 0; y < height; y++) {
+        unsigned char *row = frame + (size_t)y * stride;
+        for (int x = 0; x < width; x++) {
+            int band = x + y + (int)(sequence * 4);
+            row[x * 3] = band & 255;
+            row[x * 3 + 1] = (band * 2 + y) & 255;
+            row[x * 3 + 2] = 255 - (band & 255);
+        }
+    }
+    int bar = (int)(sequence % width);
+    for (int y = 0; y < height / 8; y++)
+        memset(frame + (size_t)y * stride, 255, (size_t)bar * 3);
+}
@@ -0,0 +1,65 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Layout of a shared memory frame ring (shm_open name, see ring_producer.c)
+// - Header, then slot_count slot headers, then slot_count frames of slot_size bytes
+// starting at data_offset
+// - A frame is in a slot while its sequence is the one written there, sequence 0
+// means the slot is being written, sequences start from 1
+// - Latest has the sequence of the newest frame << 16 | its slot
+// - The reader keeps the slot it is showing in reading and the producer never
+// writes into it, so frames are read straight from the ring without copying
+//
+// Producer, for every frame:
+// 1. pick a slot that is not reading or the latest one
+// 2. set its sequence to 0, if reading is that slot now put the old sequence back
+// and pick another one
+// 3. write the frame, set the sequence, then set latest
+// Reader:
+// 1. load latest, store its slot into reading
+// 2. if the sequence of the slot is not the one of latest anymore start again
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define SHM_RING_MAGIC "DUCKRING"
+#define SHM_RING_VERSION 1
+#define SHM_RING_MIN_SLOTS 3
+#define SHM_RING_MAX_SLOTS 0xffff
+#define SHM_RING_NO_SLOT 0xffffffffu
+#define SHM_RING_SLOT_BITS 16
+
+// Struct at the start of the shared memory
+// - Channels is 3 for rgb24 and 1 for gray, stride is the size of a row in bytes
+// - Producer pid lets the reader notice a producer that died without closing
+typedef struct shm_ring_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t stride;
+    uint32_t framerate;
+    uint32_t slot_count;
+    int32_t producer_pid;
+    uint64_t slot_size;
+    uint64_t data_offset;
+    _Atomic uint64_t latest;
+    _Atomic uint32_t reading;
+    _Atomic uint32_t closed;
+} shm_ring_header;
+
+// Struct in front of the frames, one per slot (a cache line each)
+typedef struct shm_ring_slot {
+    _Atomic uint64_t sequence;
+    unsigned char padding[56];
+} shm_ring_slot;
+
+#endif
@@ -0,0 +1,124 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Frame sources for the player
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+
+#define FOLDER_EXTENSION_SIZE 8
+
+// Struct that represents a folder full of frames from a video
+// - Frames are the image files with the extension of the first one in natural order
+// - Name of frame i starts at names + offsets[i] (see get_folder_frame_name())
+// - Directory stays open so frames are opened by index without building paths
+// - All the frames are assumed to be the dimension of the first one
+typedef struct frame_folder {
+    const char *path;
+    int directory;
+    int count;
+    char *names;
+    int *offsets;
+    char extension[FOLDER_EXTENSION_SIZE];
+    int width;
+    int height;
+    int original_framerate;
+} frame_folder;
+
+// Struct that represents anything that can give frames one after another
+// - Channels is 1 for luma frames and 3 for RGB frames
+// - Frame count is -1 if it is not known (pipes)
+// - Period is how many frames one loop has (frame i + period is frame i again),
+// 0 if the frames do not come back
+// - next_frame returns NULL at the end, the frame stays valid until the next call
+// - Stride is the size of a row in bytes
+// - Seek is NULL if the source can not seek, otherwise it returns 0 on success
+// and the next call to next_frame gives that frame (counting from 0)
+// - Delay is how long the last given frame should stay in ms, 0 means 1000 / framerate
+// - next_rows is NULL if the source only gives whole frames, otherwise it can be
+// used instead of next_frame to get the frames a band of rows at a time
+// It returns NULL at the end, first row 0 starts a new frame and the rows stay
+// valid until the next call (use only one of next_frame and next_rows)
+typedef struct frame_source {
+    int width;
+    int height;
+    int channels;
+    int stride;
+    int framerate;
+    int frame_count;
+    int period;
+    int delay;
+    void *state;
+    const unsigned char *(*next_frame)(struct frame_source *);
+    int (*seek)(struct frame_source *, int);
+    const unsigned char *(*next_rows)(struct frame_source *, int *, int *);
+    void (*close)(struct frame_source *);
+} frame_source;
+
+// Scans a folder of frames, or loads the manifest of an earlier scan if the folder did not change
+// - Framerate 0 means 30, frame files do not have one
+void open_frame_folder(frame_folder *, const char *, int);
+
+const char *get_folder_frame_name(const frame_folder *, int);
+
+// Opens frame i of the folder, returns the file descriptor (-1 on failure)
+int open_folder_frame(const frame_folder *, int);
+
+// Reads the whole file of frame i into a buffer that grows when needed, returns its size
+size_t read_folder_frame(const frame_folder *, int, unsigned char **, size_t *);
+
+void close_frame_folder(frame_folder *);
+
+// Makes a frame source out of a scanned folder, the folder has to stay open while it is used
+// - Channels is 1 to load the frames as luma, 3 for RGB
+// - JPEG frames are made smaller while they stay at least min size (0 means full size)
+// - Read ahead is how many frame files are read before they are needed (0 reads each one
+// when it is needed), io_uring is used for that if use_uring is 1 and the kernel has it
+void open_folder_source(frame_source *, const frame_folder *, int, int, int, int, int);
+
+// Opens a YUV4MPEG2 stream or a headerless raw stream (stdin if path is "-")
+// - Raw width 0 means YUV4MPEG2, size and framerate come from the header
+// - Raw channels is 3 for rgb24 and 1 for gray
+// - If luma_only is 1 YUV4MPEG2 frames are given as the Y plane without RGB conversion
+void open_stream_source(frame_source *, const char *, int, int, int, int, int);
+
+// Opens a frame pack made by write_frame_pack()
+// - Channels is 1 to decode the frames as luma, 3 for RGB
+void open_pack_source(frame_source *, const char *, int);
+
+// Opens a Motion-JPEG AVI file
+// - Channels is 1 to decode the frames as luma, 3 for RGB
+// - Framerate comes from the stream header
+// - Frames are decoded at 1/2, 1/4 or 1/8 size when that is still at least min size
+// (0 means full size)
+void open_avi_source(frame_source *, const char *, int, int, int);
+
+// Opens an animated GIF, every frame is decoded once at the start
+// - Channels is 1 to give the frames as luma, 3 for RGB
+// - Loops is how many times the animation plays, 0 means forever
+// - Delay of the source follows the delay of every frame
+void open_gif_source(frame_source *, const char *, int, int);
+
+// Attaches to a shared memory frame ring made by a producer (see shm_ring.h)
+// - Frames are given straight from the ring, the newest one every time
+void open_shm_source(frame_source *, const char *);
+
+// Decodes every frame of a source into memory in the background while it plays
+// - Sources are the same video opened source count times, every one is used by
+// its own thread, the preload source owns them and closes them
+// - Sources have to be able to seek and know their frame count
+// - Frames are kept compressed up to budget bytes, the rest is streamed from the first source
+// - Loops is how many times the video plays, 0 means forever
+void open_preload_source(frame_source *, frame_source *, int, size_t, int);
+
+// Copies every frame file of the folder into a single frame pack
+// - Frames are not decoded again, only their header is checked
+void write_frame_pack(const frame_folder *, const char *);
+
+#endif
@@ -0,0 +1,471 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Motion-JPEG AVI source
+// - The file is mapped and every frame is a JPEG chunk ("00dc") inside it
+// - Frames are found through the OpenDML index (indx/ix00), the old idx1 index
+// or by walking the movi list if the file has no index at all
+// - Seeking only looks up the index, nothing has to be decoded
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jpeg.h"
+#include "source.h"
+
+// Struct that represents where the JPEG of a frame is in the file
+// - Length 0 means the frame was dropped and the previous one is shown again
+typedef struct avi_frame {
+    uint64_t offset;
+    uint32_t length;
+} avi_frame;
+
+// Struct that keeps the state of an AVI source between frames
+// - Jpeg is used for frames without huffman tables (MJPEG cameras leave them out)
+// - Frames are decoded at 1/denominator size
+// - Image frame is the frame that image was decoded from
+typedef struct avi_state {
+    const unsigned char *map;
+    size_t map_size;
+    avi_frame *frames;
+    int frame_capacity;
+    int current;
+    int stream;
+    int denominator;
+    uint32_t chunk_ids[2];
+    long page_size;
+    unsigned char *image;
+    int image_frame;
+    unsigned char *jpeg;
+    size_t jpeg_capacity;
+} avi_state;
+
+static uint32_t read_u16(const unsigned char *);
+static uint32_t read_u32(const unsigned char *);
+static uint64_t read_u64(const unsigned char *);
+static uint32_t fourcc(const char *);
+static int find_chunk(const avi_state *, uint64_t, uint64_t, uint32_t, uint32_t, uint64_t *, uint32_t *);
+static void parse_headers(frame_source *, avi_state *, uint64_t, uint32_t, uint64_t *);
+static void add_frame(avi_state *, int *, uint64_t, uint32_t);
+static int read_opendml_index(frame_source *, avi_state *, uint64_t);
+static int read_idx1(frame_source *, avi_state *, uint64_t, uint32_t, uint64_t);
+static void walk_movi(frame_source *, avi_state *, uint64_t, uint32_t);
+static const unsigned char *prepare_jpeg(avi_state *, const unsigned char *, uint32_t, uint32_t *);
+static const unsigned char *next_avi_frame(frame_source *);
+static int seek_avi_source(frame_source *, int);
+static void close_avi_source(frame_source *);
+
+#define AVI_LIST_HEADER_SIZE 12
+#define AVI_CHUNK_HEADER_SIZE 8
+#define AVI_IDX1_ENTRY_SIZE 16
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS 0x01
+#define AVI_DEFAULT_FRAMERATE 30
+
+// Standard huffman tables from the JPEG specification (K.3) as a DHT segment
+// - Motion-JPEG frames that have no DHT segment are decoded with these
+static const unsigned char default_huffman_tables[] = {
+    0xff, 0xc4, 0x01, 0xa2,
+    0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+    0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+    0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7d,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+    0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+void open_avi_source(frame_source *source, const char *path, int channels, int min_width, int min_height) {
+    avi_state *state = (avi_state *)calloc(1, sizeof(avi_state));
+    if (!state) {
+        fprintf(stderr, "Memory allocation failed in open_avi_source()\n");
+        exit(1);
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Could not open %s in open_avi_source()\n", path);
+        exit(1);
+    }
+    state->map_size = info.st_size;
+    if (state->map_size < AVI_LIST_HEADER_SIZE) {
+        fprintf(stderr, "%s is not an AVI file in open_avi_source()\n", path);
+        exit(1);
+    }
+    state->map = (const unsigned char *)mmap(NULL, state->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (state->map == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s in open_avi_source()\n", path);
+        exit(1);
+    }
+    madvise((void *)state->map, state->map_size, MADV_SEQUENTIAL);
+    if (read_u32(state->map) != fourcc("RIFF") || read_u32(state->map + 8) != fourcc("AVI ")) {
+        fprintf(stderr, "%s is not an AVI file in open_avi_source()\n", path);
+        exit(1);
+    }
+
+    // First RIFF has the headers, the movi list and idx1
+    // OpenDML files go on with more RIFF AVIX lists that only have movi
+    uint64_t riff_end = AVI_CHUNK_HEADER_SIZE + (uint64_t)read_u32(state->map + 4);
+    if (riff_end > state->map_size)
+        riff_end = state->map_size;
+    uint64_t hdrl, movi, idx1;
+    uint32_t hdrl_size, movi_size, idx1_size;
+    if (!find_chunk(state, AVI_LIST_HEADER_SIZE, riff_end, fourcc("LIST"), fourcc("hdrl"), &hdrl, &hdrl_size) ||
+        !find_chunk(state, AVI_LIST_HEADER_SIZE, riff_end, fourcc("LIST"), fourcc("movi"), &movi, &movi_size)) {
+        fprintf(stderr, "%s has no hdrl or movi list in open_avi_source()\n", path);
+        exit(1);
+    }
+    uint64_t super_index = 0;
+    parse_headers(source, state, hdrl, hdrl_size, &super_index);
+
+    state->denominator = jpeg_pick_scale(source->width, source->height, min_width, min_height);
+    jpeg_scaled_size(source->width, source->height, state->denominator, &source->width, &source->height);
+    source->channels = channels;
+    source->stride = source->width * channels;
+    source->frame_count = 0;
+    if (!(super_index && read_opendml_index(source, state, super_index))) {
+        source->frame_count = 0;
+        if (!(find_chunk(state, AVI_LIST_HEADER_SIZE, riff_end, fourcc("idx1"), 0, &idx1, &idx1_size) && read_idx1(source, state, idx1, idx1_size, movi))) {
+            source->frame_count = 0;
+            walk_movi(source, state, movi, movi_size);
+        }
+    }
+    if (source->frame_count == 0) {
+        fprintf(stderr, "%s has no video frames in open_avi_source()\n", path);
+        exit(1);
+    }
+
+    state->page_size = sysconf(_SC_PAGESIZE);
+    source->state = state;
+    source->next_frame = next_avi_frame;
+    source->seek = seek_avi_source;
+    source->next_rows = NULL;
+    source->period = 0;
+    source->delay = 0;
+    source->close = close_avi_source;
+    seek_avi_source(source, 0);
+}
+
+static uint32_t read_u16(const unsigned char *buffer) {
+    return buffer[0] | buffer[1] << 8;
+}
+
+static uint32_t read_u32(const unsigned char *buffer) {
+    return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+static uint64_t read_u64(const unsigned char *buffer) {
+    return read_u32(buffer) | (uint64_t)read_u32(buffer + 4) << 32;
+}
+
+static uint32_t fourcc(const char *code) {
+    return read_u32((const unsigned char *)code);
+}
+
+// Looks for a chunk (or a LIST with the given type) between start and end
+// - Position is where the data starts (after the list type for lists)
+// - Returns 0 if there is no such chunk
+static int find_chunk(const avi_state *state, uint64_t start, uint64_t end, uint32_t id, uint32_t list_type, uint64_t *position, uint32_t *size) {
+    while (start + AVI_CHUNK_HEADER_SIZE <= end) {
+        uint32_t chunk_id = read_u32(state->map + start);
+        uint32_t chunk_size = read_u32(state->map + start + 4);
+        uint64_t data = start + AVI_CHUNK_HEADER_SIZE;
+        if (data + chunk_size > end)
+            chunk_size = end - data;
+        if (chunk_id == id) {
+            if (list_type == 0) {
+                *position = data;
+                *size = chunk_size;
+                return 1;
+            }
+            if (chunk_size >= 4 && read_u32(state->map + data) == list_type) {
+                *position = data + 4;
+                *size = chunk_size - 4;
+                return 1;
+            }
+        }
+        start = data + chunk_size + (chunk_size & 1);
+    }
+    return 0;
+}
+
+// Reads the size and the framerate of the first video stream
+// - Super index is set if the stream has an OpenDML index
+static void parse_headers(frame_source *source, avi_state *state, uint64_t hdrl, uint32_t hdrl_size, uint64_t *super_index) {
+    uint64_t end = hdrl + hdrl_size;
+    uint64_t avih, strl;
+    uint32_t avih_size, strl_size;
+    double microseconds_per_frame = 0;
+    if (find_chunk(state, hdrl, end, fourcc("avih"), 0, &avih, &avih_size) && avih_size >= 40)
+        microseconds_per_frame = read_u32(state->map + avih);
+
+    state->stream = -1;
+    uint64_t position = hdrl;
+    for (int stream = 0; find_chunk(state, position, end, fourcc("LIST"), fourcc("strl"), &strl, &strl_size); stream++) {
+        position = strl + strl_size + (strl_size & 1);
+        uint64_t strh, strf, indx;
+        uint32_t strh_size, strf_size, indx_size;
+        if (!find_chunk(state, strl, strl + strl_size, fourcc("strh"), 0, &strh, &strh_size) || strh_size < 36 ||
+            read_u32(state->map + strh) != fourcc("vids"))
+            continue;
+        if (!find_chunk(state, strl, strl + strl_size, fourcc("strf"), 0, &strf, &strf_size) || strf_size < 20) {
+            fprintf(stderr, "Video stream has no format in parse_headers()\n");
+            exit(1);
+        }
+        uint32_t compression = read_u32(state->map + strf + 16);
+        if (compression != fourcc("MJPG") && compression != fourcc("mjpg") && compression != fourcc("AVRn") && compression != fourcc("jpeg")) {
+            fprintf(stderr, "Video stream is not Motion-JPEG in parse_headers()\n");
+            exit(1);
+        }
+
+        int width = (int)read_u32(state->map + strf + 4);
+        int height = (int)read_u32(state->map + strf + 8);
+        source->width = width;
+        source->height = height < 0 ? -height : height;
+        uint32_t scale = read_u32(state->map + strh + 20);
+        uint32_t rate = read_u32(state->map + strh + 24);
+        if (scale && rate)
+            source->framerate = (int)((double)rate / scale + 0.5);
+        else if (microseconds_per_frame > 0)
+            source->framerate = (int)(1000000.0 / microseconds_per_frame + 0.5);
+        else
+            source->framerate = AVI_DEFAULT_FRAMERATE;
+        if (source->framerate < 1)
+            source->framerate = 1;
+
+        state->stream = stream;
+        char id[5];
+        snprintf(id, sizeof(id), "%02ddc", stream % 100);
+        state->chunk_ids[0] = fourcc(id);
+        snprintf(id, sizeof(id), "%02ddb", stream % 100);
+        state->chunk_ids[1] = fourcc(id);
+        *super_index = 0;
+        if (find_chunk(state, strl, strl + strl_size, fourcc("indx"), 0, &indx, &indx_size) && indx_size >= 24)
+            *super_index = indx;
+        break;
+    }
+    if (state->stream < 0 || source->width <= 0 || source->height <= 0) {
+        fprintf(stderr, "No video stream in parse_headers()\n");
+        exit(1);
+    }
+}
+
+// Appends a frame to the frame table, the table grows when needed
+static void add_frame(avi_state *state, int *frame_count, uint64_t offset, uint32_t length) {
+    if (*frame_count == state->frame_capacity) {
+        int capacity = state->frame_capacity ? state->frame_capacity * 2 : 256;
+        avi_frame *frames = (avi_frame *)realloc(state->frames, capacity * sizeof(avi_frame));
+        if (!frames) {
+            fprintf(stderr, "Memory allocation failed in add_frame()\n");
+            exit(1);
+        }
+        state->frames = frames;
+        state->frame_capacity = capacity;
+    }
+    if (offset + length > state->map_size)
+        length = offset < state->map_size ? state->map_size - offset : 0;
+    state->frames[*frame_count].offset = offset;
+    state->frames[*frame_count].length = length;
+    (*frame_count)++;
+}
+
+// Reads the OpenDML super index (indx) and every standard index (ix00) it points to
+// - Returns 0 if the index is not usable
+static int read_opendml_index(frame_source *source, avi_state *state, uint64_t indx) {
+    const unsigned char *super = state->map + indx;
+    if (read_u16(super) != 4 || super[3] != AVI_INDEX_OF_INDEXES)
+        return 0;
+    uint32_t entry_count = read_u32(super + 4);
+    for (uint32_t i = 0; i < entry_count; i++) {
+        const unsigned char *entry = super + 24 + i * 16;
+        if (entry + 16 > state->map + state->map_size)
+            return 0;
+        uint64_t chunk = read_u64(entry);
+        if (chunk + AVI_CHUNK_HEADER_SIZE + 24 > state->map_size)
+            return 0;
+        // Standard index chunk: header, then offset and size pairs relative to base offset
+        const unsigned char *standard = state->map + chunk + AVI_CHUNK_HEADER_SIZE;
+        if (read_u16(standard) != 2 || standard[3] != AVI_INDEX_OF_CHUNKS)
+            return 0;
+        uint32_t chunk_count = read_u32(standard + 4);
+        uint64_t base = read_u64(standard + 12);
+        if (chunk + AVI_CHUNK_HEADER_SIZE + 24 + (uint64_t)chunk_count * 8 > state->map_size)
+            return 0;
+        for (uint32_t j = 0; j < chunk_count; j++) {
+            const unsigned char *pair = standard + 24 + j * 8;
+            add_frame(state, &source->frame_count, base + read_u32(pair), read_u32(pair + 4) & 0x7fffffff);
+        }
+    }
+    return source->frame_count > 0;
+}
+
+// Reads the old AVI 1.0 index
+// - Offsets are relative to the movi list in most files but some writers use file offsets
+// - Returns 0 if the index is not usable
+static int read_idx1(frame_source *source, avi_state *state, uint64_t idx1, uint32_t size, uint64_t movi) {
+    uint64_t base = movi - 4;
+    int checked = 0;
+    for (uint64_t position = idx1; position + AVI_IDX1_ENTRY_SIZE <= idx1 + size; position += AVI_IDX1_ENTRY_SIZE) {
+        uint32_t id = read_u32(state->map + position);
+        if (id != state->chunk_ids[0] && id != state->chunk_ids[1])
+            continue;
+        uint64_t offset = read_u32(state->map + position + 8);
+        uint32_t length = read_u32(state->map + position + 12);
+        if (!checked) {
+            if (base + offset + AVI_CHUNK_HEADER_SIZE > state->map_size || read_u32(state->map + base + offset) != id)
+                base = 0;
+            if (offset + AVI_CHUNK_HEADER_SIZE > state->map_size || read_u32(state->map + base + offset) != id)
+                return 0;
+            checked = 1;
+        }
+        add_frame(state, &source->frame_count, base + offset + AVI_CHUNK_HEADER_SIZE, length);
+    }
+    return source->frame_count > 0;
+}
+
+// Finds the frames by going through every chunk of the movi list (files without an index)
+// - Chunks can be grouped in rec lists
+static void walk_movi(frame_source *source, avi_state *state, uint64_t movi, uint32_t movi_size) {
+    uint64_t position = movi, end = movi + movi_size;
+    while (position + AVI_CHUNK_HEADER_SIZE <= end) {
+        uint32_t id = read_u32(state->map + position);
+        uint32_t size = read_u32(state->map + position + 4);
+        if (id == fourcc("LIST")) {
+            position += AVI_LIST_HEADER_SIZE;
+            continue;
+        }
+        if (id == state->chunk_ids[0] || id == state->chunk_ids[1])
+            add_frame(state, &source->frame_count, position + AVI_CHUNK_HEADER_SIZE, size);
+        position += AVI_CHUNK_HEADER_SIZE + size + (size & 1);
+    }
+}
+
+// Returns a JPEG that stb_image can decode
+// - If the frame has no DHT segment before the scan, a copy with the standard tables is made
+static const unsigned char *prepare_jpeg(avi_state *state, const unsigned char *jpeg, uint32_t length, uint32_t *prepared_length) {
+    *prepared_length = length;
+    if (length < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8)
+        return jpeg;
+    uint32_t position = 2;
+    while (position + 4 <= length && jpeg[position] == 0xff) {
+        int marker = jpeg[position + 1];
+        if (marker == 0xc4)
+            return jpeg;
+        if (marker == 0xda)
+            break;
+        position += 2 + (jpeg[position + 2] << 8 | jpeg[position + 3]);
+    }
+    if (position + 4 > length || jpeg[position] != 0xff)
+        return jpeg;
+
+    size_t size = length + sizeof(default_huffman_tables);
+    if (size > state->jpeg_capacity) {
+        unsigned char *grown = (unsigned char *)realloc(state->jpeg, size);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed in prepare_jpeg()\n");
+            exit(1);
+        }
+        state->jpeg = grown;
+        state->jpeg_capacity = size;
+    }
+    memcpy(state->jpeg, jpeg, position);
+    memcpy(state->jpeg + position, default_huffman_tables, sizeof(default_huffman_tables));
+    memcpy(state->jpeg + position + sizeof(default_huffman_tables), jpeg + position, length - position);
+    *prepared_length = size;
+    return state->jpeg;
+}
+
+// Decodes the next frame straight from the mapping, the previous one is freed
+// - Dropped frames give the nearest earlier frame that has data (the first one that has
+// data if they are at the start), so frame i is always frame i after a seek
+static const unsigned char *next_avi_frame(frame_source *source) {
+    avi_state *state = (avi_state *)source->state;
+    if (state->current >= source->frame_count)
+        return NULL;
+    int shown = state->current;
+    while (shown > 0 && state->frames[shown].length == 0)
+        shown--;
+    while (shown < source->frame_count - 1 && state->frames[shown].length == 0)
+        shown++;
+    if (state->image && state->image_frame == shown) {
+        state->current++;
+        return state->image;
+    }
+    if (state->image)
+        free(state->image);
+    state->image = NULL;
+
+    if (state->current + 1 < source->frame_count) {
+        avi_frame *next = &state->frames[state->current + 1];
+        uint64_t aligned = next->offset - next->offset % state->page_size;
+        madvise((void *)(state->map + aligned), next->offset + next->length - aligned, MADV_WILLNEED);
+    }
+
+    avi_frame *frame = &state->frames[shown];
+    uint32_t length;
+    const unsigned char *jpeg = prepare_jpeg(state, state->map + frame->offset, frame->length, &length);
+    int width, height;
+    state->image = jpeg_load_scaled(jpeg, length, state->denominator, source->channels, &width, &height);
+    if (!state->image) {
+        fprintf(stderr, "Could not decode frame %d in next_avi_frame()\n", shown);
+        exit(1);
+    }
+    if (width != source->width || height != source->height) {
+        fprintf(stderr, "Frame %d is %dx%d instead of %dx%d in next_avi_frame()\n", shown, width, height, source->width, source->height);
+        exit(1);
+    }
+    state->image_frame = shown;
+    state->current++;
+    return state->image;
+}
+
+// Moves to a frame, the next call to next_frame gives it
+static int seek_avi_source(frame_source *source, int frame) {
+    avi_state *state = (avi_state *)source->state;
+    if (frame < 0 || frame >= source->frame_count)
+        return -1;
+    state->current = frame;
+    return 0;
+}
+
+static void close_avi_source(frame_source *source) {
+    avi_state *state = (avi_state *)source->state;
+    if (state->image)
+        free(state->image);
+    munmap((void *)state->map, state->map_size);
+    free(state->frames);
+    free(state->jpeg);
+    free(state);
+}
@@ -0,0 +1,558 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Frame folders, a directory of numbered image files
+// - The directory is scanned once with getdents64 and the names are sorted so
+// frame2 comes before frame10, no file name pattern has to be known
+// - Only the first frame is probed for the size
+// - The result is saved into a manifest (.duckframes in the folder) and used again
+// while the folder is not changed, so big folders open without a scan
+// - Manifest: "DUCKFRAMES 1 mtime_sec mtime_nsec count width height" and then one
+// name per line, mtime is the one of the folder after the manifest was written
+// - Frames are opened with openat() on the folder by their index
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "stb_image/stb_image.h"
+
+#include "jpeg.h"
+#include "prefetch.h"
+#include "qoi.h"
+#include "source.h"
+#include "trace.h"
+
+// Struct that keeps the state of a folder source between frames
+// - QOI frames are read into file and decoded into frame, both are reused
+// - Other frames are loaded by stb_image into image
+// - JPEG frames are decoded at 1/denominator size
+// - With a prefetcher the files of the next frames are read ahead, submitted is the
+// next frame to queue
+typedef struct folder_state {
+    const frame_folder *folder;
+    int current;
+    unsigned char *image;
+    int qoi;
+    unsigned char *file;
+    size_t file_capacity;
+    unsigned char *frame;
+    int denominator;
+    file_prefetcher *prefetcher;
+    int submitted;
+} folder_state;
+
+// Entry that getdents64 fills in, glibc does not declare it
+typedef struct folder_entry {
+    uint64_t inode;
+    int64_t offset;
+    unsigned short length;
+    unsigned char type;
+    char name[];
+} folder_entry;
+
+static int load_manifest(frame_folder *, const struct stat *);
+static void save_manifest(frame_folder *);
+static void scan_folder(frame_folder *);
+static void probe_folder(frame_folder *);
+static int is_frame_name(const char *);
+static const char *get_extension(const char *);
+static int compare_names(const void *, const void *);
+static void queue_folder_reads(folder_state *);
+static const unsigned char *next_folder_frame(frame_source *);
+static int seek_folder_source(frame_source *, int);
+static void close_folder_source(frame_source *);
+
+#define MANIFEST_NAME ".duckframes"
+#define MANIFEST_TEMPORARY_NAME ".duckframes.tmp"
+#define MANIFEST_MAGIC "DUCKFRAMES 1 "
+#define MANIFEST_TIME_SIZE 30
+#define FOLDER_SCAN_BUFFER_SIZE 65536
+#define FOLDER_FRAMERATE 30
+
+void open_frame_folder(frame_folder *folder, const char *path, int framerate) {
+    memset(folder, 0, sizeof(frame_folder));
+    folder->path = path;
+    folder->original_framerate = framerate > 0 ? framerate : FOLDER_FRAMERATE;
+    folder->directory = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat info;
+    if (folder->directory < 0 || fstat(folder->directory, &info) != 0) {
+        fprintf(stderr, "Could not open the folder %s in open_frame_folder()\n", path);
+        exit(1);
+    }
+    if (load_manifest(folder, &info))
+        return;
+
+    scan_folder(folder);
+    if (folder->count == 0) {
+        fprintf(stderr, "No frames in %s in open_frame_folder()\n", path);
+        exit(1);
+    }
+    probe_folder(folder);
+    save_manifest(folder);
+}
+
+const char *get_folder_frame_name(const frame_folder *folder, int index) {
+    return folder->names + folder->offsets[index];
+}
+
+int open_folder_frame(const frame_folder *folder, int index) {
+    return openat(folder->directory, get_folder_frame_name(folder, index), O_RDONLY | O_CLOEXEC);
+}
+
+size_t read_folder_frame(const frame_folder *folder, int index, unsigned char **buffer, size_t *capacity) {
+    int fd = open_folder_frame(folder, index);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Could not open %s in read_folder_frame()\n", get_folder_frame_name(folder, index));
+        exit(1);
+    }
+    size_t size = info.st_size;
+    if (size > *capacity) {
+        unsigned char *grown = (unsigned char *)realloc(*buffer, size);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed in read_folder_frame()\n");
+            exit(1);
+        }
+        *buffer = grown;
+        *capacity = size;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t result = read(fd, *buffer + done, size - done);
+        if (result <= 0) {
+            fprintf(stderr, "Could not read %s in read_folder_frame()\n", get_folder_frame_name(folder, index));
+            exit(1);
+        }
+        done += result;
+    }
+    close(fd);
+    return size;
+}
+
+void close_frame_folder(frame_folder *folder) {
+    close(folder->directory);
+    free(folder->names);
+    free(folder->offsets);
+}
+
+// Loads the names from the manifest if it was written after the last change of the folder
+// - Returns 0 if there is no usable manifest
+static int load_manifest(frame_folder *folder, const struct stat *info) {
+    int fd = openat(folder->directory, MANIFEST_NAME, O_RDONLY | O_CLOEXEC);
+    struct stat manifest_info;
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &manifest_info) != 0 || manifest_info.st_size < (off_t)sizeof(MANIFEST_MAGIC)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = manifest_info.st_size;
+    char *manifest = (char *)malloc(size + 1);
+    if (!manifest) {
+        fprintf(stderr, "Memory allocation failed in load_manifest()\n");
+        exit(1);
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t result = read(fd, manifest + done, size - done);
+        if (result <= 0)
+            break;
+        done += result;
+    }
+    close(fd);
+    manifest[done] = '\0';
+
+    long long seconds;
+    long nanoseconds;
+    int count, width, height, header_size = 0;
+    if (done != size || memcmp(manifest, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0 ||
+        sscanf(manifest + strlen(MANIFEST_MAGIC), "%lld %ld %d %d %d\n%n", &seconds, &nanoseconds, &count, &width, &height, &header_size) != 5 ||
+        header_size == 0 || seconds != (long long)info->st_mtim.tv_sec || nanoseconds != info->st_mtim.tv_nsec || count < 1 ||
+        width < 1 || height < 1) {
+        free(manifest);
+        return 0;
+    }
+
+    int *offsets = (int *)malloc(count * sizeof(int));
+    if (!offsets) {
+        fprintf(stderr, "Memory allocation failed in load_manifest()\n");
+        exit(1);
+    }
+    // Names are ended in place, the manifest becomes the name buffer
+    char *name = manifest + strlen(MANIFEST_MAGIC) + header_size;
+    int found = 0;
+    while (found < count && name < manifest + done) {
+        char *end = memchr(name, '\n', manifest + done - name);
+        if (!end)
+            break;
+        *end = '\0';
+        offsets[found++] = name - manifest;
+        name = end + 1;
+    }
+    if (found != count || strlen(get_extension(manifest + offsets[0])) >= FOLDER_EXTENSION_SIZE) {
+        free(offsets);
+        free(manifest);
+        return 0;
+    }
+    folder->names = manifest;
+    folder->offsets = offsets;
+    folder->count = count;
+    folder->width = width;
+    folder->height = height;
+    strcpy(folder->extension, get_extension(get_folder_frame_name(folder, 0)));
+    return 1;
+}
+
+// Writes the manifest next to the frames, a folder that can not be written is left alone
+// - Renaming the manifest in changes the folder, so its time is filled in after that
+static void save_manifest(frame_folder *folder) {
+    int fd = openat(folder->directory, MANIFEST_TEMPORARY_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    FILE *file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+        unlinkat(folder->directory, MANIFEST_TEMPORARY_NAME, 0);
+        return;
+    }
+    fprintf(file, "%s%0*d %d %d %d\n", MANIFEST_MAGIC, MANIFEST_TIME_SIZE, 0, folder->count, folder->width, folder->height);
+    for (int i = 0; i < folder->count; i++)
+        fprintf(file, "%s\n", get_folder_frame_name(folder, i));
+    if (fclose(file) != 0 || renameat(folder->directory, MANIFEST_TEMPORARY_NAME, folder->directory, MANIFEST_NAME) != 0) {
+        unlinkat(folder->directory, MANIFEST_TEMPORARY_NAME, 0);
+        return;
+    }
+
+    struct stat info;
+    char time[MANIFEST_TIME_SIZE + 1];
+    fd = openat(folder->directory, MANIFEST_NAME, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fstat(folder->directory, &info) == 0) {
+        snprintf(time, sizeof(time), "%020lld %09ld", (long long)info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+        pwrite(fd, time, MANIFEST_TIME_SIZE, strlen(MANIFEST_MAGIC));
+    }
+    close(fd);
+}
+
+// Reads every entry of the folder and keeps the frames in natural order
+// - Only files with the extension of the first frame are kept
+static void scan_folder(frame_folder *folder) {
+    char *entries = (char *)malloc(FOLDER_SCAN_BUFFER_SIZE);
+    size_t names_size = 0, names_capacity = 0;
+    int count = 0, capacity = 0;
+    char *names = NULL;
+    int *offsets = NULL;
+    if (!entries) {
+        fprintf(stderr, "Memory allocation failed in scan_folder()\n");
+        exit(1);
+    }
+    long read_size;
+    while ((read_size = syscall(SYS_getdents64, folder->directory, entries, FOLDER_SCAN_BUFFER_SIZE)) > 0) {
+        for (long position = 0; position < read_size;) {
+            folder_entry *entry = (folder_entry *)(entries + position);
+            position += entry->length;
+            if ((entry->type != DT_REG && entry->type != DT_LNK && entry->type != DT_UNKNOWN) || !is_frame_name(entry->name))
+                continue;
+            size_t length = strlen(entry->name) + 1;
+            if (names_size + length > names_capacity || count == capacity) {
+                names_capacity = names_capacity ? names_capacity * 2 : FOLDER_SCAN_BUFFER_SIZE;
+                capacity = capacity ? capacity * 2 : 1024;
+                names = (char *)realloc(names, names_capacity);
+                offsets = (int *)realloc(offsets, capacity * sizeof(int));
+                if (!names || !offsets) {
+                    fprintf(stderr, "Memory allocation failed in scan_folder()\n");
+                    exit(1);
+                }
+            }
+            memcpy(names + names_size, entry->name, length);
+            offsets[count++] = names_size;
+            names_size += length;
+        }
+    }
+    free(entries);
+    if (read_size < 0) {
+        fprintf(stderr, "Could not read the folder %s in scan_folder()\n", folder->path);
+        exit(1);
+    }
+
+    // Names are sorted as pointers and written again in order
+    const char **sorted = (const char **)malloc((count ? count : 1) * sizeof(char *));
+    char *sorted_names = (char *)malloc(names_size ? names_size : 1);
+    if (!sorted || !sorted_names) {
+        fprintf(stderr, "Memory allocation failed in scan_folder()\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++)
+        sorted[i] = names + offsets[i];
+    qsort(sorted, count, sizeof(char *), compare_names);
+    size_t position = 0;
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(get_extension(sorted[i]), get_extension(sorted[0])) != 0)
+            continue;
+        size_t length = strlen(sorted[i]) + 1;
+        memcpy(sorted_names + position, sorted[i], length);
+        offsets[kept++] = position;
+        position += length;
+    }
+    free(sorted);
+    free(names);
+    folder->names = sorted_names;
+    folder->offsets = offsets;
+    folder->count = kept;
+    if (kept)
+        strcpy(folder->extension, get_extension(get_folder_frame_name(folder, 0)));
+}
+
+// Reads the size of the first frame from its header, every frame should be that size
+static void probe_folder(frame_folder *folder) {
+    unsigned char header[QOI_HEADER_SIZE + QOI_PADDING_SIZE];
+    int fd = open_folder_frame(folder, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s in probe_folder()\n", get_folder_frame_name(folder, 0));
+        exit(1);
+    }
+    if (strcasecmp(folder->extension, ".qoi") == 0) {
+        int ok = read(fd, header, sizeof(header)) == sizeof(header) && qoi_read_header(header, sizeof(header), &folder->width, &folder->height);
+        close(fd);
+        if (!ok) {
+            fprintf(stderr, "%s is not a QOI image in probe_folder()\n", get_folder_frame_name(folder, 0));
+            exit(1);
+        }
+        return;
+    }
+    FILE *file = fdopen(fd, "rb");
+    int channels;
+    if (!file || !stbi_info_from_file(file, &folder->width, &folder->height, &channels)) {
+        fprintf(stderr, "%s is not a supported image in probe_folder()\n", get_folder_frame_name(folder, 0));
+        exit(1);
+    }
+    fclose(file);
+}
+
+// Returns 1 for files that look like frames (not hidden and an image extension)
+static int is_frame_name(const char *name) {
+    static const char *extensions[] = {".png", ".jpg", ".jpeg", ".qoi", ".bmp", ".tga", ".ppm", ".pgm"};
+    if (name[0] == '.')
+        return 0;
+    const char *extension = get_extension(name);
+    if (strlen(extension) >= FOLDER_EXTENSION_SIZE)
+        return 0;
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (strcasecmp(extension, extensions[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Returns the extension of a name with the dot ("" if there is none)
+static const char *get_extension(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot ? dot : name + strlen(name);
+}
+
+// Natural order, runs of digits are compared as numbers
+// - ex. frame9.png < frame10.png, frame010.png and frame10.png are ordered by the text
+static int compare_names(const void *a, const void *b) {
+    const char *first = *(const char *const *)a, *second = *(const char *const *)b;
+    const char *x = first, *y = second;
+    while (*x && *y) {
+        if (isdigit((unsigned char)*x) && isdigit((unsigned char)*y)) {
+            while (*x == '0')
+                x++;
+            while (*y == '0')
+                y++;
+            size_t x_digits = 0, y_digits = 0;
+            while (isdigit((unsigned char)x[x_digits]))
+                x_digits++;
+            while (isdigit((unsigned char)y[y_digits]))
+                y_digits++;
+            if (x_digits != y_digits)
+                return x_digits < y_digits ? -1 : 1;
+            int order = memcmp(x, y, x_digits);
+            if (order)
+                return order;
+            x += x_digits;
+            y += y_digits;
+            continue;
+        }
+        if (*x != *y)
+            return (unsigned char)*x - (unsigned char)*y;
+        x++;
+        y++;
+    }
+    if (*x || *y)
+        return (unsigned char)*x - (unsigned char)*y;
+    return strcmp(first, second);
+}
+
+void open_folder_source(frame_source *source, const frame_folder *folder, int channels, int min_width, int min_height, int read_ahead, int use_uring) {
+    folder_state *state = (folder_state *)calloc(1, sizeof(folder_state));
+    if (!state) {
+        fprintf(stderr, "Memory allocation failed in open_folder_source()\n");
+        exit(1);
+    }
+
+    state->folder = folder;
+    state->qoi = strcasecmp(folder->extension, ".qoi") == 0;
+    if (state->qoi) {
+        state->frame = (unsigned char *)malloc((size_t)folder->width * folder->height * channels);
+        if (!state->frame) {
+            fprintf(stderr, "Memory allocation failed in open_folder_source()\n");
+            exit(1);
+        }
+    }
+    if (read_ahead > 0) {
+        // Buffers fit twice the first frame, bigger files are finished in an extra buffer
+        struct stat info;
+        if (fstatat(folder->directory, get_folder_frame_name(folder, 0), &info, 0) != 0) {
+            fprintf(stderr, "Could not open %s in open_folder_source()\n", get_folder_frame_name(folder, 0));
+            exit(1);
+        }
+        size_t buffer_size = ((size_t)info.st_size * 2 + 65535) / 65536 * 65536;
+        state->prefetcher = (file_prefetcher *)malloc(sizeof(file_prefetcher));
+        if (!state->prefetcher) {
+            fprintf(stderr, "Memory allocation failed in open_folder_source()\n");
+            exit(1);
+        }
+        prefetch_init(state->prefetcher, read_ahead, buffer_size, use_uring);
+    }
+    state->denominator = 1;
+    if (strcasecmp(folder->extension, ".jpg") == 0 || strcasecmp(folder->extension, ".jpeg") == 0)
+        state->denominator = jpeg_pick_scale(folder->width, folder->height, min_width, min_height);
+    jpeg_scaled_size(folder->width, folder->height, state->denominator, &source->width, &source->height);
+    source->channels = channels;
+    source->stride = source->width * channels;
+    source->framerate = folder->original_framerate;
+    source->frame_count = folder->count;
+    source->period = 0;
+    source->state = state;
+    source->next_frame = next_folder_frame;
+    source->seek = seek_folder_source;
+    source->next_rows = NULL;
+    source->delay = 0;
+    source->close = close_folder_source;
+}
+
+// Queues reads for the next frames until every slot of the prefetcher is used
+static void queue_folder_reads(folder_state *state) {
+    const frame_folder *folder = state->folder;
+    if (state->submitted < state->current)
+        state->submitted = state->current;
+    while (state->submitted < folder->count && prefetch_has_room(state->prefetcher)) {
+        prefetch_submit(state->prefetcher, state->submitted, folder->directory, get_folder_frame_name(folder, state->submitted));
+        state->submitted++;
+    }
+}
+
+// Loads the next frame of the folder, the previous one is freed
+// - Read ahead files are decoded from memory and their slot is given back right away
+static const unsigned char *next_folder_frame(frame_source *source) {
+    folder_state *state = (folder_state *)source->state;
+    const frame_folder *folder = state->folder;
+    if (state->image)
+        stbi_image_free(state->image);
+    state->image = NULL;
+    if (state->current >= folder->count)
+        return NULL;
+
+    int width, height, channels;
+    const char *name = get_folder_frame_name(folder, state->current);
+    const unsigned char *file = NULL;
+    size_t size = 0;
+    if (state->prefetcher) {
+        queue_folder_reads(state);
+        file = prefetch_take(state->prefetcher, state->current, &size);
+        if (!file) {
+            fprintf(stderr, "Could not read %s in next_folder_frame()\n", name);
+            exit(1);
+        }
+    } else {
+        size = read_folder_frame(folder, state->current, &state->file, &state->file_capacity);
+        file = state->file;
+    }
+
+    if (state->qoi) {
+        if (!qoi_read_header(file, size, &width, &height)) {
+            fprintf(stderr, "%s is not a QOI image in next_folder_frame()\n", name);
+            exit(1);
+        }
+        if (width != source->width || height != source->height) {
+            fprintf(stderr, "%s is %dx%d instead of %dx%d in next_folder_frame()\n", name, width, height, source->width, source->height);
+            exit(1);
+        }
+        TRACE_BEGIN("qoi_decode");
+        int decoded = qoi_decode(file, size, state->frame, source->channels);
+        TRACE_END("qoi_decode");
+        if (!decoded) {
+            fprintf(stderr, "Could not decode %s in next_folder_frame()\n", name);
+            exit(1);
+        }
+        if (state->prefetcher)
+            prefetch_release(state->prefetcher, state->current);
+        state->current++;
+        return state->frame;
+    }
+    if (state->denominator > 1) {
+        TRACE_BEGIN("jpeg_load_scaled");
+        state->image = jpeg_load_scaled(file, size, state->denominator, source->channels, &width, &height);
+        TRACE_END("jpeg_load_scaled");
+    } else {
+        TRACE_BEGIN("stbi_load");
+        state->image = stbi_load_from_memory(file, size, &width, &height, &channels, source->channels);
+        TRACE_END("stbi_load");
+    }
+    if (state->prefetcher)
+        prefetch_release(state->prefetcher, state->current);
+    if (!state->image) {
+        fprintf(stderr, "Could not load %s in next_folder_frame()\n", name);
+        exit(1);
+    }
+    if (width != source->width || height != source->height) {
+        fprintf(stderr, "%s is %dx%d instead of %dx%d in next_folder_frame()\n", name, width, height, source->width, source->height);
+        exit(1);
+    }
+    state->current++;
+    return state->image;
+}
+
+// Moves to a frame, counting from the first frame of the folder
+static int seek_folder_source(frame_source *source, int frame) {
+    folder_state *state = (folder_state *)source->state;
+    if (frame < 0 || frame >= source->frame_count)
+        return -1;
+    state->current = frame;
+    if (state->prefetcher) {
+        prefetch_drain(state->prefetcher);
+        state->submitted = state->current;
+    }
+    return 0;
+}
+
+static void close_folder_source(frame_source *source) {
+    folder_state *state = (folder_state *)source->state;
+    if (state->image)
+        stbi_image_free(state->image);
+    if (state->prefetcher) {
+        prefetch_report(state->prefetcher, stderr);
+        prefetch_close(state->prefetcher);
+        free(state->prefetcher);
+    }
+    free(state->file);
+    free(state->frame);
+    free(state);
+}
@@ -0,0 +1,257 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Animated GIF source
+// - Every frame is decoded once by stb_image and kept in a compact cache
+// - RGB frames with up to 256 colors keep a palette and one index per pixel
+// - A frame that is the same as the one before it shares its cache entry
+// - Looping plays from the cache without decoding again
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stb_image/stb_image.h"
+
+#include "source.h"
+#include "trace.h"
+
+// Struct that represents a frame in the cache
+// - Palette size 0 means data has the pixels as they are
+// - Otherwise data has the palette (palette size * 3 bytes) and then the indices
+typedef struct gif_frame {
+    unsigned char *data;
+    int palette_size;
+    int delay;
+} gif_frame;
+
+// Struct that keeps the state of a GIF source between frames
+// - Loops 0 means the animation repeats forever
+typedef struct gif_state {
+    gif_frame *frames;
+    int gif_frame_count;
+    int current;
+    int loops;
+    int loop;
+    unsigned char *frame;
+    int expanded;
+} gif_state;
+
+static unsigned char *read_gif_file(const char *, int *);
+static void cache_frame(gif_state *, int, const unsigned char *, int, int, int);
+static const unsigned char *next_gif_frame(frame_source *);
+static int seek_gif_source(frame_source *, int);
+static void close_gif_source(frame_source *);
+
+#define GIF_MIN_DELAY 20
+#define GIF_DEFAULT_DELAY 100
+#define GIF_COLOR_TABLE_SIZE 1024
+#define GIF_EMPTY_COLOR 0xffffffffu
+
+void open_gif_source(frame_source *source, const char *path, int channels, int loops) {
+    gif_state *state = (gif_state *)calloc(1, sizeof(gif_state));
+    if (!state) {
+        fprintf(stderr, "Memory allocation failed in open_gif_source()\n");
+        exit(1);
+    }
+
+    int length;
+    unsigned char *file = read_gif_file(path, &length);
+    int *delays = NULL;
+    int width, height, count, file_channels;
+    TRACE_BEGIN("stbi_load");
+    unsigned char *pixels = stbi_load_gif_from_memory(file, length, &delays, &width, &height, &count, &file_channels, 4);
+    TRACE_END("stbi_load");
+    free(file);
+    if (!pixels || count < 1) {
+        fprintf(stderr, "Could not decode %s in open_gif_source(): %s\n", path, stbi_failure_reason());
+        exit(1);
+    }
+
+    state->frames = (gif_frame *)calloc(count, sizeof(gif_frame));
+    state->frame = (unsigned char *)malloc((size_t)width * height * channels);
+    if (!state->frames || !state->frame) {
+        fprintf(stderr, "Memory allocation failed in open_gif_source()\n");
+        exit(1);
+    }
+    state->gif_frame_count = count;
+    state->loops = loops;
+    state->expanded = -1;
+
+    // Browsers show very short delays as 100ms, most GIFs are made with that in mind
+    long total_delay = 0;
+    size_t frame_size = (size_t)width * height * 4;
+    for (int i = 0; i < count; i++) {
+        int delay = delays ? delays[i] : 0;
+        if (delay < GIF_MIN_DELAY)
+            delay = GIF_DEFAULT_DELAY;
+        if (i > 0 && memcmp(pixels + i * frame_size, pixels + (i - 1) * frame_size, frame_size) == 0) {
+            state->frames[i] = state->frames[i - 1];
+        } else {
+            cache_frame(state, i, pixels + i * frame_size, width, height, channels);
+        }
+        state->frames[i].delay = delay;
+        total_delay += delay;
+    }
+    stbi_image_free(pixels);
+    free(delays);
+
+    source->width = width;
+    source->height = height;
+    source->channels = channels;
+    source->stride = width * channels;
+    source->framerate = (int)(1000.0 * count / total_delay + 0.5);
+    if (source->framerate < 1)
+        source->framerate = 1;
+    source->frame_count = loops > 0 ? count * loops : -1;
+    source->period = count;
+    source->delay = state->frames[0].delay;
+    source->state = state;
+    source->next_frame = next_gif_frame;
+    source->seek = seek_gif_source;
+    source->next_rows = NULL;
+    source->close = close_gif_source;
+}
+
+// Reads the whole file, stb_image wants GIFs in memory
+static unsigned char *read_gif_file(const char *path, int *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s in read_gif_file()\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *buffer = (unsigned char *)malloc(size > 0 ? size : 1);
+    if (size < 0 || size > 0x7fffffff || !buffer || fread(buffer, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Could not read %s in read_gif_file()\n", path);
+        exit(1);
+    }
+    fclose(file);
+    *length = size;
+    return buffer;
+}
+
+// Stores an RGBA frame in the cache in the most compact way it fits in
+// - Luma frames are always 1 byte per pixel so they are stored as they are
+static void cache_frame(gif_state *state, int index, const unsigned char *rgba, int width, int height, int channels) {
+    gif_frame *frame = &state->frames[index];
+    size_t pixel_count = (size_t)width * height;
+
+    if (channels == 1) {
+        frame->data = (unsigned char *)malloc(pixel_count);
+        if (!frame->data) {
+            fprintf(stderr, "Memory allocation failed in cache_frame()\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < pixel_count; i++) {
+            const unsigned char *pixel = rgba + i * 4;
+            frame->data[i] = (pixel[0] * 77 + pixel[1] * 150 + pixel[2] * 29) >> 8;
+        }
+        return;
+    }
+
+    // Open addressing table from a packed color to its palette index
+    unsigned int colors[GIF_COLOR_TABLE_SIZE];
+    unsigned char color_indices[GIF_COLOR_TABLE_SIZE];
+    memset(colors, 0xff, sizeof(colors));
+    unsigned char *data = (unsigned char *)malloc(256 * 3 + pixel_count);
+    if (!data) {
+        fprintf(stderr, "Memory allocation failed in cache_frame()\n");
+        exit(1);
+    }
+    unsigned char *indices = data + 256 * 3;
+    int palette_size = 0;
+    for (size_t i = 0; i < pixel_count && palette_size <= 256; i++) {
+        const unsigned char *pixel = rgba + i * 4;
+        unsigned int color = pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+        unsigned int slot = (color * 2654435761u) >> 22;
+        while (colors[slot] != GIF_EMPTY_COLOR && colors[slot] != color)
+            slot = (slot + 1) & (GIF_COLOR_TABLE_SIZE - 1);
+        if (colors[slot] == GIF_EMPTY_COLOR) {
+            if (palette_size == 256) {
+                palette_size++;
+                break;
+            }
+            colors[slot] = color;
+            color_indices[slot] = palette_size;
+            memcpy(data + palette_size * 3, pixel, 3);
+            palette_size++;
+        }
+        indices[i] = color_indices[slot];
+    }
+
+    if (palette_size <= 256) {
+        // Indices go right after the used part of the palette
+        memmove(data + palette_size * 3, indices, pixel_count);
+        frame->data = (unsigned char *)realloc(data, palette_size * 3 + pixel_count);
+        if (!frame->data)
+            frame->data = data;
+        frame->palette_size = palette_size;
+        return;
+    }
+
+    // Too many colors after compositing, keep the RGB pixels
+    frame->data = (unsigned char *)realloc(data, pixel_count * 3);
+    if (!frame->data) {
+        fprintf(stderr, "Memory allocation failed in cache_frame()\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < pixel_count; i++)
+        memcpy(frame->data + i * 3, rgba + i * 4, 3);
+    frame->palette_size = 0;
+}
+
+// Gives the next frame from the cache, palette frames are expanded into the frame buffer
+// - Delay of the source is set to how long the frame should stay
+static const unsigned char *next_gif_frame(frame_source *source) {
+    gif_state *state = (gif_state *)source->state;
+    if (state->current == state->gif_frame_count) {
+        state->loop++;
+        if (state->loops > 0 && state->loop >= state->loops)
+            return NULL;
+        state->current = 0;
+    }
+
+    gif_frame *frame = &state->frames[state->current++];
+    source->delay = frame->delay;
+    if (frame->palette_size == 0)
+        return frame->data;
+    // Frames that share a cache entry are only expanded once
+    if (state->expanded >= 0 && state->frames[state->expanded].data == frame->data)
+        return state->frame;
+
+    const unsigned char *palette = frame->data;
+    const unsigned char *indices = frame->data + frame->palette_size * 3;
+    size_t pixel_count = (size_t)source->width * source->height;
+    for (size_t i = 0; i < pixel_count; i++)
+        memcpy(state->frame + i * 3, palette + indices[i] * 3, 3);
+    state->expanded = state->current - 1;
+    return state->frame;
+}
+
+// Moves to a frame, frames of later loops count after the first loop
+static int seek_gif_source(frame_source *source, int frame) {
+    gif_state *state = (gif_state *)source->state;
+    if (frame < 0 || (source->frame_count > 0 && frame >= source->frame_count))
+        return -1;
+    state->loop = frame / state->gif_frame_count;
+    state->current = frame % state->gif_frame_count;
+    return 0;
+}
+
+static void close_gif_source(frame_source *source) {
+    gif_state *state = (gif_state *)source->state;
+    for (int i = 0; i < state->gif_frame_count; i++) {
+        if (i == 0 || state->frames[i].data != state->frames[i - 1].data)
+            free(state->frames[i].data);
+    }
+    free(state->frames);
+    free(state->frame);
+    free(state);
+}
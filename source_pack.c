@@ -0,0 +1,454 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Frame packs, a whole frame folder in a single file
+// - Header: "DUCKPACK", version, width, height, framerate, frame count (u32 each)
+// - Index: offset (u64), length (u32), format (u32) for every frame
+// - Frames: the original files one after another, a file that is the same as an
+// earlier one is not written again and its index entry points to the earlier copy
+// - Every number is little endian
+// - Playback maps the file and only asks the kernel for the next few frames
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stb_image/stb_image.h"
+
+#include "frame_hash.h"
+#include "qoi.h"
+#include "source.h"
+#include "trace.h"
+
+// Struct that keeps the state of a pack source between frames
+// - Advised is the first frame that madvise has not been called for yet
+// - QOI frames are decoded into frame, other frames are loaded by stb_image into image
+// - In bands QOI frames are decoded a few rows at a time into band and the pages
+// of the frame up to released are dropped once they are read
+typedef struct pack_state {
+    const unsigned char *map;
+    size_t map_size;
+    const unsigned char *index;
+    int current;
+    int advised;
+    long page_size;
+    unsigned char *image;
+    unsigned char *frame;
+    qoi_decoder decoder;
+    int row;
+    unsigned char *band;
+    const unsigned char *released;
+} pack_state;
+
+static void write_u32(unsigned char *, uint32_t);
+static void write_u64(unsigned char *, uint64_t);
+static uint32_t read_u32(const unsigned char *);
+static uint64_t read_u64(const unsigned char *);
+static int find_packed_frame(FILE *, const unsigned char *, const uint64_t *, const int *, size_t, uint64_t, const unsigned char *, size_t);
+static void advise_frames(pack_state *, int, int);
+static void advise_range(pack_state *, uint64_t, uint64_t);
+static void advise_next_frames(frame_source *);
+static void release_pages(pack_state *, const unsigned char *);
+static const unsigned char *load_image_frame(frame_source *, const unsigned char *, uint32_t);
+static const unsigned char *next_pack_frame(frame_source *);
+static const unsigned char *next_pack_rows(frame_source *, int *, int *);
+static int seek_pack_source(frame_source *, int);
+static void close_pack_source(frame_source *);
+
+#define PACK_MAGIC "DUCKPACK"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 28
+#define PACK_INDEX_ENTRY_SIZE 16
+#define PACK_FORMAT_IMAGE 0
+#define PACK_FORMAT_QOI 1
+#define PACK_READAHEAD_FRAMES 8
+#define PACK_BAND_ROWS 16
+// Frame time is 1000 / framerate ms, more than this would make it 0
+#define PACK_MAX_FRAMERATE 1000
+
+void write_frame_pack(const frame_folder *folder, const char *pack_path) {
+    int frame_count = folder->count;
+    size_t index_size = (size_t)frame_count * PACK_INDEX_ENTRY_SIZE;
+    unsigned char header[PACK_HEADER_SIZE];
+    unsigned char *index = (unsigned char *)malloc(index_size);
+    if (!index) {
+        fprintf(stderr, "Memory allocation failed in write_frame_pack()\n");
+        exit(1);
+    }
+    FILE *pack = fopen(pack_path, "w+b");
+    if (!pack) {
+        fprintf(stderr, "Could not create %s in write_frame_pack()\n", pack_path);
+        exit(1);
+    }
+
+    memcpy(header, PACK_MAGIC, 8);
+    write_u32(header + 8, PACK_VERSION);
+    write_u32(header + 12, folder->width);
+    write_u32(header + 16, folder->height);
+    write_u32(header + 20, folder->original_framerate);
+    write_u32(header + 24, frame_count);
+    // Index is written again at the end when the offsets are known
+    memset(index, 0, index_size);
+    if (fwrite(header, 1, PACK_HEADER_SIZE, pack) != PACK_HEADER_SIZE || fwrite(index, 1, index_size, pack) != index_size) {
+        fprintf(stderr, "Could not write %s in write_frame_pack()\n", pack_path);
+        exit(1);
+    }
+
+    // Hash of every frame and a table from hash to frame index + 1 (open addressing, 0 is empty)
+    size_t table_size = 1;
+    while (table_size < (size_t)frame_count * 2)
+        table_size *= 2;
+    uint64_t *hashes = (uint64_t *)malloc(frame_count * sizeof(uint64_t));
+    int *table = (int *)calloc(table_size, sizeof(int));
+    if (!hashes || !table) {
+        fprintf(stderr, "Memory allocation failed in write_frame_pack()\n");
+        exit(1);
+    }
+
+    unsigned char *file = NULL;
+    size_t file_capacity = 0;
+    uint64_t offset = PACK_HEADER_SIZE + index_size;
+    int repeats = 0;
+    for (int i = 0; i < frame_count; i++) {
+        const char *name = get_folder_frame_name(folder, i);
+        size_t length = read_folder_frame(folder, i, &file, &file_capacity);
+        int width, height, channels;
+        int format = PACK_FORMAT_QOI;
+        if (!qoi_read_header(file, length, &width, &height)) {
+            format = PACK_FORMAT_IMAGE;
+            if (!stbi_info_from_memory(file, length, &width, &height, &channels)) {
+                fprintf(stderr, "%s is not a supported image in write_frame_pack()\n", name);
+                exit(1);
+            }
+        }
+        if (width != folder->width || height != folder->height) {
+            fprintf(stderr, "%s is %dx%d instead of %dx%d in write_frame_pack()\n", name, width, height, folder->width, folder->height);
+            exit(1);
+        }
+        write_u32(index + i * PACK_INDEX_ENTRY_SIZE + 8, length);
+        write_u32(index + i * PACK_INDEX_ENTRY_SIZE + 12, format);
+
+        hashes[i] = hash_bytes(file, length, 0);
+        int earlier = find_packed_frame(pack, index, hashes, table, table_size - 1, hashes[i], file, length);
+        if (earlier >= 0) {
+            memcpy(index + i * PACK_INDEX_ENTRY_SIZE, index + earlier * PACK_INDEX_ENTRY_SIZE, 8);
+            repeats++;
+            continue;
+        }
+        if (fwrite(file, 1, length, pack) != length) {
+            fprintf(stderr, "Could not write %s in write_frame_pack()\n", pack_path);
+            exit(1);
+        }
+        write_u64(index + i * PACK_INDEX_ENTRY_SIZE, offset);
+        offset += length;
+        size_t slot = hashes[i] & (table_size - 1);
+        while (table[slot])
+            slot = (slot + 1) & (table_size - 1);
+        table[slot] = i + 1;
+    }
+    free(file);
+    free(hashes);
+    free(table);
+    if (repeats > 0)
+        fprintf(stderr, "%d of %d frames were repeats and point to an earlier copy\n", repeats, frame_count);
+
+    if (fseek(pack, PACK_HEADER_SIZE, SEEK_SET) != 0 || fwrite(index, 1, index_size, pack) != index_size || fclose(pack) != 0) {
+        fprintf(stderr, "Could not write %s in write_frame_pack()\n", pack_path);
+        exit(1);
+    }
+    free(index);
+}
+
+void open_pack_source(frame_source *source, const char *path, int channels) {
+    pack_state *state = (pack_state *)calloc(1, sizeof(pack_state));
+    if (!state) {
+        fprintf(stderr, "Memory allocation failed in open_pack_source()\n");
+        exit(1);
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Could not open %s in open_pack_source()\n", path);
+        exit(1);
+    }
+    if ((size_t)info.st_size < PACK_HEADER_SIZE) {
+        fprintf(stderr, "%s is not a frame pack in open_pack_source()\n", path);
+        exit(1);
+    }
+    state->map_size = info.st_size;
+    state->map = (const unsigned char *)mmap(NULL, state->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (state->map == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s in open_pack_source()\n", path);
+        exit(1);
+    }
+    madvise((void *)state->map, state->map_size, MADV_SEQUENTIAL);
+
+    if (memcmp(state->map, PACK_MAGIC, 8) != 0 || read_u32(state->map + 8) != PACK_VERSION) {
+        fprintf(stderr, "%s is not a frame pack in open_pack_source()\n", path);
+        exit(1);
+    }
+    source->width = read_u32(state->map + 12);
+    source->height = read_u32(state->map + 16);
+    // A broken header could give 0 (frame time divides by it) or more than an int holds
+    uint32_t framerate = read_u32(state->map + 20);
+    source->framerate = framerate < 1 ? 1 : framerate > PACK_MAX_FRAMERATE ? PACK_MAX_FRAMERATE : (int)framerate;
+    source->frame_count = read_u32(state->map + 24);
+    source->period = 0;
+    source->channels = channels;
+    source->stride = source->width * channels;
+    source->state = state;
+    source->next_frame = next_pack_frame;
+    source->seek = seek_pack_source;
+    source->next_rows = next_pack_rows;
+    source->delay = 0;
+    source->close = close_pack_source;
+
+    // Every entry of the index has to point inside the file
+    state->index = state->map + PACK_HEADER_SIZE;
+    if (PACK_HEADER_SIZE + (uint64_t)source->frame_count * PACK_INDEX_ENTRY_SIZE > state->map_size) {
+        fprintf(stderr, "Index of %s is cut in open_pack_source()\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < source->frame_count; i++) {
+        const unsigned char *entry = state->index + i * PACK_INDEX_ENTRY_SIZE;
+        if (read_u64(entry) + read_u32(entry + 8) > state->map_size) {
+            fprintf(stderr, "Frame %d of %s is cut in open_pack_source()\n", i, path);
+            exit(1);
+        }
+    }
+
+    state->page_size = sysconf(_SC_PAGESIZE);
+    advise_frames(state, 0, PACK_READAHEAD_FRAMES < source->frame_count ? PACK_READAHEAD_FRAMES : source->frame_count);
+}
+
+// Looks for an earlier frame with the same bytes, returns its index or -1 if there is none
+// - Frames with the same hash are read back from the pack to be sure
+static int find_packed_frame(FILE *pack, const unsigned char *index, const uint64_t *hashes, const int *table, size_t mask, uint64_t hash, const unsigned char *file, size_t length) {
+    for (size_t slot = hash & mask; table[slot]; slot = (slot + 1) & mask) {
+        int earlier = table[slot] - 1;
+        const unsigned char *entry = index + earlier * PACK_INDEX_ENTRY_SIZE;
+        if (hashes[earlier] != hash || read_u32(entry + 8) != length)
+            continue;
+        unsigned char *copy = (unsigned char *)malloc(length);
+        if (!copy || fflush(pack) != 0 || pread(fileno(pack), copy, length, read_u64(entry)) != (ssize_t)length) {
+            fprintf(stderr, "Could not read the pack back in find_packed_frame()\n");
+            exit(1);
+        }
+        int same = memcmp(copy, file, length) == 0;
+        free(copy);
+        if (same)
+            return earlier;
+    }
+    return -1;
+}
+
+static void write_u32(unsigned char *buffer, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        buffer[i] = value >> (i * 8);
+}
+
+static void write_u64(unsigned char *buffer, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        buffer[i] = value >> (i * 8);
+}
+
+static uint32_t read_u32(const unsigned char *buffer) {
+    return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+static uint64_t read_u64(const unsigned char *buffer) {
+    return read_u32(buffer) | (uint64_t)read_u32(buffer + 4) << 32;
+}
+
+// Asks the kernel to start reading frames [first, end) before they are needed
+// - Repeated frames point at an earlier copy, so every entry is advised on its own and
+// only entries that follow each other in the file are merged into one range
+static void advise_frames(pack_state *state, int first, int end) {
+    uint64_t start = 0, stop = 0;
+    for (int i = first; i < end; i++) {
+        const unsigned char *entry = state->index + i * PACK_INDEX_ENTRY_SIZE;
+        uint64_t offset = read_u64(entry), length = read_u32(entry + 8);
+        if (length == 0)
+            continue;
+        if (offset == stop && stop > start) {
+            stop += length;
+            continue;
+        }
+        advise_range(state, start, stop);
+        start = offset;
+        stop = offset + length;
+    }
+    advise_range(state, start, stop);
+    state->advised = end;
+}
+
+static void advise_range(pack_state *state, uint64_t start, uint64_t stop) {
+    if (stop <= start)
+        return;
+    uint64_t aligned = start - start % state->page_size;
+    madvise((void *)(state->map + aligned), stop - aligned, MADV_WILLNEED);
+}
+
+// Window moves one frame at a time so every frame is advised once
+static void advise_next_frames(frame_source *source) {
+    pack_state *state = (pack_state *)source->state;
+    int window_end = state->current + PACK_READAHEAD_FRAMES;
+    if (window_end > source->frame_count)
+        window_end = source->frame_count;
+    if (window_end > state->advised)
+        advise_frames(state, state->advised, window_end);
+}
+
+// Drops the pages of the mapping that were read up to end from memory
+// - They are read from the file again if they are needed later
+// - Released only moves forward, a repeated frame that points behind it drops nothing
+static void release_pages(pack_state *state, const unsigned char *end) {
+    if (end <= state->released)
+        return;
+    size_t start = (state->released - state->map) - (state->released - state->map) % state->page_size;
+    size_t stop = (end - state->map) - (end - state->map) % state->page_size;
+    if (stop > start)
+        madvise((void *)(state->map + start), stop - start, MADV_DONTNEED);
+    state->released = end;
+}
+
+// Loads a frame that is not QOI with stb_image into image
+static const unsigned char *load_image_frame(frame_source *source, const unsigned char *entry, uint32_t format) {
+    pack_state *state = (pack_state *)source->state;
+    if (format != PACK_FORMAT_IMAGE) {
+        fprintf(stderr, "Frame %d has unknown format %u in load_image_frame()\n", state->current, format);
+        exit(1);
+    }
+    int width, height, channels;
+    TRACE_BEGIN("stbi_load");
+    state->image = stbi_load_from_memory(state->map + read_u64(entry), read_u32(entry + 8), &width, &height, &channels, source->channels);
+    TRACE_END("stbi_load");
+    if (!state->image) {
+        fprintf(stderr, "Could not decode frame %d in load_image_frame()\n", state->current);
+        exit(1);
+    }
+    if (width != source->width || height != source->height) {
+        fprintf(stderr, "Frame %d is %dx%d instead of %dx%d in load_image_frame()\n", state->current, width, height, source->width, source->height);
+        exit(1);
+    }
+    state->current++;
+    return state->image;
+}
+
+// Decodes the next frame straight from the mapping, the previous one is freed
+static const unsigned char *next_pack_frame(frame_source *source) {
+    pack_state *state = (pack_state *)source->state;
+    if (state->image)
+        stbi_image_free(state->image);
+    state->image = NULL;
+    if (state->current >= source->frame_count)
+        return NULL;
+    advise_next_frames(source);
+
+    const unsigned char *entry = state->index + state->current * PACK_INDEX_ENTRY_SIZE;
+    uint64_t offset = read_u64(entry);
+    uint32_t length = read_u32(entry + 8);
+    uint32_t format = read_u32(entry + 12);
+    if (format != PACK_FORMAT_QOI)
+        return load_image_frame(source, entry, format);
+
+    int width, height;
+    if (!state->frame)
+        state->frame = (unsigned char *)malloc((size_t)source->width * source->height * source->channels);
+    if (!state->frame) {
+        fprintf(stderr, "Memory allocation failed in next_pack_frame()\n");
+        exit(1);
+    }
+    if (!qoi_read_header(state->map + offset, length, &width, &height) || width != source->width || height != source->height ||
+        !qoi_decode(state->map + offset, length, state->frame, source->channels)) {
+        fprintf(stderr, "Could not decode frame %d in next_pack_frame()\n", state->current);
+        exit(1);
+    }
+    state->current++;
+    return state->frame;
+}
+
+// Gives the next band of rows, QOI frames are decoded PACK_BAND_ROWS rows at a time
+// - Other frames can not be decoded in parts and are given as a single band
+static const unsigned char *next_pack_rows(frame_source *source, int *first_row, int *count) {
+    pack_state *state = (pack_state *)source->state;
+    if (state->row == 0) {
+        if (state->image)
+            stbi_image_free(state->image);
+        state->image = NULL;
+        if (state->current >= source->frame_count)
+            return NULL;
+        advise_next_frames(source);
+
+        const unsigned char *entry = state->index + state->current * PACK_INDEX_ENTRY_SIZE;
+        uint64_t offset = read_u64(entry);
+        uint32_t format = read_u32(entry + 12);
+        if (format != PACK_FORMAT_QOI) {
+            *first_row = 0;
+            *count = source->height;
+            return load_image_frame(source, entry, format);
+        }
+        if (!qoi_decoder_start(&state->decoder, state->map + offset, read_u32(entry + 8)) ||
+            state->decoder.width != source->width || state->decoder.height != source->height) {
+            fprintf(stderr, "Could not decode frame %d in next_pack_rows()\n", state->current);
+            exit(1);
+        }
+        if (state->map + offset > state->released)
+            state->released = state->map + offset;
+    }
+
+    if (!state->band)
+        state->band = (unsigned char *)malloc((size_t)PACK_BAND_ROWS * source->stride);
+    if (!state->band) {
+        fprintf(stderr, "Memory allocation failed in next_pack_rows()\n");
+        exit(1);
+    }
+    int rows = source->height - state->row;
+    if (rows > PACK_BAND_ROWS)
+        rows = PACK_BAND_ROWS;
+    if (!qoi_decode_rows(&state->decoder, state->band, rows, source->channels)) {
+        fprintf(stderr, "Could not decode frame %d in next_pack_rows()\n", state->current);
+        exit(1);
+    }
+    release_pages(state, state->decoder.position);
+    *first_row = state->row;
+    *count = rows;
+    state->row += rows;
+    if (state->row == source->height) {
+        state->row = 0;
+        state->current++;
+    }
+    return state->band;
+}
+
+// Moves to a frame, the read ahead window starts again from there
+static int seek_pack_source(frame_source *source, int frame) {
+    pack_state *state = (pack_state *)source->state;
+    if (frame < 0 || frame >= source->frame_count)
+        return -1;
+    state->current = frame;
+    state->advised = frame;
+    state->row = 0;
+    return 0;
+}
+
+static void close_pack_source(frame_source *source) {
+    pack_state *state = (pack_state *)source->state;
+    if (state->image)
+        stbi_image_free(state->image);
+    munmap((void *)state->map, state->map_size);
+    free(state->frame);
+    free(state->band);
+    free(state);
+}
@@ -0,0 +1,435 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Preloading, a source that decodes another one into memory in the background
+// - Every worker thread has its own copy of the inner source and takes frames a
+// chunk at a time, playback starts right away and only waits for a frame that
+// is not decoded yet
+// - Frames are kept compressed, a row is runs that are copied from the row above
+// and runs that are stored as they are, so getting a frame back is only memcpy
+// - When the budget is used up the frames from there on are streamed from the
+// first inner source, the stored ones still play from memory on every loop
+// - Frames that are the same as an earlier one are stored once, the repeat only
+// points to the earlier data (found by the hash of the compressed frame)
+// - How much was stored and how long it took is printed when the source is closed
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_hash.h"
+#include "perf_counters.h"
+#include "source.h"
+#include "trace.h"
+
+// Struct that represents a frame in the store
+// - Data is NULL until a worker stored it
+// - Repeat is 1 if data belongs to an earlier frame with the same contents
+typedef struct preload_frame {
+    unsigned char *data;
+    size_t size;
+    int delay;
+    uint64_t hash;
+    int repeat;
+} preload_frame;
+
+struct preload_state;
+
+// Argument of a worker thread, the worker uses the inner source at index
+typedef struct preload_worker {
+    struct preload_state *state;
+    int index;
+    pthread_t thread;
+} preload_worker;
+
+// Struct that keeps the state of a preload source between frames
+// - Limit is the first frame that is streamed instead of stored (frame count if every frame fit),
+// frames after it that another worker stored before it was lowered still play from memory
+// - Next is the first frame no worker took yet, workers stop once it reaches the limit
+// - Running is how many workers did not finish yet, the first inner source is only
+// used for streaming after every worker finished
+// - Streamed is the frame the first inner source gives next (-1 if it has to seek)
+// - Table has the index + 1 of every stored frame that is not a repeat at the slot of
+// its hash (open addressing, 0 is an empty slot), it is twice the frame count rounded up
+typedef struct preload_state {
+    frame_source *sources;
+    preload_worker *workers;
+    int worker_count;
+    int running;
+    preload_frame *frames;
+    int frame_count;
+    int *table;
+    size_t table_mask;
+    int repeats;
+    int limit;
+    int next;
+    int stop;
+    size_t budget;
+    size_t used;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int current;
+    int loops;
+    int loop;
+    int streamed;
+    unsigned char *frame;
+    size_t row_size;
+    struct timespec started;
+    struct timespec finished;
+} preload_state;
+
+static void *preload_frames(void *);
+static int claim_frames(preload_state *);
+static void store_frame(preload_state *, int, const unsigned char *, size_t, int);
+static preload_frame *find_stored_frame(const preload_state *, uint64_t, const unsigned char *, size_t);
+static size_t compress_frame(const unsigned char *, int, size_t, int, unsigned char *);
+static unsigned char *put_run(unsigned char *, int, const unsigned char *, size_t);
+static void decompress_frame(const unsigned char *, size_t, size_t, unsigned char *);
+static const unsigned char *get_streamed_frame(frame_source *, int);
+static const unsigned char *next_preload_frame(frame_source *);
+static int seek_preload_source(frame_source *, int);
+static void report_preload(const preload_state *, int, FILE *);
+static void close_preload_source(frame_source *);
+
+#define PRELOAD_CHUNK_FRAMES 8
+#define PRELOAD_MIN_COPY 4
+#define PRELOAD_MAX_RUN 128
+#define PRELOAD_COPY_RUN 0x00
+#define PRELOAD_STORED_RUN 0x80
+
+void open_preload_source(frame_source *source, frame_source *sources, int source_count, size_t budget, int loops) {
+    preload_state *state = (preload_state *)calloc(1, sizeof(preload_state));
+    if (!state) {
+        fprintf(stderr, "Memory allocation failed in open_preload_source()\n");
+        exit(1);
+    }
+    if (!sources[0].seek || sources[0].frame_count <= 0) {
+        fprintf(stderr, "Only sources that can seek and know their length can be preloaded in open_preload_source()\n");
+        exit(1);
+    }
+
+    state->worker_count = source_count;
+    state->frame_count = sources[0].frame_count;
+    state->limit = state->frame_count;
+    state->budget = budget;
+    state->loops = loops;
+    state->streamed = -1;
+    state->row_size = (size_t)sources[0].width * sources[0].channels;
+    state->sources = (frame_source *)malloc(source_count * sizeof(frame_source));
+    state->workers = (preload_worker *)malloc(source_count * sizeof(preload_worker));
+    state->frames = (preload_frame *)calloc(state->frame_count, sizeof(preload_frame));
+    state->frame = (unsigned char *)malloc(state->row_size * sources[0].height);
+    size_t table_size = 1;
+    while (table_size < (size_t)state->frame_count * 2)
+        table_size *= 2;
+    state->table = (int *)calloc(table_size, sizeof(int));
+    state->table_mask = table_size - 1;
+    if (!state->sources || !state->workers || !state->frames || !state->frame || !state->table) {
+        fprintf(stderr, "Memory allocation failed in open_preload_source()\n");
+        exit(1);
+    }
+    memcpy(state->sources, sources, source_count * sizeof(frame_source));
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->changed, NULL);
+
+    source->width = sources[0].width;
+    source->height = sources[0].height;
+    source->channels = sources[0].channels;
+    source->stride = state->row_size;
+    source->framerate = sources[0].framerate;
+    source->frame_count = loops > 0 ? state->frame_count * loops : -1;
+    source->period = state->frame_count;
+    source->delay = 0;
+    source->state = state;
+    source->next_frame = next_preload_frame;
+    source->seek = seek_preload_source;
+    source->next_rows = NULL;
+    source->close = close_preload_source;
+
+    state->running = source_count;
+    clock_gettime(CLOCK_MONOTONIC, &state->started);
+    for (int i = 0; i < source_count; i++) {
+        state->workers[i].state = state;
+        state->workers[i].index = i;
+        if (pthread_create(&state->workers[i].thread, NULL, preload_frames, &state->workers[i])) {
+            fprintf(stderr, "Could not create a thread in open_preload_source()\n");
+            exit(1);
+        }
+    }
+}
+
+// Worker thread, decodes chunks of frames with its own inner source and stores them
+static void *preload_frames(void *argument) {
+    preload_worker *worker = (preload_worker *)argument;
+    preload_state *state = worker->state;
+    frame_source *inner = &state->sources[worker->index];
+    unsigned char *compressed = (unsigned char *)malloc((state->row_size + state->row_size / 64 + 4) * inner->height);
+    if (!compressed) {
+        fprintf(stderr, "Memory allocation failed in preload_frames()\n");
+        exit(1);
+    }
+
+    int position = 0;
+    int first;
+    TRACE_THREAD("preload");
+    while ((first = claim_frames(state)) >= 0) {
+        if (first != position && inner->seek(inner, first) != 0) {
+            fprintf(stderr, "Could not seek to frame %d in preload_frames()\n", first);
+            exit(1);
+        }
+        position = first;
+        for (int i = first; i < first + PRELOAD_CHUNK_FRAMES && i < state->frame_count; i++) {
+            TRACE_BEGIN("decode");
+            PERF_STAGE("preload", 1);
+            const unsigned char *frame = inner->next_frame(inner);
+            PERF_STAGE("preload", 0);
+            TRACE_END("decode");
+            if (!frame) {
+                fprintf(stderr, "Frame %d is missing in preload_frames()\n", i);
+                exit(1);
+            }
+            position++;
+            TRACE_BEGIN("compress");
+            size_t size = compress_frame(frame, inner->stride, state->row_size, inner->height, compressed);
+            store_frame(state, i, compressed, size, inner->delay);
+            TRACE_END("compress");
+        }
+    }
+
+    free(compressed);
+    pthread_mutex_lock(&state->lock);
+    if (--state->running == 0)
+        clock_gettime(CLOCK_MONOTONIC, &state->finished);
+    pthread_cond_broadcast(&state->changed);
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// Takes the next chunk of frames, returns its first frame or -1 if there is nothing left
+static int claim_frames(preload_state *state) {
+    pthread_mutex_lock(&state->lock);
+    int first = -1;
+    if (!state->stop && state->next < state->limit) {
+        first = state->next;
+        state->next += PRELOAD_CHUNK_FRAMES;
+    }
+    pthread_mutex_unlock(&state->lock);
+    return first;
+}
+
+// Copies a compressed frame into the store if it fits into the budget
+// - A repeat of a stored frame only points to it and does not use any of the budget
+// - A frame that does not fit makes it the limit, frames after it are streamed
+static void store_frame(preload_state *state, int index, const unsigned char *compressed, size_t size, int delay) {
+    uint64_t hash = hash_bytes(compressed, size, 0);
+    unsigned char *data = (unsigned char *)malloc(size);
+    pthread_mutex_lock(&state->lock);
+    preload_frame *frame = &state->frames[index];
+    preload_frame *stored = index < state->limit ? find_stored_frame(state, hash, compressed, size) : NULL;
+    if (stored) {
+        frame->data = stored->data;
+        frame->size = size;
+        frame->repeat = 1;
+        state->repeats++;
+    } else if (index < state->limit && data && state->used + size <= state->budget) {
+        memcpy(data, compressed, size);
+        frame->data = data;
+        frame->size = size;
+        frame->hash = hash;
+        state->used += size;
+        size_t slot = hash & state->table_mask;
+        while (state->table[slot])
+            slot = (slot + 1) & state->table_mask;
+        state->table[slot] = index + 1;
+        data = NULL;
+    } else if (index < state->limit) {
+        state->limit = index;
+    }
+    frame->delay = delay;
+    pthread_cond_broadcast(&state->changed);
+    pthread_mutex_unlock(&state->lock);
+    free(data);
+}
+
+// Looks for a stored frame with the same compressed bytes, returns NULL if there is none
+// - Called with the lock held
+static preload_frame *find_stored_frame(const preload_state *state, uint64_t hash, const unsigned char *compressed, size_t size) {
+    for (size_t slot = hash & state->table_mask; state->table[slot]; slot = (slot + 1) & state->table_mask) {
+        preload_frame *frame = &state->frames[state->table[slot] - 1];
+        if (frame->hash == hash && frame->size == size && memcmp(frame->data, compressed, size) == 0)
+            return frame;
+    }
+    return NULL;
+}
+
+// Compresses every row against the row above it, returns the compressed size
+// - Output has to fit (row size + row size / 64 + 4) bytes for every row
+// - Bytes that are the same as the ones above for at least PRELOAD_MIN_COPY bytes
+// become a copy run, everything else is stored as it is
+static size_t compress_frame(const unsigned char *frame, int stride, size_t row_size, int height, unsigned char *output) {
+    unsigned char *out = output;
+    for (int y = 0; y < height; y++) {
+        const unsigned char *row = frame + (size_t)y * stride;
+        const unsigned char *above = y > 0 ? row - stride : NULL;
+        size_t stored_start = 0, x = 0;
+        while (x < row_size) {
+            size_t same = 0;
+            if (above) {
+                while (x + same < row_size && row[x + same] == above[x + same])
+                    same++;
+            }
+            if (same < PRELOAD_MIN_COPY) {
+                x += same ? same : 1;
+                continue;
+            }
+            out = put_run(out, PRELOAD_STORED_RUN, row + stored_start, x - stored_start);
+            out = put_run(out, PRELOAD_COPY_RUN, NULL, same);
+            x += same;
+            stored_start = x;
+        }
+        out = put_run(out, PRELOAD_STORED_RUN, row + stored_start, row_size - stored_start);
+    }
+    return out - output;
+}
+
+// Writes a run as tokens of up to PRELOAD_MAX_RUN bytes, stored runs are followed by their bytes
+static unsigned char *put_run(unsigned char *out, int type, const unsigned char *bytes, size_t length) {
+    while (length > 0) {
+        size_t part = length < PRELOAD_MAX_RUN ? length : PRELOAD_MAX_RUN;
+        *out++ = type | (part - 1);
+        if (type == PRELOAD_STORED_RUN) {
+            memcpy(out, bytes, part);
+            out += part;
+            bytes += part;
+        }
+        length -= part;
+    }
+    return out;
+}
+
+static void decompress_frame(const unsigned char *data, size_t size, size_t row_size, unsigned char *frame) {
+    const unsigned char *end = data + size;
+    unsigned char *out = frame;
+    while (data < end) {
+        size_t length = (*data & (PRELOAD_MAX_RUN - 1)) + 1;
+        if (*data++ & PRELOAD_STORED_RUN) {
+            memcpy(out, data, length);
+            data += length;
+        } else {
+            memcpy(out, out - row_size, length);
+        }
+        out += length;
+    }
+}
+
+// Gives frame index from the first inner source once the workers are done with it
+static const unsigned char *get_streamed_frame(frame_source *source, int index) {
+    preload_state *state = (preload_state *)source->state;
+    frame_source *inner = &state->sources[0];
+    pthread_mutex_lock(&state->lock);
+    while (state->running > 0)
+        pthread_cond_wait(&state->changed, &state->lock);
+    pthread_mutex_unlock(&state->lock);
+
+    if (state->streamed != index && inner->seek(inner, index) != 0) {
+        fprintf(stderr, "Could not seek to frame %d in get_streamed_frame()\n", index);
+        exit(1);
+    }
+    const unsigned char *frame = inner->next_frame(inner);
+    state->streamed = index + 1;
+    if (!frame)
+        return NULL;
+    source->delay = inner->delay;
+    // Rows are packed the same way as stored frames
+    if (inner->stride == (int)state->row_size)
+        return frame;
+    for (int y = 0; y < source->height; y++)
+        memcpy(state->frame + y * state->row_size, frame + (size_t)y * inner->stride, state->row_size);
+    return state->frame;
+}
+
+// Gives the next frame from the store, waits for the workers if it is not there yet
+// - Data of a frame never changes once it is stored, so it is read without the lock
+static const unsigned char *next_preload_frame(frame_source *source) {
+    preload_state *state = (preload_state *)source->state;
+    if (state->current == state->frame_count) {
+        state->loop++;
+        if (state->loops > 0 && state->loop >= state->loops)
+            return NULL;
+        state->current = 0;
+    }
+
+    int index = state->current++;
+    pthread_mutex_lock(&state->lock);
+    if (index < state->limit && !state->frames[index].data) {
+        TRACE_BEGIN("wait for preload");
+        while (index < state->limit && !state->frames[index].data)
+            pthread_cond_wait(&state->changed, &state->lock);
+        TRACE_END("wait for preload");
+    }
+    int stored = state->frames[index].data != NULL;
+    // Frames the workers took after this one, the first loop is the only one they decode
+    TRACE_COUNTER("preload frames ahead", state->loop == 0 && state->next > index ? state->next - index - 1 : 0);
+    pthread_mutex_unlock(&state->lock);
+    if (!stored)
+        return get_streamed_frame(source, index);
+
+    preload_frame *frame = &state->frames[index];
+    decompress_frame(frame->data, frame->size, state->row_size, state->frame);
+    source->delay = frame->delay;
+    return state->frame;
+}
+
+// Moves to a frame, frames of later loops count after the first loop
+static int seek_preload_source(frame_source *source, int frame) {
+    preload_state *state = (preload_state *)source->state;
+    if (frame < 0 || (source->frame_count > 0 && frame >= source->frame_count))
+        return -1;
+    state->loop = frame / state->frame_count;
+    state->current = frame % state->frame_count;
+    return 0;
+}
+
+// Prints how many frames were stored, how small they got and how long decoding took
+static void report_preload(const preload_state *state, int height, FILE *file) {
+    int stored = 0;
+    for (int i = 0; i < state->frame_count; i++)
+        stored += state->frames[i].data != NULL;
+    if (stored == 0)
+        return;
+    double raw = (double)stored * state->row_size * height;
+    double seconds = (state->finished.tv_sec - state->started.tv_sec) + (state->finished.tv_nsec - state->started.tv_nsec) / 1e9;
+    fprintf(file, "Preloaded %d of %d frames (%d repeats) into %.1f MB (%.1fx smaller) in %.2f s with %d threads\n", stored,
+            state->frame_count, state->repeats, state->used / 1e6, raw / state->used, seconds > 0 ? seconds : 0, state->worker_count);
+}
+
+static void close_preload_source(frame_source *source) {
+    preload_state *state = (preload_state *)source->state;
+    pthread_mutex_lock(&state->lock);
+    state->stop = 1;
+    pthread_mutex_unlock(&state->lock);
+    for (int i = 0; i < state->worker_count; i++)
+        pthread_join(state->workers[i].thread, NULL);
+    report_preload(state, source->height, stderr);
+    for (int i = 0; i < state->worker_count; i++)
+        state->sources[i].close(&state->sources[i]);
+    for (int i = 0; i < state->frame_count; i++) {
+        if (!state->frames[i].repeat)
+            free(state->frames[i].data);
+    }
+    pthread_mutex_destroy(&state->lock);
+    pthread_cond_destroy(&state->changed);
+    free(state->sources);
+    free(state->workers);
+    free(state->frames);
+    free(state->table);
+    free(state->frame);
+    free(state);
+}
@@ -0,0 +1,157 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Shared memory frame ring source, see shm_ring.h for the layout
+// - ./ring_producer /duckring 288x216 30 & ./output -R /duckring
+// - Frames are rendered straight out of the ring, nothing is copied
+// - The newest frame is always taken, frames the reader was too slow for are skipped
+// - If the producer stalls the reader waits for the next frame
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+#include "source.h"
+#include "trace.h"
+
+// Struct that keeps the state of a ring source between frames
+// - Sequence is the one of the last given frame (0 before the first one)
+// - Slot count and size are copies of the checked header, the producer can still write to it
+typedef struct shm_state {
+    shm_ring_header *header;
+    shm_ring_slot *slots;
+    unsigned char *data;
+    size_t map_size;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint64_t sequence;
+} shm_state;
+
+static int producer_gone(const shm_ring_header *);
+static const unsigned char *next_shm_frame(frame_source *);
+static void close_shm_source(frame_source *);
+
+#define SHM_POLL_NS 1000000
+#define SHM_LIVENESS_POLLS 100
+#define SHM_MAX_FRAMERATE 1000
+
+void open_shm_source(frame_source *source, const char *name) {
+    shm_state *state = (shm_state *)calloc(1, sizeof(shm_state));
+    if (!state) {
+        fprintf(stderr, "Memory allocation failed in open_shm_source()\n");
+        exit(1);
+    }
+
+    int fd = shm_open(name, O_RDWR, 0);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Could not open the ring %s in open_shm_source()\n", name);
+        exit(1);
+    }
+    if ((size_t)info.st_size < sizeof(shm_ring_header)) {
+        fprintf(stderr, "%s is not a frame ring in open_shm_source()\n", name);
+        exit(1);
+    }
+    state->map_size = info.st_size;
+    void *map = mmap(NULL, state->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map the ring %s in open_shm_source()\n", name);
+        exit(1);
+    }
+
+    // Everything in the header has to fit in the mapping before the slots are used
+    shm_ring_header *header = (shm_ring_header *)map;
+    if (memcmp(header->magic, SHM_RING_MAGIC, 8) != 0 || header->version != SHM_RING_VERSION) {
+        fprintf(stderr, "%s is not a frame ring in open_shm_source()\n", name);
+        exit(1);
+    }
+    // Header is read once into locals, every size is checked by division so nothing can wrap
+    uint32_t width = header->width, height = header->height, channels = header->channels;
+    uint32_t stride = header->stride, framerate = header->framerate, slot_count = header->slot_count;
+    uint64_t slot_size = header->slot_size, data_offset = header->data_offset;
+    if (width < 1 || height < 1 || (channels != 1 && channels != 3) || stride / channels < width ||
+        slot_count < SHM_RING_MIN_SLOTS || slot_count > SHM_RING_MAX_SLOTS || slot_size / height < stride ||
+        data_offset < sizeof(shm_ring_header) + (uint64_t)slot_count * sizeof(shm_ring_slot) ||
+        data_offset > state->map_size || (state->map_size - data_offset) / slot_count < slot_size) {
+        fprintf(stderr, "Header of the ring %s is broken in open_shm_source()\n", name);
+        exit(1);
+    }
+    state->header = header;
+    state->slots = (shm_ring_slot *)(header + 1);
+    state->data = (unsigned char *)map + data_offset;
+    state->slot_count = slot_count;
+    state->slot_size = slot_size;
+
+    source->width = width;
+    source->height = height;
+    source->channels = channels;
+    source->stride = stride;
+    source->framerate = framerate < 1 ? 30 : framerate > SHM_MAX_FRAMERATE ? SHM_MAX_FRAMERATE : (int)framerate;
+    source->frame_count = -1;
+    source->period = 0;
+    source->delay = 0;
+    source->state = state;
+    source->next_frame = next_shm_frame;
+    source->seek = NULL;
+    source->next_rows = NULL;
+    source->close = close_shm_source;
+}
+
+// Returns 1 if the producer closed the ring or is not running anymore
+static int producer_gone(const shm_ring_header *header) {
+    if (atomic_load(&header->closed))
+        return 1;
+    return header->producer_pid > 0 && kill(header->producer_pid, 0) != 0 && errno == ESRCH;
+}
+
+// Claims the newest frame of the ring, the slot given before is released by that
+// - Waits while there is nothing newer than the last given frame
+// - Returns NULL once the producer is gone and every frame was given
+static const unsigned char *next_shm_frame(frame_source *source) {
+    shm_state *state = (shm_state *)source->state;
+    shm_ring_header *header = state->header;
+    struct timespec poll_time = {0, SHM_POLL_NS};
+    int polls = 0;
+    while (1) {
+        uint64_t latest = atomic_load_explicit(&header->latest, memory_order_acquire);
+        uint64_t sequence = latest >> SHM_RING_SLOT_BITS;
+        uint32_t slot = latest & ((1u << SHM_RING_SLOT_BITS) - 1);
+        if (sequence == 0 || sequence == state->sequence || slot >= state->slot_count) {
+            // Liveness is checked now and then, kill() is a system call
+            if (polls++ % SHM_LIVENESS_POLLS == 0 && producer_gone(header) &&
+                atomic_load(&header->latest) == latest)
+                return NULL;
+            nanosleep(&poll_time, NULL);
+            continue;
+        }
+
+        // Producer checks reading after it marks a slot so one of the two always sees the other
+        atomic_store(&header->reading, slot);
+        if (atomic_load(&state->slots[slot].sequence) != sequence)
+            continue;
+        // Frames the producer wrote since the last one that was given are never shown
+        TRACE_COUNTER("ring frames missed", state->sequence ? (long)(sequence - state->sequence - 1) : 0);
+        state->sequence = sequence;
+        return state->data + slot * state->slot_size;
+    }
+}
+
+static void close_shm_source(frame_source *source) {
+    shm_state *state = (shm_state *)source->state;
+    atomic_store(&state->header->reading, SHM_RING_NO_SLOT);
+    munmap(state->header, state->map_size);
+    free(state);
+}
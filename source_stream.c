@@ -0,0 +1,565 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Streaming source for YUV4MPEG2 and raw rgb24/gray frames
+// - ffmpeg -i input.mp4 -f yuv4mpegpipe - | ./output -i -
+// - ffmpeg -i input.mp4 -f rawvideo -pix_fmt rgb24 - | ./output -i - -s 288x216
+// - Rows can also be read a band at a time so huge frames never have to be in memory,
+// only YUV4MPEG2 color from a pipe keeps the Y and U planes (chroma comes after luma)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "source.h"
+#include "trace.h"
+
+// Struct that keeps the state of a stream between frames
+// - A reader thread fills one slot while the other one is being rendered, it is
+// started by the first whole frame that is asked for
+// - Chroma shift is how many times the chroma planes are halved (-1 means no chroma)
+// - Row is the next row of the frame that is read in bands, frame start is where
+// the frame starts in the file when the input can seek
+typedef struct stream_state {
+    int fd;
+    int y4m;
+    int luma_only;
+    int full_range;
+    int chroma_shift_x;
+    int chroma_shift_y;
+    int chroma_width;
+    size_t luma_size;
+    size_t chroma_size;
+    size_t frame_size;
+    int seekable;
+    int row;
+    off_t frame_start;
+    unsigned char *band;
+    unsigned char *band_yuv;
+    unsigned char *planes;
+    int reader_started;
+    unsigned char *raw[2];
+    unsigned char *rgb[2];
+    unsigned char range_lookup[256];
+    int full[2];
+    int held;
+    int next;
+    int ended;
+    int stop;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} stream_state;
+
+static int read_fully(int, unsigned char *, size_t);
+static int read_fully_at(int, unsigned char *, size_t, off_t);
+static int read_line(int, char *, int);
+static void parse_y4m_header(frame_source *, stream_state *, char *);
+static int read_frame_header(stream_state *);
+static int read_stream_frame(stream_state *, unsigned char *);
+static void convert_yuv_to_rgb(const stream_state *, const unsigned char *, unsigned char *, int, int);
+static void convert_yuv_row(const stream_state *, const unsigned char *, const unsigned char *, const unsigned char *, unsigned char *, int);
+static void start_reader(frame_source *);
+static void *read_stream(void *);
+static const unsigned char *next_stream_frame(frame_source *);
+static void allocate_bands(frame_source *);
+static int start_stream_rows(frame_source *);
+static int read_stream_rows(frame_source *, int, int);
+static int finish_stream_rows(frame_source *);
+static const unsigned char *next_stream_rows(frame_source *, int *, int *);
+static void close_stream_source(frame_source *);
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_LINE_SIZE 256
+#define STREAM_BAND_ROWS 16
+
+void open_stream_source(frame_source *source, const char *path, int luma_only, int raw_width, int raw_height, int raw_channels, int raw_framerate) {
+    stream_state *state = (stream_state *)calloc(1, sizeof(stream_state));
+    if (!state) {
+        fprintf(stderr, "Memory allocation failed in open_stream_source()\n");
+        exit(1);
+    }
+
+    state->fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDONLY);
+    if (state->fd < 0) {
+        fprintf(stderr, "Could not open %s in open_stream_source()\n", path);
+        exit(1);
+    }
+
+    state->luma_only = luma_only;
+    source->framerate = raw_framerate;
+    source->frame_count = -1;
+    source->period = 0;
+    if (raw_width == 0) {
+        char line[Y4M_LINE_SIZE];
+        if (read_line(state->fd, line, Y4M_LINE_SIZE) < 0 || strncmp(line, Y4M_MAGIC, strlen(Y4M_MAGIC)) != 0) {
+            fprintf(stderr, "Input is not a YUV4MPEG2 stream in open_stream_source()\n");
+            exit(1);
+        }
+        state->y4m = 1;
+        parse_y4m_header(source, state, line + strlen(Y4M_MAGIC));
+    } else {
+        source->width = raw_width;
+        source->height = raw_height;
+        source->channels = raw_channels;
+        if (source->framerate == 0)
+            source->framerate = 30;
+        state->frame_size = (size_t)raw_width * raw_height * raw_channels;
+    }
+    source->stride = source->width * source->channels;
+    state->seekable = lseek(state->fd, 0, SEEK_CUR) >= 0;
+
+    for (int i = 0; i < 256; i++) {
+        int value = state->full_range ? i : ((i - 16) * 255 + 109) / 219;
+        state->range_lookup[i] = value < 0 ? 0 : (value > 255 ? 255 : value);
+    }
+
+    state->held = -1;
+    source->state = state;
+    source->next_frame = next_stream_frame;
+    source->seek = NULL;
+    source->next_rows = next_stream_rows;
+    source->delay = 0;
+    source->close = close_stream_source;
+}
+
+// Reads exactly size bytes unless the stream ends
+// - Returns 1 on success, 0 at the end of the stream
+static int read_fully(int fd, unsigned char *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t result = read(fd, buffer + done, size - done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return 0;
+        done += result;
+    }
+    return 1;
+}
+
+// Same as read_fully() but from an offset of a file that can seek
+static int read_fully_at(int fd, unsigned char *buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t result = pread(fd, buffer + done, size - done, offset + done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return 0;
+        done += result;
+    }
+    return 1;
+}
+
+// Reads a line without the '\n', lines longer than size are cut
+// - Returns the length or -1 at the end of the stream
+static int read_line(int fd, char *line, int size) {
+    int length = 0;
+    char character;
+    while (1) {
+        ssize_t result = read(fd, &character, 1);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return -1;
+        if (character == '\n')
+            break;
+        if (length < size - 1)
+            line[length++] = character;
+    }
+    line[length] = '\0';
+    return length;
+}
+
+// Reads the parameters after "YUV4MPEG2 "
+// - W and H are the size, F is the framerate as a fraction
+// - C is the chroma subsampling, XCOLORRANGE=FULL turns off the 16-235 range
+static void parse_y4m_header(frame_source *source, stream_state *state, char *parameters) {
+    int framerate_numerator = 30, framerate_denominator = 1;
+    state->chroma_shift_x = 1;
+    state->chroma_shift_y = 1;
+    for (char *token = strtok(parameters, " "); token; token = strtok(NULL, " ")) {
+        if (token[0] == 'W') {
+            source->width = atoi(token + 1);
+        } else if (token[0] == 'H') {
+            source->height = atoi(token + 1);
+        } else if (token[0] == 'F') {
+            sscanf(token + 1, "%d:%d", &framerate_numerator, &framerate_denominator);
+        } else if (token[0] == 'C') {
+            if (strncmp(token + 1, "420", 3) == 0 && (token[4] == '\0' || strcmp(token + 4, "jpeg") == 0 || strcmp(token + 4, "paldv") == 0 || strcmp(token + 4, "mpeg2") == 0)) {
+                state->chroma_shift_x = 1;
+                state->chroma_shift_y = 1;
+            } else if (strcmp(token + 1, "422") == 0) {
+                state->chroma_shift_x = 1;
+                state->chroma_shift_y = 0;
+            } else if (strcmp(token + 1, "444") == 0) {
+                state->chroma_shift_x = 0;
+                state->chroma_shift_y = 0;
+            } else if (strcmp(token + 1, "411") == 0) {
+                state->chroma_shift_x = 2;
+                state->chroma_shift_y = 0;
+            } else if (strcmp(token + 1, "mono") == 0) {
+                state->chroma_shift_x = -1;
+                state->chroma_shift_y = -1;
+            } else {
+                fprintf(stderr, "Unsupported YUV4MPEG2 colorspace %s in open_stream_source()\n", token + 1);
+                exit(1);
+            }
+        } else if (strcmp(token, "XCOLORRANGE=FULL") == 0) {
+            state->full_range = 1;
+        }
+    }
+    if (source->width < 1 || source->height < 1 || framerate_denominator < 1) {
+        fprintf(stderr, "Broken YUV4MPEG2 header in open_stream_source()\n");
+        exit(1);
+    }
+
+    if (source->framerate == 0)
+        source->framerate = (framerate_numerator + framerate_denominator / 2) / framerate_denominator;
+    if (source->framerate < 1)
+        source->framerate = 1;
+
+    state->luma_size = (size_t)source->width * source->height;
+    if (state->chroma_shift_x >= 0) {
+        state->chroma_width = (source->width + (1 << state->chroma_shift_x) - 1) >> state->chroma_shift_x;
+        int chroma_height = (source->height + (1 << state->chroma_shift_y) - 1) >> state->chroma_shift_y;
+        state->chroma_size = (size_t)state->chroma_width * chroma_height;
+    }
+    state->frame_size = state->luma_size + state->chroma_size * 2;
+    source->channels = state->luma_only ? 1 : 3;
+}
+
+// Reads the "FRAME" line of YUV4MPEG2, raw streams have nothing to read
+// - Returns 1 on success, 0 at the end of the stream
+static int read_frame_header(stream_state *state) {
+    if (!state->y4m)
+        return 1;
+    char line[Y4M_LINE_SIZE];
+    if (read_line(state->fd, line, Y4M_LINE_SIZE) < 0)
+        return 0;
+    if (strncmp(line, "FRAME", 5) != 0) {
+        fprintf(stderr, "Lost the YUV4MPEG2 frame header in read_frame_header()\n");
+        exit(1);
+    }
+    return 1;
+}
+
+// Reads the next frame into the buffer
+// - Returns 1 on success, 0 at the end of the stream
+static int read_stream_frame(stream_state *state, unsigned char *buffer) {
+    if (!read_frame_header(state))
+        return 0;
+    return read_fully(state->fd, buffer, state->frame_size);
+}
+
+// Turns a planar YUV frame into RGB
+static void convert_yuv_to_rgb(const stream_state *state, const unsigned char *yuv, unsigned char *rgb, int width, int height) {
+    const unsigned char *u_plane = yuv + state->luma_size;
+    const unsigned char *v_plane = u_plane + state->chroma_size;
+    for (int y = 0; y < height; y++) {
+        size_t chroma_offset = state->chroma_shift_x < 0 ? 0 : (size_t)(y >> state->chroma_shift_y) * state->chroma_width;
+        convert_yuv_row(state, &yuv[(size_t)y * width], &u_plane[chroma_offset], &v_plane[chroma_offset], &rgb[(size_t)y * width * 3], width);
+    }
+}
+
+// Turns a row of YUV into RGB using BT.601
+// - Chroma is upsampled by picking the closest sample
+// - Without chroma (mono) the U and V lines are not read
+static void convert_yuv_row(const stream_state *state, const unsigned char *y_line, const unsigned char *u_line, const unsigned char *v_line, unsigned char *out, int width) {
+    if (state->chroma_shift_x < 0) {
+        for (int x = 0; x < width; x++) {
+            unsigned char value = state->range_lookup[y_line[x]];
+            out[x * 3] = value;
+            out[x * 3 + 1] = value;
+            out[x * 3 + 2] = value;
+        }
+        return;
+    }
+
+    // 8 bit fixed point, limited range scales luma by 255/219 and chroma by 255/224
+    int luma_scale = state->full_range ? 256 : 298;
+    int luma_offset = state->full_range ? 0 : 16;
+    int red_v = state->full_range ? 359 : 409;
+    int green_u = state->full_range ? 88 : 100;
+    int green_v = state->full_range ? 183 : 208;
+    int blue_u = state->full_range ? 454 : 516;
+    for (int x = 0; x < width; x++) {
+        int luma = (y_line[x] - luma_offset) * luma_scale + 128;
+        int u = u_line[x >> state->chroma_shift_x] - 128;
+        int v = v_line[x >> state->chroma_shift_x] - 128;
+        int red = (luma + red_v * v) >> 8;
+        int green = (luma - green_u * u - green_v * v) >> 8;
+        int blue = (luma + blue_u * u) >> 8;
+        out[x * 3] = red < 0 ? 0 : (red > 255 ? 255 : red);
+        out[x * 3 + 1] = green < 0 ? 0 : (green > 255 ? 255 : green);
+        out[x * 3 + 2] = blue < 0 ? 0 : (blue > 255 ? 255 : blue);
+    }
+}
+
+// Makes the two frame slots and starts the reader thread
+static void start_reader(frame_source *source) {
+    stream_state *state = (stream_state *)source->state;
+    for (int i = 0; i < 2; i++) {
+        state->raw[i] = (unsigned char *)malloc(state->frame_size);
+        if (state->y4m && !state->luma_only)
+            state->rgb[i] = (unsigned char *)malloc((size_t)source->width * source->height * 3);
+        if (!state->raw[i] || (state->y4m && !state->luma_only && !state->rgb[i])) {
+            fprintf(stderr, "Memory allocation failed in start_reader()\n");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->changed, NULL);
+    if (pthread_create(&state->reader, NULL, read_stream, source)) {
+        fprintf(stderr, "Could not create a thread in start_reader()\n");
+        exit(1);
+    }
+    state->reader_started = 1;
+}
+
+// Reader thread, keeps the free slot filled while the other one is rendered
+// - Conversion to RGB also happens here so it overlaps with rendering
+// - Can only be cancelled while it waits for input
+static void *read_stream(void *argument) {
+    frame_source *source = (frame_source *)argument;
+    stream_state *state = (stream_state *)source->state;
+    int slot = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    TRACE_THREAD("stream reader");
+    while (1) {
+        pthread_mutex_lock(&state->lock);
+        while (state->full[slot] && !state->stop)
+            pthread_cond_wait(&state->changed, &state->lock);
+        int stop = state->stop;
+        pthread_mutex_unlock(&state->lock);
+        if (stop)
+            break;
+
+        TRACE_BEGIN("read");
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int result = read_stream_frame(state, state->raw[slot]);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        TRACE_END("read");
+        if (!result)
+            break;
+        if (state->y4m && state->luma_only) {
+            for (int i = 0; i < source->width * source->height; i++)
+                state->raw[slot][i] = state->range_lookup[state->raw[slot][i]];
+        } else if (state->y4m) {
+            TRACE_BEGIN("yuv to rgb");
+            convert_yuv_to_rgb(state, state->raw[slot], state->rgb[slot], source->width, source->height);
+            TRACE_END("yuv to rgb");
+        }
+
+        pthread_mutex_lock(&state->lock);
+        state->full[slot] = 1;
+        TRACE_COUNTER("stream frames ready", state->full[0] + state->full[1] - (state->held >= 0));
+        pthread_cond_broadcast(&state->changed);
+        pthread_mutex_unlock(&state->lock);
+        slot ^= 1;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->ended = 1;
+    pthread_cond_broadcast(&state->changed);
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// Gives the slot that was read next and frees the one given before
+static const unsigned char *next_stream_frame(frame_source *source) {
+    stream_state *state = (stream_state *)source->state;
+    if (!state->reader_started)
+        start_reader(source);
+    pthread_mutex_lock(&state->lock);
+    if (state->held >= 0) {
+        state->full[state->held] = 0;
+        state->held = -1;
+        pthread_cond_broadcast(&state->changed);
+    }
+    if (!state->full[state->next] && !state->ended) {
+        // Player waits for the reader, in a trace that is a stall of the stream
+        TRACE_BEGIN("wait for reader");
+        while (!state->full[state->next] && !state->ended)
+            pthread_cond_wait(&state->changed, &state->lock);
+        TRACE_END("wait for reader");
+    }
+    if (!state->full[state->next]) {
+        pthread_mutex_unlock(&state->lock);
+        return NULL;
+    }
+    state->held = state->next;
+    state->next ^= 1;
+    TRACE_COUNTER("stream frames ready", state->full[0] + state->full[1] - 1);
+    pthread_mutex_unlock(&state->lock);
+
+    if (state->y4m && !state->luma_only)
+        return state->rgb[state->held];
+    return state->raw[state->held];
+}
+
+// Makes the buffers for reading in bands
+// - Band has the finished rows, band yuv the Y, U and V rows they are made from
+// - Planes has the Y and U planes when YUV4MPEG2 color comes from a pipe
+static void allocate_bands(frame_source *source) {
+    stream_state *state = (stream_state *)source->state;
+    int color = state->y4m && !state->luma_only;
+    state->band = (unsigned char *)malloc((size_t)STREAM_BAND_ROWS * source->stride);
+    if (color)
+        state->band_yuv = (unsigned char *)malloc((size_t)STREAM_BAND_ROWS * (source->width + state->chroma_width * 2));
+    if (color && state->chroma_size && !state->seekable)
+        state->planes = (unsigned char *)malloc(state->luma_size + state->chroma_size);
+    if (!state->band || (color && !state->band_yuv) || (color && state->chroma_size && !state->seekable && !state->planes)) {
+        fprintf(stderr, "Memory allocation failed in allocate_bands()\n");
+        exit(1);
+    }
+}
+
+// Gets ready to read a new frame in bands
+// - Returns 1 on success, 0 at the end of the stream
+static int start_stream_rows(frame_source *source) {
+    stream_state *state = (stream_state *)source->state;
+    if (!read_frame_header(state))
+        return 0;
+    if (state->seekable) {
+        state->frame_start = lseek(state->fd, 0, SEEK_CUR);
+        return 1;
+    }
+    if (state->planes)
+        return read_fully(state->fd, state->planes, state->luma_size + state->chroma_size);
+    return 1;
+}
+
+// Reads count rows of the current frame starting from first into the band
+// - Bands start at a multiple of STREAM_BAND_ROWS so they never share a chroma row
+// - Returns 1 on success, 0 at the end of the stream
+static int read_stream_rows(frame_source *source, int first, int count) {
+    stream_state *state = (stream_state *)source->state;
+    int width = source->width;
+    if (!state->y4m)
+        return read_fully(state->fd, state->band, (size_t)count * source->stride);
+    if (state->luma_only) {
+        if (!read_fully(state->fd, state->band, (size_t)count * width))
+            return 0;
+        for (size_t i = 0; i < (size_t)count * width; i++)
+            state->band[i] = state->range_lookup[state->band[i]];
+        return 1;
+    }
+
+    unsigned char *y_rows = state->band_yuv;
+    if (state->chroma_shift_x < 0) {
+        if (!read_fully(state->fd, y_rows, (size_t)count * width))
+            return 0;
+        for (int r = 0; r < count; r++)
+            convert_yuv_row(state, y_rows + (size_t)r * width, NULL, NULL, state->band + (size_t)r * width * 3, width);
+        return 1;
+    }
+
+    int chroma_first = first >> state->chroma_shift_y;
+    int chroma_count = ((first + count - 1) >> state->chroma_shift_y) - chroma_first + 1;
+    size_t chroma_offset = (size_t)chroma_first * state->chroma_width;
+    size_t chroma_rows_size = (size_t)chroma_count * state->chroma_width;
+    unsigned char *u_rows = y_rows + (size_t)STREAM_BAND_ROWS * width;
+    unsigned char *v_rows = u_rows + (size_t)STREAM_BAND_ROWS * state->chroma_width;
+    if (state->seekable) {
+        off_t start = state->frame_start;
+        if (!read_fully_at(state->fd, y_rows, (size_t)count * width, start + (off_t)first * width) ||
+            !read_fully_at(state->fd, u_rows, chroma_rows_size, start + state->luma_size + chroma_offset) ||
+            !read_fully_at(state->fd, v_rows, chroma_rows_size, start + state->luma_size + state->chroma_size + chroma_offset))
+            return 0;
+    } else {
+        // Y and U are already in planes, V comes in order
+        y_rows = state->planes + (size_t)first * width;
+        u_rows = state->planes + state->luma_size + chroma_offset;
+        if (!read_fully(state->fd, v_rows, chroma_rows_size))
+            return 0;
+    }
+    for (int r = 0; r < count; r++) {
+        size_t chroma_row = (size_t)(((first + r) >> state->chroma_shift_y) - chroma_first) * state->chroma_width;
+        convert_yuv_row(state, y_rows + (size_t)r * width, u_rows + chroma_row, v_rows + chroma_row, state->band + (size_t)r * width * 3, width);
+    }
+    return 1;
+}
+
+// Moves the stream to the start of the next frame after the last band
+// - Luma only skips the chroma planes, a file that can seek jumps over the frame
+// - Returns 1 on success, 0 at the end of the stream
+static int finish_stream_rows(frame_source *source) {
+    stream_state *state = (stream_state *)source->state;
+    if (!state->y4m)
+        return 1;
+    if (state->seekable && !state->luma_only)
+        return lseek(state->fd, state->frame_start + state->frame_size, SEEK_SET) >= 0;
+    if (!state->luma_only || state->chroma_size == 0)
+        return 1;
+    if (state->seekable)
+        return lseek(state->fd, state->chroma_size * 2, SEEK_CUR) >= 0;
+    size_t band_size = (size_t)STREAM_BAND_ROWS * source->stride;
+    for (size_t left = state->chroma_size * 2; left > 0;) {
+        size_t size = left < band_size ? left : band_size;
+        if (!read_fully(state->fd, state->band, size))
+            return 0;
+        left -= size;
+    }
+    return 1;
+}
+
+// Gives the next band of up to STREAM_BAND_ROWS rows, first row 0 is a new frame
+static const unsigned char *next_stream_rows(frame_source *source, int *first_row, int *count) {
+    stream_state *state = (stream_state *)source->state;
+    if (!state->band)
+        allocate_bands(source);
+    if (state->ended || (state->row == 0 && !start_stream_rows(source)))
+        return NULL;
+
+    int rows = source->height - state->row;
+    if (rows > STREAM_BAND_ROWS)
+        rows = STREAM_BAND_ROWS;
+    if (!read_stream_rows(source, state->row, rows)) {
+        state->ended = 1;
+        return NULL;
+    }
+    *first_row = state->row;
+    *count = rows;
+    state->row += rows;
+    if (state->row == source->height) {
+        state->row = 0;
+        state->ended = !finish_stream_rows(source);
+    }
+    return state->band;
+}
+
+// Stops the reader (it can be waiting on a pipe) and frees everything
+static void close_stream_source(frame_source *source) {
+    stream_state *state = (stream_state *)source->state;
+    if (state->reader_started) {
+        pthread_mutex_lock(&state->lock);
+        state->stop = 1;
+        pthread_cond_broadcast(&state->changed);
+        pthread_mutex_unlock(&state->lock);
+        pthread_cancel(state->reader);
+        pthread_join(state->reader, NULL);
+        pthread_mutex_destroy(&state->lock);
+        pthread_cond_destroy(&state->changed);
+    }
+    if (state->fd != 0)
+        close(state->fd);
+    for (int i = 0; i < 2; i++) {
+        free(state->raw[i]);
+        free(state->rgb[i]);
+    }
+    free(state->band);
+    free(state->band_yuv);
+    free(state->planes);
+    free(state);
+}
@@ -0,0 +1,211 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Per thread event rings and the thread that writes them as Chrome trace event JSON
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+static trace_ring *get_ring(void);
+static void add_event(char phase, const char *name, long value);
+static void *flush_rings(void *);
+static int flush_ring(trace_ring *);
+static void write_event(const trace_ring *, const trace_event *);
+static uint64_t get_nanoseconds(void);
+
+// Flusher looks at the rings this often when they are empty
+#define TRACE_POLL_MS 10
+
+// Struct that keeps the state of the trace
+// - Rings are only added under the lock, count is published after the ring is filled in
+typedef struct trace_state {
+    FILE *file;
+    const char *path;
+    trace_ring *rings[TRACE_MAX_THREADS];
+    _Atomic int ring_count;
+    pthread_mutex_t lock;
+    pthread_t flusher;
+    _Atomic int stop;
+    uint64_t start_ns;
+    long written;
+    long lost;
+    int threads;
+} trace_state;
+
+_Atomic int trace_enabled = 0;
+static trace_state trace;
+static _Thread_local trace_ring *thread_ring;
+static _Thread_local int thread_refused;
+
+void trace_open(const char *path) {
+#ifdef DUCK_NO_TRACE
+    fprintf(stderr, "Built with -DDUCK_NO_TRACE, %s can not be traced in trace_open()\n", path);
+    exit(1);
+#endif
+    trace.file = fopen(path, "w");
+    if (!trace.file) {
+        fprintf(stderr, "Could not open %s for writing in trace_open()\n", path);
+        exit(1);
+    }
+    trace.path = path;
+    pthread_mutex_init(&trace.lock, NULL);
+    trace.start_ns = get_nanoseconds();
+    fprintf(trace.file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(trace.file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"duckvideo\"}}");
+    if (pthread_create(&trace.flusher, NULL, flush_rings, NULL)) {
+        fprintf(stderr, "Could not start the flusher thread in trace_open()\n");
+        exit(1);
+    }
+    atomic_store_explicit(&trace_enabled, 1, memory_order_relaxed);
+}
+
+void trace_begin(const char *name) {
+    add_event('B', name, 0);
+}
+
+void trace_end(const char *name) {
+    add_event('E', name, 0);
+}
+
+void trace_counter(const char *name, long value) {
+    add_event('C', name, value);
+}
+
+void trace_name_thread(const char *name) {
+    add_event('M', name, 0);
+}
+
+void trace_stage(const char *name, int begin) {
+    if (TRACE_ENABLED)
+        add_event(begin ? 'B' : 'E', name, 0);
+}
+
+void trace_report(FILE *file) {
+    if (!trace.path)
+        return;
+    fprintf(file, "Trace wrote %ld events of %d threads to %s", trace.written, trace.threads, trace.path);
+    if (trace.lost > 0)
+        fprintf(file, ", %ld events were lost (full rings or too many threads)", trace.lost);
+    fprintf(file, "\n");
+}
+
+void trace_close(void) {
+    if (!trace.file)
+        return;
+    atomic_store_explicit(&trace_enabled, 0, memory_order_relaxed);
+    atomic_store_explicit(&trace.stop, 1, memory_order_release);
+    pthread_join(trace.flusher, NULL);
+    fprintf(trace.file, "\n]}\n");
+    fclose(trace.file);
+    trace.file = NULL;
+    trace.threads = atomic_load_explicit(&trace.ring_count, memory_order_acquire);
+    for (int i = 0; i < trace.threads; i++) {
+        trace.lost += trace.rings[i]->lost;
+        free(trace.rings[i]);
+    }
+    pthread_mutex_destroy(&trace.lock);
+}
+
+// Returns the ring of the calling thread, it is made on the first event
+// - Returns NULL if there are too many threads or no memory, the thread never gets one then
+static trace_ring *get_ring(void) {
+    if (thread_ring || thread_refused)
+        return thread_ring;
+    trace_ring *ring = (trace_ring *)calloc(1, sizeof(trace_ring));
+    pthread_mutex_lock(&trace.lock);
+    int count = atomic_load_explicit(&trace.ring_count, memory_order_relaxed);
+    if (ring && count < TRACE_MAX_THREADS) {
+        ring->id = count + 1;
+        trace.rings[count] = ring;
+        atomic_store_explicit(&trace.ring_count, count + 1, memory_order_release);
+        thread_ring = ring;
+    } else {
+        free(ring);
+        thread_refused = 1;
+    }
+    pthread_mutex_unlock(&trace.lock);
+    return thread_ring;
+}
+
+static void add_event(char phase, const char *name, long value) {
+    uint64_t ns = get_nanoseconds();
+    trace_ring *ring = get_ring();
+    if (!ring) {
+        pthread_mutex_lock(&trace.lock);
+        trace.lost++;
+        pthread_mutex_unlock(&trace.lock);
+        return;
+    }
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == TRACE_RING_SIZE) {
+        ring->lost++;
+        return;
+    }
+    trace_event *event = &ring->events[head % TRACE_RING_SIZE];
+    event->ns = ns;
+    event->name = name;
+    event->value = value;
+    event->phase = phase;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Flusher thread, writes the rings until it is stopped and every ring is empty
+static void *flush_rings(void *argument) {
+    (void)argument;
+    struct timespec poll = {0, TRACE_POLL_MS * 1000000L};
+    for (;;) {
+        int stop = atomic_load_explicit(&trace.stop, memory_order_acquire);
+        int count = atomic_load_explicit(&trace.ring_count, memory_order_acquire);
+        int written = 0;
+        for (int i = 0; i < count; i++)
+            written += flush_ring(trace.rings[i]);
+        if (written == 0) {
+            if (stop)
+                break;
+            fflush(trace.file);
+            nanosleep(&poll, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Writes the events that are in a ring, returns how many
+static int flush_ring(trace_ring *ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    int written = head - tail;
+    for (; tail != head; tail++) {
+        write_event(ring, &ring->events[tail % TRACE_RING_SIZE]);
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    trace.written += written;
+    return written;
+}
+
+// Times are written in microseconds, that is what the format wants
+static void write_event(const trace_ring *ring, const trace_event *event) {
+    if (event->phase == 'M') {
+        fprintf(trace.file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", ring->id, event->name);
+        return;
+    }
+    double us = (event->ns - trace.start_ns) / 1000.0;
+    fprintf(trace.file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", event->name, event->phase, us, ring->id);
+    if (event->phase == 'C')
+        fprintf(trace.file, ",\"args\":{\"value\":%ld}", event->value);
+    fprintf(trace.file, "}");
+}
+
+static uint64_t get_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,104 @@
+//      __
+//  ___( o)>
+//  \ <_. )
+//   `---'
+//
+// by ducktumn
+//
+// Tracing of what every thread does, saved as Chrome trace event JSON (opens in Perfetto
+// or chrome://tracing)
+// - Every thread has its own ring of begin, end and counter events with nanosecond times,
+// a flusher thread formats them into the file, adding an event never takes a lock or waits
+// - If the ring of a thread is full its events are lost and counted
+// - The TRACE_ macros only check a flag while tracing is off, building with -DDUCK_NO_TRACE
+// leaves them out completely
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_RING_SIZE 16384
+#define TRACE_MAX_THREADS 64
+
+// Struct that represents a single event
+// - Phase is 'B' (begin), 'E' (end), 'C' (counter with value) or 'M' (name of the thread)
+// - Name has to be a string that stays alive until the trace is closed
+typedef struct trace_event {
+    uint64_t ns;
+    const char *name;
+    long value;
+    char phase;
+} trace_event;
+
+// Struct that represents the ring of a thread
+// - Head is only moved by the thread, tail only by the flusher
+// - Lost is only changed by the thread, it is read after the thread ended
+typedef struct trace_ring {
+    trace_event events[TRACE_RING_SIZE];
+    _Atomic unsigned head;
+    _Atomic unsigned tail;
+    int id;
+    long lost;
+} trace_ring;
+
+// 1 while a trace is open, checked by the TRACE_ macros before anything else
+// - Threads read it while trace_close() clears it, a relaxed load is enough because an
+// event that still gets in before the flusher stops is written anyway
+extern _Atomic int trace_enabled;
+
+// Opens the JSON file and starts the flusher thread, exits if it can not
+// - Call it before the threads that are traced start
+void trace_open(const char *path);
+
+// Adds an event to the ring of the calling thread
+void trace_begin(const char *name);
+void trace_end(const char *name);
+void trace_counter(const char *name, long value);
+void trace_name_thread(const char *name);
+
+// Begins (begin 1) or ends (begin 0) a span, fits dv_set_trace_hook()
+void trace_stage(const char *name, int begin);
+
+// Writes what is left in the rings, stops the flusher thread and closes the file
+// - Threads that are traced have to be done before it is called
+void trace_close(void);
+
+// Prints how many events of how many threads were written and how many were lost (after trace_close())
+void trace_report(FILE *);
+
+// Whether a trace is open, for code that checks it itself
+#define TRACE_ENABLED atomic_load_explicit(&trace_enabled, memory_order_relaxed)
+
+#ifdef DUCK_NO_TRACE
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_COUNTER(name, value) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#else
+#define TRACE_BEGIN(name)      \
+    do {                       \
+        if (TRACE_ENABLED)     \
+            trace_begin(name); \
+    } while (0)
+#define TRACE_END(name)      \
+    do {                     \
+        if (TRACE_ENABLED)   \
+            trace_end(name); \
+    } while (0)
+// Value is only worked out while tracing
+#define TRACE_COUNTER(name, value)      \
+    do {                                \
+        if (TRACE_ENABLED)              \
+            trace_counter(name, value); \
+    } while (0)
+#define TRACE_THREAD(name)           \
+    do {                             \
+        if (TRACE_ENABLED)           \
+            trace_name_thread(name); \
+    } while (0)
+#endif
+
+#endif